@@ -30,6 +30,10 @@ OTHER DEALINGS IN THE SOFTWARE.
 #define WIN32_LEAN_AND_MEAN
 #define __USE_UNIX98
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #ifdef UNICODE
 #undef UNICODE
 #endif
@@ -53,6 +57,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include <winsock2.h>
 #include <winioctl.h>
 #include <io.h>
+#include <malloc.h>
 
 #pragma comment(lib, "kernel32.lib")
 #pragma comment(lib, "user32.lib")
@@ -176,13 +181,31 @@ OVERLAPPED drv_request_io;
 #else // Unix
 
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#endif
+
 #endif
 
 #include "../inc/fscryptdproxy.h"
@@ -190,6 +213,14 @@ OVERLAPPED drv_request_io;
 #include "safeio.h"
 #include "devio.h"
 
+// Requests from clients are not aligned as O_DIRECT requires on Linux,
+// where it is only visible because of _GNU_SOURCE. It is only set with
+// --cache=direct, where transfers are aligned first.
+#ifdef __linux__
+const int direct_io_flag = O_DIRECT;
+#undef O_DIRECT
+#endif
+
 #ifndef O_DIRECT
 #define O_DIRECT 0
 #endif
@@ -214,7 +245,7 @@ int64_t GetBigEndian64(int8_t *storage)
     int64_t number = 0;
     for (i = 0; i < sizeof(int64_t); i++)
     {
-        number |= (int64_t)storage[i] << ((sizeof(int64_t) - i - 1) << 3);
+        number |= (int64_t)(uint8_t)storage[i] << ((sizeof(int64_t) - i - 1) << 3);
     }
     return number;
 }
@@ -230,22 +261,301 @@ uint32_t GetLittleEndian32U(uint8_t *storage)
     return number;
 }
 
+uint64_t GetLittleEndian64U(uint8_t *storage)
+{
+    int i;
+    uint64_t number = 0;
+    for (i = 0; i < sizeof(uint64_t); i++)
+    {
+        number |= (uint64_t)storage[i] << (i << 3);
+    }
+    return number;
+}
+
+void SetLittleEndian32U(uint8_t *storage, uint32_t number)
+{
+    int i;
+    for (i = 0; i < sizeof(uint32_t); i++)
+    {
+        storage[i] = (uint8_t)(number >> (i << 3));
+    }
+}
+
+void SetLittleEndian64U(uint8_t *storage, uint64_t number)
+{
+    int i;
+    for (i = 0; i < sizeof(uint64_t); i++)
+    {
+        storage[i] = (uint8_t)(number >> (i << 3));
+    }
+}
+
+uint32_t GetBigEndian32U(uint8_t *storage)
+{
+    int i;
+    uint32_t number = 0;
+    for (i = 0; i < sizeof(uint32_t); i++)
+    {
+        number |= (uint32_t)storage[i] << ((sizeof(uint32_t) - i - 1) << 3);
+    }
+    return number;
+}
+
+uint64_t GetBigEndian64U(uint8_t *storage)
+{
+    int i;
+    uint64_t number = 0;
+    for (i = 0; i < sizeof(uint64_t); i++)
+    {
+        number |= (uint64_t)storage[i] << ((sizeof(uint64_t) - i - 1) << 3);
+    }
+    return number;
+}
+
+void SetBigEndian32U(uint8_t *storage, uint32_t number)
+{
+    int i;
+    for (i = 0; i < sizeof(uint32_t); i++)
+    {
+        storage[i] = (uint8_t)(number >> ((sizeof(uint32_t) - i - 1) << 3));
+    }
+}
+
+void SetBigEndian64U(uint8_t *storage, uint64_t number)
+{
+    int i;
+    for (i = 0; i < sizeof(uint64_t); i++)
+    {
+        storage[i] = (uint8_t)(number >> ((sizeof(uint64_t) - i - 1) << 3));
+    }
+}
+
 int image_fd = -1;
 void *libhandle = NULL;
-SOCKET sd = INVALID_SOCKET;
 int shm_mode = 0;
-char *shm_readptr = 0;
-char *shm_writeptr = 0;
-char *shm_view = NULL;
-char *buf = NULL;
-char *buf2 = NULL;
 safeio_size_t buffer_size = DEF_BUFFER_SIZE;
 off_t_64 image_offset = 0;
+off_t_64 image_file_size = 0;
+char image_blkdev = 0;
+off_t_64 image_discard_granularity = 0;
 FSCRYPTDPROXY_INFO_RESP devio_info = {0};
 char dll_mode = 0;
 char drv_mode = 0;
 char vhd_mode = 0;
+char vhdx_mode = 0;
+char qcow2_mode = 0;
+char vmdk_mode = 0;
 char auto_vhd_detect = 1;
+char vhd_journal_mode = 1;
+char multi_mode = 0;
+char uring_mode = 0;
+int worker_count = 0;
+
+// Durability policy set with --sync. Image files are opened with O_FSYNC
+// only with SYNC_ALWAYS. Otherwise data written is made durable every
+// interval milliseconds with SYNC_INTERVAL, by FSCRYPTDPROXY_REQ_FLUSH and
+// FUA writes with SYNC_INTERVAL and SYNC_FLUSH, when more than limit bytes
+// have been written since last sync if set with --writeback, and on a clean
+// exit.
+typedef enum _SYNC_MODE
+{
+    SYNC_ALWAYS,
+    SYNC_INTERVAL,
+    SYNC_FLUSH,
+    SYNC_NONE
+} SYNC_MODE;
+
+struct _WRITEBACK
+{
+    SYNC_MODE mode;
+    ULONGLONG interval;
+    ULONGLONG limit;
+    ULONGLONG dirty;
+    ULONGLONG synced_since;
+} writeback = {SYNC_ALWAYS};
+
+#define IMAGE_SYNC_FLAG (writeback.mode == SYNC_ALWAYS ? O_FSYNC : 0)
+
+// Flush requests and FUA writes sync image files in these modes
+#define SYNC_ON_FLUSH \
+    (writeback.mode == SYNC_INTERVAL || writeback.mode == SYNC_FLUSH)
+
+// Page cache use for image file I/O set with --cache. Direct I/O is used
+// if align is set, with transfers that are not aligned to it bounced
+// through aligned buffers. Raw image files are read from a shared mapping
+// at base if that is set.
+typedef enum _CACHE_MODE
+{
+    CACHE_BUFFERED,
+    CACHE_DIRECT,
+    CACHE_MMAP
+} CACHE_MODE;
+
+CACHE_MODE cache_mode = CACHE_BUFFERED;
+
+// State of --cache=direct. Writes that reach past end of image file go
+// through buffered_fd, which is open to same file without direct I/O.
+struct _DIRECT_IO
+{
+    safeio_size_t align;
+    ULONGLONG bounced;
+    int buffered_fd;
+} direct_io = {0, 0, -1};
+
+struct _IMAGE_MAP
+{
+    char *base;
+    off_t_64 size;
+} image_map = {NULL};
+
+// Size of request and response header staging areas used in --multi mode.
+// Must hold a tagged header plus largest request or response structure.
+#define CONN_HDR_SIZE 64
+
+// Largest number of requests accepted in flight on a tagged connection.
+#define DEVIO_MAX_OUTSTANDING 64
+
+// Number of recent reads on a connection that a sequential read may follow,
+// so that streams are found even when a client has several reads
+// outstanding, and number of reads in a row before reading ahead starts.
+#define READ_AHEAD_HISTORY 8
+#define READ_AHEAD_TRIGGER 3
+
+// Smallest and largest read-ahead window. It starts at four times the
+// size of the read that triggered it.
+#define READ_AHEAD_MIN_WINDOW (128 << 10)
+#define READ_AHEAD_MAX_WINDOW (16 << 20)
+
+typedef struct _DEVIO_CONN DEVIO_CONN, *PDEVIO_CONN;
+
+// A request in --multi mode, from when its header has been received until
+// its response has been sent. Requests are recycled per connection along
+// with their data buffers.
+typedef struct _DEVIO_REQ
+{
+    struct _DEVIO_REQ *next;
+    struct _DEVIO_REQ *work_next;
+    PDEVIO_CONN conn;
+    FSCRYPTDPROXY_TAGGED_HEADER hdr;
+    ULONGLONG offset;
+    ULONGLONG length;
+    ULONGLONG write_flags;
+    char *buf;
+    safeio_size_t buffer_size;
+    int buf_index;
+    safeio_size_t io_size;
+    char resp[CONN_HDR_SIZE];
+    safeio_size_t resp_size;
+    safeio_size_t resp_payload_size;
+
+    // Set when response payload is sent directly from image file at
+    // file_offset instead of from buf.
+    char sendfile;
+    off_t_64 file_offset;
+} DEVIO_REQ, *PDEVIO_REQ;
+
+// State for one client connection. In shm, drv, stdin and single client tcp
+// mode there is only one of these for the lifetime of the process. In --multi
+// mode, one is allocated for each accepted connection.
+struct _DEVIO_CONN
+{
+    SOCKET sd;
+    char *buf;
+    safeio_size_t buffer_size;
+    char *shm_view;
+    char *shm_readptr;
+    char *shm_writeptr;
+
+    // Read responses for raw image files are sent with sendfile() when
+    // set, 1 for sockets and 2 for pipes. Cleared when connection switches
+    // to tagged mode, because sendfile() only queues references to page
+    // cache and a pipelined write could change data before it is sent.
+    char zero_copy;
+
+    // Receive buffer on streams. Data is received in as large chunks as
+    // are available and requests are parsed from here.
+    char *recv_buf;
+    safeio_size_t recv_start;
+    safeio_size_t recv_end;
+
+    // Set when client has switched to tagged operation. tag holds header of
+    // the request currently being handled outside --multi mode.
+    char tagged;
+    ULONGLONG max_outstanding;
+    FSCRYPTDPROXY_TAGGED_HEADER tag;
+
+    // --multi mode request assembly and response queue
+    char req_hdr[CONN_HDR_SIZE];
+    safeio_size_t req_hdr_size;
+    safeio_size_t req_got;
+    PDEVIO_REQ recv_req;
+    PDEVIO_REQ free_reqs;
+    PDEVIO_REQ send_head;
+    PDEVIO_REQ send_tail;
+    safeio_size_t resp_sent;
+    ULONGLONG outstanding;
+    uint32_t events;
+    char peer[32];
+
+    // Number of responses sent, number of separate writes they would need
+    // with one write for each header and payload, and number of send
+    // system calls actually used.
+    ULONGLONG stat_responses;
+    ULONGLONG stat_pieces;
+    ULONGLONG stat_sends;
+
+    // Sequential read detection. A read that starts where one of the last
+    // READ_AHEAD_HISTORY reads ended continues a stream, and once a stream
+    // is READ_AHEAD_TRIGGER reads long, image file is read into page cache
+    // ahead of it, from ra_start up to ra_end. Window doubles when stream
+    // reads past what was read ahead, and halves when stream stops with
+    // much of it left unread.
+    off_t_64 ra_history[READ_AHEAD_HISTORY];
+    int ra_history_pos;
+    int ra_stream;
+    off_t_64 ra_start;
+    off_t_64 ra_end;
+    safeio_size_t ra_window;
+    ULONGLONG stat_ra_reads;
+    ULONGLONG stat_ra_hits;
+
+    // --multi mode requests submitted to io_uring or worker threads and not
+    // yet completed. Connection is not freed until this list is empty.
+    // Requests that wait for overlapping requests to complete before they
+    // can be handed to worker threads are queued in blocked list.
+    PDEVIO_REQ io_head;
+    PDEVIO_REQ blocked_head;
+    PDEVIO_REQ blocked_tail;
+    char closed;
+    char ready;
+    PDEVIO_CONN ready_next;
+};
+
+// A physical I/O operation on image file, for use with physical_batch().
+typedef struct _DEVIO_IO
+{
+    char write;
+    void *buf;
+    safeio_size_t size;
+    off_t_64 offset;
+    safeio_ssize_t result;
+    int error;
+
+    // When non-zero, buf points to this many iovec structures that hold
+    // size bytes in total.
+    int iovcnt;
+
+    // RWF_xxx flags for the operation.
+    int rw_flags;
+} DEVIO_IO, *PDEVIO_IO;
+
+// Range entry in unmap and zero requests, same layout as DEVICE_DATA_SET_RANGE used
+// by the driver.
+typedef struct _DEVIO_RANGE
+{
+    int64_t offset;
+    uint64_t length;
+} DEVIO_RANGE, *PDEVIO_RANGE;
 
 struct _VHD_INFO
 {
@@ -302,893 +612,9765 @@ int16_t block_shift = 0;
 int16_t sector_shift = 0;
 off_t_64 current_size = 0;
 
-dllread_proc dll_read = NULL;
-dllwrite_proc dll_write = NULL;
-dllclose_proc dll_close = NULL;
-dllopen_proc dll_open = NULL;
+// Block allocation table of dynamic VHD images, loaded when image is opened
+// and updated along with the table in image file. Entries are sector
+// numbers in host byte order, or 0xFFFFFFFF for blocks not allocated.
+uint32_t *vhd_bat = NULL;
+uint32_t vhd_bat_entries = 0;
 
-safeio_ssize_t
-physical_read(void *io_ptr, safeio_size_t size, off_t_64 offset)
+// Receives block bitmaps between data of adjacent blocks read together.
+char *vhd_gap_buf = NULL;
+
+// Number of block bitmaps kept in memory, and longest time in milliseconds
+// a changed bitmap is kept before it is written to image file.
+#define VHD_BITMAP_CACHE_BLOCKS 4096
+#define VHD_BITMAP_FLUSH_MS 1000
+
+// Sector bitmap of an allocated VHD block, one sector as stored in image
+// file. Dirty bitmaps have bits set that are not yet written.
+typedef struct _VHD_BITMAP
 {
-    if (dll_mode)
-        return dll_read(libhandle, io_ptr, size, offset);
-    else
-        return pread(image_fd, io_ptr, size, offset);
+    uint32_t block;
+    char dirty;
+    uint8_t *bits;
+} VHD_BITMAP, *PVHD_BITMAP;
+
+// Bitmaps of blocks written to are loaded when first needed and replaced in
+// the order they were loaded. Since reads do not look at bitmaps, changed
+// bitmaps are written in batches, at the latest VHD_BITMAP_FLUSH_MS after
+// first change. A crash before that leaves recently written sectors marked
+// as unused for other VHD implementations. With metadata journal, journaled
+// holds position in journal buffer of latest bitmap of each block written
+// there since last checkpoint, where it is loaded from instead.
+struct _VHD_BITMAPS
+{
+    uint32_t *slot;
+    size_t *journaled;
+    VHD_BITMAP *cache;
+    uint32_t loaded;
+    uint32_t hand;
+    uint32_t dirty_count;
+    ULONGLONG dirty_since;
+} vhd_bitmaps = {0};
+
+// Journal file for metadata of writable dynamic VHD images is named after
+// image file with this appended. Journal is checkpointed when it has held
+// committed transactions for VHD_JOURNAL_CHECKPOINT_MS, or right away when
+// it has grown to VHD_JOURNAL_CHECKPOINT_SIZE bytes.
+#define VHD_JOURNAL_SUFFIX "-journal"
+#define VHD_JOURNAL_MAGIC "devioJnl"
+#define VHD_JOURNAL_CHECKPOINT_MS 5000
+#define VHD_JOURNAL_CHECKPOINT_SIZE (4 << 20)
+
+// Journal transaction as stored in journal file, followed by size bytes of
+// records. Checksum covers header, with checksum field zero, and records.
+// Transactions follow each other with consecutive sequence numbers, and
+// carry unique id from footer of image, so that a journal left behind is
+// not replayed to another image file created under the same name.
+typedef struct _VHD_JOURNAL_HEADER
+{
+    char magic[8];
+    uint64_t sequence;
+    uint8_t image_id[16];
+    uint32_t size;
+    uint32_t checksum;
+} VHD_JOURNAL_HEADER;
+
+// Journal record, followed by size bytes to write at offset in image file,
+// padded to a multiple of 8 bytes.
+typedef struct _VHD_JOURNAL_RECORD
+{
+    int64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} VHD_JOURNAL_RECORD;
+
+// Write-ahead journal for BAT entries and bitmaps. Instead of being written
+// in place as they change, they are added as records to an open transaction
+// in buf. A commit syncs image file, so that data new BAT entries refer to
+// is on disk, and then writes sealed transactions to journal file with one
+// sync for all of them. A checkpoint writes everything in journal in place
+// and empties it. Journal left by a crash is replayed when image is opened.
+// buf holds transactions committed since last checkpoint up to committed,
+// sealed ones up to sealed, and an open transaction after that. unsynced is
+// set when image file has been written to since last commit.
+struct _VHD_JOURNAL
+{
+    int fd;
+    char *path;
+    char *buf;
+    size_t size;
+    size_t alloc;
+    size_t sealed;
+    size_t committed;
+    ULONGLONG sequence;
+    ULONGLONG committed_since;
+    char unsynced;
+} vhd_journal = {-1};
+
+void vhd_flush_metadata(char force);
+int vhd_metadata_timeout();
+
+// Largest number of blocks read with one vectored read.
+#define VHD_MAX_RUN_BLOCKS 32
+
+// Number of blocks a dynamic VHD image grows by at a time. Image file
+// location of next new block, and of the footer after space prepared for
+// new blocks, are found when first needed.
+#define VHD_GROW_BLOCKS 16
+off_t_64 vhd_next_block = -1;
+off_t_64 vhd_footer_offset = -1;
+
+// Longest chain of parents of a differencing VHD image, and number of blocks
+// with sectors in more than one layer that have their sector map kept in
+// memory.
+#define VHD_MAX_PARENTS 64
+#define VHD_OWNER_CACHE_BLOCKS 256
+
+// Values in owner index other than layer numbers. Layer 0 is the image
+// itself, its parents follow from 1 up.
+#define VHD_OWNER_NONE 0xFD
+#define VHD_OWNER_MIXED 0xFE
+#define VHD_OWNER_UNKNOWN 0xFF
+
+// Parent image of a differencing VHD image, opened read-only. The last one
+// in a chain is a dynamic image, where whole blocks are read regardless of
+// bitmaps just as for a dynamic image opened directly.
+typedef struct _VHD_PARENT
+{
+    int fd;
+    char *path;
+    uint32_t *bat;
+    uint32_t bat_entries;
+    char dynamic;
+} VHD_PARENT, *PVHD_PARENT;
+
+// Parent chain of a differencing VHD image. Parents are opened once, and
+// shared by all connections and worker threads. Instead of checking bitmaps
+// layer by layer on every read, owner holds for each block the layer all
+// its sectors are read from, VHD_OWNER_NONE where no layer has data, or
+// VHD_OWNER_MIXED. Layer of each sector in mixed blocks is kept in a map,
+// for recently used blocks found through map_slot. Entries are found when
+// first needed, and forgotten when the block is written to.
+struct _VHD_CHAIN
+{
+    VHD_PARENT parents[VHD_MAX_PARENTS];
+    int count;
+    uint8_t *owner;
+    uint32_t *map_slot;
+    uint32_t *map_block;
+    uint8_t *maps;
+    uint32_t hand;
+    uint8_t *bits;
+} vhd_chain = {{{0}}};
+
+// VHDX structures are found at fixed locations at start of image file, and
+// all of them are aligned to 1 MB. Everything is in little endian byte
+// order. Headers and region tables are stored twice.
+#define VHDX_HEADER_OFFSET (64 << 10)
+#define VHDX_HEADER_SIZE (4 << 10)
+#define VHDX_REGION_TABLE_OFFSET (192 << 10)
+#define VHDX_REGION_TABLE_SIZE (64 << 10)
+#define VHDX_METADATA_TABLE_SIZE (64 << 10)
+#define VHDX_LOG_SECTOR_SIZE (4 << 10)
+#define VHDX_ALIGNMENT (1 << 20)
+
+// Payload block states in BAT entries, and where in entries state and
+// file offset in megabytes are.
+#define VHDX_BLOCK_NOT_PRESENT 0
+#define VHDX_BLOCK_ZERO 2
+#define VHDX_BLOCK_FULLY_PRESENT 6
+#define VHDX_BLOCK_PARTIALLY_PRESENT 7
+#define VHDX_BLOCK_STATE_MASK 7
+#define VHDX_BLOCK_OFFSET_MASK (~(uint64_t)(VHDX_ALIGNMENT - 1))
+
+// Dynamic or fixed VHDX image. BAT entries of payload blocks are kept in
+// memory in host byte order, without the sector bitmap entry that follows
+// each chunk_ratio of them in image file. New blocks are allocated at
+// next_block, in space prepared up to file_end VHD_GROW_BLOCKS at a time,
+// and space not used is cut off when image is closed. header is a copy of
+// current one of the two headers in image file, in slot 0 or 1.
+struct _VHDX_INFO
+{
+    uint64_t *bat;
+    uint32_t bat_entries;
+    uint32_t chunk_ratio;
+    off_t_64 bat_offset;
+    off_t_64 next_block;
+    off_t_64 file_end;
+    char leave_allocated;
+    int header_slot;
+    uint8_t header[VHDX_HEADER_SIZE];
+} vhdx = {NULL, 0, 0, 0, -1, -1};
+
+// QCOW2 images are in big endian byte order, and everything in them is
+// stored in clusters. Backing files are opened read-only, as QCOW2 or raw
+// images, up to QCOW2_MAX_BACKING of them.
+#define QCOW2_MAGIC 0x514649FB
+#define QCOW2_HEADER_SIZE 104
+#define QCOW2_MAX_BACKING 16
+
+// Flags and host cluster offset in L1 and L2 table entries.
+#define QCOW2_OFLAG_COPIED ((uint64_t)1 << 63)
+#define QCOW2_OFLAG_COMPRESSED ((uint64_t)1 << 62)
+#define QCOW2_OFLAG_ZERO ((uint64_t)1)
+#define QCOW2_OFFSET_MASK ((uint64_t)0x00FFFFFFFFFFFE00ULL)
+
+// Incompatible feature bits understood here. Compressed clusters are not
+// read, so compression type does not matter.
+#define QCOW2_INCOMPAT_DIRTY 1
+#define QCOW2_INCOMPAT_CORRUPT 2
+#define QCOW2_INCOMPAT_COMPRESSION 8
+
+// What L2 table entries mean for reading clusters.
+#define QCOW2_CLUSTER_UNALLOCATED 0
+#define QCOW2_CLUSTER_DATA 1
+#define QCOW2_CLUSTER_ZERO 2
+#define QCOW2_CLUSTER_COMPRESSED 3
+
+// Memory used for cached L2 tables and refcount blocks, and limits for the
+// number of tables this is divided into.
+#define QCOW2_CACHE_SIZE (4 << 20)
+#define QCOW2_CACHE_MIN_TABLES 16
+#define QCOW2_CACHE_MAX_TABLES 256
+
+// Number of clusters that get their refcounts set with one write, before
+// they are used for new data clusters and L2 tables.
+#define QCOW2_ALLOC_CLUSTERS 16
+
+// An image in a QCOW2 backing chain, the image itself first. Raw backing
+// files have cluster_bits zero and no L1 table.
+typedef struct _QCOW2_LAYER
+{
+    int fd;
+    char *path;
+    off_t_64 size;
+    int cluster_bits;
+    uint64_t *l1;
+    uint32_t l1_size;
+    off_t_64 l1_offset;
+} QCOW2_LAYER, *PQCOW2_LAYER;
+
+// L2 table or refcount block in cache, as stored in image file. Least
+// recently used one is replaced when another one is needed.
+typedef struct _QCOW2_TABLE
+{
+    int layer;
+    off_t_64 offset;
+    uint64_t last_use;
+    uint8_t *data;
+} QCOW2_TABLE, *PQCOW2_TABLE;
+
+// QCOW2 image with its backing chain. Cluster size of the image itself is
+// block_size. L1 tables and refcount table are kept in memory in host byte
+// order. New clusters are taken from next_cluster at end of image file.
+// Refcounts are set for QCOW2_ALLOC_CLUSTERS of them at a time, up to
+// reserved_end, and reset for those not used when image is closed.
+struct _QCOW2_INFO
+{
+    QCOW2_LAYER layers[QCOW2_MAX_BACKING + 1];
+    int count;
+    int version;
+    int refcount_order;
+    uint64_t *refcount_table;
+    uint32_t refcount_table_size;
+    off_t_64 refcount_table_offset;
+    off_t_64 next_cluster;
+    off_t_64 reserved_end;
+    PQCOW2_TABLE tables;
+    int table_count;
+    uint64_t clock;
+    uint8_t *cluster_buf;
+} qcow2 = {{{0}}};
+
+// VMDK sparse extents are in little endian byte order, with offsets and
+// sizes in 512 byte sectors. Images are either a single sparse extent file
+// with descriptor embedded, or a text descriptor file listing extent files.
+#define VMDK_MAGIC 0x564D444B
+#define VMDK_HEADER_SIZE 512
+#define VMDK_DESCRIPTOR_MAX_SIZE (1 << 20)
+
+// Flags in sparse extent header, and grain table entry for grains that
+// read as zeroes without data.
+#define VMDK_FLAG_REDUNDANT_GD 2
+#define VMDK_FLAG_ZERO_GRAINS 4
+#define VMDK_FLAG_COMPRESSED 0x10000
+#define VMDK_GRAIN_ZERO 1
+
+// Kinds of extents listed in descriptors.
+#define VMDK_EXTENT_FLAT 0
+#define VMDK_EXTENT_SPARSE 1
+#define VMDK_EXTENT_ZERO 2
+
+// Memory used for cached grain tables, and least number of them.
+#define VMDK_CACHE_SIZE (8 << 20)
+#define VMDK_CACHE_MIN_TABLES 16
+
+// Extent of a VMDK image at start in virtual disk. Grain directories of
+// sparse extents are kept in memory in host byte order, and gt_slot holds
+// for each of their entries the cache slot of the grain table plus one, or
+// zero where it is not cached. New grains and grain tables go at file_end.
+typedef struct _VMDK_EXTENT
+{
+    int fd;
+    char *path;
+    char type;
+    char read_only;
+    char zero_grains;
+    off_t_64 start;
+    off_t_64 size;
+    off_t_64 file_offset;
+    int grain_shift;
+    uint32_t gt_entries;
+    uint32_t gd_entries;
+    uint32_t *gd;
+    uint32_t *rgd;
+    off_t_64 gd_offset;
+    off_t_64 rgd_offset;
+    uint32_t *gt_slot;
+    off_t_64 file_end;
+} VMDK_EXTENT, *PVMDK_EXTENT;
+
+// Grain table in cache, in host byte order.
+typedef struct _VMDK_TABLE
+{
+    PVMDK_EXTENT extent;
+    uint32_t gd_index;
+    uint64_t last_use;
+    uint32_t *entries;
+} VMDK_TABLE, *PVMDK_TABLE;
+
+// VMDK image with its extents in order in virtual disk. Grain tables of all
+// sparse extents share one cache, where the least recently used one is
+// replaced when another one is needed.
+struct _VMDK_INFO
+{
+    PVMDK_EXTENT extents;
+    int count;
+    PVMDK_TABLE tables;
+    int table_count;
+    uint64_t clock;
+    char *grain_buf;
+} vmdk = {0};
+
+#ifdef __linux__
+// Most extents kept in map of data in raw image files. Map is dropped if
+// image file is more fragmented than that.
+#define EXTENT_MAP_MAX_EXTENTS 65536
+
+// Range of a raw image file that holds data, as opposed to a hole.
+typedef struct _DATA_EXTENT
+{
+    off_t_64 start;
+    off_t_64 end;
+} DATA_EXTENT, *PDATA_EXTENT;
+
+// Data in raw image file up to size, in order, found with SEEK_DATA and
+// SEEK_HOLE when opened and kept up to date as it is written, unmapped and
+// zeroed. Ranges outside extents read as zeroes, and are read without
+// touching image file. Ranges beyond size are always read from image file.
+struct _EXTENT_MAP
+{
+    char enabled;
+    PDATA_EXTENT extents;
+    int count;
+    int capacity;
+    off_t_64 size;
+} extent_map = {0};
+#endif
+
+#ifdef __linux__
+// Worker threads read VHD, VHDX, QCOW2 and VMDK images concurrently, while
+// writes may allocate new blocks and need exclusive access. Readers also
+// update owner index of differencing VHD images and QCOW2 and VMDK table
+// caches, one at a time.
+pthread_rwlock_t vhd_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t vhd_chain_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t qcow2_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t vmdk_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Journal commits and checkpoints run one at a time. In write-back mode,
+// worker threads commit as well as the event loop thread.
+pthread_mutex_t vhd_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Extent map of raw image files is looked up by worker threads reading,
+// and changed by those writing. Unmapping and zeroing hold it while they
+// release space, so that data written meanwhile is not taken for a hole.
+pthread_mutex_t extent_map_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Locks are only taken when there are worker threads. Shared access to VHD
+// lock is for reading image data and exclusive access for changing layout.
+void vhd_lock_acquire_read()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_rwlock_rdlock(&vhd_lock);
+#endif
 }
 
-safeio_ssize_t
-physical_write(void *io_ptr, safeio_size_t size, off_t_64 offset)
+void vhd_lock_acquire_write()
 {
-    if (dll_mode)
-        return dll_write(libhandle, io_ptr, size, offset);
-    else
-        return pwrite(image_fd, io_ptr, size, offset);
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_rwlock_wrlock(&vhd_lock);
+#endif
 }
 
-int physical_close(int fd)
+void vhd_lock_release()
 {
-    if (dll_mode)
-        return dll_close(libhandle);
-    else
-        return _close(fd);
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_rwlock_unlock(&vhd_lock);
+#endif
 }
 
-#ifdef _WIN32
+void vhd_chain_lock_acquire()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_lock(&vhd_chain_lock);
+#endif
+}
 
-int alloc_drv_buffer()
+void vhd_chain_lock_release()
 {
-    HANDLE hFileMap = NULL;
-    safeio_size_t detected_buffer_size;
-    MEMORY_BASIC_INFORMATION memory_info;
-    ULARGE_INTEGER map_size = {0};
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_unlock(&vhd_chain_lock);
+#endif
+}
 
-    printf("Allocating new buffer: " SIZ_FMT " bytes.\n", buffer_size);
+void qcow2_cache_lock_acquire()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_lock(&qcow2_cache_lock);
+#endif
+}
 
-    map_size.QuadPart = (ULONGLONG)buffer_size + FSCRYPTDPROXY_HEADER_SIZE;
+void qcow2_cache_lock_release()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_unlock(&qcow2_cache_lock);
+#endif
+}
 
-    hFileMap = CreateFileMapping(INVALID_HANDLE_VALUE,
-                                 NULL,
-                                 PAGE_READWRITE | SEC_COMMIT,
-                                 map_size.HighPart,
-                                 map_size.LowPart,
-                                 NULL);
+void vmdk_cache_lock_acquire()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_lock(&vmdk_cache_lock);
+#endif
+}
 
-    if (hFileMap == NULL)
-    {
-        syslog(LOG_ERR, "CreateFileMapping() failed: %m\n");
-        return 2;
-    }
+void vmdk_cache_lock_release()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_unlock(&vmdk_cache_lock);
+#endif
+}
 
-    shm_view = (char *)MapViewOfFile(hFileMap, FILE_MAP_WRITE, 0, 0, 0);
+void vhd_commit_lock_acquire()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_lock(&vhd_commit_lock);
+#endif
+}
 
-    if (shm_view == NULL)
-    {
-        syslog(LOG_ERR, "MapViewOfFile() failed: %m\n");
-        return 2;
-    }
+void vhd_commit_lock_release()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_unlock(&vhd_commit_lock);
+#endif
+}
 
-    CloseHandle(hFileMap);
+void extent_map_lock_acquire()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_lock(&extent_map_lock);
+#endif
+}
 
-    buf = shm_view + FSCRYPTDPROXY_HEADER_SIZE;
+void extent_map_lock_release()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_unlock(&extent_map_lock);
+#endif
+}
 
-    if (!VirtualQuery(shm_view, &memory_info, sizeof(memory_info)))
-    {
-        syslog(LOG_ERR, "VirtualQuery() failed: %m\n");
-        return 2;
-    }
+dllread_proc dll_read = NULL;
+dllwrite_proc dll_write = NULL;
+dllclose_proc dll_close = NULL;
+dllopen_proc dll_open = NULL;
 
-    memset(shm_view, 0, memory_info.RegionSize);
+#ifdef __linux__
 
-    detected_buffer_size = (safeio_size_t)(memory_info.RegionSize - FSCRYPTDPROXY_HEADER_SIZE);
+// Number of submission queue entries in the io_uring instance used with
+// --io=uring.
+#define URING_ENTRIES 256
 
-    if (buffer_size != detected_buffer_size)
-    {
-        buffer_size = detected_buffer_size;
-        if (buf2 != NULL)
-        {
-            free(buf2);
-            buf2 = (char *)malloc(buffer_size);
-            if (buf2 == NULL)
-            {
-                syslog(LOG_ERR, "malloc() failed: %m\n");
-                return 2;
-            }
-        }
-    }
+// Number of slots in fixed buffer table. In --multi mode, each request
+// buffer is registered in a slot for as long as there are free slots.
+#define URING_FIXED_BUFFERS 1024
 
-    ResetEvent(drv_memory_io.hEvent);
+// io_uring instance, set up with plain system calls so that devio does not
+// depend on liburing. Completions with lowest bit set in user_data belong to
+// a DEVIO_IO waited for by physical_batch(), other completions belong to a
+// DEVIO_REQ submitted asynchronously in --multi mode.
+struct _DEVIO_URING
+{
+    int fd;
+    int event_fd;
+    char fixed_file;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;
+    unsigned cq_entries;
+    unsigned cq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+    unsigned in_flight;
+    unsigned sync_pending;
+    int free_slots[URING_FIXED_BUFFERS];
+    int free_slot_count;
+} uring = {-1, -1};
+
+void uring_req_done(PDEVIO_REQ req, int res);
+
+int uring_init()
+{
+    struct io_uring_params params = {0};
+    struct io_uring_rsrc_register reg = {0};
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    char *sq_ring;
+    char *cq_ring;
+    int i;
 
-    if (!DeviceIoControl((HANDLE)sd, IOCTL_DEVIODRV_LOCK_MEMORY, &shm_view, sizeof(void *), shm_view, buffer_size + FSCRYPTDPROXY_HEADER_SIZE, NULL, &drv_memory_io))
+    uring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd == -1)
     {
-        if (GetLastError() == ERROR_IO_PENDING)
-        {
-            dbglog((LOG_ERR, "Memory successfully locked.\n"));
-        }
-        else
-        {
-            syslog(LOG_ERR, "Lock memory request failed: %m\n");
-            return 3;
-        }
+        syslog(LOG_ERR, "io_uring_setup() failed: %m\n");
+        return 0;
     }
 
-    return 0;
-}
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
 
-int shm_read(void *io_ptr, safeio_size_t size)
-{
-    if (io_ptr == buf)
-        if (size <= buffer_size)
-            return 1;
-        else
-            return 0;
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+        cq_ring_size > sq_ring_size)
+        sq_ring_size = cq_ring_size;
 
-    if (shm_readptr == NULL)
-        if (drv_mode)
-            shm_readptr = shm_view + sizeof(FSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER);
-        else
-            shm_readptr = shm_view;
+    sq_ring = (char *)mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, uring.fd,
+                           IORING_OFF_SQ_RING);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else
+        cq_ring = (char *)mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, uring.fd,
+                               IORING_OFF_CQ_RING);
+
+    uring.sqes = (struct io_uring_sqe *)
+        mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd,
+             IORING_OFF_SQES);
 
-    if ((long long)size > (long long)(buf - shm_readptr))
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+        uring.sqes == MAP_FAILED)
+    {
+        syslog(LOG_ERR, "Failed mapping io_uring queues: %m\n");
+        close(uring.fd);
+        uring.fd = -1;
         return 0;
+    }
 
-    memcpy(io_ptr, shm_readptr, size);
-    shm_readptr = shm_readptr + size;
+    uring.sq_entries = params.sq_entries;
+    uring.sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+    uring.sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    uring.sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    uring.sqe_tail = *uring.sq_tail;
+
+    uring.cq_entries = params.cq_entries;
+    uring.cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+    uring.cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    uring.cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+    // Image file descriptor is registered to save a file table lookup for
+    // each operation
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES,
+                &image_fd, 1) == 0)
+        uring.fixed_file = 1;
+
+    // Sparse fixed buffer table, filled in as request buffers are allocated.
+    // Request I/O uses non-fixed operations if this is not supported.
+    reg.nr = URING_FIXED_BUFFERS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS2,
+                &reg, sizeof reg) == -1)
+    {
+        syslog(LOG_ERR, "io_uring fixed buffers not available: %m\n");
+    }
+    else
+    {
+        for (i = URING_FIXED_BUFFERS - 1; i >= 0; i--)
+            uring.free_slots[uring.free_slot_count++] = i;
+    }
 
     return 1;
 }
 
-int shm_write(const void *io_ptr, safeio_size_t size)
+// Returns next free submission queue entry, cleared and prepared for an
+// operation on image file, or NULL if queue is full or too many operations
+// are in flight for completion queue to hold their results.
+struct io_uring_sqe *uring_get_sqe(__u8 opcode, void *buf,
+                                   safeio_size_t size, off_t_64 offset)
 {
-    if (io_ptr == buf)
-        if (size <= buffer_size)
-            return 1;
-        else
-            return 0;
-
-    if (shm_writeptr == NULL)
-        if (drv_mode)
-            shm_writeptr = shm_view + sizeof(FSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER);
-        else
-            shm_writeptr = shm_view;
-
-    if ((long long)size > (long long)(buf - shm_writeptr))
-        return 0;
+    struct io_uring_sqe *sqe;
+    unsigned index;
 
-    memcpy(shm_writeptr, io_ptr, size);
-    shm_writeptr = shm_writeptr + size;
+    if (uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >=
+            uring.sq_entries ||
+        uring.in_flight >= uring.cq_entries)
+        return NULL;
 
-    return 1;
-}
+    index = uring.sqe_tail & uring.sq_mask;
+    sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
 
-int shm_flush()
-{
-    shm_readptr = NULL;
-    shm_writeptr = NULL;
+    sqe->opcode = opcode;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = (__u32)size;
+    sqe->off = (__u64)offset;
 
-    if (!SetEvent(shm_response_event))
+    if (uring.fixed_file)
     {
-        syslog(LOG_ERR, "SetEvent() failed: %m\n");
-        return 0;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    else
+    {
+        sqe->fd = image_fd;
     }
 
-    if (WaitForSingleObject(shm_request_event, INFINITE) != WAIT_OBJECT_0)
-        return 0;
+    uring.sq_array[index] = index;
+    uring.sqe_tail++;
+    uring.in_flight++;
 
-    return 1;
+    return sqe;
 }
 
-int drv_flush()
+// Submits prepared entries to kernel and, if wait_nr is non-zero, waits for
+// that many completions to become available. Returns -1 with errno set if
+// kernel refused, in which case entries it has not taken stay in queue.
+int uring_enter(unsigned wait_nr)
 {
-    DWORD dw;
+    unsigned to_submit;
 
-    shm_readptr = NULL;
-    shm_writeptr = NULL;
+    __atomic_store_n(uring.sq_tail, uring.sqe_tail, __ATOMIC_RELEASE);
 
-    dbglog((LOG_ERR, "Calling DeviceIoControl for exchanging requests.\n"));
+    to_submit =
+        uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
 
-    ResetEvent(drv_request_io.hEvent);
+    if (to_submit == 0 && wait_nr == 0)
+        return 0;
 
-    while (!DeviceIoControl((HANDLE)sd, IOCTL_DEVIODRV_EXCHANGE_IO, &shm_view, sizeof(void *), NULL, 0, &dw, &drv_request_io))
+    while (syscall(__NR_io_uring_enter, uring.fd, to_submit, wait_nr,
+                   wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1)
     {
-        DWORD err = GetLastError();
+        // Busy means completion queue needs to be reaped before more can
+        // be submitted, which caller does after this returns
+        if (errno == EBUSY || errno == EAGAIN)
+            return -1;
 
-        if (err == ERROR_IO_PENDING)
+        if (errno != EINTR)
         {
-            dbglog((LOG_ERR, "Waiting for request to complete.\n"));
+            syslog(LOG_ERR, "io_uring_enter() failed: %m\n");
+            return -1;
+        }
+    }
 
-            if (GetOverlappedResult((HANDLE)sd, &drv_request_io, &dw, TRUE))
-            {
-                dbglog((LOG_ERR, "Request complete.\n"));
+    return 0;
+}
 
-                break;
-            }
+// Dispatches all available completions.
+void uring_reap()
+{
+    unsigned head = *uring.cq_head;
 
-            err = GetLastError();
-        }
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+        __u64 user_data = cqe->user_data;
+        int res = cqe->res;
 
-        dbglog((LOG_ERR, "Request failed: %i %m", err));
+        head++;
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        uring.in_flight--;
 
-        if (err == ERROR_INSUFFICIENT_BUFFER)
+        if (user_data & 1)
         {
-            // need larger buffer (for write request, detected in driver)
-            dbglog((LOG_ERR, "Larger buffer needed.\n"));
-
-            if (!GetOverlappedResult((HANDLE)sd, &drv_memory_io, &dw, TRUE) &&
-                GetLastError() != ERROR_INSUFFICIENT_BUFFER)
-            {
-                syslog(LOG_ERR, "Error waiting for memory unlock: %i %m", GetLastError());
-            }
-
-            UnmapViewOfFile(shm_view);
-
-            shm_view = NULL;
-
-            buffer_size <<= 1;
+            PDEVIO_IO io = (PDEVIO_IO)(uintptr_t)(user_data & ~(__u64)1);
 
-            if (alloc_drv_buffer() == 0)
+            if (res < 0)
             {
-                continue;
+                io->result = -1;
+                io->error = -res;
             }
             else
             {
-                return 0;
+                io->result = res;
             }
-        }
-        else if (err == ERROR_DEV_NOT_EXIST)
-        {
-            return 1;
+
+            uring.sync_pending--;
         }
         else
         {
-            syslog(LOG_ERR, "DeviceIoControl() failed: %m\n", err);
-            return 0;
+            uring_req_done((PDEVIO_REQ)(uintptr_t)user_data, res);
         }
     }
-
-    return 1;
-}
-
-#else // Unix
-
-int shm_read(void *io_ptr, safeio_size_t size)
-{
-    return 0;
 }
 
-int shm_write(const void *io_ptr, safeio_size_t size)
+// Waits for operations of batches in flight to complete. Kernel uses their
+// buffers until then, so this cannot give up early.
+void uring_wait_batch()
 {
-    return 0;
-}
+    char logged = 0;
 
-int shm_flush()
-{
-    return 0;
-}
+    while (uring.sync_pending > 0)
+    {
+        if (syscall(__NR_io_uring_enter, uring.fd, 0, uring.sync_pending,
+                    IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+            errno != EINTR && errno != EBUSY && errno != EAGAIN && !logged)
+        {
+            syslog(LOG_ERR, "io_uring_enter() failed: %m\n");
+            logged = 1;
+        }
 
-int drv_flush()
-{
-    return 0;
+        uring_reap();
+    }
 }
 
-#endif
+void physical_batch(PDEVIO_IO ios, int count);
 
-void buf_realloc(ULONGLONG new_size)
+// Submits a batch of operations as a linked chain and waits for all of
+// them to complete. Returns zero if there was no room in submission queue
+// or kernel did not take any of them, in which case nothing was submitted.
+// Otherwise all operations have results as from physical_batch(). If
+// kernel takes only the first part of chain, rest of it is done after
+// that part has completed.
+int uring_batch(PDEVIO_IO ios, int count)
 {
-    if (shm_mode)
-        return;
+    unsigned first = uring.sqe_tail;
+    unsigned taken;
+    int error;
+    int i;
 
-    if (new_size > (((safeio_size_t)-1) >> 1))
+    if (uring.sqe_tail - *uring.sq_head + count > uring.sq_entries ||
+        uring.in_flight + count > uring.cq_entries)
+        return 0;
+
+    for (i = 0; i < count; i++)
     {
-        new_size = (((safeio_size_t)-1) >> 1);
-    }
+        struct io_uring_sqe *sqe;
 
-    buffer_size = (safeio_size_t)new_size;
+        if (ios[i].iovcnt > 0)
+            sqe = uring_get_sqe(ios[i].write ? IORING_OP_WRITEV : IORING_OP_READV,
+                                ios[i].buf, ios[i].iovcnt, ios[i].offset);
+        else
+            sqe = uring_get_sqe(ios[i].write ? IORING_OP_WRITE : IORING_OP_READ,
+                                ios[i].buf, ios[i].size, ios[i].offset);
 
-    dbglog((LOG_ERR, "Read request " SLL_FMT " bytes, reallocating buffer.\n",
-            (off_t_64)buffer_size));
+        if (i < count - 1)
+            sqe->flags |= IOSQE_IO_LINK;
 
-#ifdef _WIN32
-    if (drv_mode)
-    {
-        DWORD dw;
+        sqe->rw_flags = ios[i].rw_flags;
+        sqe->user_data = (uintptr_t)&ios[i] | 1;
+    }
 
-        char *existing_buf = buf;
-        char *existing_buf2 = buf2;
-        char *existing_shm_view = shm_view;
-        safeio_size_t existing_buffer_size = buffer_size;
+    uring.sync_pending += count;
 
-        if (!GetOverlappedResult((HANDLE)sd, &drv_memory_io, &dw, TRUE) &&
-            GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    while (uring.sync_pending > 0)
+    {
+        if (uring_enter(1) == 0)
         {
-            syslog(LOG_ERR, "Error waiting for memory unlock: %i %m", GetLastError());
+            uring_reap();
+            continue;
         }
 
-        if (alloc_drv_buffer() == 0)
+        error = errno;
+
+        // Busy with completions to reap is retried after reaping them
+        if ((error == EBUSY || error == EAGAIN) &&
+            __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE) != *uring.cq_head)
         {
-            memcpy(shm_view, existing_shm_view, FSCRYPTDPROXY_HEADER_SIZE);
-            UnmapViewOfFile(existing_shm_view);
-            free(existing_buf2);
+            uring_reap();
+            continue;
         }
-        else
+
+        // Entries of this batch are last in queue, so those that kernel
+        // has not taken can be withdrawn
+        taken = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) - first;
+        if ((int)taken < 0)
+            taken = 0;
+
+        if (taken >= (unsigned)count)
         {
-            shm_view = existing_shm_view;
-            buf = existing_buf;
-            buf2 = existing_buf2;
-            buffer_size = existing_buffer_size;
+            uring_wait_batch();
+            return 1;
         }
-    }
-    else
-#endif
-    {
-        char *new_buf = (char *)malloc(buffer_size);
-        char *new_buf2 = (char *)malloc(buffer_size);
-        if (new_buf == NULL || new_buf2 == NULL)
-        {
-            syslog(LOG_ERR, "Failed allocating new buffer: %m\n");
 
-            if (new_buf != NULL)
-                free(new_buf);
-            if (new_buf2 != NULL)
-                free(new_buf2);
+        uring.sqe_tail = first + taken;
+        __atomic_store_n(uring.sq_tail, uring.sqe_tail, __ATOMIC_RELEASE);
+        uring.in_flight -= count - taken;
+        uring.sync_pending -= count - taken;
+
+        uring_wait_batch();
+
+        if (taken == 0)
+            return 0;
+
+        // Rest of chain follows the part that kernel took, unless that part
+        // was cut short, which cancels rest of chain
+        if (ios[taken - 1].result == (safeio_ssize_t)ios[taken - 1].size)
+        {
+            physical_batch(ios + taken, count - taken);
         }
         else
         {
-            free(buf);
-            buf = new_buf;
-            free(buf2);
-            buf2 = new_buf2;
+            for (i = taken; i < count; i++)
+            {
+                ios[i].result = -1;
+                ios[i].error = ECANCELED;
+            }
         }
-    }
-}
 
-int comm_flush()
-{
-    if (shm_mode)
-        return shm_flush();
-    else if (drv_mode)
-        return drv_flush();
-    else
         return 1;
-}
+    }
 
-int comm_read(void *io_ptr, safeio_size_t size)
-{
-    if (shm_mode || drv_mode)
-        return shm_read(io_ptr, size);
-    else
-        return safe_read(sd, io_ptr, size);
+    return 1;
 }
 
-int comm_write(const void *io_ptr, safeio_size_t size)
+#endif
+
+// Alignment of transfer buffers, enough for direct I/O on any device
+#define DEVIO_BUF_ALIGNMENT 4096
+
+#ifdef __linux__
+
+// Transfer buffers of at least this size are mapped separately, rounded up
+// to and aligned at this size, so that they can be backed by huge pages
+#define BUF_HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+// Kinds of pages that large transfer buffers have been backed with, each
+// reported first time it is used, and whether huge pages from hugetlbfs
+// pool have run out.
+typedef enum _BUF_PAGES
 {
-    if (shm_mode || drv_mode)
-        return shm_write(io_ptr, size);
-    else
-        return safe_write(sd, io_ptr, size);
-}
+    BUF_PAGES_NORMAL,
+    BUF_PAGES_THP,
+    BUF_PAGES_HUGETLB
+} BUF_PAGES;
 
-int send_info()
+struct _BUF_HUGE
 {
-    if (!comm_write(&devio_info, sizeof devio_info))
-        return 0;
+    char reported[3];
+    char hugetlb_failed;
+    char thp_checked;
+    char thp_enabled;
+} buf_huge = {{0}};
+
+// Checks whether transparent huge pages can back mappings that ask for
+// them with madvise().
+char buf_thp_enabled()
+{
+    char setting[64] = "";
+    FILE *file;
 
-    if (!comm_flush())
+    if (buf_huge.thp_checked)
+        return buf_huge.thp_enabled;
+
+    file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (file != NULL)
     {
-        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        if (fgets(setting, sizeof(setting), file) == NULL)
+            setting[0] = 0;
 
-        return 0;
+        fclose(file);
     }
 
-    return 1;
+    buf_huge.thp_enabled = setting[0] != 0 && strstr(setting, "[never]") == NULL;
+    buf_huge.thp_checked = 1;
+
+    return buf_huge.thp_enabled;
 }
 
-int send_failed()
+// Maps anonymous memory at an address aligned to BUF_HUGE_PAGE_SIZE, by
+// releasing parts of a larger mapping before and after it. Returns NULL
+// with errno set on failure.
+char *buf_map_aligned(size_t size)
 {
-    ULONGLONG req = ENODEV;
-    if (!comm_write(&req, sizeof req))
-    {
-        syslog(LOG_ERR, "stdout: %m\n");
-        return 1;
-    }
+    size_t map_size = size + BUF_HUGE_PAGE_SIZE;
+    char *map;
+    char *buf;
 
-    if (!comm_flush())
-    {
-        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+    map = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
 
-        return 0;
-    }
+    buf = (char *)(((uintptr_t)map + BUF_HUGE_PAGE_SIZE - 1) &
+                   ~(uintptr_t)(BUF_HUGE_PAGE_SIZE - 1));
 
-    return 1;
+    if (buf > map)
+        munmap(map, buf - map);
+
+    if (map + map_size > buf + size)
+        munmap(buf + size, map + map_size - (buf + size));
+
+    return buf;
 }
 
-safeio_ssize_t
-vhd_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+// Maps a large transfer buffer, from hugetlbfs pool where huge pages are
+// reserved, otherwise aligned for transparent huge pages. Size is a
+// multiple of BUF_HUGE_PAGE_SIZE. Returns NULL with errno set on failure.
+void *buf_map_huge(size_t size)
 {
-    off_t_64 block_number;
-    off_t_64 data_offset;
-    safeio_size_t in_block_offset;
-    uint32_t block_offset;
-    safeio_size_t first_size = size;
-    off_t_64 second_offset = 0;
-    safeio_size_t second_size = 0;
-    safeio_ssize_t readdone;
-
-    dbglog((LOG_ERR, "vhd_read: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
-            (off_t_64)size, (off_t_64)offset));
+    BUF_PAGES pages = BUF_PAGES_HUGETLB;
+    char *buf = (char *)MAP_FAILED;
 
-    if (offset + size > current_size)
-        return 0;
+    static const char *const messages[] = {
+        "Transfer buffers use normal pages, huge pages not available.",
+        "Transfer buffers use transparent huge pages.",
+        "Transfer buffers use 2 MB huge pages."
+    };
 
-    block_number = (safeio_size_t)(offset >> block_shift);
-    data_offset = table_offset + (block_number << 2);
-    in_block_offset = (safeio_size_t)offset & (block_size - 1);
-    if (first_size + in_block_offset > block_size)
+    if (!buf_huge.hugetlb_failed)
     {
-        first_size = block_size - in_block_offset;
-        second_size = size - first_size;
-        second_offset = offset + first_size;
+        buf = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                           MAP_HUGE_2MB, -1, 0);
+
+        // Pool stays empty unless administrator reserves more pages
+        if (buf == MAP_FAILED)
+            buf_huge.hugetlb_failed = 1;
     }
 
-    readdone = physical_read(&block_offset, sizeof(block_offset), data_offset);
-    if (readdone != sizeof(block_offset))
+    if (buf == MAP_FAILED)
     {
-        syslog(LOG_ERR, "vhd_read: Error reading block table: %m\n");
+        buf = buf_map_aligned(size);
+        if (buf == NULL)
+            return NULL;
 
-        if (errno == 0)
-            errno = E2BIG;
+        pages = buf_thp_enabled() && madvise(buf, size, MADV_HUGEPAGE) == 0 ?
+            BUF_PAGES_THP : BUF_PAGES_NORMAL;
+    }
 
-        return (safeio_ssize_t)-1;
+    if (!buf_huge.reported[pages])
+    {
+        buf_huge.reported[pages] = 1;
+        puts(messages[pages]);
+        fflush(stdout);
     }
 
-    memset(io_ptr, 0, size);
+    return buf;
+}
 
-    if (block_offset == 0xFFFFFFFF)
-        readdone = first_size;
-    else
-    {
-        block_offset = ntohl(block_offset);
+#endif
+
+// Allocates a transfer buffer aligned for direct I/O, with huge pages for
+// large buffers where available. Returns NULL with errno set on failure.
+void *buf_alloc(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, DEVIO_BUF_ALIGNMENT);
+#else
+    void *buf;
+    int err;
 
-        data_offset =
-            (((off_t_64)block_offset) << sector_shift) + sector_size +
-            in_block_offset;
+#ifdef __linux__
+    if (size >= BUF_HUGE_PAGE_SIZE)
+        return buf_map_huge((size + BUF_HUGE_PAGE_SIZE - 1) &
+                            ~(BUF_HUGE_PAGE_SIZE - 1));
+#endif
 
-        readdone = physical_read(io_ptr, (safeio_size_t)first_size, data_offset);
-        readdone = physical_read(io_ptr, (safeio_size_t)first_size, data_offset);
-        if (readdone == -1)
-            return (safeio_ssize_t)-1;
-    }
+    err = posix_memalign(&buf, DEVIO_BUF_ALIGNMENT, size);
 
-    if (second_size > 0)
+    if (err != 0)
     {
-        safeio_size_t second_read =
-            vhd_read(io_ptr + first_size, second_size, second_offset);
+        errno = err;
+        return NULL;
+    }
 
-        if (second_read == -1)
-            return (safeio_ssize_t)-1;
+    return buf;
+#endif
+}
 
-        readdone += second_read;
+// Frees a transfer buffer of size bytes from buf_alloc().
+void buf_free(void *buf, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    _aligned_free(buf);
+#else
+#ifdef __linux__
+    if (buf != NULL && size >= BUF_HUGE_PAGE_SIZE)
+    {
+        munmap(buf, (size + BUF_HUGE_PAGE_SIZE - 1) &
+                    ~(BUF_HUGE_PAGE_SIZE - 1));
+        return;
     }
+#else
+    (void)size;
+#endif
 
-    return readdone;
+    free(buf);
+#endif
 }
 
-safeio_ssize_t
-vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+#ifdef _WIN32
+#define DEVIO_THREAD_LOCAL __declspec(thread)
+#else
+#define DEVIO_THREAD_LOCAL __thread
+#endif
+
+// Transfer buffer that a thread keeps for its next transfer, grown as
+// needed. Worker threads run until process exits, so these are not freed.
+typedef struct _DEVIO_THREAD_BUF
 {
-    off_t_64 block_number;
-    off_t_64 data_offset;
-    safeio_size_t in_block_offset;
-    uint32_t block_offset;
-    safeio_size_t first_size = size;
-    off_t_64 second_offset = 0;
-    safeio_size_t second_size = 0;
-    safeio_ssize_t readdone;
-    safeio_ssize_t writedone;
-    off_t_64 bitmap_offset;
-    safeio_size_t bitmap_datasize;
-    safeio_size_t first_size_nqwords;
+    char *buf;
+    safeio_size_t size;
+} DEVIO_THREAD_BUF, *PDEVIO_THREAD_BUF;
 
-    dbglog((LOG_ERR, "vhd_write: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
-            (off_t_64)size, (off_t_64)offset));
+// Returns buffer of a thread with room for at least size bytes, or NULL
+// if it cannot be grown.
+char *thread_buf_get(PDEVIO_THREAD_BUF tbuf, safeio_size_t size)
+{
+    char *buf;
 
-    if (offset + size > current_size)
-        return 0;
+    if (size <= tbuf->size)
+        return tbuf->buf;
 
-    block_number = offset >> block_shift;
-    data_offset = table_offset + (block_number << 2);
-    in_block_offset = (safeio_size_t)offset & (block_size - 1);
-    if (first_size + in_block_offset > block_size)
-    {
-        first_size = block_size - in_block_offset;
-        second_size = size - first_size;
-        second_offset = offset + first_size;
-    }
-    first_size_nqwords = (first_size + 7) >> 3;
+    buf = (char *)buf_alloc(size);
+    if (buf == NULL)
+        return NULL;
 
-    readdone = physical_read(&block_offset, sizeof(block_offset), data_offset);
-    if (readdone != sizeof(block_offset))
-    {
-        syslog(LOG_ERR, "vhd_write: Error reading block table: %m\n");
+    buf_free(tbuf->buf, tbuf->size);
 
-        if (errno == 0)
-            errno = E2BIG;
+    tbuf->buf = buf;
+    tbuf->size = size;
 
-        return (safeio_ssize_t)-1;
-    }
+    return buf;
+}
 
-    // Alocate a new block if not already defined
-    if (block_offset == 0xFFFFFFFF)
-    {
-        off_t_64 block_offset_bytes;
-        char *new_block_buf;
-        long long *buf_ptr;
+#ifdef __linux__
 
-        // First check if new block is all zeroes, in that case don't allocate
-        // a new block in the vhd file
-        for (buf_ptr = (long long *)io_ptr;
-             (buf_ptr < (long long *)io_ptr + first_size_nqwords) ? 0 : (*buf_ptr == 0);
-             buf_ptr++)
-            ;
-        if (buf_ptr >= (long long *)io_ptr + first_size_nqwords)
-        {
-            dbglog((LOG_ERR, "vhd_write: New empty block not added to vhd file "
-                             "backing " SLL_FMT " bytes at " SLL_FMT ".\n",
-                    (off_t_64)first_size, (off_t_64)offset));
+pthread_mutex_t direct_io_lock = PTHREAD_MUTEX_INITIALIZER;
 
-            writedone = first_size;
+void direct_io_lock_acquire()
+{
+    if (worker_count > 0)
+        pthread_mutex_lock(&direct_io_lock);
+}
 
-            if (second_size > 0)
-            {
-                safeio_size_t second_write =
-                    vhd_write(io_ptr + first_size, second_size, second_offset);
+void direct_io_lock_release()
+{
+    if (worker_count > 0)
+        pthread_mutex_unlock(&direct_io_lock);
+}
 
-                if (second_write == -1)
-                    return (safeio_ssize_t)-1;
+safeio_ssize_t
+physical_read(void *io_ptr, safeio_size_t size, off_t_64 offset);
 
-                writedone += second_write;
-            }
+safeio_ssize_t
+physical_write(void *io_ptr, safeio_size_t size, off_t_64 offset);
 
-            return writedone;
-        }
+// Checks whether a transfer can be done with direct I/O on image file as it
+// is, which is always the case without direct I/O.
+int direct_io_aligned(const void *io_ptr, safeio_size_t size,
+                      off_t_64 offset)
+{
+    uintptr_t mask = direct_io.align - 1;
 
-        dbglog((LOG_ERR, "vhd_write: Adding new block to vhd file backing " SLL_FMT " bytes at " SLL_FMT ".\n",
-                (off_t_64)first_size, (off_t_64)offset));
+    return direct_io.align == 0 ||
+        (((uintptr_t)io_ptr & mask) == 0 && (size & mask) == 0 &&
+         ((uint64_t)offset & mask) == 0);
+}
 
-        new_block_buf = (char *)
-            malloc((size_t)sector_size + block_size + sizeof(vhd_info.Footer));
-        if (new_block_buf == NULL)
-        {
-            syslog(LOG_ERR, "vhd_write: Error allocating memory buffer for new "
-                            "block: %m\n");
+// Checks whether a vectored transfer can be done as a whole with one system
+// call. It cannot if any part of it needs to be bounced for direct I/O, or
+// if it is a read from a mapped image file.
+int physical_iov_whole(const struct iovec *iov, int iovcnt, off_t_64 offset,
+                       char write)
+{
+    int i;
 
-            return (safeio_ssize_t)-1;
-        }
+    if (!write && image_map.base != NULL)
+        return 0;
 
-        // New block is placed where the footer currently is
-        block_offset_bytes =
-            _lseeki64(image_fd, -(off_t_64)sizeof(vhd_info.Footer), SEEK_END);
-        if (block_offset_bytes == -1)
-        {
-            syslog(LOG_ERR, "vhd_write: Error moving file pointer to last "
-                            "block: %m\n");
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (!direct_io_aligned(iov[i].iov_base, (safeio_size_t)iov[i].iov_len,
+                               offset))
+            return 0;
 
-            free(new_block_buf);
-            return (safeio_ssize_t)-1;
-        }
+        offset += iov[i].iov_len;
+    }
 
-        // Store pointer to new block start sector in BAT
-        block_offset = htonl((uint32_t)(block_offset_bytes >> sector_shift));
-        readdone =
-            physical_write(&block_offset, sizeof(block_offset), data_offset);
-        if (readdone != sizeof(block_offset))
-        {
-            syslog(LOG_ERR, "vhd_write: Error updating BAT: %m\n");
+    return 1;
+}
 
-            free(new_block_buf);
+// Counts a transfer bounced for direct I/O.
+void direct_io_count_bounce()
+{
+    direct_io_lock_acquire();
 
-            if (errno == 0)
-                errno = E2BIG;
+    direct_io.bounced++;
 
-            return (safeio_ssize_t)-1;
-        }
+    direct_io_lock_release();
+}
 
-        // Initialize new block with zeroes followed by the new footer
-        memset(new_block_buf, 0, (size_t)sector_size + block_size);
-        memcpy(new_block_buf + sector_size + block_size, &vhd_info.Footer,
-               sizeof(vhd_info.Footer));
+// Bounce buffer of each thread that does I/O
+DEVIO_THREAD_LOCAL DEVIO_THREAD_BUF direct_bounce = {0};
 
-        readdone =
-            physical_write(new_block_buf,
-                           (size_t)sector_size + block_size + sizeof(vhd_info.Footer),
-                           block_offset_bytes);
+// Reads into io_ptr through an aligned buffer that covers the aligned
+// sectors around the requested range, for direct I/O.
+safeio_ssize_t
+direct_bounce_read(void *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 start = offset & ~(off_t_64)(direct_io.align - 1);
+    safeio_size_t span = (safeio_size_t)
+        ((offset + size - start + direct_io.align - 1) &
+         ~(off_t_64)(direct_io.align - 1));
+    safeio_ssize_t readdone;
+    char *buf = thread_buf_get(&direct_bounce, span);
 
-        if (readdone != (safeio_ssize_t)(sector_size + block_size) +
-                            (safeio_ssize_t)sizeof(vhd_info.Footer))
-        {
-            syslog(LOG_ERR, "vhd_write: Error writing new block: %m\n");
+    if (buf == NULL)
+        return (safeio_ssize_t)-1;
 
-            free(new_block_buf);
+    readdone = physical_read(buf, span, start);
 
-            if (errno == 0)
-                errno = E2BIG;
+    if (readdone != -1)
+    {
+        readdone -= (safeio_ssize_t)(offset - start);
 
-            return (safeio_ssize_t)-1;
-        }
+        if (readdone < 0)
+            readdone = 0;
+        else if (readdone > (safeio_ssize_t)size)
+            readdone = (safeio_ssize_t)size;
 
-        free(new_block_buf);
+        memcpy(io_ptr, buf + (offset - start), readdone);
     }
 
-    // Calculate where actual data should be written
-    block_offset = ntohl(block_offset);
-    data_offset = (((off_t_64)block_offset) << sector_shift) + sector_size +
-                  in_block_offset;
+    direct_io_count_bounce();
 
-    // Write data
-    writedone = physical_write(io_ptr, (safeio_size_t)first_size, data_offset);
-    if (writedone == -1)
-        return (safeio_ssize_t)-1;
+    return readdone;
+}
+
+// Writes from io_ptr with read-modify-write of the aligned sectors around
+// the requested range, for direct I/O. Concurrent bounced writes are
+// serialized, because they may share sectors without overlapping. Aligned
+// writes from the same connection that share sectors with this one overlap
+// it, so they are not executed concurrently. Writes from other connections
+// to the same sectors have no defined order anyway. If aligned sectors
+// reach past end of file, requested range is written without direct I/O
+// instead, so that file is extended only as far as requested and other
+// writes extending it meanwhile are not cut off.
+safeio_ssize_t
+direct_bounce_write(void *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 start = offset & ~(off_t_64)(direct_io.align - 1);
+    safeio_size_t span = (safeio_size_t)
+        ((offset + size - start + direct_io.align - 1) &
+         ~(off_t_64)(direct_io.align - 1));
+    safeio_ssize_t readdone;
+    safeio_ssize_t writedone = (safeio_ssize_t)-1;
+    char *buf = thread_buf_get(&direct_bounce, span);
 
-    // Calculate where and how many bytes in allocation bitmap we need to update
-    bitmap_offset = ((off_t_64)block_offset << sector_shift) +
-                    (in_block_offset >> sector_shift >> 3);
+    if (buf == NULL)
+        return (safeio_ssize_t)-1;
 
-    bitmap_datasize =
-        (((first_size + sector_size - 1) >> sector_shift) + 7) >> 3;
+    direct_io_lock_acquire();
 
-    // Set bits as 'allocated'
-    memset(buf2, 0xFF, bitmap_datasize);
+    readdone = physical_read(buf, span, start);
 
-    // Update allocation bitmap
-    readdone = physical_write(buf2, bitmap_datasize, bitmap_offset);
-    if (readdone != (safeio_ssize_t)bitmap_datasize)
+    if (readdone != -1 && readdone < (safeio_ssize_t)span)
     {
-        syslog(LOG_ERR, "vhd_write: Error updating block bitmap: %m\n");
+        writedone = pwrite(direct_io.buffered_fd, io_ptr, size, offset);
 
-        if (errno == 0)
-            errno = E2BIG;
+        direct_io.bounced++;
 
-        return (safeio_ssize_t)-1;
+        direct_io_lock_release();
+
+        return writedone;
     }
 
-    if (second_size > 0)
+    if (readdone != -1)
     {
-        safeio_size_t second_write =
-            vhd_write(io_ptr + first_size, second_size, second_offset);
+        memcpy(buf + (offset - start), io_ptr, size);
 
-        if (second_write == -1)
-            return (safeio_ssize_t)-1;
+        writedone = physical_write(buf, span, start);
+    }
+
+    direct_io.bounced++;
+
+    direct_io_lock_release();
+
+    if (writedone != -1)
+    {
+        writedone -= (safeio_ssize_t)(offset - start);
 
-        writedone += second_write;
+        if (writedone < 0)
+            writedone = 0;
+        else if (writedone > (safeio_ssize_t)size)
+            writedone = (safeio_ssize_t)size;
     }
 
     return writedone;
 }
 
-safeio_ssize_t
-logical_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+// Returns alignment of buffer address, offset and size that direct I/O on
+// image file needs, or zero if it is not supported. Without statx()
+// information, file system block size is used for regular files, as it is
+// a multiple of device sector size.
+safeio_size_t direct_io_alignment()
 {
-    if (vhd_mode)
-        return vhd_read(io_ptr, size, offset);
-    else
-        return physical_read(io_ptr, size, offset);
+    struct stat file_stat;
+    int sector_size;
+
+#ifdef STATX_DIOALIGN
+    struct statx file_statx;
+
+    if (statx(image_fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &file_statx) == 0 &&
+        (file_statx.stx_mask & STATX_DIOALIGN))
+        return file_statx.stx_dio_mem_align > file_statx.stx_dio_offset_align ?
+            file_statx.stx_dio_mem_align : file_statx.stx_dio_offset_align;
+#endif
+
+    if (fstat(image_fd, &file_stat) == -1)
+        return 0;
+
+    if (S_ISBLK(file_stat.st_mode) &&
+        ioctl(image_fd, BLKSSZGET, &sector_size) == 0)
+        return (safeio_size_t)sector_size;
+
+    return file_stat.st_blksize < DEVIO_BUF_ALIGNMENT ?
+        (safeio_size_t)file_stat.st_blksize : DEVIO_BUF_ALIGNMENT;
 }
 
-safeio_ssize_t
-logical_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+// Switches image file to direct I/O for --cache=direct. Image file stays
+// with page cache if file system does not support direct I/O.
+void direct_io_setup()
 {
-    if (vhd_mode)
-        return vhd_write(io_ptr, size, offset);
-    else
-        return physical_write(io_ptr, size, offset);
+    int flags = fcntl(image_fd, F_GETFL);
+    safeio_size_t align = direct_io_alignment();
+
+    // A separate open file is needed for writes past end of file, as file
+    // status flags are shared by duplicated descriptors
+    if (flags != -1 && (flags & O_ACCMODE) != O_RDONLY)
+    {
+        char path[32];
+
+        snprintf(path, sizeof path, "/proc/self/fd/%i", image_fd);
+
+        direct_io.buffered_fd = open(path, O_RDWR);
+        if (direct_io.buffered_fd == -1)
+            flags = -1;
+    }
+
+    if (align == 0 || align > DEVIO_BUF_ALIGNMENT || (align & (align - 1)) ||
+        flags == -1 || fcntl(image_fd, F_SETFL, flags | direct_io_flag) == -1)
+    {
+        syslog(LOG_ERR, "Direct I/O not supported for image file.\n");
+        puts("Using page cache for image file.");
+
+        if (direct_io.buffered_fd != -1)
+        {
+            close(direct_io.buffered_fd);
+            direct_io.buffered_fd = -1;
+        }
+
+        return;
+    }
+
+    direct_io.align = align;
+
+    printf("Using direct I/O for image file, aligned to " SIZ_FMT " bytes.\n",
+           direct_io.align);
 }
 
-int read_data()
+// Maps raw image file for --cache=mmap, so that reads are copied from page
+// cache without a system call each. Writes still go through write calls,
+// which update the same page cache.
+void image_map_open()
 {
-    FSCRYPTDPROXY_READ_REQ req_block = {0};
-    FSCRYPTDPROXY_READ_RESP resp_block = {0};
-    safeio_size_t size;
-    safeio_ssize_t readdone;
+    void *base;
 
-    if (!comm_read(&req_block.offset,
-                   sizeof(req_block) - sizeof(req_block.request_code)))
+    if (vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode ||
+        image_file_size <= 0 || (ULONGLONG)image_file_size > (size_t)-1)
     {
-        syslog(LOG_ERR, "Error reading request header.\n");
-        return 0;
+        puts("Mapped reads only for raw image files, using read calls.");
+        return;
     }
 
-    if (req_block.length > buffer_size) // we will need larger buffer to complete this request
+    base = mmap(NULL, (size_t)image_file_size, PROT_READ, MAP_SHARED,
+                image_fd, 0);
+    if (base == MAP_FAILED)
     {
-        buf_realloc(req_block.length);
+        syslog(LOG_ERR, "Cannot map image file: %m\n");
+        puts("Using read calls for image file.");
+        return;
     }
 
-    size = (safeio_size_t)(req_block.length < buffer_size ? req_block.length : buffer_size);
+    image_map.base = (char *)base;
+    image_map.size = image_file_size;
 
-    dbglog((LOG_ERR, "read request " ULL_FMT " bytes at " ULL_FMT " + " ULL_FMT " = " ULL_FMT ".\n",
-            req_block.length, req_block.offset, image_offset,
-            req_block.offset + image_offset));
+    printf("Image file mapped for reads, " SLL_FMT " bytes.\n",
+           (int64_t)image_map.size);
+}
 
-    memset(buf, 0, size);
+#endif
 
-    readdone =
-        logical_read(buf, (safeio_size_t)size, (off_t_64)(image_offset + req_block.offset));
+safeio_ssize_t
+physical_read(void *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+#ifdef __linux__
+    if (image_map.base != NULL && offset + size <= image_map.size)
+    {
+        memcpy(io_ptr, image_map.base + offset, size);
+        return (safeio_ssize_t)size;
+    }
 
-    if (readdone == -1)
+    if (!direct_io_aligned(io_ptr, size, offset))
+        return direct_bounce_read(io_ptr, size, offset);
+
+    if (uring_mode)
     {
-        resp_block.errorno = errno;
-        resp_block.length = 0;
-        syslog(LOG_ERR, "Device read: %m\n");
+        DEVIO_IO io = {0, io_ptr, size, offset};
+
+        if (uring_batch(&io, 1))
+        {
+            if (io.result == -1)
+                errno = io.error;
+
+            return io.result;
+        }
     }
+#endif
+
+    if (dll_mode)
+        return dll_read(libhandle, io_ptr, size, offset);
     else
+        return pread(image_fd, io_ptr, size, offset);
+}
+
+safeio_ssize_t
+physical_write(void *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+#ifdef __linux__
+    if (!direct_io_aligned(io_ptr, size, offset))
+        return direct_bounce_write(io_ptr, size, offset);
+
+    if (uring_mode)
     {
-        resp_block.errorno = 0;
-        resp_block.length = size;
+        DEVIO_IO io = {1, io_ptr, size, offset};
 
-        if (req_block.length != readdone)
+        if (uring_batch(&io, 1))
         {
-            syslog(LOG_ERR,
-                   "Partial read at " SLL_FMT ": Got " SLL_FMT ", req " ULL_FMT ".\n",
-                   (int64_t)(image_offset + req_block.offset), (int64_t)readdone, req_block.length);
+            if (io.result == -1)
+                errno = io.error;
+
+            return io.result;
         }
     }
+#endif
 
-    dbglog((LOG_ERR, "read done reporting/sending " ULL_FMT " bytes.\n",
-            resp_block.length));
+    if (dll_mode)
+        return dll_write(libhandle, io_ptr, size, offset);
+    else
+        return pwrite(image_fd, io_ptr, size, offset);
+}
+
+// Reads into iovcnt buffers in iov from consecutive parts of image file,
+// with one system call where possible.
+safeio_ssize_t
+physical_readv(struct iovec *iov, int iovcnt, off_t_64 offset)
+{
+    safeio_ssize_t readdone = 0;
+    int i;
 
-    if (!comm_write(&resp_block, sizeof resp_block))
+#ifdef __linux__
+    if (uring_mode && physical_iov_whole(iov, iovcnt, offset, 0))
     {
-        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
-        return 0;
-    }
+        DEVIO_IO io = {0, iov, 0, offset};
+
+        for (i = 0; i < iovcnt; i++)
+            io.size += (safeio_size_t)iov[i].iov_len;
 
-    if (resp_block.errorno == 0)
-        if (!comm_write(buf, (safeio_size_t)resp_block.length))
+        io.iovcnt = iovcnt;
+
+        if (uring_batch(&io, 1))
         {
-            syslog(LOG_ERR, "Error sending read response to caller.\n");
-            return 0;
+            if (io.result == -1)
+                errno = io.error;
+
+            return io.result;
         }
+    }
+
+    if (!dll_mode && physical_iov_whole(iov, iovcnt, offset, 0))
+        return preadv(image_fd, iov, iovcnt, offset);
+#endif
 
-    if (!comm_flush())
+    for (i = 0; i < iovcnt; i++)
     {
-        syslog(LOG_ERR, "Error flushing comm data: %m\n");
-        return 0;
+        safeio_ssize_t sizedone =
+            physical_read(iov[i].iov_base, (safeio_size_t)iov[i].iov_len,
+                          offset + readdone);
+
+        if (sizedone == -1)
+            return -1;
+
+        readdone += sizedone;
+
+        if (sizedone != (safeio_ssize_t)iov[i].iov_len)
+            break;
     }
 
-    return 1;
+    return readdone;
 }
 
-int write_data()
+// Writes iovcnt buffers in iov to consecutive parts of image file, with one
+// system call where possible.
+safeio_ssize_t
+physical_writev(struct iovec *iov, int iovcnt, off_t_64 offset)
 {
-    FSCRYPTDPROXY_WRITE_REQ req_block = {0};
-    FSCRYPTDPROXY_WRITE_RESP resp_block = {0};
+    safeio_ssize_t writedone = 0;
+    int i;
 
-    if (!comm_read(&req_block.offset,
-                   sizeof(req_block) - sizeof(req_block.request_code)))
-        return 0;
+#ifdef __linux__
+    if (uring_mode && physical_iov_whole(iov, iovcnt, offset, 1))
+    {
+        DEVIO_IO io = {1, iov, 0, offset};
 
-    dbglog((LOG_ERR, "write request " ULL_FMT " bytes at " ULL_FMT " + " ULL_FMT " = " ULL_FMT ".\n",
-            req_block.length, req_block.offset, image_offset,
-            req_block.offset + image_offset));
+        for (i = 0; i < iovcnt; i++)
+            io.size += (safeio_size_t)iov[i].iov_len;
+
+        io.iovcnt = iovcnt;
+
+        if (uring_batch(&io, 1))
+        {
+            if (io.result == -1)
+                errno = io.error;
+
+            return io.result;
+        }
+    }
+
+    if (!dll_mode && physical_iov_whole(iov, iovcnt, offset, 1))
+        return pwritev(image_fd, iov, iovcnt, offset);
+#endif
 
-    if (req_block.length > buffer_size)
+    for (i = 0; i < iovcnt; i++)
     {
-        syslog(LOG_ERR, "Too big block write requested: %u bytes.\n",
-               (int)req_block.length);
-        return 0;
+        safeio_ssize_t sizedone =
+            physical_write(iov[i].iov_base, (safeio_size_t)iov[i].iov_len,
+                           offset + writedone);
+
+        if (sizedone == -1)
+            return -1;
+
+        writedone += sizedone;
+
+        if (sizedone != (safeio_ssize_t)iov[i].iov_len)
+            break;
     }
 
-    if (!comm_read(buf, (safeio_size_t)req_block.length))
+    return writedone;
+}
+
+// Performs a batch of physical I/O operations in order. With io_uring they
+// are submitted together as one linked chain, otherwise one at a time. An
+// operation that fails or transfers less than requested cancels the rest of
+// the batch, which then get -1 results with error ECANCELED. Caller checks
+// result of each operation, and error when result is -1.
+void physical_batch(PDEVIO_IO ios, int count)
+{
+    int i;
+
+#ifdef __linux__
+    // Operations bounced for direct I/O are done one at a time
+    for (i = 0; i < count; i++)
+        if (ios[i].iovcnt > 0 ?
+            !physical_iov_whole((struct iovec *)ios[i].buf, ios[i].iovcnt,
+                                ios[i].offset, ios[i].write) :
+            !direct_io_aligned(ios[i].buf, ios[i].size, ios[i].offset))
+            break;
+
+    if (uring_mode && i == count && uring_batch(ios, count))
+        return;
+#endif
+
+    for (i = 0; i < count; i++)
     {
-        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        if (ios[i].iovcnt > 0 && ios[i].write)
+            ios[i].result = physical_writev((struct iovec *)ios[i].buf,
+                                            ios[i].iovcnt, ios[i].offset);
+        else if (ios[i].iovcnt > 0)
+            ios[i].result = physical_readv((struct iovec *)ios[i].buf,
+                                           ios[i].iovcnt, ios[i].offset);
+        else if (ios[i].write)
+            ios[i].result = physical_write(ios[i].buf, ios[i].size,
+                                           ios[i].offset);
+        else
+            ios[i].result = physical_read(ios[i].buf, ios[i].size,
+                                          ios[i].offset);
 
-        return 0;
+        ios[i].error = ios[i].result == -1 ? errno : 0;
+
+        if (ios[i].result != (safeio_ssize_t)ios[i].size)
+            break;
     }
 
-    if (devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
+    for (i++; i < count; i++)
     {
-        resp_block.errorno = EBADF;
-        resp_block.length = 0;
-        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
+        ios[i].result = -1;
+        ios[i].error = ECANCELED;
     }
+}
+
+void prepare_io(PDEVIO_IO io, char write, void *buf, safeio_size_t size,
+                off_t_64 offset)
+{
+    io->write = write;
+    io->buf = buf;
+    io->size = size;
+    io->offset = offset;
+    io->result = 0;
+    io->error = 0;
+    io->iovcnt = 0;
+    io->rw_flags = 0;
+}
+
+int physical_close(int fd)
+{
+    if (dll_mode)
+        return dll_close(libhandle);
     else
-    {
-        safeio_ssize_t writedone = logical_write(buf, (safeio_size_t)req_block.length,
-                                                 (off_t_64)(image_offset + req_block.offset));
-        if (writedone == -1)
-        {
-            resp_block.errorno = errno;
-            resp_block.length = writedone;
-#ifdef _WIN32
-            perror("Device write");
+        return _close(fd);
+}
+
+// Flushes data written to a file to disk. Returns -1 with errno set on
+// failure.
+int file_sync(int fd)
+{
+#if defined(_WIN32)
+    return _commit(fd);
+#elif defined(__linux__)
+    return fdatasync(fd);
 #else
-            syslog(LOG_ERR, "Device write: %m\n");
+    return fsync(fd);
 #endif
-        }
-        else
-        {
-            resp_block.errorno = 0;
-            resp_block.length = writedone;
-        }
+}
 
-        if (req_block.length != resp_block.length)
-        {
-            if (writedone < 0)
-            {
-                syslog(LOG_ERR, "Write error (code " ULL_FMT ") at " ULL_FMT ": Req " ULL_FMT ".\n",
-                       resp_block.errorno, image_offset + req_block.offset, req_block.length);
-            }
-            else
-            {
-                syslog(LOG_ERR, "Partial write at " ULL_FMT ": Got " ULL_FMT ", req " ULL_FMT ".\n",
-                       resp_block.errorno, image_offset + req_block.offset, req_block.length);
-            }
-        }
+// Writes to image file so that data is on stable storage when done, without
+// waiting for other data written to image file where possible.
+safeio_ssize_t
+physical_write_dsync(void *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_ssize_t writedone;
 
-        dbglog((LOG_ERR, "write done reporting/sending " ULL_FMT " bytes.\n",
-                resp_block.length));
-    }
+    if (dll_mode)
+        return dll_write(libhandle, io_ptr, size, offset);
 
-    if (!comm_write(&resp_block, sizeof resp_block))
+#ifdef __linux__
+    // Writes bounced for direct I/O are synced separately
+    if (!direct_io_aligned(io_ptr, size, offset))
     {
-        syslog(LOG_ERR, "Error sending write response to caller.\n");
+        writedone = physical_write(io_ptr, size, offset);
+        if (writedone != -1 && file_sync(image_fd) == -1)
+            return -1;
 
-        return 0;
+        return writedone;
     }
+#endif
 
-    if (!comm_flush())
+#if defined(__linux__) && defined(RWF_DSYNC)
+    if (uring_mode)
     {
-        syslog(LOG_ERR, "Error flushing comm data: %m\n");
-        return 0;
+        DEVIO_IO io = {1, io_ptr, size, offset};
+
+        io.rw_flags = RWF_DSYNC;
+
+        if (uring_batch(&io, 1))
+        {
+            if (io.result == -1)
+                errno = io.error;
+
+            return io.result;
+        }
     }
+    else
+    {
+        struct iovec iov;
 
-    return 1;
-}
+        iov.iov_base = io_ptr;
+        iov.iov_len = size;
 
-int do_comm(char *comm_device);
+        writedone = pwritev2(image_fd, &iov, 1, offset, RWF_DSYNC);
+        if (writedone != -1 || errno != EOPNOTSUPP)
+            return writedone;
+    }
+#endif
 
-int main(int argc, char **argv)
+    writedone = pwrite(image_fd, io_ptr, size, offset);
+    if (writedone != -1 && file_sync(image_fd) == -1)
+        return -1;
+
+    return writedone;
+}
+
+// Sets size of a file. Returns -1 with errno set on failure.
+int file_truncate(int fd, off_t_64 size)
 {
-    safeio_ssize_t readdone;
-    int partition_number = 0;
-    char mbr[512];
-    int retval;
-    char *comm_device = NULL;
+#ifdef _WIN32
+    errno = _chsize_s(fd, size);
+    return errno == 0 ? 0 : -1;
+#else
+    return ftruncate(fd, size);
+#endif
+}
 
 #ifdef _WIN32
-    WSADATA wsadata;
 
-    SetUnhandledExceptionFilter(ExceptionFilter);
+int alloc_drv_buffer(PDEVIO_CONN conn)
+{
+    HANDLE hFileMap = NULL;
+    safeio_size_t detected_buffer_size;
+    MEMORY_BASIC_INFORMATION memory_info;
+    ULARGE_INTEGER map_size = {0};
 
-    (void)WSAStartup(0x0101, &wsadata);
-#endif
+    printf("Allocating new buffer: " SIZ_FMT " bytes.\n", conn->buffer_size);
 
-    if (argc > 1 && _stricmp(argv[1], "--dll") == 0)
+    map_size.QuadPart = (ULONGLONG)conn->buffer_size + FSCRYPTDPROXY_HEADER_SIZE;
+
+    hFileMap = CreateFileMapping(INVALID_HANDLE_VALUE,
+                                 NULL,
+                                 PAGE_READWRITE | SEC_COMMIT,
+                                 map_size.HighPart,
+                                 map_size.LowPart,
+                                 NULL);
+
+    if (hFileMap == NULL)
     {
-        fprintf(stderr,
-                "devio with custom DLL support\n"
-                "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
-                "\n"
-                "Usage for unmanaged C/C++ DLL files:\n"
-                "devio --dll=dllfile;procedure other_devio_parameters ...\n"
-                "\n"
-                "dllfile     Name of custom DLL file to use for device I/O.\n"
-                "\n"
-                "procedure   Name of procedure in DLL file to use for opening device. This\n"
-                "            procedure must follow the dllopen_proc typedef as specified in\n"
-                "devio.h.\n"
-                "\n"
-                "Declaration for dllopen is:\n"
-                "void * __cdecl dllopen(const char *str,\n"
-                "                       int read_only,\n"
-                "                       dllread_proc *dllread,\n"
-                "                       dllwrite_proc *dllwrite,\n"
-                "                       dllclose_proc *dllclose,\n"
-                "                       __int64 *size)\n"
-                "\n"
-                "str         Device name to open as specified at devio command line.\n"
-                "\n"
-                "read_only   A non-zero value requests a device to be opened in read only mode.\n"
-                "\n"
-                "dllread     Pointer to memory where dllopen should store address to a function\n"
+        syslog(LOG_ERR, "CreateFileMapping() failed: %m\n");
+        return 2;
+    }
+
+    conn->shm_view = (char *)MapViewOfFile(hFileMap, FILE_MAP_WRITE, 0, 0, 0);
+
+    if (conn->shm_view == NULL)
+    {
+        syslog(LOG_ERR, "MapViewOfFile() failed: %m\n");
+        return 2;
+    }
+
+    CloseHandle(hFileMap);
+
+    conn->buf = conn->shm_view + FSCRYPTDPROXY_HEADER_SIZE;
+
+    if (!VirtualQuery(conn->shm_view, &memory_info, sizeof(memory_info)))
+    {
+        syslog(LOG_ERR, "VirtualQuery() failed: %m\n");
+        return 2;
+    }
+
+    memset(conn->shm_view, 0, memory_info.RegionSize);
+
+    detected_buffer_size = (safeio_size_t)(memory_info.RegionSize - FSCRYPTDPROXY_HEADER_SIZE);
+
+    conn->buffer_size = detected_buffer_size;
+
+    ResetEvent(drv_memory_io.hEvent);
+
+    if (!DeviceIoControl((HANDLE)conn->sd, IOCTL_DEVIODRV_LOCK_MEMORY, &conn->shm_view, sizeof(void *), conn->shm_view, conn->buffer_size + FSCRYPTDPROXY_HEADER_SIZE, NULL, &drv_memory_io))
+    {
+        if (GetLastError() == ERROR_IO_PENDING)
+        {
+            dbglog((LOG_ERR, "Memory successfully locked.\n"));
+        }
+        else
+        {
+            syslog(LOG_ERR, "Lock memory request failed: %m\n");
+            return 3;
+        }
+    }
+
+    return 0;
+}
+
+int shm_read(PDEVIO_CONN conn, void *io_ptr, safeio_size_t size)
+{
+    if (io_ptr == conn->buf)
+        if (size <= conn->buffer_size)
+            return 1;
+        else
+            return 0;
+
+    if (conn->shm_readptr == NULL)
+        if (drv_mode)
+            conn->shm_readptr = conn->shm_view + sizeof(FSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER);
+        else
+            conn->shm_readptr = conn->shm_view;
+
+    if ((long long)size > (long long)(conn->buf - conn->shm_readptr))
+        return 0;
+
+    memcpy(io_ptr, conn->shm_readptr, size);
+    conn->shm_readptr = conn->shm_readptr + size;
+
+    return 1;
+}
+
+int shm_write(PDEVIO_CONN conn, const void *io_ptr, safeio_size_t size)
+{
+    if (io_ptr == conn->buf)
+        if (size <= conn->buffer_size)
+            return 1;
+        else
+            return 0;
+
+    if (conn->shm_writeptr == NULL)
+        if (drv_mode)
+            conn->shm_writeptr = conn->shm_view + sizeof(FSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER);
+        else
+            conn->shm_writeptr = conn->shm_view;
+
+    if ((long long)size > (long long)(conn->buf - conn->shm_writeptr))
+        return 0;
+
+    memcpy(conn->shm_writeptr, io_ptr, size);
+    conn->shm_writeptr = conn->shm_writeptr + size;
+
+    return 1;
+}
+
+int shm_flush(PDEVIO_CONN conn)
+{
+    conn->shm_readptr = NULL;
+    conn->shm_writeptr = NULL;
+
+    if (!SetEvent(shm_response_event))
+    {
+        syslog(LOG_ERR, "SetEvent() failed: %m\n");
+        return 0;
+    }
+
+    if (WaitForSingleObject(shm_request_event, INFINITE) != WAIT_OBJECT_0)
+        return 0;
+
+    return 1;
+}
+
+int drv_flush(PDEVIO_CONN conn)
+{
+    DWORD dw;
+
+    conn->shm_readptr = NULL;
+    conn->shm_writeptr = NULL;
+
+    dbglog((LOG_ERR, "Calling DeviceIoControl for exchanging requests.\n"));
+
+    ResetEvent(drv_request_io.hEvent);
+
+    while (!DeviceIoControl((HANDLE)conn->sd, IOCTL_DEVIODRV_EXCHANGE_IO, &conn->shm_view, sizeof(void *), NULL, 0, &dw, &drv_request_io))
+    {
+        DWORD err = GetLastError();
+
+        if (err == ERROR_IO_PENDING)
+        {
+            dbglog((LOG_ERR, "Waiting for request to complete.\n"));
+
+            if (GetOverlappedResult((HANDLE)conn->sd, &drv_request_io, &dw, TRUE))
+            {
+                dbglog((LOG_ERR, "Request complete.\n"));
+
+                break;
+            }
+
+            err = GetLastError();
+        }
+
+        dbglog((LOG_ERR, "Request failed: %i %m", err));
+
+        if (err == ERROR_INSUFFICIENT_BUFFER)
+        {
+            // need larger buffer (for write request, detected in driver)
+            dbglog((LOG_ERR, "Larger buffer needed.\n"));
+
+            if (!GetOverlappedResult((HANDLE)conn->sd, &drv_memory_io, &dw, TRUE) &&
+                GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            {
+                syslog(LOG_ERR, "Error waiting for memory unlock: %i %m", GetLastError());
+            }
+
+            UnmapViewOfFile(conn->shm_view);
+
+            conn->shm_view = NULL;
+
+            conn->buffer_size <<= 1;
+
+            if (alloc_drv_buffer(conn) == 0)
+            {
+                continue;
+            }
+            else
+            {
+                return 0;
+            }
+        }
+        else if (err == ERROR_DEV_NOT_EXIST)
+        {
+            return 1;
+        }
+        else
+        {
+            syslog(LOG_ERR, "DeviceIoControl() failed: %m\n", err);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+#else // Unix
+
+int shm_read(PDEVIO_CONN conn, void *io_ptr, safeio_size_t size)
+{
+    return 0;
+}
+
+int shm_write(PDEVIO_CONN conn, const void *io_ptr, safeio_size_t size)
+{
+    return 0;
+}
+
+int shm_flush(PDEVIO_CONN conn)
+{
+    return 0;
+}
+
+int drv_flush(PDEVIO_CONN conn)
+{
+    return 0;
+}
+
+#endif
+
+void buf_realloc(PDEVIO_CONN conn, ULONGLONG new_size)
+{
+    if (shm_mode)
+        return;
+
+    if (new_size > (((safeio_size_t)-1) >> 1))
+    {
+        new_size = (((safeio_size_t)-1) >> 1);
+    }
+
+    dbglog((LOG_ERR, "Read request " SLL_FMT " bytes, reallocating buffer.\n",
+            (off_t_64)new_size));
+
+#ifdef _WIN32
+    if (drv_mode)
+    {
+        DWORD dw;
+
+        char *existing_buf = conn->buf;
+        char *existing_shm_view = conn->shm_view;
+        safeio_size_t existing_buffer_size = conn->buffer_size;
+
+        conn->buffer_size = (safeio_size_t)new_size;
+
+        if (!GetOverlappedResult((HANDLE)conn->sd, &drv_memory_io, &dw, TRUE) &&
+            GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+        {
+            syslog(LOG_ERR, "Error waiting for memory unlock: %i %m", GetLastError());
+        }
+
+        if (alloc_drv_buffer(conn) == 0)
+        {
+            memcpy(conn->shm_view, existing_shm_view, FSCRYPTDPROXY_HEADER_SIZE);
+            UnmapViewOfFile(existing_shm_view);
+        }
+        else
+        {
+            conn->shm_view = existing_shm_view;
+            conn->buf = existing_buf;
+            conn->buffer_size = existing_buffer_size;
+        }
+    }
+    else
+#endif
+    {
+        char *new_buf = (char *)buf_alloc((size_t)new_size);
+        if (new_buf == NULL)
+        {
+            syslog(LOG_ERR, "Failed allocating new buffer: %m\n");
+        }
+        else
+        {
+            buf_free(conn->buf, conn->buffer_size);
+            conn->buf = new_buf;
+            conn->buffer_size = (safeio_size_t)new_size;
+        }
+    }
+}
+
+int comm_flush(PDEVIO_CONN conn)
+{
+    if (shm_mode)
+        return shm_flush(conn);
+    else if (drv_mode)
+        return drv_flush(conn);
+    else
+        return 1;
+}
+
+// Size of receive buffer for stream connections.
+#define COMM_RECV_BUFFER_SIZE (64 << 10)
+
+#ifndef _WIN32
+
+// Reads size bytes from a stream connection through its receive buffer.
+// Each read system call asks for as much as fits in buffer, so that small
+// requests sent back to back by a client are received with one call. Reads
+// at least as large as the buffer, such as large write payloads, go
+// directly to destination once buffered data is used up.
+int comm_recv(PDEVIO_CONN conn, void *io_ptr, safeio_size_t size)
+{
+    char *ptr = (char *)io_ptr;
+
+    while (size > 0)
+    {
+        safeio_size_t avail = conn->recv_end - conn->recv_start;
+        ssize_t sizedone;
+
+        if (avail > 0)
+        {
+            if (avail > size)
+                avail = size;
+
+            memcpy(ptr, conn->recv_buf + conn->recv_start, avail);
+            conn->recv_start += avail;
+            ptr += avail;
+            size -= avail;
+            continue;
+        }
+
+        if (size >= COMM_RECV_BUFFER_SIZE)
+            return safe_read(conn->sd, ptr, size);
+
+        if (conn->recv_buf == NULL)
+        {
+            conn->recv_buf = (char *)malloc(COMM_RECV_BUFFER_SIZE);
+            if (conn->recv_buf == NULL)
+                return safe_read(conn->sd, ptr, size);
+        }
+
+        conn->recv_start = 0;
+        conn->recv_end = 0;
+
+        // Changed VHD bitmaps are written, and journal checkpointed, when
+        // due while waiting for client
+        if (vhd_mode)
+        {
+            struct pollfd pfd = {0};
+            int timeout;
+
+            pfd.fd = conn->sd;
+            pfd.events = POLLIN;
+
+            while ((timeout = vhd_metadata_timeout()) >= 0)
+            {
+                if (timeout > 0 && poll(&pfd, 1, timeout) != 0)
+                    break;
+
+                vhd_flush_metadata(0);
+            }
+        }
+
+        sizedone = read(conn->sd, conn->recv_buf, COMM_RECV_BUFFER_SIZE);
+
+        if (sizedone == -1 && errno == EINTR)
+            continue;
+
+        if (sizedone == -1)
+            syslog(LOG_ERR, "comm_recv(): %m\n");
+
+        if (sizedone <= 0)
+            return 0;
+
+        conn->recv_end = sizedone;
+    }
+
+    return 1;
+}
+
+#endif
+
+int comm_read(PDEVIO_CONN conn, void *io_ptr, safeio_size_t size)
+{
+    if (shm_mode || drv_mode)
+        return shm_read(conn, io_ptr, size);
+    else
+#ifdef _WIN32
+        return safe_read(conn->sd, io_ptr, size);
+#else
+        return comm_recv(conn, io_ptr, size);
+#endif
+}
+
+int comm_write(PDEVIO_CONN conn, const void *io_ptr, safeio_size_t size)
+{
+    if (shm_mode || drv_mode)
+        return shm_write(conn, io_ptr, size);
+    else
+        return safe_write(conn->sd, io_ptr, size);
+}
+
+// Writes all buffers in iov, with one gather write on streams.
+int comm_writev(PDEVIO_CONN conn, struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    if (!shm_mode && !drv_mode)
+    {
+        conn->stat_sends++;
+        return safe_writev(conn->sd, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++)
+        if (!comm_write(conn, iov[i].iov_base, (safeio_size_t)iov[i].iov_len))
+            return 0;
+
+    return 1;
+}
+
+// Sends a response structure followed by payload_size bytes of payload. In
+// tagged mode, it is preceded by a header identifying the request it
+// belongs to. All parts are sent with one gather write.
+int send_response(PDEVIO_CONN conn, const void *resp, safeio_size_t resp_size,
+                  const void *payload, safeio_size_t payload_size)
+{
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (conn->tagged)
+    {
+        iov[iovcnt].iov_base = &conn->tag;
+        iov[iovcnt].iov_len = sizeof conn->tag;
+        iovcnt++;
+    }
+
+    iov[iovcnt].iov_base = (void *)resp;
+    iov[iovcnt].iov_len = resp_size;
+    iovcnt++;
+
+    if (payload_size > 0)
+    {
+        iov[iovcnt].iov_base = (void *)payload;
+        iov[iovcnt].iov_len = payload_size;
+        iovcnt++;
+    }
+
+    conn->stat_responses++;
+    conn->stat_pieces += iovcnt;
+
+    return comm_writev(conn, iov, iovcnt);
+}
+
+// Prints number of send system calls used for responses on a connection,
+// compared to sending headers and payloads with separate writes.
+void print_stats(PDEVIO_CONN conn)
+{
+    if (conn->stat_responses == 0 || conn->stat_sends == 0)
+        return;
+
+    printf("Sent " ULL_FMT " responses with " ULL_FMT " send calls, %.2f per "
+           "response. Separate writes would have needed " ULL_FMT ", %.2f "
+           "saved per response.\n",
+           conn->stat_responses, conn->stat_sends,
+           (double)conn->stat_sends / conn->stat_responses,
+           conn->stat_pieces,
+           ((double)conn->stat_pieces - (double)conn->stat_sends) /
+               conn->stat_responses);
+
+    if (conn->stat_ra_reads > 0)
+        printf("Read ahead for " ULL_FMT " sequential reads, " ULL_FMT
+               " of them already read ahead, %.0f%%.\n",
+               conn->stat_ra_reads, conn->stat_ra_hits,
+               conn->stat_ra_hits * 100.0 / conn->stat_ra_reads);
+
+    fflush(stdout);
+}
+
+int send_info(PDEVIO_CONN conn)
+{
+    if (!send_response(conn, &devio_info, sizeof devio_info, NULL, 0))
+        return 0;
+
+    if (!comm_flush(conn))
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+
+        return 0;
+    }
+
+    return 1;
+}
+
+int send_failed(PDEVIO_CONN conn)
+{
+    ULONGLONG req = ENODEV;
+    if (!send_response(conn, &req, sizeof req, NULL, 0))
+    {
+        syslog(LOG_ERR, "stdout: %m\n");
+        return 1;
+    }
+
+    if (!comm_flush(conn))
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+
+        return 0;
+    }
+
+    return 1;
+}
+
+// Maps start of a range of size bytes at offset in virtual disk of a VHD
+// image. Returns number of bytes from offset that are either all in blocks
+// not allocated, where *file_offset is set to -1, or in blocks allocated
+// one after another in image file, where *file_offset is set to image file
+// location of data at offset. Blocks in such a run are separated by the
+// bitmap of next block.
+safeio_size_t
+vhd_map(off_t_64 offset, safeio_size_t size, off_t_64 *file_offset)
+{
+    off_t_64 block_number = offset >> block_shift;
+    safeio_size_t in_block_offset = (safeio_size_t)offset & (block_size - 1);
+    safeio_size_t mapped = block_size - in_block_offset;
+    uint32_t block_offset = 0xFFFFFFFF;
+    int blocks;
+
+    if (block_number < vhd_bat_entries)
+        block_offset = vhd_bat[block_number];
+
+    if (block_offset == 0xFFFFFFFF)
+        *file_offset = -1;
+    else
+        *file_offset = (((off_t_64)block_offset) << sector_shift) +
+                       sector_size + in_block_offset;
+
+    for (blocks = 1; mapped < size && blocks < VHD_MAX_RUN_BLOCKS; blocks++)
+    {
+        uint32_t next_offset = 0xFFFFFFFF;
+
+        if (block_number + blocks < vhd_bat_entries)
+            next_offset = vhd_bat[block_number + blocks];
+
+        if (block_offset == 0xFFFFFFFF ?
+            next_offset != 0xFFFFFFFF :
+            next_offset != block_offset +
+                               ((sector_size + block_size) >> sector_shift) * blocks)
+            break;
+
+        mapped += block_size;
+    }
+
+    if (mapped > size)
+        mapped = size;
+
+    return mapped;
+}
+
+// Millisecond counter for timing bitmap writes.
+ULONGLONG devio_ticks()
+{
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ULONGLONG)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// FNV-1a hash of size bytes at data, continuing from hash.
+uint32_t vhd_journal_checksum(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *ptr = (const uint8_t *)data;
+
+    while (size-- > 0)
+    {
+        hash ^= *ptr++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+// Checksum of a transaction with header and size bytes of records.
+uint32_t vhd_journal_transaction_checksum(VHD_JOURNAL_HEADER header,
+                                          const char *records)
+{
+    header.checksum = 0;
+
+    return vhd_journal_checksum(
+        vhd_journal_checksum(2166136261U, &header, sizeof header),
+        records, header.size);
+}
+
+// Extends journal buffer by size bytes. Returns pointer to them, or NULL
+// with errno set if out of memory.
+char *vhd_journal_reserve(size_t size)
+{
+    char *ptr;
+
+    if (vhd_journal.size + size > vhd_journal.alloc)
+    {
+        size_t alloc = vhd_journal.alloc > 0 ? vhd_journal.alloc : (64 << 10);
+        char *buf;
+
+        while (alloc < vhd_journal.size + size)
+            alloc <<= 1;
+
+        buf = (char *)realloc(vhd_journal.buf, alloc);
+        if (buf == NULL)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        vhd_journal.buf = buf;
+        vhd_journal.alloc = alloc;
+    }
+
+    ptr = vhd_journal.buf + vhd_journal.size;
+    vhd_journal.size += size;
+
+    return ptr;
+}
+
+// Adds a record to open journal transaction. Returns -1 with errno set on
+// failure.
+int vhd_journal_add(const void *data, safeio_size_t size, off_t_64 offset)
+{
+    VHD_JOURNAL_RECORD record = {0};
+    size_t padded_size = (size + 7) & ~(size_t)7;
+    char *ptr;
+
+    // First record of a transaction is preceded by room for its header
+    if (vhd_journal.size == vhd_journal.sealed)
+    {
+        ptr = vhd_journal_reserve(sizeof(VHD_JOURNAL_HEADER));
+        if (ptr == NULL)
+            return -1;
+
+        memset(ptr, 0, sizeof(VHD_JOURNAL_HEADER));
+    }
+
+    ptr = vhd_journal_reserve(sizeof record + padded_size);
+    if (ptr == NULL)
+        return -1;
+
+    record.offset = offset;
+    record.size = size;
+
+    memcpy(ptr, &record, sizeof record);
+    memcpy(ptr + sizeof record, data, size);
+    memset(ptr + sizeof record + size, 0, padded_size - size);
+
+    return 0;
+}
+
+// Fills in header of open transaction, if any, so that it can be written.
+void vhd_journal_seal()
+{
+    VHD_JOURNAL_HEADER header = {{0}};
+
+    if (vhd_journal.size == vhd_journal.sealed)
+        return;
+
+    memcpy(header.magic, VHD_JOURNAL_MAGIC, sizeof header.magic);
+    memcpy(header.image_id, vhd_info.Footer.UniqueID, sizeof header.image_id);
+    header.sequence = ++vhd_journal.sequence;
+    header.size = (uint32_t)(vhd_journal.size - vhd_journal.sealed -
+                             sizeof header);
+    header.checksum = vhd_journal_transaction_checksum(
+        header, vhd_journal.buf + vhd_journal.sealed + sizeof header);
+
+    memcpy(vhd_journal.buf + vhd_journal.sealed, &header, sizeof header);
+    vhd_journal.sealed = vhd_journal.size;
+}
+
+// Writes sealed transactions up to end to journal file and syncs it.
+// Returns -1 with errno set on failure.
+int vhd_journal_write(size_t end)
+{
+    size_t size = end - vhd_journal.committed;
+
+    if (pwrite(vhd_journal.fd, vhd_journal.buf + vhd_journal.committed, size,
+               vhd_journal.committed) != (safeio_ssize_t)size ||
+        file_sync(vhd_journal.fd) == -1)
+    {
+        syslog(LOG_ERR, "vhd_journal: Error writing journal: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return -1;
+    }
+
+    if (vhd_journal.committed == 0)
+        vhd_journal.committed_since = devio_ticks();
+
+    vhd_journal.committed = end;
+
+    // Large journal is checkpointed as soon as possible
+    if (end >= VHD_JOURNAL_CHECKPOINT_SIZE)
+        vhd_journal.committed_since = devio_ticks() - VHD_JOURNAL_CHECKPOINT_MS;
+
+    return 0;
+}
+
+// Makes everything written to image file so far durable. Image file is
+// synced, then records added since last commit are written to journal as
+// one or more transactions with one sync. Concurrent writes that complete
+// before this is called share both syncs. Called with vhd_commit_lock held
+// where needed. Returns -1 with errno set on failure.
+int vhd_journal_commit_locked()
+{
+    size_t end;
+    char unsynced;
+    int result = 0;
+
+    vhd_lock_acquire_write();
+
+    vhd_journal_seal();
+    end = vhd_journal.sealed;
+    unsynced = vhd_journal.unsynced;
+    vhd_journal.unsynced = 0;
+
+    vhd_lock_release();
+
+    if (!unsynced && end == vhd_journal.committed)
+        return 0;
+
+    // New blocks are on disk before BAT entries that refer to them
+    if (file_sync(image_fd) == -1)
+    {
+        syslog(LOG_ERR, "vhd_journal_commit: Error syncing image file: %m\n");
+        return -1;
+    }
+
+    if (end == vhd_journal.committed)
+        return 0;
+
+    // Worker threads may add records meanwhile, but not move buffer
+    vhd_lock_acquire_read();
+
+    result = vhd_journal_write(end);
+
+    vhd_lock_release();
+
+    return result;
+}
+
+int vhd_journal_commit()
+{
+    int result;
+
+    if (vhd_journal.fd == -1)
+        return 0;
+
+    vhd_commit_lock_acquire();
+
+    result = vhd_journal_commit_locked();
+
+    vhd_commit_lock_release();
+
+    return result;
+}
+
+// Writes records of valid transactions in size bytes of journal at buf in
+// place in image file, in order. Stops at first transaction that is not
+// complete, such as one that was being written when a crash happened.
+// Returns number of transactions, or -1 with errno set on failure.
+int vhd_journal_apply(const char *buf, size_t size)
+{
+    size_t pos = 0;
+    int count = 0;
+    VHD_JOURNAL_HEADER header;
+
+    while (size - pos >= sizeof header)
+    {
+        const char *records = buf + pos + sizeof header;
+        size_t record_pos = 0;
+
+        memcpy(&header, buf + pos, sizeof header);
+
+        if (memcmp(header.magic, VHD_JOURNAL_MAGIC, sizeof header.magic) != 0 ||
+            memcmp(header.image_id, vhd_info.Footer.UniqueID,
+                   sizeof header.image_id) != 0 ||
+            header.size > size - pos - sizeof header ||
+            header.checksum != vhd_journal_transaction_checksum(header, records))
+            break;
+
+        if (count > 0 && header.sequence != vhd_journal.sequence + 1)
+            break;
+
+        while (header.size - record_pos >= sizeof(VHD_JOURNAL_RECORD))
+        {
+            VHD_JOURNAL_RECORD record;
+
+            memcpy(&record, records + record_pos, sizeof record);
+            record_pos += sizeof record;
+
+            if (((record.size + 7) & ~(size_t)7) > header.size - record_pos ||
+                record.offset < 0)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            if (physical_write((void *)(records + record_pos), record.size,
+                               record.offset) != (safeio_ssize_t)record.size)
+            {
+                if (errno == 0)
+                    errno = E2BIG;
+
+                return -1;
+            }
+
+            record_pos += (record.size + 7) & ~(size_t)7;
+        }
+
+        vhd_journal.sequence = header.sequence;
+        pos += sizeof header + header.size;
+        count++;
+    }
+
+    return count;
+}
+
+// Writes a BAT entry or bitmap to image file, or adds it to journal if one
+// is used. Returns -1 with errno set on failure.
+int vhd_write_metadata(const void *data, safeio_size_t size, off_t_64 offset)
+{
+    if (vhd_journal.fd != -1)
+        return vhd_journal_add(data, size, offset);
+
+    if (physical_write((void *)data, size, offset) != (safeio_ssize_t)size)
+    {
+        if (errno == 0)
+            errno = E2BIG;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+int vhd_bitmaps_init()
+{
+    uint32_t i;
+
+    vhd_bitmaps.slot = (uint32_t *)calloc(vhd_bat_entries, sizeof(uint32_t));
+    vhd_bitmaps.cache = (VHD_BITMAP *)
+        calloc(VHD_BITMAP_CACHE_BLOCKS, sizeof(VHD_BITMAP));
+
+    if (vhd_bitmaps.slot == NULL || vhd_bitmaps.cache == NULL)
+        return 0;
+
+    for (i = 0; i < VHD_BITMAP_CACHE_BLOCKS; i++)
+    {
+        vhd_bitmaps.cache[i].block = 0xFFFFFFFF;
+        vhd_bitmaps.cache[i].bits = (uint8_t *)malloc(sector_size);
+
+        if (vhd_bitmaps.cache[i].bits == NULL)
+            return 0;
+    }
+
+    return 1;
+}
+
+void vhd_bitmap_dirty(PVHD_BITMAP bitmap)
+{
+    if (bitmap->dirty)
+        return;
+
+    bitmap->dirty = 1;
+
+    if (vhd_bitmaps.dirty_count++ == 0)
+        vhd_bitmaps.dirty_since = devio_ticks();
+}
+
+void vhd_bitmap_clean(PVHD_BITMAP bitmap)
+{
+    if (!bitmap->dirty)
+        return;
+
+    bitmap->dirty = 0;
+    vhd_bitmaps.dirty_count--;
+}
+
+int vhd_bitmap_compare(const void *a, const void *b)
+{
+    uint32_t block_a = vhd_bat[(*(const PVHD_BITMAP *)a)->block];
+    uint32_t block_b = vhd_bat[(*(const PVHD_BITMAP *)b)->block];
+
+    return block_a < block_b ? -1 : block_a > block_b;
+}
+
+// Adds a bitmap to journal, where it is loaded from if it is needed again
+// before journal is checkpointed. Returns -1 with errno set on failure.
+int vhd_bitmap_journal(PVHD_BITMAP bitmap)
+{
+    if (vhd_journal_add(bitmap->bits, sector_size,
+                        ((off_t_64)vhd_bat[bitmap->block]) << sector_shift) == -1)
+        return -1;
+
+    // Bitmap is last in buffer, sector_size needs no padding
+    vhd_bitmaps.journaled[bitmap->block] = vhd_journal.size - sector_size;
+    vhd_bitmap_clean(bitmap);
+
+    return 0;
+}
+
+// Writes all dirty bitmaps, in image file order, as batches of operations,
+// or adds them to journal if one is used. Returns -1 with errno set if any
+// of them could not be written.
+int vhd_write_bitmaps()
+{
+    PVHD_BITMAP dirty[64];
+    DEVIO_IO ios[64];
+    uint32_t i = 0;
+
+    if (vhd_journal.fd != -1)
+    {
+        for (; i < vhd_bitmaps.loaded && vhd_bitmaps.dirty_count > 0; i++)
+        {
+            PVHD_BITMAP bitmap = &vhd_bitmaps.cache[i];
+
+            if (!bitmap->dirty)
+                continue;
+
+            if (vhd_bitmap_journal(bitmap) == -1)
+            {
+                syslog(LOG_ERR, "vhd_write_bitmaps: Error adding bitmap to journal: %m\n");
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    while (vhd_bitmaps.dirty_count > 0)
+    {
+        int count = 0;
+        int j;
+
+        for (; i < vhd_bitmaps.loaded && count < 64; i++)
+        {
+            if (vhd_bitmaps.cache[i].dirty)
+                dirty[count++] = &vhd_bitmaps.cache[i];
+        }
+
+        if (count == 0)
+            break;
+
+        qsort(dirty, count, sizeof(*dirty), vhd_bitmap_compare);
+
+        for (j = 0; j < count; j++)
+        {
+            prepare_io(&ios[j], 1, dirty[j]->bits, sector_size,
+                       ((off_t_64)vhd_bat[dirty[j]->block]) << sector_shift);
+        }
+
+        physical_batch(ios, count);
+
+        for (j = 0; j < count; j++)
+        {
+            if (ios[j].result != (safeio_ssize_t)sector_size)
+            {
+                errno = ios[j].error;
+                syslog(LOG_ERR, "vhd_write_bitmaps: Error updating block bitmap: %m\n");
+
+                if (errno == 0)
+                    errno = E2BIG;
+
+                return -1;
+            }
+
+            vhd_bitmap_clean(dirty[j]);
+        }
+    }
+
+    return 0;
+}
+
+// Writes everything in journal in place in image file and empties it.
+// Dirty bitmaps are committed to journal first, so that image file ends up
+// with current contents of all metadata journal has touched. Caller holds
+// vhd_lock for writing. Returns -1 with errno set on failure, in which case
+// journal is kept.
+int vhd_journal_checkpoint()
+{
+    if (vhd_write_bitmaps() == -1)
+        return -1;
+
+    vhd_journal_seal();
+
+    if (vhd_journal.sealed == 0)
+        return 0;
+
+    if (file_sync(image_fd) == -1)
+    {
+        syslog(LOG_ERR, "vhd_journal_checkpoint: Error syncing image file: %m\n");
+        return -1;
+    }
+
+    if (vhd_journal.sealed > vhd_journal.committed &&
+        vhd_journal_write(vhd_journal.sealed) == -1)
+        return -1;
+
+    if (vhd_journal_apply(vhd_journal.buf, vhd_journal.committed) == -1 ||
+        file_sync(image_fd) == -1)
+    {
+        syslog(LOG_ERR, "vhd_journal_checkpoint: Error updating image file: %m\n");
+        return -1;
+    }
+
+    if (file_truncate(vhd_journal.fd, 0) == -1 ||
+        file_sync(vhd_journal.fd) == -1)
+    {
+        syslog(LOG_ERR, "vhd_journal_checkpoint: Error emptying journal: %m\n");
+        return -1;
+    }
+
+    dbglog((LOG_ERR, "vhd_journal_checkpoint: " SIZ_FMT " bytes written in place.\n",
+            vhd_journal.committed));
+
+    vhd_journal.size = 0;
+    vhd_journal.sealed = 0;
+    vhd_journal.committed = 0;
+    vhd_journal.unsynced = 0;
+
+    memset(vhd_bitmaps.journaled, 0, vhd_bat_entries * sizeof(size_t));
+
+    return 0;
+}
+
+// Writes dirty bitmaps if force is set or if the oldest change is due, and
+// commits them if journal is used. Journal is checkpointed if force is set
+// or if it is due. Failed writes are retried when due again.
+void vhd_flush_metadata(char force)
+{
+    char bitmaps;
+    char checkpoint;
+
+    if (!vhd_mode)
+        return;
+
+    vhd_commit_lock_acquire();
+    vhd_lock_acquire_write();
+
+    bitmaps = vhd_bitmaps.dirty_count > 0 &&
+        (force ||
+         devio_ticks() - vhd_bitmaps.dirty_since >= VHD_BITMAP_FLUSH_MS);
+
+    if (bitmaps && vhd_write_bitmaps() == -1)
+        vhd_bitmaps.dirty_since = devio_ticks();
+
+    checkpoint = vhd_journal.fd != -1 &&
+        (force ||
+         (vhd_journal.committed > 0 &&
+          devio_ticks() - vhd_journal.committed_since >=
+          VHD_JOURNAL_CHECKPOINT_MS));
+
+    if (checkpoint && vhd_journal_checkpoint() == -1)
+        vhd_journal.committed_since = devio_ticks();
+
+    vhd_lock_release();
+
+    // In write-back mode, data written meanwhile waits for a flush request,
+    // or for interval to pass
+    if (!checkpoint && vhd_journal.fd != -1 &&
+        (bitmaps || writeback.mode == SYNC_ALWAYS ||
+         (writeback.mode == SYNC_INTERVAL &&
+          devio_ticks() - writeback.synced_since >= writeback.interval)))
+    {
+        writeback.synced_since = devio_ticks();
+        vhd_journal_commit_locked();
+    }
+
+    vhd_commit_lock_release();
+}
+
+// Returns milliseconds until dirty bitmaps are due to be written or journal
+// is due to be checkpointed or committed, or -1 if there is nothing to do.
+int vhd_metadata_timeout()
+{
+    ULONGLONG elapsed;
+    int timeout = -1;
+
+    if (!vhd_mode)
+        return -1;
+
+    vhd_lock_acquire_read();
+
+    if (vhd_bitmaps.dirty_count > 0)
+    {
+        elapsed = devio_ticks() - vhd_bitmaps.dirty_since;
+        timeout = elapsed < VHD_BITMAP_FLUSH_MS ?
+            (int)(VHD_BITMAP_FLUSH_MS - elapsed) : 0;
+    }
+
+    if (vhd_journal.committed > 0)
+    {
+        int checkpoint_timeout;
+
+        elapsed = devio_ticks() - vhd_journal.committed_since;
+        checkpoint_timeout = elapsed < VHD_JOURNAL_CHECKPOINT_MS ?
+            (int)(VHD_JOURNAL_CHECKPOINT_MS - elapsed) : 0;
+
+        if (timeout == -1 || checkpoint_timeout < timeout)
+            timeout = checkpoint_timeout;
+    }
+
+    // With --sync=interval, changes are committed when interval has passed
+    if (writeback.mode == SYNC_INTERVAL && vhd_journal.fd != -1 &&
+        (vhd_journal.unsynced || vhd_journal.size > vhd_journal.committed))
+    {
+        int commit_timeout;
+
+        elapsed = devio_ticks() - writeback.synced_since;
+        commit_timeout = elapsed < writeback.interval ?
+            (int)(writeback.interval - elapsed) : 0;
+
+        if (timeout == -1 || commit_timeout < timeout)
+            timeout = commit_timeout;
+    }
+
+    vhd_lock_release();
+
+    return timeout;
+}
+
+// Returns bitmap of an allocated block, loading it from image file if load
+// is set, or starting with all bits clear for a new block. Another bitmap
+// may be written and replaced to make room. Returns NULL with errno set on
+// failure.
+PVHD_BITMAP vhd_bitmap_get(uint32_t block, char load)
+{
+    PVHD_BITMAP bitmap;
+
+    if (vhd_bitmaps.slot[block] != 0)
+        return &vhd_bitmaps.cache[vhd_bitmaps.slot[block] - 1];
+
+    if (vhd_bitmaps.loaded < VHD_BITMAP_CACHE_BLOCKS)
+    {
+        bitmap = &vhd_bitmaps.cache[vhd_bitmaps.loaded++];
+    }
+    else
+    {
+        bitmap = &vhd_bitmaps.cache[vhd_bitmaps.hand];
+        vhd_bitmaps.hand = (vhd_bitmaps.hand + 1) % VHD_BITMAP_CACHE_BLOCKS;
+
+        if (bitmap->dirty)
+        {
+            if (vhd_journal.fd != -1 ?
+                vhd_bitmap_journal(bitmap) == -1 :
+                physical_write(bitmap->bits, sector_size,
+                               ((off_t_64)vhd_bat[bitmap->block]) << sector_shift) !=
+                (safeio_ssize_t)sector_size)
+            {
+                syslog(LOG_ERR, "vhd_bitmap_get: Error updating block bitmap: %m\n");
+
+                if (errno == 0)
+                    errno = E2BIG;
+
+                return NULL;
+            }
+
+            vhd_bitmap_clean(bitmap);
+        }
+
+        if (bitmap->block != 0xFFFFFFFF)
+            vhd_bitmaps.slot[bitmap->block] = 0;
+    }
+
+    bitmap->block = 0xFFFFFFFF;
+
+    if (!load)
+        memset(bitmap->bits, 0, sector_size);
+    else if (vhd_bitmaps.journaled != NULL && vhd_bitmaps.journaled[block] != 0)
+        memcpy(bitmap->bits, vhd_journal.buf + vhd_bitmaps.journaled[block],
+               sector_size);
+    else if (physical_read(bitmap->bits, sector_size,
+                           ((off_t_64)vhd_bat[block]) << sector_shift) !=
+             (safeio_ssize_t)sector_size)
+    {
+        syslog(LOG_ERR, "vhd_bitmap_get: Error reading block bitmap: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return NULL;
+    }
+
+    bitmap->block = block;
+    vhd_bitmaps.slot[block] = (uint32_t)(bitmap - vhd_bitmaps.cache) + 1;
+
+    return bitmap;
+}
+
+// Forgets bitmap of a block that is no longer allocated.
+void vhd_bitmap_drop(uint32_t block)
+{
+    PVHD_BITMAP bitmap;
+
+    if (vhd_bitmaps.journaled != NULL)
+        vhd_bitmaps.journaled[block] = 0;
+
+    if (vhd_bitmaps.slot[block] == 0)
+        return;
+
+    bitmap = &vhd_bitmaps.cache[vhd_bitmaps.slot[block] - 1];
+
+    vhd_bitmap_clean(bitmap);
+    bitmap->block = 0xFFFFFFFF;
+    vhd_bitmaps.slot[block] = 0;
+}
+
+// Sets or clears bits for sectors first_sector up to end_sector in a
+// bitmap. Returns non-zero if any bit changed.
+int vhd_bitmap_update(PVHD_BITMAP bitmap, safeio_size_t first_sector,
+                      safeio_size_t end_sector, char set)
+{
+    int changed = 0;
+
+    for (; first_sector < end_sector; first_sector++)
+    {
+        uint8_t *byte = bitmap->bits + (first_sector >> 3);
+        uint8_t bit = (uint8_t)(0x80 >> (first_sector & 7));
+
+        // Whole bytes at once where possible
+        if ((first_sector & 7) == 0 && end_sector - first_sector >= 8)
+        {
+            if (*byte != (set ? 0xFF : 0x00))
+            {
+                *byte = set ? 0xFF : 0x00;
+                changed = 1;
+            }
+
+            first_sector += 7;
+            continue;
+        }
+
+        if (((*byte & bit) != 0) != set)
+        {
+            *byte ^= bit;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+// Copies sector bitmap of an allocated block as it currently is to bits,
+// without loading it into bitmap cache. Returns -1 with errno set on
+// failure.
+int vhd_bitmap_peek(uint32_t block, uint8_t *bits)
+{
+    if (vhd_bitmaps.slot[block] != 0)
+        memcpy(bits, vhd_bitmaps.cache[vhd_bitmaps.slot[block] - 1].bits,
+               sector_size);
+    else if (vhd_bitmaps.journaled != NULL && vhd_bitmaps.journaled[block] != 0)
+        memcpy(bits, vhd_journal.buf + vhd_bitmaps.journaled[block],
+               sector_size);
+    else if (physical_read(bits, sector_size,
+                           ((off_t_64)vhd_bat[block]) << sector_shift) !=
+             (safeio_ssize_t)sector_size)
+    {
+        if (errno == 0)
+            errno = E2BIG;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// Reads sector bitmap of a block in a layer of a differencing VHD image.
+// Returns 0 if the layer has no data in the block, 1 if bits are filled in,
+// or -1 with errno set on failure.
+int vhd_layer_bitmap(int layer, uint32_t block, uint8_t *bits)
+{
+    PVHD_PARENT parent;
+
+    if (layer == 0)
+    {
+        if (block >= vhd_bat_entries || vhd_bat[block] == 0xFFFFFFFF)
+            return 0;
+
+        return vhd_bitmap_peek(block, bits) == -1 ? -1 : 1;
+    }
+
+    parent = &vhd_chain.parents[layer - 1];
+
+    if (block >= parent->bat_entries || parent->bat[block] == 0xFFFFFFFF)
+        return 0;
+
+    if (parent->dynamic)
+    {
+        memset(bits, 0xFF, sector_size);
+        return 1;
+    }
+
+    if (pread(parent->fd, bits, sector_size,
+              ((off_t_64)parent->bat[block]) << sector_shift) !=
+        (safeio_ssize_t)sector_size)
+    {
+        syslog(LOG_ERR, "Error reading block bitmap from '%s': %m\n",
+               parent->path);
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return -1;
+    }
+
+    return 1;
+}
+
+// Finds layer each sector of a block is read from, the first one from top
+// of chain with its bit set, and stores result in owner index. Mixed blocks
+// get a sector map in place of the least recently resolved one. Called with
+// vhd_chain_lock held. Returns owner index entry, or -1 with errno set on
+// failure.
+int vhd_chain_resolve(uint32_t block)
+{
+    safeio_size_t sectors = block_size >> sector_shift;
+    safeio_size_t remaining = sectors;
+    safeio_size_t sector;
+    uint32_t slot = vhd_chain.hand;
+    uint8_t *map = vhd_chain.maps + (size_t)slot * sectors;
+    int layer;
+    int owner;
+
+    vhd_chain.hand = (slot + 1) % VHD_OWNER_CACHE_BLOCKS;
+
+    if (vhd_chain.map_block[slot] != 0xFFFFFFFF)
+    {
+        vhd_chain.map_slot[vhd_chain.map_block[slot]] = 0;
+        vhd_chain.map_block[slot] = 0xFFFFFFFF;
+    }
+
+    memset(map, VHD_OWNER_NONE, sectors);
+
+    for (layer = 0; layer <= vhd_chain.count && remaining > 0; layer++)
+    {
+        switch (vhd_layer_bitmap(layer, block, vhd_chain.bits))
+        {
+        case -1:
+            return -1;
+
+        case 0:
+            continue;
+        }
+
+        for (sector = 0; sector < sectors; sector++)
+            if (map[sector] == VHD_OWNER_NONE &&
+                (vhd_chain.bits[sector >> 3] & (0x80 >> (sector & 7))) != 0)
+            {
+                map[sector] = (uint8_t)layer;
+                remaining--;
+            }
+    }
+
+    owner = map[0];
+
+    for (sector = 1; sector < sectors && map[sector] == owner; sector++)
+        ;
+
+    if (sector < sectors)
+    {
+        owner = VHD_OWNER_MIXED;
+        vhd_chain.map_block[slot] = block;
+        vhd_chain.map_slot[block] = slot + 1;
+    }
+
+    vhd_chain.owner[block] = (uint8_t)owner;
+
+    return owner;
+}
+
+// Returns owner index entry of a block of a differencing VHD image, finding
+// it first if not known.
+int vhd_chain_owner(uint32_t block)
+{
+    int owner;
+
+    vhd_chain_lock_acquire();
+
+    owner = vhd_chain.owner[block];
+
+    if (owner == VHD_OWNER_UNKNOWN)
+        owner = vhd_chain_resolve(block);
+
+    vhd_chain_lock_release();
+
+    return owner;
+}
+
+// Returns number of bytes from offset, within one block of a differencing
+// VHD image, that are read from the same layer, and sets *layer to that
+// layer or VHD_OWNER_NONE. Returns -1 with errno set on failure.
+safeio_ssize_t
+vhd_chain_run(off_t_64 offset, safeio_size_t size, int *layer)
+{
+    uint32_t block = (uint32_t)(offset >> block_shift);
+    safeio_size_t in_block_offset = (safeio_size_t)offset & (block_size - 1);
+    int owner;
+
+    if (size > block_size - in_block_offset)
+        size = block_size - in_block_offset;
+
+    vhd_chain_lock_acquire();
+
+    owner = vhd_chain.owner[block];
+
+    if (owner == VHD_OWNER_UNKNOWN ||
+        (owner == VHD_OWNER_MIXED && vhd_chain.map_slot[block] == 0))
+        owner = vhd_chain_resolve(block);
+
+    if (owner == VHD_OWNER_MIXED)
+    {
+        uint8_t *map = vhd_chain.maps +
+                       (size_t)(vhd_chain.map_slot[block] - 1) *
+                           (block_size >> sector_shift);
+        safeio_size_t sector = in_block_offset >> sector_shift;
+        safeio_size_t end_sector = (in_block_offset + size - 1) >> sector_shift;
+
+        owner = map[sector];
+
+        while (++sector <= end_sector && map[sector] == owner)
+            ;
+
+        if ((sector << sector_shift) - in_block_offset < size)
+            size = (sector << sector_shift) - in_block_offset;
+    }
+
+    vhd_chain_lock_release();
+
+    if (owner == -1)
+        return (safeio_ssize_t)-1;
+
+    *layer = owner;
+
+    return size;
+}
+
+// Forgets layers found for a block of a differencing VHD image that has
+// been written to, unless all of it was in the image already. Called with
+// vhd_lock held for writing.
+void vhd_chain_forget(uint32_t block)
+{
+    uint32_t slot = vhd_chain.map_slot[block];
+
+    if (vhd_chain.owner[block] == 0)
+        return;
+
+    vhd_chain.owner[block] = VHD_OWNER_UNKNOWN;
+
+    if (slot != 0)
+    {
+        vhd_chain.map_block[slot - 1] = 0xFFFFFFFF;
+        vhd_chain.map_slot[block] = 0;
+    }
+}
+
+// Reads from a differencing VHD image, each run of sectors from the layer
+// that has their data.
+safeio_ssize_t
+vhd_read_chain(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t readdone = 0;
+
+    while (readdone < size)
+    {
+        uint32_t block = (uint32_t)((offset + readdone) >> block_shift);
+        off_t_64 block_data_offset =
+            sector_size + ((safeio_size_t)(offset + readdone) & (block_size - 1));
+        safeio_ssize_t run_size;
+        safeio_ssize_t sizedone;
+        int layer;
+
+        run_size = vhd_chain_run(offset + readdone, size - readdone, &layer);
+        if (run_size == -1)
+            return (safeio_ssize_t)-1;
+
+        if (layer == VHD_OWNER_NONE)
+        {
+            readdone += run_size;
+            continue;
+        }
+
+        if (layer == 0)
+            sizedone = physical_read(io_ptr + readdone, run_size,
+                                     (((off_t_64)vhd_bat[block]) << sector_shift) +
+                                         block_data_offset);
+        else
+            sizedone = pread(vhd_chain.parents[layer - 1].fd, io_ptr + readdone,
+                             run_size,
+                             (((off_t_64)vhd_chain.parents[layer - 1].bat[block])
+                              << sector_shift) +
+                                 block_data_offset);
+
+        if (sizedone == -1)
+            return (safeio_ssize_t)-1;
+
+        // Data missing at end of image file reads as zeroes
+        if (sizedone != run_size)
+            return readdone;
+
+        readdone += run_size;
+    }
+
+    return readdone;
+}
+
+safeio_ssize_t
+vhd_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_ssize_t readdone = 0;
+
+    dbglog((LOG_ERR, "vhd_read: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
+            (off_t_64)size, (off_t_64)offset));
+
+    if (offset + size > current_size)
+        return 0;
+
+    memset(io_ptr, 0, size);
+
+    if (vhd_chain.count > 0)
+        return vhd_read_chain(io_ptr, size, offset);
+
+    // Each run of adjacent allocated blocks is read with one vectored read,
+    // where block bitmaps between data are read into vhd_gap_buf
+    while ((safeio_size_t)readdone < size)
+    {
+        struct iovec iov[VHD_MAX_RUN_BLOCKS * 2];
+        int iovcnt = 0;
+        off_t_64 file_offset;
+        safeio_size_t run_size =
+            vhd_map(offset + readdone, size - (safeio_size_t)readdone,
+                    &file_offset);
+        safeio_size_t piece_offset = 0;
+        safeio_ssize_t sizedone;
+        safeio_size_t iov_size = 0;
+
+        if (file_offset == -1)
+        {
+            readdone += run_size;
+            continue;
+        }
+
+        while (piece_offset < run_size)
+        {
+            safeio_size_t piece_size =
+                block_size - ((safeio_size_t)(offset + readdone + piece_offset) &
+                              (block_size - 1));
+
+            if (piece_size > run_size - piece_offset)
+                piece_size = run_size - piece_offset;
+
+            if (iovcnt > 0)
+            {
+                iov[iovcnt].iov_base = vhd_gap_buf;
+                iov[iovcnt].iov_len = sector_size;
+                iov_size += sector_size;
+                iovcnt++;
+            }
+
+            iov[iovcnt].iov_base = io_ptr + readdone + piece_offset;
+            iov[iovcnt].iov_len = piece_size;
+            iov_size += piece_size;
+            iovcnt++;
+
+            piece_offset += piece_size;
+        }
+
+        sizedone = physical_readv(iov, iovcnt, file_offset);
+        if (sizedone == -1)
+            return (safeio_ssize_t)-1;
+
+        // Data missing at end of image file reads as zeroes
+        if (sizedone != (safeio_ssize_t)iov_size)
+            return readdone;
+
+        readdone += run_size;
+    }
+
+    return readdone;
+}
+
+// Makes room for at least one more block after the last one in image
+// file. Space for VHD_GROW_BLOCKS blocks is preallocated beyond end of file
+// where supported, and the footer is moved past it with one write. Until
+// blocks are referenced by BAT, they are unused space within the image.
+int
+vhd_grow()
+{
+    off_t_64 block_span = (off_t_64)sector_size + block_size;
+    off_t_64 new_footer_offset;
+
+    if (vhd_footer_offset == -1)
+    {
+        vhd_footer_offset =
+            _lseeki64(image_fd, -(off_t_64)sizeof(vhd_info.Footer), SEEK_END);
+        if (vhd_footer_offset == -1)
+        {
+            syslog(LOG_ERR, "vhd_grow: Error moving file pointer to last "
+                            "block: %m\n");
+
+            return -1;
+        }
+
+        vhd_next_block = vhd_footer_offset;
+    }
+
+    if (vhd_next_block + block_span <= vhd_footer_offset)
+        return 0;
+
+    new_footer_offset = vhd_next_block + block_span * VHD_GROW_BLOCKS;
+
+#ifdef __linux__
+    // Space is allocated without changing file size, so the image stays
+    // valid until the footer has been written at its new location
+    if (!dll_mode &&
+        fallocate(image_fd, FALLOC_FL_KEEP_SIZE,
+                  vhd_footer_offset + sizeof(vhd_info.Footer),
+                  new_footer_offset - vhd_footer_offset) == -1 &&
+        errno != EOPNOTSUPP)
+    {
+        syslog(LOG_ERR, "vhd_grow: Error preallocating blocks: %m\n");
+    }
+#endif
+
+    // Footer is not journaled, it is on disk before new blocks overwrite
+    // the old one
+    if (physical_write(&vhd_info.Footer, sizeof(vhd_info.Footer),
+                       new_footer_offset) != sizeof(vhd_info.Footer) ||
+        (!dll_mode && file_sync(image_fd) == -1))
+    {
+        syslog(LOG_ERR, "vhd_grow: Error writing footer: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return -1;
+    }
+
+    dbglog((LOG_ERR, "vhd_grow: Footer moved from " SLL_FMT " to " SLL_FMT ".\n",
+            (off_t_64)vhd_footer_offset, (off_t_64)new_footer_offset));
+
+    vhd_footer_offset = new_footer_offset;
+
+    return 0;
+}
+
+// Moves footer back to directly after the last block in use and truncates
+// the space preallocated after it, when image is closed.
+void
+vhd_trim()
+{
+    if (dll_mode || vhd_footer_offset == -1 ||
+        vhd_footer_offset == vhd_next_block)
+        return;
+
+    if (physical_write(&vhd_info.Footer, sizeof(vhd_info.Footer),
+                       vhd_next_block) != sizeof(vhd_info.Footer))
+    {
+        syslog(LOG_ERR, "vhd_trim: Error writing footer: %m\n");
+        return;
+    }
+
+    // Footer is on disk before the one at end of file is cut off
+    if (file_sync(image_fd) == -1 ||
+        file_truncate(image_fd, vhd_next_block + sizeof(vhd_info.Footer)) == -1)
+    {
+        syslog(LOG_ERR, "vhd_trim: Error truncating image file: %m\n");
+        return;
+    }
+
+    vhd_footer_offset = vhd_next_block;
+}
+
+// Reads block allocation table from image file into vhd_bat. Returns zero
+// on failure.
+int
+vhd_load_bat()
+{
+    uint32_t entry;
+
+    if (physical_read(vhd_bat, vhd_bat_entries << 2, table_offset) !=
+        (safeio_ssize_t)(vhd_bat_entries << 2))
+    {
+        syslog(LOG_ERR, "Error reading VHD block table: %m\n");
+        return 0;
+    }
+
+    for (entry = 0; entry < vhd_bat_entries; entry++)
+        vhd_bat[entry] = ntohl(vhd_bat[entry]);
+
+    return 1;
+}
+
+// Writes transactions in journal file left by a previous run in place in
+// image file and empties journal. Block table is read again if anything
+// was replayed. Returns zero on failure.
+int
+vhd_journal_replay()
+{
+    off_t_64 journal_size = _lseeki64(vhd_journal.fd, 0, SEEK_END);
+    char *buf;
+    int count;
+
+    if (journal_size <= 0)
+        return journal_size == 0;
+
+    buf = (char *)malloc((size_t)journal_size);
+    if (buf == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    if (pread(vhd_journal.fd, buf, (safeio_size_t)journal_size, 0) !=
+        (safeio_ssize_t)journal_size)
+    {
+        syslog(LOG_ERR, "Error reading journal '%s': %m\n", vhd_journal.path);
+        free(buf);
+        return 0;
+    }
+
+    count = vhd_journal_apply(buf, (size_t)journal_size);
+
+    free(buf);
+
+    if (count == -1 || file_sync(image_fd) == -1)
+    {
+        syslog(LOG_ERR, "Error replaying journal '%s': %m\n", vhd_journal.path);
+        return 0;
+    }
+
+    if (file_truncate(vhd_journal.fd, 0) == -1 ||
+        file_sync(vhd_journal.fd) == -1)
+    {
+        syslog(LOG_ERR, "Error emptying journal '%s': %m\n", vhd_journal.path);
+        return 0;
+    }
+
+    if (count == 0)
+        syslog(LOG_ERR, "No complete transactions for this image in journal '%s', "
+                        "discarded.\n", vhd_journal.path);
+    else
+        printf("Replayed %i metadata transactions from journal '%s'.\n",
+               count, vhd_journal.path);
+
+    return count == 0 || vhd_load_bat();
+}
+
+// Closes metadata journal. Journal file is removed if it is empty, which
+// it is after a successful final checkpoint.
+void
+vhd_journal_close()
+{
+    if (vhd_journal.fd == -1)
+        return;
+
+    _close(vhd_journal.fd);
+    vhd_journal.fd = -1;
+
+    if (vhd_journal.committed > 0 || vhd_journal.size > 0)
+    {
+        syslog(LOG_ERR, "Journal '%s' kept, it is replayed next time image is opened.\n",
+               vhd_journal.path);
+        return;
+    }
+
+#ifdef _WIN32
+    _unlink(vhd_journal.path);
+#else
+    unlink(vhd_journal.path);
+#endif
+}
+
+// Opens metadata journal of a dynamic VHD image file, and replays anything
+// left in it. If use is set, journal is kept open and image file is opened
+// again without O_FSYNC. Otherwise an existing journal is removed once
+// replayed. Returns zero on failure.
+int
+vhd_journal_open(const char *image_path, char use)
+{
+    int fd;
+
+    vhd_journal.path = (char *)malloc(strlen(image_path) +
+                                      sizeof(VHD_JOURNAL_SUFFIX));
+    if (vhd_journal.path == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    strcpy(vhd_journal.path, image_path);
+    strcat(vhd_journal.path, VHD_JOURNAL_SUFFIX);
+
+    vhd_journal.fd = _open(vhd_journal.path,
+                           O_BINARY | O_RDWR | (use ? O_CREAT : 0), 0666);
+    if (vhd_journal.fd == -1)
+    {
+        if (!use && errno == ENOENT)
+            return 1;
+
+        syslog(LOG_ERR, "Failed to open journal '%s': %m\n", vhd_journal.path);
+        return 0;
+    }
+
+    if (!vhd_journal_replay())
+        return 0;
+
+    if (!use)
+    {
+        vhd_journal_close();
+        return 1;
+    }
+
+    vhd_bitmaps.journaled = (size_t *)calloc(vhd_bat_entries, sizeof(size_t));
+    if (vhd_bitmaps.journaled == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    fd = _open(image_path, O_BINARY | O_DIRECT | O_RDWR);
+    if (fd == -1)
+    {
+        syslog(LOG_ERR, "Failed to open '%s': %m\n", image_path);
+        return 0;
+    }
+
+    _close(image_fd);
+    image_fd = fd;
+
+#ifdef __linux__
+    if (uring.fixed_file)
+    {
+        struct io_uring_files_update update = {0};
+
+        update.fds = (uintptr_t)&image_fd;
+
+        if (syscall(__NR_io_uring_register, uring.fd,
+                    IORING_REGISTER_FILES_UPDATE, &update, 1) != 1)
+            uring.fixed_file = 0;
+    }
+#endif
+
+    printf("Using metadata journal '%s'.\n", vhd_journal.path);
+
+    return 1;
+}
+
+// Converts a parent path from a VHD header, UTF-16 in big or little endian
+// byte order, to UTF-8 with local path separators. Returns a string to
+// free, or NULL on failure.
+char *
+vhd_parent_name(const uint8_t *data, size_t length, char big_endian)
+{
+    char *name = (char *)malloc(length / 2 * 3 + 1);
+    char *out = name;
+    size_t pos;
+
+    if (name == NULL)
+        return NULL;
+
+    for (pos = 0; pos + 1 < length; pos += 2)
+    {
+        uint32_t c = big_endian ? (data[pos] << 8) | data[pos + 1]
+                                : data[pos] | (data[pos + 1] << 8);
+
+        if (c == 0)
+            break;
+
+        if (c >= 0xD800 && c < 0xDC00 && pos + 3 < length)
+        {
+            uint32_t low = big_endian ? (data[pos + 2] << 8) | data[pos + 3]
+                                      : data[pos + 2] | (data[pos + 3] << 8);
+
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                pos += 2;
+            }
+        }
+
+#ifndef _WIN32
+        if (c == '\\')
+            c = '/';
+#endif
+
+        if (c < 0x80)
+        {
+            *out++ = (char)c;
+        }
+        else if (c < 0x800)
+        {
+            *out++ = (char)(0xC0 | (c >> 6));
+            *out++ = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            *out++ = (char)(0xE0 | (c >> 12));
+            *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *out++ = (char)(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            *out++ = (char)(0xF0 | (c >> 18));
+            *out++ = (char)(0x80 | ((c >> 12) & 0x3F));
+            *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *out++ = (char)(0x80 | (c & 0x3F));
+        }
+    }
+
+    *out = 0;
+
+    return name;
+}
+
+// Returns path of an image file named by another one at child_path, where
+// name is relative to directory of child_path unless absolute. Returns a
+// string to free, or NULL on failure.
+char *
+image_relative_path(const char *child_path, const char *name)
+{
+    const char *dir_end = strrchr(child_path, '/');
+    size_t dir_length = 0;
+    char *path;
+
+#ifdef _WIN32
+    if (strrchr(child_path, '\\') > dir_end)
+        dir_end = strrchr(child_path, '\\');
+
+    if (name[0] != '\\' && name[0] != '/' && name[0] != 0 && name[1] != ':' &&
+        dir_end != NULL)
+#else
+    if (name[0] != '/' && dir_end != NULL)
+#endif
+        dir_length = dir_end - child_path + 1;
+
+    path = (char *)malloc(dir_length + strlen(name) + 1);
+    if (path == NULL)
+        return NULL;
+
+    memcpy(path, child_path, dir_length);
+    strcpy(path + dir_length, name);
+
+    return path;
+}
+
+// Opens parent image of a differencing VHD image at child_path, where name
+// is relative to directory of child_path unless absolute. Footer and header
+// of parent are read into info, and it is only accepted if its unique id is
+// parent_id. Takes ownership of name. Returns file descriptor, with *path
+// set to a string to free, or -1 if not found.
+int
+vhd_parent_try(const char *child_path, char *name, const uint8_t *parent_id,
+               struct _VHD_INFO *info, char **path)
+{
+    int fd;
+
+    *path = image_relative_path(child_path, name);
+    free(name);
+
+    if (*path == NULL)
+        return -1;
+
+    fd = _open(*path, O_BINARY | O_DIRECT | O_RDONLY);
+    if (fd == -1)
+    {
+        free(*path);
+        return -1;
+    }
+
+    if (pread(fd, info, sizeof(*info), 0) != sizeof(*info) ||
+        strncmp((char *)info->Header.Cookie, "cxsparse", 8) != 0 ||
+        strncmp((char *)info->Footer.Cookie, "conectix", 8) != 0 ||
+        (info->Footer.DiskType != 0x03000000UL &&
+         info->Footer.DiskType != 0x04000000UL) ||
+        memcmp(info->Footer.UniqueID, parent_id, sizeof(info->Footer.UniqueID)) != 0)
+    {
+        _close(fd);
+        free(*path);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Opens parent image of a differencing VHD image open as child_fd. Relative
+// and then absolute paths in parent locators are tried, and last parent
+// file name in the same directory as child_path. Returns file descriptor,
+// or -1 if not found.
+int
+vhd_parent_open(struct _VHD_HEADER *header, int child_fd,
+                const char *child_path, struct _VHD_INFO *info, char **path)
+{
+    // Platform codes W2ru and W2ku
+    static const uint32_t codes[] = {0x57327275, 0x57326B75};
+    char *name;
+    int code;
+    int i;
+
+    for (code = 0; code < 2; code++)
+        for (i = 0; i < 8; i++)
+        {
+            struct _VHD_PARENT_LOCATOR *locator = &header->ParentLocator[i];
+            uint32_t length = ntohl(locator->PlatformDataLength);
+            uint8_t *data;
+            int fd;
+
+            if (ntohl(locator->PlatformCode) != codes[code] ||
+                length == 0 || length > 65536)
+                continue;
+
+            data = (uint8_t *)malloc(length);
+            if (data == NULL)
+                continue;
+
+            if (pread(child_fd, data, length,
+                      GetBigEndian64((int8_t *)&locator->PlatformDataOffset)) !=
+                (safeio_ssize_t)length)
+            {
+                free(data);
+                continue;
+            }
+
+            name = vhd_parent_name(data, length, 0);
+            free(data);
+
+            if (name == NULL)
+                continue;
+
+            fd = vhd_parent_try(child_path, name, header->ParentUniqueID, info,
+                                path);
+            if (fd != -1)
+                return fd;
+        }
+
+    name = vhd_parent_name((uint8_t *)header->ParentName,
+                           sizeof(header->ParentName), 1);
+    if (name == NULL)
+        return -1;
+
+    if (strrchr(name, '/') != NULL)
+        memmove(name, strrchr(name, '/') + 1, strlen(strrchr(name, '/')));
+
+#ifdef _WIN32
+    if (strrchr(name, '\\') != NULL)
+        memmove(name, strrchr(name, '\\') + 1, strlen(strrchr(name, '\\')));
+#endif
+
+    return vhd_parent_try(child_path, name, header->ParentUniqueID, info, path);
+}
+
+// Opens parent chain of a differencing VHD image, and sets up owner index.
+// All layers need the same block size. Returns zero on failure.
+int
+vhd_chain_open(const char *image_path)
+{
+    struct _VHD_INFO info = vhd_info;
+    const char *child_path = image_path;
+    int child_fd = image_fd;
+
+    while (info.Footer.DiskType == 0x04000000UL)
+    {
+        PVHD_PARENT parent = &vhd_chain.parents[vhd_chain.count];
+        struct _VHD_INFO parent_info;
+        uint32_t entry;
+        char *name;
+        int journal_fd;
+
+        if (vhd_chain.count >= VHD_MAX_PARENTS)
+        {
+            syslog(LOG_ERR, "More than %i parent images of '%s'.\n",
+                   VHD_MAX_PARENTS, image_path);
+            return 0;
+        }
+
+        parent->fd = vhd_parent_open(&info.Header, child_fd, child_path,
+                                     &parent_info, &parent->path);
+        if (parent->fd == -1)
+        {
+            syslog(LOG_ERR, "Parent image of '%s' not found, or it has changed "
+                            "since the differencing image was created.\n",
+                   child_path);
+            return 0;
+        }
+
+        // Metadata left in journal of a parent by a crash is only replayed
+        // when it is opened for writing
+        name = (char *)malloc(strlen(parent->path) + sizeof(VHD_JOURNAL_SUFFIX));
+        if (name == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        strcpy(name, parent->path);
+        strcat(name, VHD_JOURNAL_SUFFIX);
+
+        journal_fd = _open(name, O_BINARY | O_RDONLY);
+        free(name);
+
+        if (journal_fd != -1)
+        {
+            off_t_64 journal_size = _lseeki64(journal_fd, 0, SEEK_END);
+
+            _close(journal_fd);
+
+            if (journal_size != 0)
+            {
+                syslog(LOG_ERR, "Parent image '%s' has a journal to replay, open "
+                                "it alone for writing first.\n",
+                       parent->path);
+                return 0;
+            }
+        }
+
+        if (ntohl(parent_info.Header.BlockSize) != block_size)
+        {
+            syslog(LOG_ERR, "Parent image '%s' has a different block size, "
+                            "not supported.\n",
+                   parent->path);
+            return 0;
+        }
+
+        parent->bat_entries = ntohl(parent_info.Header.MaxTableEntries);
+        parent->bat = (uint32_t *)malloc((size_t)parent->bat_entries << 2);
+        if (parent->bat == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        if (pread(parent->fd, parent->bat, parent->bat_entries << 2,
+                  GetBigEndian64(parent_info.Header.TableOffset)) !=
+            (safeio_ssize_t)(parent->bat_entries << 2))
+        {
+            syslog(LOG_ERR, "Error reading VHD block table of '%s': %m\n",
+                   parent->path);
+            return 0;
+        }
+
+        for (entry = 0; entry < parent->bat_entries; entry++)
+            parent->bat[entry] = ntohl(parent->bat[entry]);
+
+        parent->dynamic = parent_info.Footer.DiskType == 0x03000000UL;
+
+        vhd_chain.count++;
+
+        printf("Parent image: '%s'.\n", parent->path);
+
+        info = parent_info;
+        child_path = parent->path;
+        child_fd = parent->fd;
+    }
+
+    vhd_chain.owner = (uint8_t *)malloc(vhd_bat_entries);
+    vhd_chain.map_slot = (uint32_t *)calloc(vhd_bat_entries, sizeof(uint32_t));
+    vhd_chain.map_block = (uint32_t *)malloc(VHD_OWNER_CACHE_BLOCKS *
+                                             sizeof(uint32_t));
+    vhd_chain.maps = (uint8_t *)malloc((size_t)VHD_OWNER_CACHE_BLOCKS *
+                                       (block_size >> sector_shift));
+    vhd_chain.bits = (uint8_t *)malloc(sector_size);
+
+    if (vhd_chain.owner == NULL || vhd_chain.map_slot == NULL ||
+        vhd_chain.map_block == NULL || vhd_chain.maps == NULL ||
+        vhd_chain.bits == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    memset(vhd_chain.owner, VHD_OWNER_UNKNOWN, vhd_bat_entries);
+    memset(vhd_chain.map_block, 0xFF, VHD_OWNER_CACHE_BLOCKS * sizeof(uint32_t));
+
+    return 1;
+}
+
+// Writes data within one block that is not yet allocated. Unless data is
+// all zeroes, a new block is taken from space prepared by vhd_grow(). Only
+// bitmap and data are written, the rest of the block is zeroes already.
+// BAT entry is written last, so that the block is not referenced before
+// its contents are in place.
+safeio_ssize_t
+vhd_write_new_block(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 block_number = offset >> block_shift;
+    off_t_64 data_offset = table_offset + (block_number << 2);
+    safeio_size_t in_block_offset = (safeio_size_t)offset & (block_size - 1);
+    safeio_size_t size_nqwords = (size + 7) >> 3;
+    long long *buf_ptr;
+    uint32_t bat_entry;
+    PVHD_BITMAP bitmap;
+    struct iovec iov[2];
+    DEVIO_IO ios[3];
+    int io_count = 0;
+    int i;
+
+    // First check if new block is all zeroes, in that case don't allocate
+    // a new block in the vhd file. In differencing images, that only works
+    // where no parent has data either.
+    for (buf_ptr = (long long *)io_ptr;
+         (buf_ptr < (long long *)io_ptr + size_nqwords) ? (*buf_ptr == 0) : 0;
+         buf_ptr++)
+        ;
+    if (buf_ptr >= (long long *)io_ptr + size_nqwords &&
+        (vhd_chain.count == 0 ||
+         vhd_chain_owner((uint32_t)block_number) == VHD_OWNER_NONE))
+    {
+        dbglog((LOG_ERR, "vhd_write: New empty block not added to vhd file "
+                         "backing " SLL_FMT " bytes at " SLL_FMT ".\n",
+                (off_t_64)size, (off_t_64)offset));
+
+        return size;
+    }
+
+    if (vhd_grow() == -1)
+        return (safeio_ssize_t)-1;
+
+    dbglog((LOG_ERR, "vhd_write: Adding new block at " SLL_FMT " to vhd file backing " SLL_FMT " bytes at " SLL_FMT ".\n",
+            (off_t_64)vhd_next_block, (off_t_64)size, (off_t_64)offset));
+
+    bitmap = vhd_bitmap_get((uint32_t)block_number, 0);
+    if (bitmap == NULL)
+        return (safeio_ssize_t)-1;
+
+    vhd_bitmap_update(bitmap, in_block_offset >> sector_shift,
+                      (in_block_offset + size + sector_size - 1) >> sector_shift,
+                      1);
+
+    // Bitmap and data together where data starts at beginning of block
+    if (in_block_offset == 0)
+    {
+        iov[0].iov_base = bitmap->bits;
+        iov[0].iov_len = sector_size;
+        iov[1].iov_base = io_ptr;
+        iov[1].iov_len = size;
+
+        prepare_io(&ios[io_count], 1, iov, sector_size + size, vhd_next_block);
+        ios[io_count++].iovcnt = 2;
+    }
+    else
+    {
+        prepare_io(&ios[io_count++], 1, bitmap->bits, sector_size,
+                   vhd_next_block);
+        prepare_io(&ios[io_count++], 1, io_ptr, size,
+                   vhd_next_block + sector_size + in_block_offset);
+    }
+
+    // Store pointer to new block start sector in BAT
+    bat_entry = htonl((uint32_t)(vhd_next_block >> sector_shift));
+
+    // Block contents and BAT update are written as one batch, in that
+    // order. With io_uring the batch is a linked chain where a failed write
+    // cancels the ones after it. With journal, BAT update is added to
+    // journal instead, and committed after block contents are synced.
+    if (vhd_journal.fd == -1)
+        prepare_io(&ios[io_count++], 1, &bat_entry, sizeof(bat_entry),
+                   data_offset);
+
+    physical_batch(ios, io_count);
+
+    for (i = 0; i < io_count; i++)
+    {
+        if (ios[i].result != (safeio_ssize_t)ios[i].size)
+        {
+            errno = ios[i].error;
+
+            if (i == io_count - 1 && vhd_journal.fd == -1)
+                syslog(LOG_ERR, "vhd_write: Error updating BAT: %m\n");
+            else
+                syslog(LOG_ERR, "vhd_write: Error writing new block: %m\n");
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            vhd_bitmap_drop((uint32_t)block_number);
+            return (safeio_ssize_t)-1;
+        }
+    }
+
+    if (vhd_journal.fd != -1 &&
+        vhd_journal_add(&bat_entry, sizeof(bat_entry), data_offset) == -1)
+    {
+        syslog(LOG_ERR, "vhd_write: Error adding BAT update to journal: %m\n");
+
+        vhd_bitmap_drop((uint32_t)block_number);
+        return (safeio_ssize_t)-1;
+    }
+
+    vhd_bat[block_number] = ntohl(bat_entry);
+    vhd_next_block += (off_t_64)sector_size + block_size;
+
+    return size;
+}
+
+// Writes data to a run of allocated blocks mapped by vhd_map() with one
+// vectored write. Bitmaps between data of adjacent blocks are written
+// along with it, bitmap of first block is marked dirty if it changed.
+safeio_ssize_t
+vhd_write_run(char *io_ptr, safeio_size_t size, off_t_64 offset,
+              off_t_64 file_offset)
+{
+    struct iovec iov[VHD_MAX_RUN_BLOCKS * 2];
+    PVHD_BITMAP gap_bitmaps[VHD_MAX_RUN_BLOCKS];
+    char gap_changed[VHD_MAX_RUN_BLOCKS];
+    int iovcnt = 0;
+    int gaps = 0;
+    safeio_size_t piece_offset = 0;
+    safeio_size_t iov_size = 0;
+    safeio_ssize_t writedone;
+
+    while (piece_offset < size)
+    {
+        safeio_size_t in_block_offset =
+            (safeio_size_t)(offset + piece_offset) & (block_size - 1);
+        safeio_size_t piece_size = block_size - in_block_offset;
+        PVHD_BITMAP bitmap;
+        int changed;
+
+        if (piece_size > size - piece_offset)
+            piece_size = size - piece_offset;
+
+        bitmap = vhd_bitmap_get((uint32_t)((offset + piece_offset) >> block_shift),
+                                1);
+        if (bitmap == NULL)
+            return (safeio_ssize_t)-1;
+
+        changed = vhd_bitmap_update(bitmap, in_block_offset >> sector_shift,
+                                    (in_block_offset + piece_size + sector_size - 1) >>
+                                        sector_shift,
+                                    1);
+
+        if (iovcnt > 0)
+        {
+            iov[iovcnt].iov_base = bitmap->bits;
+            iov[iovcnt].iov_len = sector_size;
+            iov_size += sector_size;
+            iovcnt++;
+
+            gap_changed[gaps] = (char)changed;
+            gap_bitmaps[gaps++] = bitmap;
+        }
+        else if (changed)
+        {
+            vhd_bitmap_dirty(bitmap);
+        }
+
+        iov[iovcnt].iov_base = io_ptr + piece_offset;
+        iov[iovcnt].iov_len = piece_size;
+        iov_size += piece_size;
+        iovcnt++;
+
+        piece_offset += piece_size;
+    }
+
+    writedone = physical_writev(iov, iovcnt, file_offset);
+
+    // Bitmaps written along with data are up to date in image file now,
+    // unless something went wrong. With journal, changed ones still need to
+    // be journaled, or a checkpoint or replay of an older copy would
+    // overwrite them.
+    while (gaps-- > 0)
+    {
+        if (writedone != (safeio_ssize_t)iov_size)
+            vhd_bitmap_dirty(gap_bitmaps[gaps]);
+        else if (vhd_journal.fd == -1)
+            vhd_bitmap_clean(gap_bitmaps[gaps]);
+        else if (gap_changed[gaps])
+            vhd_bitmap_dirty(gap_bitmaps[gaps]);
+    }
+
+    if (writedone == -1)
+        return (safeio_ssize_t)-1;
+
+    if (writedone != (safeio_ssize_t)iov_size)
+    {
+        syslog(LOG_ERR, "vhd_write: Incomplete write of block data.\n");
+
+        errno = E2BIG;
+        return (safeio_ssize_t)-1;
+    }
+
+    return size;
+}
+
+safeio_ssize_t
+vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset);
+
+// Writes data that does not cover whole sectors to a differencing VHD
+// image. Sectors at either end are read first, so that the rest of them
+// keeps data from whichever layer has it once they are in the image.
+safeio_ssize_t
+vhd_write_unaligned(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 start = offset & ~(off_t_64)(sector_size - 1);
+    safeio_size_t length =
+        (safeio_size_t)(((offset + size + sector_size - 1) &
+                         ~(off_t_64)(sector_size - 1)) -
+                        start);
+    safeio_ssize_t writedone = -1;
+    char *buf = (char *)malloc(length);
+
+    if (buf == NULL)
+    {
+        syslog(LOG_ERR, "vhd_write: malloc() failed: %m\n");
+        return (safeio_ssize_t)-1;
+    }
+
+    if (vhd_read(buf, sector_size, start) != -1 &&
+        vhd_read(buf + length - sector_size, sector_size,
+                 start + length - sector_size) != -1)
+    {
+        memcpy(buf + (offset - start), io_ptr, size);
+
+        writedone = vhd_write(buf, length, start);
+        if (writedone == (safeio_ssize_t)length)
+            writedone = size;
+    }
+
+    free(buf);
+
+    return writedone;
+}
+
+safeio_ssize_t
+vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t writedone = 0;
+    safeio_ssize_t sizedone = 0;
+
+    dbglog((LOG_ERR, "vhd_write: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
+            (off_t_64)size, (off_t_64)offset));
+
+    if (offset + size > current_size)
+        return 0;
+
+    if ((offset + size - 1) >> block_shift >= vhd_bat_entries)
+    {
+        syslog(LOG_ERR, "vhd_write: Write outside block table.\n");
+
+        errno = EINVAL;
+        return (safeio_ssize_t)-1;
+    }
+
+    if (vhd_chain.count > 0 && ((offset | size) & (sector_size - 1)) != 0)
+        return vhd_write_unaligned(io_ptr, size, offset);
+
+    while (writedone < size)
+    {
+        off_t_64 file_offset;
+        safeio_size_t run_size =
+            vhd_map(offset + writedone, size - writedone, &file_offset);
+
+        // Blocks not yet allocated are added one at a time
+        if (file_offset == -1)
+        {
+            safeio_size_t in_block_offset =
+                (safeio_size_t)(offset + writedone) & (block_size - 1);
+
+            if (run_size > block_size - in_block_offset)
+                run_size = block_size - in_block_offset;
+
+            sizedone = vhd_write_new_block(io_ptr + writedone, run_size,
+                                           offset + writedone);
+        }
+        else
+        {
+            sizedone = vhd_write_run(io_ptr + writedone, run_size,
+                                     offset + writedone, file_offset);
+        }
+
+        if (sizedone == -1)
+            break;
+
+        writedone += run_size;
+    }
+
+    // Layers found for blocks written to may have changed, even if not all
+    // of the write succeeded
+    if (vhd_chain.count > 0)
+    {
+        off_t_64 block_number;
+
+        for (block_number = offset >> block_shift;
+             block_number <= (offset + size - 1) >> block_shift;
+             block_number++)
+            vhd_chain_forget((uint32_t)block_number);
+
+        // Sector bitmaps decide which layer data is read from, so they
+        // are written, or added to journal, along with the data
+        if (sizedone != -1 && vhd_write_bitmaps() == -1)
+            return (safeio_ssize_t)-1;
+    }
+
+    if (sizedone == -1)
+        return (safeio_ssize_t)-1;
+
+    return writedone;
+}
+
+// Maps start of a range of size bytes at offset in virtual disk of a VHDX
+// image, the same way as vhd_map(). Payload blocks are not separated by
+// anything in image file, so a run of blocks allocated one after another is
+// one contiguous range there.
+safeio_size_t
+vhdx_map(off_t_64 offset, safeio_size_t size, off_t_64 *file_offset)
+{
+    off_t_64 block_number = offset >> block_shift;
+    safeio_size_t in_block_offset = (safeio_size_t)offset & (block_size - 1);
+    safeio_size_t mapped = block_size - in_block_offset;
+    uint64_t entry = VHDX_BLOCK_NOT_PRESENT;
+    char present;
+    off_t_64 blocks;
+
+    if (block_number < vhdx.bat_entries)
+        entry = vhdx.bat[block_number];
+
+    present = (entry & VHDX_BLOCK_STATE_MASK) == VHDX_BLOCK_FULLY_PRESENT;
+
+    if (!present)
+        *file_offset = -1;
+    else
+        *file_offset = (off_t_64)(entry & VHDX_BLOCK_OFFSET_MASK) + in_block_offset;
+
+    for (blocks = 1; mapped < size; blocks++)
+    {
+        uint64_t next_entry = VHDX_BLOCK_NOT_PRESENT;
+
+        if (block_number + blocks < vhdx.bat_entries)
+            next_entry = vhdx.bat[block_number + blocks];
+
+        if (!present ?
+            (next_entry & VHDX_BLOCK_STATE_MASK) == VHDX_BLOCK_FULLY_PRESENT :
+            next_entry != entry + ((uint64_t)blocks << block_shift))
+            break;
+
+        mapped += block_size;
+    }
+
+    if (mapped > size)
+        mapped = size;
+
+    return mapped;
+}
+
+safeio_ssize_t
+vhdx_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t readdone = 0;
+
+    if (offset + size > current_size)
+        return 0;
+
+    memset(io_ptr, 0, size);
+
+    // Blocks not present, zeroed or unmapped read as zeroes, each run of
+    // blocks allocated one after another with one read
+    while (readdone < size)
+    {
+        off_t_64 file_offset;
+        safeio_size_t run_size =
+            vhdx_map(offset + readdone, size - readdone, &file_offset);
+        safeio_ssize_t sizedone;
+
+        if (file_offset != -1)
+        {
+            sizedone = physical_read(io_ptr + readdone, run_size, file_offset);
+            if (sizedone == -1)
+                return (safeio_ssize_t)-1;
+
+            // Data missing at end of image file reads as zeroes
+            if (sizedone != (safeio_ssize_t)run_size)
+                return readdone;
+        }
+
+        readdone += run_size;
+    }
+
+    return readdone;
+}
+
+// Makes room for at least one more block after the last one in a VHDX image
+// file. File is extended by VHD_GROW_BLOCKS blocks at a time. Space after
+// blocks in use is allowed in VHDX files, so there is nothing to move, and
+// it is cut off again when image is closed.
+int
+vhdx_grow()
+{
+    off_t_64 new_file_end;
+
+    if (vhdx.next_block == -1)
+    {
+        vhdx.file_end = _lseeki64(image_fd, 0, SEEK_END);
+        if (vhdx.file_end == -1)
+        {
+            syslog(LOG_ERR, "vhdx_grow: Error finding end of file: %m\n");
+            return -1;
+        }
+
+        vhdx.next_block = (vhdx.file_end + VHDX_ALIGNMENT - 1) &
+                          ~(off_t_64)(VHDX_ALIGNMENT - 1);
+    }
+
+    if (vhdx.next_block + block_size <= vhdx.file_end)
+        return 0;
+
+    new_file_end = vhdx.next_block + (off_t_64)block_size * VHD_GROW_BLOCKS;
+
+    if (dll_mode)
+    {
+        vhdx.file_end = new_file_end;
+        return 0;
+    }
+
+#ifdef __linux__
+    if (fallocate(image_fd, 0, vhdx.file_end,
+                  new_file_end - vhdx.file_end) == 0)
+    {
+        vhdx.file_end = new_file_end;
+        return 0;
+    }
+
+    if (errno != EOPNOTSUPP)
+    {
+        syslog(LOG_ERR, "vhdx_grow: Error preallocating blocks: %m\n");
+        return -1;
+    }
+#endif
+
+    if (file_truncate(image_fd, new_file_end) == -1)
+    {
+        syslog(LOG_ERR, "vhdx_grow: Error extending image file: %m\n");
+        return -1;
+    }
+
+    vhdx.file_end = new_file_end;
+
+    return 0;
+}
+
+// Cuts off space prepared for new blocks of a VHDX image that was not used,
+// when image is closed.
+void
+vhdx_trim()
+{
+    if (dll_mode || vhdx.next_block == -1 || vhdx.file_end <= vhdx.next_block)
+        return;
+
+    if (file_truncate(image_fd, vhdx.next_block) == -1)
+    {
+        syslog(LOG_ERR, "vhdx_trim: Error truncating image file: %m\n");
+        return;
+    }
+
+    vhdx.file_end = vhdx.next_block;
+}
+
+// Writes a BAT entry of a payload block of a VHDX image to image file and to
+// BAT in memory. Returns -1 with errno set on failure.
+int
+vhdx_write_bat_entry(off_t_64 block_number, uint64_t entry)
+{
+    uint8_t bat_entry[sizeof(uint64_t)];
+
+    SetLittleEndian64U(bat_entry, entry);
+
+    if (physical_write(bat_entry, sizeof(bat_entry),
+                       vhdx.bat_offset +
+                           ((block_number + block_number / vhdx.chunk_ratio) << 3)) !=
+        sizeof(bat_entry))
+    {
+        syslog(LOG_ERR, "vhdx: Error updating BAT: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return -1;
+    }
+
+    vhdx.bat[block_number] = entry;
+
+    return 0;
+}
+
+// Writes data within one block of a VHDX image that is not yet allocated.
+// Unless data is all zeroes, a new block is taken from space prepared by
+// vhdx_grow(), where the rest of it is zeroes already. Data and BAT entry
+// are written as one batch, in that order.
+safeio_ssize_t
+vhdx_write_new_block(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 block_number = offset >> block_shift;
+    safeio_size_t in_block_offset = (safeio_size_t)offset & (block_size - 1);
+    safeio_size_t size_nqwords = (size + 7) >> 3;
+    long long *buf_ptr;
+    uint8_t bat_entry[sizeof(uint64_t)];
+    uint64_t entry;
+    DEVIO_IO ios[2];
+    int i;
+
+    for (buf_ptr = (long long *)io_ptr;
+         (buf_ptr < (long long *)io_ptr + size_nqwords) ? (*buf_ptr == 0) : 0;
+         buf_ptr++)
+        ;
+    if (buf_ptr >= (long long *)io_ptr + size_nqwords)
+        return size;
+
+    if (vhdx_grow() == -1)
+        return (safeio_ssize_t)-1;
+
+    entry = (uint64_t)vhdx.next_block | VHDX_BLOCK_FULLY_PRESENT;
+    SetLittleEndian64U(bat_entry, entry);
+
+    prepare_io(&ios[0], 1, io_ptr, size, vhdx.next_block + in_block_offset);
+    prepare_io(&ios[1], 1, bat_entry, sizeof(bat_entry),
+               vhdx.bat_offset +
+                   ((block_number + block_number / vhdx.chunk_ratio) << 3));
+
+    physical_batch(ios, 2);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (ios[i].result != (safeio_ssize_t)ios[i].size)
+        {
+            errno = ios[i].error;
+
+            if (i == 1)
+                syslog(LOG_ERR, "vhdx_write: Error updating BAT: %m\n");
+            else
+                syslog(LOG_ERR, "vhdx_write: Error writing new block: %m\n");
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return (safeio_ssize_t)-1;
+        }
+    }
+
+    vhdx.bat[block_number] = entry;
+    vhdx.next_block += block_size;
+
+    return size;
+}
+
+safeio_ssize_t
+vhdx_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t writedone = 0;
+
+    if (offset + size > current_size)
+        return 0;
+
+    while (writedone < size)
+    {
+        off_t_64 file_offset;
+        safeio_size_t run_size =
+            vhdx_map(offset + writedone, size - writedone, &file_offset);
+        safeio_ssize_t sizedone;
+
+        // Blocks not yet allocated are added one at a time
+        if (file_offset == -1)
+        {
+            safeio_size_t in_block_offset =
+                (safeio_size_t)(offset + writedone) & (block_size - 1);
+
+            if (run_size > block_size - in_block_offset)
+                run_size = block_size - in_block_offset;
+
+            sizedone = vhdx_write_new_block(io_ptr + writedone, run_size,
+                                            offset + writedone);
+        }
+        else
+        {
+            sizedone = physical_write(io_ptr + writedone, run_size, file_offset);
+
+            if (sizedone != -1 && sizedone != (safeio_ssize_t)run_size)
+            {
+                syslog(LOG_ERR, "vhdx_write: Incomplete write of block data.\n");
+
+                errno = E2BIG;
+                sizedone = -1;
+            }
+        }
+
+        if (sizedone == -1)
+            return (safeio_ssize_t)-1;
+
+        writedone += run_size;
+    }
+
+    return writedone;
+}
+
+int
+physical_unmap(off_t_64 offset, off_t_64 length);
+
+// Reads from an image in a QCOW2 backing chain, through physical_read() for
+// the image itself.
+safeio_ssize_t
+qcow2_layer_read(int layer, void *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    if (layer == 0)
+        return physical_read(io_ptr, size, offset);
+
+    return pread(qcow2.layers[layer].fd, io_ptr, size, offset);
+}
+
+// Returns what an L2 table entry means for reading the cluster.
+int
+qcow2_entry_kind(uint64_t entry)
+{
+    if (entry & QCOW2_OFLAG_COMPRESSED)
+        return QCOW2_CLUSTER_COMPRESSED;
+
+    if (entry & QCOW2_OFLAG_ZERO)
+        return QCOW2_CLUSTER_ZERO;
+
+    if (entry & QCOW2_OFFSET_MASK)
+        return QCOW2_CLUSTER_DATA;
+
+    return QCOW2_CLUSTER_UNALLOCATED;
+}
+
+// Finds an L2 table or refcount block at offset in an image of a QCOW2
+// chain in cache, reading it in place of the least recently used one if
+// not there. Called with qcow2_cache_lock held, or with vhd_lock held for
+// writing. Returns NULL with errno set on failure.
+PQCOW2_TABLE
+qcow2_table_get(int layer, off_t_64 offset)
+{
+    safeio_size_t table_size =
+        ((safeio_size_t)1) << qcow2.layers[layer].cluster_bits;
+    PQCOW2_TABLE table = qcow2.tables;
+    int i;
+
+    for (i = 0; i < qcow2.table_count; i++)
+    {
+        if (qcow2.tables[i].layer == layer && qcow2.tables[i].offset == offset)
+        {
+            qcow2.tables[i].last_use = ++qcow2.clock;
+            return &qcow2.tables[i];
+        }
+
+        if (qcow2.tables[i].last_use < table->last_use)
+            table = &qcow2.tables[i];
+    }
+
+    table->layer = -1;
+    table->last_use = 0;
+
+    if (qcow2_layer_read(layer, table->data, table_size, offset) !=
+        (safeio_ssize_t)table_size)
+    {
+        syslog(LOG_ERR, "qcow2: Error reading table at " SLL_FMT " in '%s': %m\n",
+               (off_t_64)offset, qcow2.layers[layer].path);
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return NULL;
+    }
+
+    table->layer = layer;
+    table->offset = offset;
+    table->last_use = ++qcow2.clock;
+
+    return table;
+}
+
+// Gets L2 table entry of a cluster in virtual disk of an image in a QCOW2
+// chain, zero where there is no L2 table. Returns -1 with errno set on
+// failure.
+int
+qcow2_l2_entry(int layer, uint64_t cluster, uint64_t *entry)
+{
+    PQCOW2_LAYER image = &qcow2.layers[layer];
+    int l2_bits = image->cluster_bits - 3;
+    uint64_t l1_index = cluster >> l2_bits;
+    PQCOW2_TABLE table;
+
+    *entry = 0;
+
+    if (l1_index >= image->l1_size ||
+        (image->l1[l1_index] & QCOW2_OFFSET_MASK) == 0)
+        return 0;
+
+    qcow2_cache_lock_acquire();
+
+    table = qcow2_table_get(layer,
+                            (off_t_64)(image->l1[l1_index] & QCOW2_OFFSET_MASK));
+
+    if (table != NULL)
+        *entry = GetBigEndian64U(table->data +
+                                 ((cluster & ((((uint64_t)1) << l2_bits) - 1)) << 3));
+
+    qcow2_cache_lock_release();
+
+    return table == NULL ? -1 : 0;
+}
+
+// Maps start of a range of size bytes at offset in virtual disk of an image
+// in a QCOW2 chain. Returns number of bytes in clusters of the same kind as
+// the first one, for data clusters only as long as they follow one another
+// in image file, and sets *entry to L2 table entry of the first cluster.
+// Returns -1 with errno set on failure.
+safeio_ssize_t
+qcow2_map(int layer, off_t_64 offset, safeio_size_t size, uint64_t *entry)
+{
+    int cluster_bits = qcow2.layers[layer].cluster_bits;
+    safeio_size_t cluster_size = ((safeio_size_t)1) << cluster_bits;
+    uint64_t cluster = (uint64_t)offset >> cluster_bits;
+    safeio_size_t mapped =
+        cluster_size - ((safeio_size_t)offset & (cluster_size - 1));
+    int kind;
+    uint64_t clusters;
+
+    if (qcow2_l2_entry(layer, cluster, entry) == -1)
+        return (safeio_ssize_t)-1;
+
+    kind = qcow2_entry_kind(*entry);
+
+    for (clusters = 1;
+         mapped < size && kind != QCOW2_CLUSTER_COMPRESSED;
+         clusters++)
+    {
+        uint64_t next_entry;
+
+        if (qcow2_l2_entry(layer, cluster + clusters, &next_entry) == -1)
+            return (safeio_ssize_t)-1;
+
+        if (kind == QCOW2_CLUSTER_DATA ?
+            next_entry != *entry + (clusters << cluster_bits) :
+            qcow2_entry_kind(next_entry) != kind)
+            break;
+
+        mapped += cluster_size;
+    }
+
+    if (mapped > size)
+        mapped = size;
+
+    return mapped;
+}
+
+// Reads from virtual disk of an image in a QCOW2 chain into a buffer that
+// is filled with zeroes already. Zero clusters are skipped, and clusters
+// not allocated are read from backing file, if any. Data missing at end of
+// image files reads as zeroes. Returns -1 with errno set on failure.
+int
+qcow2_read_layer(int layer, char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    PQCOW2_LAYER image = &qcow2.layers[layer];
+    safeio_size_t readdone = 0;
+
+    // Backing files may be smaller than images on top of them
+    if (offset >= image->size)
+        return 0;
+
+    if (size > image->size - offset)
+        size = (safeio_size_t)(image->size - offset);
+
+    if (image->cluster_bits == 0)
+        return qcow2_layer_read(layer, io_ptr, size, offset) == -1 ? -1 : 0;
+
+    while (readdone < size)
+    {
+        uint64_t entry;
+        safeio_ssize_t run_size =
+            qcow2_map(layer, offset + readdone, size - readdone, &entry);
+
+        if (run_size == -1)
+            return -1;
+
+        switch (qcow2_entry_kind(entry))
+        {
+        case QCOW2_CLUSTER_COMPRESSED:
+            syslog(LOG_ERR, "Compressed clusters in '%s' are not supported.\n",
+                   image->path);
+
+            errno = ENOTSUP;
+            return -1;
+
+        case QCOW2_CLUSTER_DATA:
+            if (qcow2_layer_read(layer, io_ptr + readdone, run_size,
+                                 (off_t_64)(entry & QCOW2_OFFSET_MASK) +
+                                     ((safeio_size_t)(offset + readdone) &
+                                      ((((safeio_size_t)1) << image->cluster_bits) - 1))) == -1)
+                return -1;
+
+            break;
+
+        case QCOW2_CLUSTER_UNALLOCATED:
+            if (layer + 1 < qcow2.count &&
+                qcow2_read_layer(layer + 1, io_ptr + readdone, run_size,
+                                 offset + readdone) == -1)
+                return -1;
+
+            break;
+        }
+
+        readdone += run_size;
+    }
+
+    return 0;
+}
+
+safeio_ssize_t
+qcow2_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    if (offset + size > current_size)
+        return 0;
+
+    memset(io_ptr, 0, size);
+
+    if (qcow2_read_layer(0, io_ptr, size, offset) == -1)
+        return (safeio_ssize_t)-1;
+
+    return size;
+}
+
+// Gets and sets refcount at index in a refcount block of a QCOW2 image.
+// Refcounts narrower than a byte are packed from least significant bit.
+uint64_t
+qcow2_refcount_get(const uint8_t *block, uint64_t index)
+{
+    int order = qcow2.refcount_order;
+    uint64_t refcount = 0;
+    int i;
+
+    if (order < 3)
+        return (block[(index << order) >> 3] >> ((index << order) & 7)) &
+               ((1 << (1 << order)) - 1);
+
+    for (i = 0; i < 1 << (order - 3); i++)
+        refcount = (refcount << 8) | block[(index << (order - 3)) + i];
+
+    return refcount;
+}
+
+void
+qcow2_refcount_set(uint8_t *block, uint64_t index, uint64_t refcount)
+{
+    int order = qcow2.refcount_order;
+    int i;
+
+    if (order < 3)
+    {
+        int shift = (int)((index << order) & 7);
+        uint8_t mask = (uint8_t)(((1 << (1 << order)) - 1) << shift);
+        uint8_t *byte = &block[(index << order) >> 3];
+
+        *byte = (uint8_t)((*byte & ~mask) | ((refcount << shift) & mask));
+        return;
+    }
+
+    for (i = (1 << (order - 3)) - 1; i >= 0; i--)
+    {
+        block[(index << (order - 3)) + i] = (uint8_t)refcount;
+        refcount >>= 8;
+    }
+}
+
+// Adds one to, or with decrease set subtracts one from, refcounts of count
+// clusters from offset in image file, with one write for each refcount
+// block. Refcount blocks need to be there already. Returns new refcount of
+// the last cluster, or -1 with errno set on failure.
+int64_t
+qcow2_refcount_update(off_t_64 offset, uint64_t count, char decrease)
+{
+    int entries_bits = block_shift + 3 - qcow2.refcount_order;
+    uint64_t max_refcount = qcow2.refcount_order == 6 ? ~(uint64_t)0 :
+                            (((uint64_t)1) << (1 << qcow2.refcount_order)) - 1;
+    uint64_t cluster = (uint64_t)offset >> block_shift;
+    uint64_t refcount = 0;
+
+    while (count > 0)
+    {
+        uint64_t table_index = cluster >> entries_bits;
+        uint64_t index = cluster & ((((uint64_t)1) << entries_bits) - 1);
+        uint64_t entries = (((uint64_t)1) << entries_bits) - index;
+        safeio_size_t first_byte;
+        safeio_size_t end_byte;
+        PQCOW2_TABLE block;
+        uint64_t i;
+
+        if (entries > count)
+            entries = count;
+
+        if (table_index >= qcow2.refcount_table_size ||
+            (qcow2.refcount_table[table_index] & QCOW2_OFFSET_MASK) == 0)
+        {
+            syslog(LOG_ERR, "qcow2: No refcount block for cluster at " SLL_FMT ".\n",
+                   (off_t_64)(cluster << block_shift));
+
+            errno = EIO;
+            return -1;
+        }
+
+        block = qcow2_table_get(0, (off_t_64)(qcow2.refcount_table[table_index] &
+                                              QCOW2_OFFSET_MASK));
+        if (block == NULL)
+            return -1;
+
+        for (i = index; i < index + entries; i++)
+        {
+            refcount = qcow2_refcount_get(block->data, i);
+
+            if (decrease ? refcount == 0 : refcount == max_refcount)
+            {
+                syslog(LOG_ERR, "qcow2: Refcount of cluster at " SLL_FMT
+                                " out of range.\n",
+                       (off_t_64)((cluster + i - index) << block_shift));
+
+                // Block in cache is changed already
+                block->layer = -1;
+                block->last_use = 0;
+
+                errno = EIO;
+                return -1;
+            }
+
+            refcount = decrease ? refcount - 1 : refcount + 1;
+            qcow2_refcount_set(block->data, i, refcount);
+        }
+
+        first_byte = (safeio_size_t)((index << qcow2.refcount_order) >> 3);
+        end_byte = (safeio_size_t)((((index + entries) << qcow2.refcount_order) + 7) >> 3);
+
+        if (physical_write(block->data + first_byte, end_byte - first_byte,
+                           block->offset + first_byte) !=
+            (safeio_ssize_t)(end_byte - first_byte))
+        {
+            syslog(LOG_ERR, "qcow2: Error updating refcounts: %m\n");
+
+            block->layer = -1;
+            block->last_use = 0;
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return -1;
+        }
+
+        cluster += entries;
+        count -= entries;
+    }
+
+    return (int64_t)refcount;
+}
+
+// Adds a refcount block for clusters from table_index in refcount table of
+// a QCOW2 image, at next_cluster, where it counts itself. Block is written
+// before its refcount table entry. Returns -1 with errno set on failure.
+int
+qcow2_new_refcount_block(uint64_t table_index)
+{
+    int entries_bits = block_shift + 3 - qcow2.refcount_order;
+    off_t_64 block_offset = qcow2.next_cluster;
+    uint8_t table_entry[sizeof(uint64_t)];
+    DEVIO_IO ios[2];
+    int i;
+
+    memset(qcow2.cluster_buf, 0, block_size);
+    qcow2_refcount_set(qcow2.cluster_buf,
+                       ((uint64_t)block_offset >> block_shift) &
+                           ((((uint64_t)1) << entries_bits) - 1),
+                       1);
+
+    SetBigEndian64U(table_entry, (uint64_t)block_offset);
+
+    prepare_io(&ios[0], 1, qcow2.cluster_buf, block_size, block_offset);
+    prepare_io(&ios[1], 1, table_entry, sizeof(table_entry),
+               qcow2.refcount_table_offset + (off_t_64)(table_index << 3));
+
+    physical_batch(ios, 2);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (ios[i].result != (safeio_ssize_t)ios[i].size)
+        {
+            errno = ios[i].error;
+
+            syslog(LOG_ERR, "qcow2: Error adding refcount block: %m\n");
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return -1;
+        }
+    }
+
+    qcow2.refcount_table[table_index] = (uint64_t)block_offset;
+    qcow2.next_cluster += block_size;
+
+    return 0;
+}
+
+// Moves refcount table of a QCOW2 image to a place at least twice as large
+// at next_cluster. New refcount blocks, for the table and for themselves,
+// go in front of it. Header is changed to point to the new table before
+// the old one is released.
+int
+qcow2_grow_refcount_table()
+{
+    int entries_bits = block_shift + 3 - qcow2.refcount_order;
+    uint64_t first_cluster = (uint64_t)qcow2.next_cluster >> block_shift;
+    uint64_t first_index = first_cluster >> entries_bits;
+    uint64_t old_clusters = (((uint64_t)qcow2.refcount_table_size << 3) +
+                             block_size - 1) >> block_shift;
+    off_t_64 old_offset = qcow2.refcount_table_offset;
+    uint64_t blocks = 1;
+    uint64_t table_size;
+    uint64_t table_clusters;
+    uint64_t end_cluster;
+    uint64_t *new_table;
+    uint8_t *table;
+    uint8_t header[12];
+    uint64_t i;
+
+    for (;;)
+    {
+        uint64_t needed;
+
+        table_size = (uint64_t)qcow2.refcount_table_size << 1;
+        if (table_size < first_index + blocks)
+            table_size = first_index + blocks;
+
+        table_clusters = ((table_size << 3) + block_size - 1) >> block_shift;
+        table_size = table_clusters << (block_shift - 3);
+        end_cluster = first_cluster + blocks + table_clusters;
+        needed = ((end_cluster - 1) >> entries_bits) - first_index + 1;
+
+        if (needed <= blocks)
+            break;
+
+        blocks = needed;
+    }
+
+    if (table_size > 0x7FFFFFFF >> 3)
+    {
+        syslog(LOG_ERR, "qcow2: Refcount table too large.\n");
+
+        errno = EFBIG;
+        return -1;
+    }
+
+    table = (uint8_t *)calloc((size_t)table_clusters, block_size);
+    new_table = (uint64_t *)calloc((size_t)table_size, sizeof(uint64_t));
+    if (table == NULL || new_table == NULL)
+    {
+        free(table);
+        free(new_table);
+        return -1;
+    }
+
+    memcpy(new_table, qcow2.refcount_table,
+           (size_t)qcow2.refcount_table_size * sizeof(uint64_t));
+
+    for (i = 0; i < blocks; i++)
+    {
+        uint64_t cluster;
+
+        memset(qcow2.cluster_buf, 0, block_size);
+
+        for (cluster = first_cluster; cluster < end_cluster; cluster++)
+            if (cluster >> entries_bits == first_index + i)
+                qcow2_refcount_set(qcow2.cluster_buf,
+                                   cluster & ((((uint64_t)1) << entries_bits) - 1),
+                                   1);
+
+        if (physical_write(qcow2.cluster_buf, block_size,
+                           (off_t_64)((first_cluster + i) << block_shift)) !=
+            (safeio_ssize_t)block_size)
+        {
+            syslog(LOG_ERR, "qcow2: Error adding refcount block: %m\n");
+
+            free(table);
+            free(new_table);
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return -1;
+        }
+
+        new_table[first_index + i] = (first_cluster + i) << block_shift;
+    }
+
+    for (i = 0; i < table_size; i++)
+        SetBigEndian64U(table + (i << 3), new_table[i]);
+
+    SetBigEndian64U(header, (first_cluster + blocks) << block_shift);
+    SetBigEndian32U(header + 8, (uint32_t)table_clusters);
+
+    if (physical_write(table, (safeio_size_t)(table_clusters << block_shift),
+                       (off_t_64)((first_cluster + blocks) << block_shift)) !=
+            (safeio_ssize_t)(table_clusters << block_shift) ||
+        physical_write(header, sizeof(header), 48) != sizeof(header))
+    {
+        syslog(LOG_ERR, "qcow2: Error moving refcount table: %m\n");
+
+        free(table);
+        free(new_table);
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return -1;
+    }
+
+    free(table);
+    free(qcow2.refcount_table);
+
+    qcow2.refcount_table = new_table;
+    qcow2.refcount_table_size = (uint32_t)table_size;
+    qcow2.refcount_table_offset = (off_t_64)((first_cluster + blocks) << block_shift);
+    qcow2.next_cluster = (off_t_64)(end_cluster << block_shift);
+    qcow2.reserved_end = qcow2.next_cluster;
+
+    // Old table is not referenced any more, failing to release it only
+    // leaves it unused
+    if (qcow2_refcount_update(old_offset, old_clusters, 1) == 0)
+        physical_unmap(old_offset, (off_t_64)(old_clusters << block_shift));
+
+    return 0;
+}
+
+// Makes sure there is at least one cluster from next_cluster up to
+// reserved_end in a QCOW2 image, with its refcount set already. Refcounts
+// are set for QCOW2_ALLOC_CLUSTERS clusters with one write, after adding
+// refcount blocks or a larger refcount table at next_cluster where needed.
+// Returns -1 with errno set on failure.
+int
+qcow2_reserve()
+{
+    int entries_bits = block_shift + 3 - qcow2.refcount_order;
+
+    if (qcow2.refcount_table == NULL)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    while (qcow2.reserved_end <= qcow2.next_cluster)
+    {
+        uint64_t cluster = (uint64_t)qcow2.next_cluster >> block_shift;
+        uint64_t table_index = cluster >> entries_bits;
+        uint64_t count;
+
+        if (table_index >= qcow2.refcount_table_size)
+        {
+            if (qcow2_grow_refcount_table() == -1)
+                return -1;
+
+            continue;
+        }
+
+        if ((qcow2.refcount_table[table_index] & QCOW2_OFFSET_MASK) == 0)
+        {
+            if (qcow2_new_refcount_block(table_index) == -1)
+                return -1;
+
+            continue;
+        }
+
+        count = ((table_index + 1) << entries_bits) - cluster;
+        if (count > QCOW2_ALLOC_CLUSTERS)
+            count = QCOW2_ALLOC_CLUSTERS;
+
+        if (qcow2_refcount_update(qcow2.next_cluster, count, 0) == -1)
+            return -1;
+
+        qcow2.reserved_end = qcow2.next_cluster + (off_t_64)(count << block_shift);
+    }
+
+    return 0;
+}
+
+// Takes a cluster for data or an L2 table from clusters reserved at end of
+// a QCOW2 image file. Returns its offset, or -1 with errno set on failure.
+off_t_64
+qcow2_alloc()
+{
+    off_t_64 offset;
+
+    if (qcow2_reserve() == -1)
+        return -1;
+
+    offset = qcow2.next_cluster;
+    qcow2.next_cluster += block_size;
+
+    return offset;
+}
+
+// Resets refcounts of reserved clusters not used, and cuts them off image
+// file, when a QCOW2 image is closed.
+void
+qcow2_trim()
+{
+    off_t_64 file_end;
+
+    if (qcow2.reserved_end <= qcow2.next_cluster)
+        return;
+
+    if (qcow2_refcount_update(qcow2.next_cluster,
+                              (uint64_t)(qcow2.reserved_end - qcow2.next_cluster) >>
+                                  block_shift,
+                              1) == -1)
+        return;
+
+    qcow2.reserved_end = qcow2.next_cluster;
+
+    if (dll_mode)
+        return;
+
+    file_end = _lseeki64(image_fd, 0, SEEK_END);
+
+    if (file_end > qcow2.next_cluster &&
+        file_truncate(image_fd, qcow2.next_cluster) == -1)
+        syslog(LOG_ERR, "qcow2_trim: Error truncating image file: %m\n");
+}
+
+// Returns offset of L2 table for a cluster in virtual disk of a QCOW2
+// image, adding a new one if there is none. A new table is written before
+// L1 table entry. Returns -1 with errno set on failure.
+off_t_64
+qcow2_l2_table(uint64_t cluster)
+{
+    PQCOW2_LAYER image = &qcow2.layers[0];
+    uint64_t l1_index = cluster >> (block_shift - 3);
+    uint8_t l1_entry[sizeof(uint64_t)];
+    off_t_64 l2_offset;
+    DEVIO_IO ios[2];
+    int i;
+
+    if (image->l1[l1_index] & QCOW2_OFFSET_MASK)
+    {
+        // Tables shared with internal snapshots would need to be copied
+        if ((image->l1[l1_index] & QCOW2_OFLAG_COPIED) == 0)
+        {
+            syslog(LOG_ERR, "qcow2: Shared L2 tables are not supported.\n");
+
+            errno = EIO;
+            return -1;
+        }
+
+        return (off_t_64)(image->l1[l1_index] & QCOW2_OFFSET_MASK);
+    }
+
+    l2_offset = qcow2_alloc();
+    if (l2_offset == -1)
+        return -1;
+
+    memset(qcow2.cluster_buf, 0, block_size);
+    SetBigEndian64U(l1_entry, (uint64_t)l2_offset | QCOW2_OFLAG_COPIED);
+
+    prepare_io(&ios[0], 1, qcow2.cluster_buf, block_size, l2_offset);
+    prepare_io(&ios[1], 1, l1_entry, sizeof(l1_entry),
+               image->l1_offset + (off_t_64)(l1_index << 3));
+
+    physical_batch(ios, 2);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (ios[i].result != (safeio_ssize_t)ios[i].size)
+        {
+            errno = ios[i].error;
+
+            if (i == 1)
+                syslog(LOG_ERR, "qcow2: Error updating L1 table: %m\n");
+            else
+                syslog(LOG_ERR, "qcow2: Error writing new L2 table: %m\n");
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return -1;
+        }
+    }
+
+    image->l1[l1_index] = (uint64_t)l2_offset | QCOW2_OFLAG_COPIED;
+
+    return l2_offset;
+}
+
+// Writes size bytes of data at data_offset in a QCOW2 image file, if any,
+// and then L2 table entry of a cluster in virtual disk, as one batch. L2
+// table needs to be there already. Returns -1 with errno set on failure.
+int
+qcow2_set_entry(uint64_t cluster, uint64_t entry, void *data,
+                safeio_size_t size, off_t_64 data_offset)
+{
+    uint64_t index = cluster & ((((uint64_t)1) << (block_shift - 3)) - 1);
+    uint8_t l2_entry[sizeof(uint64_t)];
+    off_t_64 l2_offset;
+    DEVIO_IO ios[2];
+    int count = 0;
+    int i;
+
+    l2_offset = qcow2_l2_table(cluster);
+    if (l2_offset == -1)
+        return -1;
+
+    SetBigEndian64U(l2_entry, entry);
+
+    if (data != NULL)
+        prepare_io(&ios[count++], 1, data, size, data_offset);
+
+    prepare_io(&ios[count++], 1, l2_entry, sizeof(l2_entry),
+               l2_offset + (off_t_64)(index << 3));
+
+    physical_batch(ios, count);
+
+    for (i = 0; i < count; i++)
+    {
+        if (ios[i].result != (safeio_ssize_t)ios[i].size)
+        {
+            errno = ios[i].error;
+
+            if (i == count - 1)
+                syslog(LOG_ERR, "qcow2: Error updating L2 table: %m\n");
+            else
+                syslog(LOG_ERR, "qcow2: Error writing new cluster: %m\n");
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return -1;
+        }
+    }
+
+    for (i = 0; i < qcow2.table_count; i++)
+        if (qcow2.tables[i].layer == 0 && qcow2.tables[i].offset == l2_offset)
+            SetBigEndian64U(qcow2.tables[i].data + (index << 3), entry);
+
+    return 0;
+}
+
+// Drops a reference to a cluster no longer in L2 table of a QCOW2 image,
+// releasing its space when nothing else refers to it. Compressed clusters
+// are left as they are. Failing to release a cluster only leaves it
+// unused.
+void
+qcow2_free_cluster(uint64_t entry)
+{
+    off_t_64 cluster_offset = (off_t_64)(entry & QCOW2_OFFSET_MASK);
+
+    if ((entry & QCOW2_OFLAG_COMPRESSED) || cluster_offset == 0)
+        return;
+
+    if (qcow2_refcount_update(cluster_offset, 1, 1) == 0)
+        physical_unmap(cluster_offset, block_size);
+}
+
+// Writes data within one cluster of a QCOW2 image that is not allocated, or
+// cannot be written in place, where entry is its current L2 table entry.
+// Data goes to a new cluster, along with the rest of the cluster as it
+// reads before the write, and L2 table entry is written last. All zeroes
+// are not written where the cluster reads as zeroes already, and whole
+// clusters of zeroes become zero clusters in version 3 images.
+safeio_ssize_t
+qcow2_write_new_cluster(char *io_ptr, safeio_size_t size, off_t_64 offset,
+                        uint64_t entry)
+{
+    uint64_t cluster = (uint64_t)offset >> block_shift;
+    off_t_64 cluster_start = offset & ~(off_t_64)(block_size - 1);
+    safeio_size_t in_cluster_offset = (safeio_size_t)offset & (block_size - 1);
+    safeio_size_t size_nqwords = (size + 7) >> 3;
+    int kind = qcow2_entry_kind(entry);
+    long long *buf_ptr;
+    char *data = io_ptr;
+    off_t_64 new_offset;
+
+    for (buf_ptr = (long long *)io_ptr;
+         (buf_ptr < (long long *)io_ptr + size_nqwords) ? (*buf_ptr == 0) : 0;
+         buf_ptr++)
+        ;
+    if (buf_ptr >= (long long *)io_ptr + size_nqwords)
+    {
+        if (kind == QCOW2_CLUSTER_ZERO ||
+            (kind == QCOW2_CLUSTER_UNALLOCATED && qcow2.count == 1))
+            return size;
+
+        if (size == block_size && qcow2.version >= 3)
+        {
+            if (qcow2_set_entry(cluster, QCOW2_OFLAG_ZERO, NULL, 0, 0) == -1)
+                return (safeio_ssize_t)-1;
+
+            qcow2_free_cluster(entry);
+
+            return size;
+        }
+    }
+
+    // L2 table and new cluster are found before cluster_buf is filled in,
+    // as adding tables uses it
+    if (qcow2_l2_table(cluster) == -1)
+        return (safeio_ssize_t)-1;
+
+    new_offset = qcow2_alloc();
+    if (new_offset == -1)
+        return (safeio_ssize_t)-1;
+
+    if (size < block_size)
+    {
+        safeio_size_t cluster_data = block_size;
+
+        // Last cluster may be cut short by end of virtual disk
+        if (cluster_start + cluster_data > current_size)
+            cluster_data = (safeio_size_t)(current_size - cluster_start);
+
+        memset(qcow2.cluster_buf, 0, block_size);
+
+        if (qcow2_read_layer(0, (char *)qcow2.cluster_buf, cluster_data,
+                             cluster_start) == -1)
+            return (safeio_ssize_t)-1;
+
+        memcpy(qcow2.cluster_buf + in_cluster_offset, io_ptr, size);
+        data = (char *)qcow2.cluster_buf;
+    }
+
+    if (qcow2_set_entry(cluster, (uint64_t)new_offset | QCOW2_OFLAG_COPIED,
+                        data, block_size, new_offset) == -1)
+        return (safeio_ssize_t)-1;
+
+    qcow2_free_cluster(entry);
+
+    return size;
+}
+
+safeio_ssize_t
+qcow2_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t writedone = 0;
+
+    if (offset + size > current_size)
+        return 0;
+
+    while (writedone < size)
+    {
+        uint64_t entry;
+        safeio_ssize_t run_size =
+            qcow2_map(0, offset + writedone, size - writedone, &entry);
+        safeio_ssize_t sizedone;
+
+        if (run_size == -1)
+            return (safeio_ssize_t)-1;
+
+        // Data clusters referenced only from here are written in place,
+        // other clusters one at a time
+        if (qcow2_entry_kind(entry) == QCOW2_CLUSTER_DATA &&
+            (entry & QCOW2_OFLAG_COPIED))
+        {
+            sizedone = physical_write(io_ptr + writedone, run_size,
+                                      (off_t_64)(entry & QCOW2_OFFSET_MASK) +
+                                          ((safeio_size_t)(offset + writedone) &
+                                           (block_size - 1)));
+
+            if (sizedone != -1 && sizedone != run_size)
+            {
+                syslog(LOG_ERR, "qcow2_write: Incomplete write of cluster data.\n");
+
+                errno = E2BIG;
+                sizedone = -1;
+            }
+        }
+        else
+        {
+            safeio_size_t in_cluster_offset =
+                (safeio_size_t)(offset + writedone) & (block_size - 1);
+
+            if (run_size > (safeio_ssize_t)(block_size - in_cluster_offset))
+                run_size = block_size - in_cluster_offset;
+
+            sizedone = qcow2_write_new_cluster(io_ptr + writedone, run_size,
+                                               offset + writedone, entry);
+        }
+
+        if (sizedone == -1)
+            return (safeio_ssize_t)-1;
+
+        writedone += run_size;
+    }
+
+    return writedone;
+}
+
+// Reads from or writes to a file of a VMDK extent, through physical_read()
+// and physical_write() where that is the image file.
+safeio_ssize_t
+vmdk_extent_io(PVMDK_EXTENT extent, char write, void *io_ptr,
+               safeio_size_t size, off_t_64 offset)
+{
+    if (extent->fd == image_fd)
+        return write ? physical_write(io_ptr, size, offset) :
+                       physical_read(io_ptr, size, offset);
+
+    return write ? pwrite(extent->fd, io_ptr, size, offset) :
+                   pread(extent->fd, io_ptr, size, offset);
+}
+
+// Returns extent of a VMDK image that holds a byte offset in virtual disk.
+PVMDK_EXTENT
+vmdk_extent_find(off_t_64 offset)
+{
+    int first = 0;
+    int last = vmdk.count - 1;
+
+    while (first < last)
+    {
+        int middle = (first + last + 1) >> 1;
+
+        if (vmdk.extents[middle].start <= offset)
+            first = middle;
+        else
+            last = middle - 1;
+    }
+
+    return &vmdk.extents[first];
+}
+
+// Finds a grain table of a sparse VMDK extent in cache, reading it in
+// place of the least recently used one if not there. Called with
+// vmdk_cache_lock held, or with vhd_lock held for writing. Returns NULL
+// with errno set on failure.
+PVMDK_TABLE
+vmdk_table_get(PVMDK_EXTENT extent, uint32_t gd_index)
+{
+    safeio_size_t table_size = extent->gt_entries << 2;
+    PVMDK_TABLE table;
+    uint32_t entry;
+    int i;
+
+    if (extent->gt_slot[gd_index] != 0)
+    {
+        table = &vmdk.tables[extent->gt_slot[gd_index] - 1];
+        table->last_use = ++vmdk.clock;
+        return table;
+    }
+
+    table = vmdk.tables;
+
+    for (i = 1; i < vmdk.table_count; i++)
+        if (vmdk.tables[i].last_use < table->last_use)
+            table = &vmdk.tables[i];
+
+    if (table->extent != NULL)
+        table->extent->gt_slot[table->gd_index] = 0;
+
+    table->extent = NULL;
+    table->last_use = 0;
+
+    if (vmdk_extent_io(extent, 0, table->entries, table_size,
+                       ((off_t_64)extent->gd[gd_index]) << 9) !=
+        (safeio_ssize_t)table_size)
+    {
+        syslog(LOG_ERR, "vmdk: Error reading grain table in '%s': %m\n",
+               extent->path);
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return NULL;
+    }
+
+    for (entry = 0; entry < extent->gt_entries; entry++)
+        table->entries[entry] = GetLittleEndian32U((uint8_t *)(table->entries + entry));
+
+    table->extent = extent;
+    table->gd_index = gd_index;
+    table->last_use = ++vmdk.clock;
+    extent->gt_slot[gd_index] = (uint32_t)(table - vmdk.tables) + 1;
+
+    return table;
+}
+
+// Gets grain table entry of a grain in a sparse VMDK extent, zero where
+// there is no grain table. Returns -1 with errno set on failure.
+int
+vmdk_grain_entry(PVMDK_EXTENT extent, uint64_t grain, uint32_t *entry)
+{
+    uint64_t gd_index = grain / extent->gt_entries;
+    PVMDK_TABLE table;
+
+    *entry = 0;
+
+    if (gd_index >= extent->gd_entries || extent->gd[gd_index] == 0)
+        return 0;
+
+    vmdk_cache_lock_acquire();
+
+    table = vmdk_table_get(extent, (uint32_t)gd_index);
+
+    if (table != NULL)
+        *entry = table->entries[grain % extent->gt_entries];
+
+    vmdk_cache_lock_release();
+
+    return table == NULL ? -1 : 0;
+}
+
+// Maps start of a range of size bytes at offset in virtual disk of a VMDK
+// image, within one extent. Returns number of bytes that are either in one
+// contiguous range in an extent file, where *file_offset is set to its
+// start, or that read as zeroes, where *file_offset is set to -1. *extent
+// is set to the extent. Returns -1 with errno set on failure.
+safeio_ssize_t
+vmdk_map(off_t_64 offset, safeio_size_t size, PVMDK_EXTENT *extent,
+         off_t_64 *file_offset)
+{
+    PVMDK_EXTENT found = vmdk_extent_find(offset);
+    off_t_64 extent_offset = offset - found->start;
+    safeio_size_t grain_size;
+    safeio_size_t mapped;
+    uint64_t grain;
+    uint32_t entry;
+    uint32_t grains;
+
+    *extent = found;
+
+    if (size > found->size - extent_offset)
+        size = (safeio_size_t)(found->size - extent_offset);
+
+    switch (found->type)
+    {
+    case VMDK_EXTENT_FLAT:
+        *file_offset = found->file_offset + extent_offset;
+        return size;
+
+    case VMDK_EXTENT_ZERO:
+        *file_offset = -1;
+        return size;
+    }
+
+    grain_size = ((safeio_size_t)1) << found->grain_shift;
+    grain = (uint64_t)extent_offset >> found->grain_shift;
+    mapped = grain_size - ((safeio_size_t)extent_offset & (grain_size - 1));
+
+    if (vmdk_grain_entry(found, grain, &entry) == -1)
+        return (safeio_ssize_t)-1;
+
+    if (entry <= VMDK_GRAIN_ZERO)
+        *file_offset = -1;
+    else
+        *file_offset = (((off_t_64)entry) << 9) +
+                       ((safeio_size_t)extent_offset & (grain_size - 1));
+
+    for (grains = 1; mapped < size; grains++)
+    {
+        uint32_t next_entry;
+
+        if (vmdk_grain_entry(found, grain + grains, &next_entry) == -1)
+            return (safeio_ssize_t)-1;
+
+        if (*file_offset == -1 ?
+            next_entry > VMDK_GRAIN_ZERO :
+            next_entry != entry + (grains << (found->grain_shift - 9)))
+            break;
+
+        mapped += grain_size;
+    }
+
+    if (mapped > size)
+        mapped = size;
+
+    return mapped;
+}
+
+safeio_ssize_t
+vmdk_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t readdone = 0;
+
+    if (offset + size > current_size)
+        return 0;
+
+    memset(io_ptr, 0, size);
+
+    // Grains not allocated read as zeroes, as there are no parent images,
+    // and each run of grains one after another is read with one call
+    while (readdone < size)
+    {
+        PVMDK_EXTENT extent;
+        off_t_64 file_offset;
+        safeio_ssize_t run_size = vmdk_map(offset + readdone, size - readdone,
+                                           &extent, &file_offset);
+
+        if (run_size == -1)
+            return (safeio_ssize_t)-1;
+
+        // Data missing at end of extent files reads as zeroes
+        if (file_offset != -1 &&
+            vmdk_extent_io(extent, 0, io_ptr + readdone, run_size,
+                           file_offset) == -1)
+            return (safeio_ssize_t)-1;
+
+        readdone += run_size;
+    }
+
+    return readdone;
+}
+
+// Makes sure there is a grain table, and a redundant one where there is a
+// redundant grain directory, for an entry in grain directory of a sparse
+// VMDK extent. New tables are written before grain directory entries.
+// Returns -1 with errno set on failure.
+int
+vmdk_grain_table(PVMDK_EXTENT extent, uint32_t gd_index)
+{
+    safeio_size_t table_size = ((extent->gt_entries << 2) + 511) & ~511;
+    uint8_t gd_entry[sizeof(uint32_t)];
+    char *table;
+    int copy;
+
+    if (extent->gd[gd_index] != 0)
+        return 0;
+
+    table = (char *)calloc(1, table_size);
+    if (table == NULL)
+        return -1;
+
+    for (copy = extent->rgd != NULL ? 1 : 0; copy >= 0; copy--)
+    {
+        uint32_t *gd = copy ? extent->rgd : extent->gd;
+        off_t_64 gd_offset = copy ? extent->rgd_offset : extent->gd_offset;
+
+        SetLittleEndian32U(gd_entry, (uint32_t)(extent->file_end >> 9));
+
+        if (vmdk_extent_io(extent, 1, table, table_size, extent->file_end) !=
+                (safeio_ssize_t)table_size ||
+            vmdk_extent_io(extent, 1, gd_entry, sizeof(gd_entry),
+                           gd_offset + ((off_t_64)gd_index << 2)) !=
+                sizeof(gd_entry))
+        {
+            syslog(LOG_ERR, "vmdk: Error adding grain table: %m\n");
+
+            free(table);
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return -1;
+        }
+
+        gd[gd_index] = (uint32_t)(extent->file_end >> 9);
+        extent->file_end += table_size;
+    }
+
+    free(table);
+
+    return 0;
+}
+
+// Writes grain table entry of a grain in a sparse VMDK extent, to grain
+// table and redundant grain table, and to cached grain table. Returns -1
+// with errno set on failure.
+int
+vmdk_set_grain_entry(PVMDK_EXTENT extent, uint64_t grain, uint32_t entry)
+{
+    uint32_t gd_index = (uint32_t)(grain / extent->gt_entries);
+    uint32_t index = (uint32_t)(grain % extent->gt_entries);
+    uint8_t gt_entry[sizeof(uint32_t)];
+    int copy;
+
+    if (vmdk_grain_table(extent, gd_index) == -1)
+        return -1;
+
+    SetLittleEndian32U(gt_entry, entry);
+
+    for (copy = 0; copy < (extent->rgd != NULL ? 2 : 1); copy++)
+        if (vmdk_extent_io(extent, 1, gt_entry, sizeof(gt_entry),
+                           (((off_t_64)(copy ? extent->rgd : extent->gd)[gd_index]) << 9) +
+                               ((off_t_64)index << 2)) != sizeof(gt_entry))
+        {
+            syslog(LOG_ERR, "vmdk: Error updating grain table: %m\n");
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            return -1;
+        }
+
+    if (extent->gt_slot[gd_index] != 0)
+        vmdk.tables[extent->gt_slot[gd_index] - 1].entries[index] = entry;
+
+    return 0;
+}
+
+// Writes data within one grain of a sparse VMDK extent that is not
+// allocated. Unless data is all zeroes, a new grain is added at end of
+// extent file, with the rest of it zeroes, and grain table entry is
+// written after grain data.
+safeio_ssize_t
+vmdk_write_new_grain(PVMDK_EXTENT extent, char *io_ptr, safeio_size_t size,
+                     off_t_64 offset)
+{
+    safeio_size_t grain_size = ((safeio_size_t)1) << extent->grain_shift;
+    uint64_t grain = (uint64_t)(offset - extent->start) >> extent->grain_shift;
+    safeio_size_t in_grain_offset =
+        (safeio_size_t)(offset - extent->start) & (grain_size - 1);
+    safeio_size_t size_nqwords = (size + 7) >> 3;
+    long long *buf_ptr;
+    char *data = io_ptr;
+    off_t_64 grain_offset;
+
+    for (buf_ptr = (long long *)io_ptr;
+         (buf_ptr < (long long *)io_ptr + size_nqwords) ? (*buf_ptr == 0) : 0;
+         buf_ptr++)
+        ;
+    if (buf_ptr >= (long long *)io_ptr + size_nqwords)
+        return size;
+
+    // Grain table is added first, if needed, so that the grain follows it
+    if (vmdk_grain_table(extent, (uint32_t)(grain / extent->gt_entries)) == -1)
+        return (safeio_ssize_t)-1;
+
+    grain_offset = extent->file_end;
+
+    if (size < grain_size)
+    {
+        memset(vmdk.grain_buf, 0, grain_size);
+        memcpy(vmdk.grain_buf + in_grain_offset, io_ptr, size);
+        data = vmdk.grain_buf;
+    }
+
+    if (vmdk_extent_io(extent, 1, data, grain_size, grain_offset) !=
+        (safeio_ssize_t)grain_size)
+    {
+        syslog(LOG_ERR, "vmdk_write: Error writing new grain: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return (safeio_ssize_t)-1;
+    }
+
+    extent->file_end += grain_size;
+
+    if (vmdk_set_grain_entry(extent, grain, (uint32_t)(grain_offset >> 9)) == -1)
+        return (safeio_ssize_t)-1;
+
+    return size;
+}
+
+safeio_ssize_t
+vmdk_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t writedone = 0;
+
+    if (offset + size > current_size)
+        return 0;
+
+    while (writedone < size)
+    {
+        PVMDK_EXTENT extent;
+        off_t_64 file_offset;
+        safeio_ssize_t run_size = vmdk_map(offset + writedone, size - writedone,
+                                           &extent, &file_offset);
+        safeio_ssize_t sizedone;
+
+        if (run_size == -1)
+            return (safeio_ssize_t)-1;
+
+        if (extent->read_only || extent->type == VMDK_EXTENT_ZERO)
+        {
+            syslog(LOG_ERR, "vmdk_write: Extent is read-only.\n");
+
+            errno = EROFS;
+            return (safeio_ssize_t)-1;
+        }
+
+        // Grains not yet allocated are added one at a time
+        if (file_offset == -1)
+        {
+            safeio_size_t grain_size = ((safeio_size_t)1) << extent->grain_shift;
+            safeio_size_t in_grain_offset =
+                (safeio_size_t)(offset + writedone - extent->start) &
+                (grain_size - 1);
+
+            if (run_size > (safeio_ssize_t)(grain_size - in_grain_offset))
+                run_size = grain_size - in_grain_offset;
+
+            sizedone = vmdk_write_new_grain(extent, io_ptr + writedone, run_size,
+                                            offset + writedone);
+        }
+        else
+        {
+            sizedone = vmdk_extent_io(extent, 1, io_ptr + writedone, run_size,
+                                      file_offset);
+
+            if (sizedone != -1 && sizedone != run_size)
+            {
+                syslog(LOG_ERR, "vmdk_write: Incomplete write of extent data.\n");
+
+                errno = E2BIG;
+                sizedone = -1;
+            }
+        }
+
+        if (sizedone == -1)
+            return (safeio_ssize_t)-1;
+
+        writedone += run_size;
+    }
+
+    return writedone;
+}
+
+#ifdef __linux__
+// Drops extent map, so that everything is read from image file from then
+// on. Called with extent_map_lock held where needed.
+void extent_map_drop()
+{
+    extent_map.enabled = 0;
+    free(extent_map.extents);
+    extent_map.extents = NULL;
+    extent_map.count = 0;
+    extent_map.capacity = 0;
+}
+
+// Returns index of first extent in map that ends after offset.
+int extent_map_find(off_t_64 offset)
+{
+    int first = 0;
+    int last = extent_map.count;
+
+    while (first < last)
+    {
+        int middle = (first + last) >> 1;
+
+        if (extent_map.extents[middle].end <= offset)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+
+    return first;
+}
+
+// Replaces extents first up to last in map with count new ones. Returns -1
+// if map would grow beyond EXTENT_MAP_MAX_EXTENTS.
+int extent_map_replace(int first, int last, const DATA_EXTENT *extents,
+                       int count)
+{
+    int new_count = extent_map.count - (last - first) + count;
+
+    if (new_count > EXTENT_MAP_MAX_EXTENTS)
+        return -1;
+
+    if (new_count > extent_map.capacity)
+    {
+        int capacity = extent_map.capacity > 0 ? extent_map.capacity << 1 : 64;
+        PDATA_EXTENT new_extents;
+
+        if (capacity > EXTENT_MAP_MAX_EXTENTS)
+            capacity = EXTENT_MAP_MAX_EXTENTS;
+
+        new_extents = (PDATA_EXTENT)realloc(extent_map.extents,
+                                            capacity * sizeof(DATA_EXTENT));
+        if (new_extents == NULL)
+            return -1;
+
+        extent_map.extents = new_extents;
+        extent_map.capacity = capacity;
+    }
+
+    memmove(extent_map.extents + first + count, extent_map.extents + last,
+            (extent_map.count - last) * sizeof(DATA_EXTENT));
+    memcpy(extent_map.extents + first, extents, count * sizeof(DATA_EXTENT));
+    extent_map.count = new_count;
+
+    return 0;
+}
+
+// Marks a range of image file as data, or as a hole. Called with
+// extent_map_lock held where needed. If map cannot hold it, map is dropped.
+void extent_map_set_locked(off_t_64 offset, off_t_64 length, char data)
+{
+    off_t_64 end = offset + length;
+    DATA_EXTENT extents[2];
+    int count = 0;
+    int first;
+    int last;
+
+    if (!extent_map.enabled || length <= 0 || offset >= extent_map.size)
+        return;
+
+    if (end > extent_map.size)
+        end = extent_map.size;
+
+    if (data)
+    {
+        // Merged with extents it touches
+        first = extent_map_find(offset - 1);
+        for (last = first;
+             last < extent_map.count && extent_map.extents[last].start <= end;
+             last++)
+            ;
+
+        extents[0].start = offset;
+        extents[0].end = end;
+
+        if (first < last && extent_map.extents[first].start < offset)
+            extents[0].start = extent_map.extents[first].start;
+        if (first < last && extent_map.extents[last - 1].end > end)
+            extents[0].end = extent_map.extents[last - 1].end;
+
+        count = 1;
+    }
+    else
+    {
+        // Cut out of extents it overlaps
+        first = extent_map_find(offset);
+        for (last = first;
+             last < extent_map.count && extent_map.extents[last].start < end;
+             last++)
+            ;
+
+        if (first == last)
+            return;
+
+        if (extent_map.extents[first].start < offset)
+        {
+            extents[count].start = extent_map.extents[first].start;
+            extents[count++].end = offset;
+        }
+
+        if (extent_map.extents[last - 1].end > end)
+        {
+            extents[count].start = end;
+            extents[count++].end = extent_map.extents[last - 1].end;
+        }
+    }
+
+    if (extent_map_replace(first, last, extents, count) == -1)
+    {
+        syslog(LOG_ERR, "Image file too fragmented, extent map dropped.\n");
+        extent_map_drop();
+    }
+}
+
+// Marks a range of image file as written.
+void extent_map_set_data(off_t_64 offset, off_t_64 length)
+{
+    if (!extent_map.enabled)
+        return;
+
+    extent_map_lock_acquire();
+
+    extent_map_set_locked(offset, length, 1);
+
+    extent_map_lock_release();
+}
+
+// Finds part of a range of image file that can hold data, from start of
+// first extent that overlaps it to end of last one. *data_length is set to
+// zero where the whole range is a hole. Returns zero where the range needs
+// to be read as it is.
+int extent_map_data_range(off_t_64 offset, safeio_size_t size,
+                          off_t_64 *data_offset, safeio_size_t *data_length)
+{
+    off_t_64 end = offset + size;
+    int first;
+    int last;
+
+    if (!extent_map.enabled || end > extent_map.size)
+        return 0;
+
+    extent_map_lock_acquire();
+
+    // Map may have been dropped while waiting for lock
+    if (!extent_map.enabled)
+    {
+        extent_map_lock_release();
+
+        return 0;
+    }
+
+    first = extent_map_find(offset);
+    last = extent_map_find(end - 1);
+
+    if (first == extent_map.count || extent_map.extents[first].start >= end)
+    {
+        *data_offset = offset;
+        *data_length = 0;
+    }
+    else
+    {
+        if (last == extent_map.count || extent_map.extents[last].start >= end)
+            last--;
+
+        *data_offset = extent_map.extents[first].start > offset ?
+            extent_map.extents[first].start : offset;
+        *data_length = (safeio_size_t)((extent_map.extents[last].end < end ?
+                                        extent_map.extents[last].end : end) -
+                                       *data_offset);
+    }
+
+    extent_map_lock_release();
+
+    return 1;
+}
+
+// Checks whether a range of image file is all in holes.
+int extent_map_is_hole(off_t_64 offset, safeio_size_t size)
+{
+    off_t_64 data_offset;
+    safeio_size_t data_length;
+
+    return extent_map_data_range(offset, size, &data_offset, &data_length) &&
+           data_length == 0;
+}
+
+// Builds extent map of a raw image file with SEEK_DATA and SEEK_HOLE. Map
+// is not used if file system does not tell where holes are, or if there
+// are too many extents.
+void extent_map_build()
+{
+    struct stat file_stat = {0};
+    off_t_64 offset = 0;
+    off_t_64 hole_size = 0;
+
+    if (fstat(image_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) ||
+        file_stat.st_size == 0)
+        return;
+
+    extent_map.size = file_stat.st_size;
+    extent_map.enabled = 1;
+
+    while (offset < extent_map.size)
+    {
+        DATA_EXTENT extent;
+
+        extent.start = lseek(image_fd, offset, SEEK_DATA);
+        if ((extent.start == -1 && errno == ENXIO) ||
+            extent.start >= extent_map.size)
+            break;
+
+        if (extent.start != -1)
+            extent.end = lseek(image_fd, extent.start, SEEK_HOLE);
+
+        if (extent.start == -1 || extent.end == -1)
+        {
+            syslog(LOG_ERR, "Cannot find holes in image file: %m\n");
+            extent_map_drop();
+            return;
+        }
+
+        if (extent.end > extent_map.size)
+            extent.end = extent_map.size;
+
+        if (extent_map_replace(extent_map.count, extent_map.count, &extent,
+                               1) == -1)
+        {
+            syslog(LOG_ERR, "Image file too fragmented for extent map.\n");
+            extent_map_drop();
+            return;
+        }
+
+        hole_size += extent.start - offset;
+        offset = extent.end;
+    }
+
+    hole_size += extent_map.size - offset;
+
+    printf("Image file extent map: %i data extents, " SLL_FMT " bytes in holes.\n",
+           extent_map.count, (int64_t)hole_size);
+}
+#endif
+
+// Reads from virtual disk of image, in whatever format it is, bypassing
+// block cache.
+safeio_ssize_t
+backend_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    if (vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode)
+    {
+        safeio_ssize_t readdone;
+
+        vhd_lock_acquire_read();
+
+        if (vhdx_mode)
+            readdone = vhdx_read(io_ptr, size, offset);
+        else if (qcow2_mode)
+            readdone = qcow2_read(io_ptr, size, offset);
+        else if (vmdk_mode)
+            readdone = vmdk_read(io_ptr, size, offset);
+        else
+            readdone = vhd_read(io_ptr, size, offset);
+
+        vhd_lock_release();
+
+        return readdone;
+    }
+    else
+    {
+#ifdef __linux__
+        off_t_64 data_offset;
+        safeio_size_t data_length;
+
+        // Holes at either end of range read as zeroes without touching
+        // image file
+        if (extent_map_data_range(offset, size, &data_offset, &data_length))
+        {
+            safeio_size_t head = (safeio_size_t)(data_offset - offset);
+            safeio_ssize_t readdone = 0;
+
+            memset(io_ptr, 0, head);
+            memset(io_ptr + head + data_length, 0, size - head - data_length);
+
+            if (data_length > 0)
+                readdone = physical_read(io_ptr + head, data_length,
+                                         data_offset);
+
+            if (readdone == -1)
+                return (safeio_ssize_t)-1;
+
+            if (readdone < (safeio_ssize_t)data_length)
+                return head + readdone;
+
+            return size;
+        }
+#endif
+
+        return physical_read(io_ptr, size, offset);
+    }
+}
+
+// Writes to raw image files are on stable storage when done if dsync is
+// set. Image formats leave that to caller.
+safeio_ssize_t
+backend_write(char *io_ptr, safeio_size_t size, off_t_64 offset, char dsync)
+{
+    if (vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode)
+    {
+        safeio_ssize_t writedone;
+
+        vhd_lock_acquire_write();
+
+        if (vhdx_mode)
+            writedone = vhdx_write(io_ptr, size, offset);
+        else if (qcow2_mode)
+            writedone = qcow2_write(io_ptr, size, offset);
+        else if (vmdk_mode)
+            writedone = vmdk_write(io_ptr, size, offset);
+        else
+            writedone = vhd_write(io_ptr, size, offset);
+        vhd_journal.unsynced = 1;
+
+        vhd_lock_release();
+
+        return writedone;
+    }
+    else
+    {
+        safeio_ssize_t writedone = dsync ?
+            physical_write_dsync(io_ptr, size, offset) :
+            physical_write(io_ptr, size, offset);
+
+#ifdef __linux__
+        // Marked after data is written, so that a range unmapped meanwhile
+        // is not left marked as a hole
+        extent_map_set_data(offset, size);
+#endif
+
+        return writedone;
+    }
+}
+
+// Size of blocks in block cache. Reads that miss are read from image in
+// whole blocks, up to BLOCK_CACHE_MAX_RUN blocks with one call.
+#define BLOCK_CACHE_BLOCK_SHIFT 16
+#define BLOCK_CACHE_BLOCK_SIZE (1 << BLOCK_CACHE_BLOCK_SHIFT)
+#define BLOCK_CACHE_MAX_RUN 16
+
+// Queues of 2Q replacement. Blocks read once wait in A1in, in order they
+// were read, and are then forgotten but remembered in A1out without data.
+// Blocks read again while in A1in or remembered in A1out go to Am, least
+// recently used first out. Reads of a block that start after where the
+// previous one started continue a sequential read, and do not count as
+// reading it again, so a scan through the image passes through A1in only.
+#define BLOCK_CACHE_FREE 0
+#define BLOCK_CACHE_A1IN 1
+#define BLOCK_CACHE_A1OUT 2
+#define BLOCK_CACHE_AM 3
+
+typedef struct _BLOCK_CACHE_ENTRY
+{
+    off_t_64 block;
+    struct _BLOCK_CACHE_ENTRY *hash_next;
+    struct _BLOCK_CACHE_ENTRY *prev;
+    struct _BLOCK_CACHE_ENTRY *next;
+    char queue;
+    safeio_size_t last_start;
+    char *data;
+} BLOCK_CACHE_ENTRY, *PBLOCK_CACHE_ENTRY;
+
+typedef struct _BLOCK_CACHE_QUEUE
+{
+    PBLOCK_CACHE_ENTRY head;
+    PBLOCK_CACHE_ENTRY tail;
+    int count;
+} BLOCK_CACHE_QUEUE;
+
+// Block cache in front of image, shared by all connections, set up with
+// --blockcache. Writes go through to image, and update blocks in cache.
+// Blocks are read from image without cache lock held, so writes, unmaps and
+// zeroes bump generation before and after they change image, and blocks
+// read while generation changed are not added.
+struct _BLOCK_CACHE
+{
+    int block_count;
+    int a1in_max;
+    int a1out_max;
+    PBLOCK_CACHE_ENTRY entries;
+    PBLOCK_CACHE_ENTRY free_entries;
+    PBLOCK_CACHE_ENTRY *hash;
+    int hash_shift;
+    BLOCK_CACHE_QUEUE queues[4];
+    char **free_data;
+    int free_data_count;
+    uint64_t generation;
+    ULONGLONG hits;
+    ULONGLONG misses;
+} block_cache = {0};
+
+#ifdef __linux__
+pthread_mutex_t block_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void block_cache_lock_acquire()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_lock(&block_cache_lock);
+#endif
+}
+
+void block_cache_lock_release()
+{
+#ifdef __linux__
+    if (worker_count > 0)
+        pthread_mutex_unlock(&block_cache_lock);
+#endif
+}
+
+// Sets up block cache for a memory budget in bytes. Returns zero on failure.
+int block_cache_init(ULONGLONG budget)
+{
+    int entry_count;
+    int i;
+
+    block_cache.block_count = (int)(budget >> BLOCK_CACHE_BLOCK_SHIFT);
+    if (block_cache.block_count < 4)
+    {
+        fprintf(stderr, "Block cache needs at least %i bytes.\n",
+                4 * BLOCK_CACHE_BLOCK_SIZE);
+        return 0;
+    }
+
+    block_cache.a1in_max = block_cache.block_count >> 2;
+    block_cache.a1out_max = block_cache.block_count >> 1;
+    entry_count = block_cache.block_count + block_cache.a1out_max + 1;
+
+    for (block_cache.hash_shift = 64;
+         (1 << (64 - block_cache.hash_shift)) < entry_count;
+         block_cache.hash_shift--)
+        ;
+
+    block_cache.entries =
+        (PBLOCK_CACHE_ENTRY)calloc(entry_count, sizeof(BLOCK_CACHE_ENTRY));
+    block_cache.hash = (PBLOCK_CACHE_ENTRY *)calloc(
+        (size_t)1 << (64 - block_cache.hash_shift), sizeof(PBLOCK_CACHE_ENTRY));
+    block_cache.free_data =
+        (char **)malloc(block_cache.block_count * sizeof(char *));
+
+    if (block_cache.entries == NULL || block_cache.hash == NULL ||
+        block_cache.free_data == NULL)
+    {
+        perror("Block cache");
+        return 0;
+    }
+
+    for (i = 0; i < entry_count; i++)
+    {
+        block_cache.entries[i].next = block_cache.free_entries;
+        block_cache.free_entries = &block_cache.entries[i];
+    }
+
+    for (i = 0; i < block_cache.block_count; i++)
+    {
+        block_cache.free_data[i] = (char *)malloc(BLOCK_CACHE_BLOCK_SIZE);
+        if (block_cache.free_data[i] == NULL)
+        {
+            perror("Block cache");
+            return 0;
+        }
+    }
+
+    block_cache.free_data_count = block_cache.block_count;
+
+    return 1;
+}
+
+PBLOCK_CACHE_ENTRY *block_cache_bucket(off_t_64 block)
+{
+    return &block_cache.hash[((uint64_t)block * 0x9E3779B97F4A7C15ULL) >>
+                             block_cache.hash_shift];
+}
+
+PBLOCK_CACHE_ENTRY block_cache_find(off_t_64 block)
+{
+    PBLOCK_CACHE_ENTRY entry;
+
+    for (entry = *block_cache_bucket(block);
+         entry != NULL && entry->block != block;
+         entry = entry->hash_next)
+        ;
+
+    return entry;
+}
+
+void block_cache_unlink(PBLOCK_CACHE_ENTRY entry)
+{
+    BLOCK_CACHE_QUEUE *queue = &block_cache.queues[(int)entry->queue];
+
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        queue->head = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        queue->tail = entry->prev;
+
+    queue->count--;
+}
+
+// Puts an entry first in a queue, where the last one is next out.
+void block_cache_push(PBLOCK_CACHE_ENTRY entry, char queue_number)
+{
+    BLOCK_CACHE_QUEUE *queue = &block_cache.queues[(int)queue_number];
+
+    entry->queue = queue_number;
+    entry->prev = NULL;
+    entry->next = queue->head;
+
+    if (queue->head != NULL)
+        queue->head->prev = entry;
+    else
+        queue->tail = entry;
+
+    queue->head = entry;
+    queue->count++;
+}
+
+// Removes an entry from cache, keeping its data buffer for reuse.
+void block_cache_remove(PBLOCK_CACHE_ENTRY entry)
+{
+    PBLOCK_CACHE_ENTRY *ptr;
+
+    for (ptr = block_cache_bucket(entry->block); *ptr != entry;
+         ptr = &(*ptr)->hash_next)
+        ;
+
+    *ptr = entry->hash_next;
+
+    block_cache_unlink(entry);
+
+    if (entry->data != NULL)
+        block_cache.free_data[block_cache.free_data_count++] = entry->data;
+
+    entry->data = NULL;
+    entry->queue = BLOCK_CACHE_FREE;
+    entry->next = block_cache.free_entries;
+    block_cache.free_entries = entry;
+}
+
+// Makes room for one more block with data. Blocks pushed out of A1in are
+// remembered in A1out.
+void block_cache_reclaim()
+{
+    PBLOCK_CACHE_ENTRY entry;
+
+    if (block_cache.free_data_count > 0)
+        return;
+
+    if (block_cache.queues[BLOCK_CACHE_A1IN].count > block_cache.a1in_max ||
+        block_cache.queues[BLOCK_CACHE_AM].count == 0)
+    {
+        entry = block_cache.queues[BLOCK_CACHE_A1IN].tail;
+
+        block_cache_unlink(entry);
+        block_cache.free_data[block_cache.free_data_count++] = entry->data;
+        entry->data = NULL;
+
+        if (block_cache.queues[BLOCK_CACHE_A1OUT].count >= block_cache.a1out_max)
+            block_cache_remove(block_cache.queues[BLOCK_CACHE_A1OUT].tail);
+
+        block_cache_push(entry, BLOCK_CACHE_A1OUT);
+    }
+    else
+        block_cache_remove(block_cache.queues[BLOCK_CACHE_AM].tail);
+}
+
+// Stores data of a block in cache, in place of what is there already, for
+// a read that started at read_start within it.
+void block_cache_store(off_t_64 block, const char *data,
+                       safeio_size_t read_start)
+{
+    PBLOCK_CACHE_ENTRY entry = block_cache_find(block);
+
+    if (entry != NULL && entry->data != NULL)
+    {
+        memcpy(entry->data, data, BLOCK_CACHE_BLOCK_SIZE);
+        return;
+    }
+
+    block_cache_reclaim();
+
+    // Entry may have been forgotten from A1out to make room
+    entry = block_cache_find(block);
+
+    if (entry != NULL)
+    {
+        // Seen recently, so kept in Am from now on
+        block_cache_unlink(entry);
+        block_cache_push(entry, BLOCK_CACHE_AM);
+    }
+    else
+    {
+        PBLOCK_CACHE_ENTRY *bucket = block_cache_bucket(block);
+
+        if (block_cache.free_entries == NULL)
+            block_cache_remove(block_cache.queues[BLOCK_CACHE_A1OUT].tail);
+
+        entry = block_cache.free_entries;
+        block_cache.free_entries = entry->next;
+
+        entry->block = block;
+        entry->hash_next = *bucket;
+        *bucket = entry;
+
+        block_cache_push(entry, BLOCK_CACHE_A1IN);
+    }
+
+    entry->last_start = read_start;
+    entry->data = block_cache.free_data[--block_cache.free_data_count];
+    memcpy(entry->data, data, BLOCK_CACHE_BLOCK_SIZE);
+}
+
+// Returns number of blocks from offset that are completely within image
+// and can be cached.
+off_t_64 block_cache_end_block()
+{
+    return current_size >> BLOCK_CACHE_BLOCK_SHIFT;
+}
+
+// Drops blocks in a range from cache, and bumps generation so that blocks
+// being read meanwhile are not added.
+void block_cache_invalidate(off_t_64 offset, off_t_64 length)
+{
+    off_t_64 block = offset >> BLOCK_CACHE_BLOCK_SHIFT;
+    off_t_64 end_block =
+        (offset + length + BLOCK_CACHE_BLOCK_SIZE - 1) >> BLOCK_CACHE_BLOCK_SHIFT;
+
+    block_cache_lock_acquire();
+
+    block_cache.generation++;
+
+    for (; block < end_block; block++)
+    {
+        PBLOCK_CACHE_ENTRY entry = block_cache_find(block);
+
+        if (entry != NULL && entry->data != NULL)
+            block_cache_remove(entry);
+    }
+
+    block_cache_lock_release();
+}
+
+// Buffer of each thread that reads runs of blocks into cache
+DEVIO_THREAD_LOCAL DEVIO_THREAD_BUF block_cache_run = {0};
+
+// Reads a run of blocks missing from cache from image in one call, and adds
+// them to cache unless image changed meanwhile. Part of them within the
+// request is copied to io_ptr, which holds request from offset.
+safeio_ssize_t block_cache_fill(char *io_ptr, safeio_size_t size,
+                                off_t_64 offset, off_t_64 block, int count,
+                                uint64_t generation)
+{
+    safeio_size_t run_size = (safeio_size_t)count << BLOCK_CACHE_BLOCK_SHIFT;
+    off_t_64 run_offset = block << BLOCK_CACHE_BLOCK_SHIFT;
+    off_t_64 first = run_offset > offset ? run_offset : offset;
+    off_t_64 last = run_offset + run_size < offset + size ?
+        run_offset + run_size : offset + size;
+    safeio_ssize_t readdone;
+    char *run_buf;
+    int i;
+
+    run_buf = thread_buf_get(&block_cache_run, run_size);
+    if (run_buf == NULL)
+        return (safeio_ssize_t)-1;
+
+    readdone = backend_read(run_buf, run_size, run_offset);
+
+    if (readdone == -1)
+        return (safeio_ssize_t)-1;
+
+    if (readdone < (safeio_ssize_t)run_size)
+        memset(run_buf + readdone, 0, run_size - readdone);
+
+    memcpy(io_ptr + (first - offset), run_buf + (first - run_offset),
+           (size_t)(last - first));
+
+    block_cache_lock_acquire();
+
+    block_cache.misses += count;
+
+    if (readdone == (safeio_ssize_t)run_size &&
+        block_cache.generation == generation)
+        for (i = 0; i < count; i++)
+            block_cache_store(block + i,
+                              run_buf + ((size_t)i << BLOCK_CACHE_BLOCK_SHIFT),
+                              i == 0 ? (safeio_size_t)(first - run_offset) : 0);
+
+    block_cache_lock_release();
+
+    // A short read ends the request where it ended
+    if (readdone < (safeio_ssize_t)run_size &&
+        run_offset + readdone < offset + size)
+        return run_offset + readdone > offset ?
+            (safeio_ssize_t)(run_offset + readdone - offset) : 0;
+
+    return size;
+}
+
+safeio_ssize_t
+logical_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 block;
+    off_t_64 end_block;
+    off_t_64 run_block = -1;
+    int run_count = 0;
+    uint64_t run_generation = 0;
+    uint64_t generation;
+    off_t_64 cached_end;
+    safeio_ssize_t result;
+
+    if (block_cache.block_count == 0 || size == 0)
+        return backend_read(io_ptr, size, offset);
+
+    block = offset >> BLOCK_CACHE_BLOCK_SHIFT;
+    end_block = (offset + size + BLOCK_CACHE_BLOCK_SIZE - 1) >>
+                BLOCK_CACHE_BLOCK_SHIFT;
+    if (end_block > block_cache_end_block())
+        end_block = block_cache_end_block();
+
+    // Tail of image that does not fill a block is read as it is
+    cached_end = end_block << BLOCK_CACHE_BLOCK_SHIFT;
+    if (cached_end < offset + size)
+    {
+        off_t_64 tail = cached_end > offset ? cached_end : offset;
+
+        result = backend_read(io_ptr + (tail - offset),
+                              (safeio_size_t)(offset + size - tail), tail);
+        if (result == -1)
+            return (safeio_ssize_t)-1;
+
+        if (result < (safeio_ssize_t)(offset + size - tail))
+            size = (safeio_size_t)(tail - offset + result);
+    }
+
+    for (; block < end_block; block++)
+    {
+        PBLOCK_CACHE_ENTRY entry;
+        off_t_64 block_offset = block << BLOCK_CACHE_BLOCK_SHIFT;
+        off_t_64 first;
+        off_t_64 last;
+
+        block_cache_lock_acquire();
+
+        entry = block_cache_find(block);
+        generation = block_cache.generation;
+
+        if (entry != NULL && entry->data != NULL)
+        {
+            first = block_offset > offset ? block_offset : offset;
+            last = block_offset + BLOCK_CACHE_BLOCK_SIZE < offset + size ?
+                block_offset + BLOCK_CACHE_BLOCK_SIZE : offset + size;
+
+            memcpy(io_ptr + (first - offset),
+                   entry->data + (first - block_offset), (size_t)(last - first));
+
+            if (entry->queue == BLOCK_CACHE_AM ||
+                (safeio_size_t)(first - block_offset) <= entry->last_start)
+            {
+                block_cache_unlink(entry);
+                block_cache_push(entry, BLOCK_CACHE_AM);
+            }
+            else
+                entry->last_start = (safeio_size_t)(first - block_offset);
+
+            block_cache.hits++;
+        }
+
+        block_cache_lock_release();
+
+        if (entry != NULL && entry->data != NULL)
+        {
+            if (run_count > 0)
+            {
+                result = block_cache_fill(io_ptr, size, offset, run_block,
+                                          run_count, run_generation);
+                if (result != (safeio_ssize_t)size)
+                    return result;
+
+                run_count = 0;
+            }
+
+            continue;
+        }
+
+        if (run_count == 0)
+        {
+            run_block = block;
+            run_generation = generation;
+        }
+
+        if (++run_count == BLOCK_CACHE_MAX_RUN)
+        {
+            result = block_cache_fill(io_ptr, size, offset, run_block,
+                                      run_count, run_generation);
+            if (result != (safeio_ssize_t)size)
+                return result;
+
+            run_count = 0;
+        }
+    }
+
+    if (run_count > 0)
+        return block_cache_fill(io_ptr, size, offset, run_block, run_count,
+                                run_generation);
+
+    return size;
+}
+
+safeio_ssize_t
+logical_write(char *io_ptr, safeio_size_t size, off_t_64 offset, char dsync)
+{
+    off_t_64 block;
+    off_t_64 end_block;
+    uint64_t generation;
+    safeio_ssize_t writedone;
+
+    if (block_cache.block_count == 0)
+        return backend_write(io_ptr, size, offset, dsync);
+
+    block_cache_lock_acquire();
+    generation = ++block_cache.generation;
+    block_cache_lock_release();
+
+    writedone = backend_write(io_ptr, size, offset, dsync);
+
+    block = offset >> BLOCK_CACHE_BLOCK_SHIFT;
+    end_block = (offset + size + BLOCK_CACHE_BLOCK_SIZE - 1) >>
+                BLOCK_CACHE_BLOCK_SHIFT;
+
+    block_cache_lock_acquire();
+
+    // Blocks in cache are updated where they were written completely and
+    // nothing else changed image meanwhile, and dropped otherwise
+    for (; block < end_block; block++)
+    {
+        PBLOCK_CACHE_ENTRY entry = block_cache_find(block);
+        off_t_64 block_offset = block << BLOCK_CACHE_BLOCK_SHIFT;
+
+        if (entry == NULL || entry->data == NULL)
+            continue;
+
+        if (writedone == (safeio_ssize_t)size &&
+            block_cache.generation == generation &&
+            block_offset >= offset &&
+            block_offset + BLOCK_CACHE_BLOCK_SIZE <= offset + size)
+            memcpy(entry->data, io_ptr + (block_offset - offset),
+                   BLOCK_CACHE_BLOCK_SIZE);
+        else
+            block_cache_remove(entry);
+    }
+
+    block_cache.generation++;
+
+    block_cache_lock_release();
+
+    return writedone;
+}
+
+// Prints block cache hit rate.
+void block_cache_print_stats()
+{
+    if (block_cache.hits + block_cache.misses == 0)
+        return;
+
+    printf("Block cache: " ULL_FMT " blocks read from cache, " ULL_FMT
+           " from image, %.0f%% hit rate.\n",
+           block_cache.hits, block_cache.misses,
+           block_cache.hits * 100.0 / (block_cache.hits + block_cache.misses));
+}
+
+#ifdef __linux__
+
+// Returns discard granularity of block device that image file is, or zero
+// if it does not support discard. Attributes of partitions are in queue
+// directory of their parent device.
+off_t_64 blkdev_discard_granularity(dev_t rdev)
+{
+    static const char *dirs[] = { "queue", "../queue" };
+    unsigned long long max_bytes = 0;
+    unsigned long long granularity = 0;
+    char path[96];
+    FILE *file;
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        snprintf(path, sizeof path, "/sys/dev/block/%u:%u/%s/discard_max_bytes",
+                 major(rdev), minor(rdev), dirs[i]);
+
+        file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+
+        if (fscanf(file, "%llu", &max_bytes) != 1)
+            max_bytes = 0;
+
+        fclose(file);
+
+        snprintf(path, sizeof path, "/sys/dev/block/%u:%u/%s/discard_granularity",
+                 major(rdev), minor(rdev), dirs[i]);
+
+        file = fopen(path, "r");
+        if (file != NULL)
+        {
+            if (fscanf(file, "%llu", &granularity) != 1)
+                granularity = 0;
+
+            fclose(file);
+        }
+
+        break;
+    }
+
+    if (max_bytes == 0)
+        return 0;
+
+    // BLKDISCARD needs at least whole logical blocks
+    if (granularity < 512)
+        granularity = 512;
+
+    return (off_t_64)granularity;
+}
+
+#endif
+
+// Deallocates a range in image file by punching a hole in regular files or
+// discarding it on block devices. Unmap is advisory, so file systems that
+// cannot punch holes, devices that cannot discard and parts of range that
+// are smaller than discard granularity are not an error. Returns -1 with
+// errno set on failure.
+int
+physical_unmap(off_t_64 offset, off_t_64 length)
+{
+#ifdef __linux__
+    if (image_blkdev)
+    {
+        off_t_64 granularity = image_discard_granularity;
+        off_t_64 end = (offset + length) / granularity * granularity;
+        uint64_t range[2];
+
+        if (granularity == 0)
+            return 0;
+
+        offset = (offset + granularity - 1) / granularity * granularity;
+        if (end <= offset)
+            return 0;
+
+        range[0] = (uint64_t)offset;
+        range[1] = (uint64_t)(end - offset);
+
+        if (ioctl(image_fd, BLKDISCARD, range) == -1 &&
+            errno != EOPNOTSUPP && errno != EINVAL)
+            return -1;
+
+        return 0;
+    }
+
+    extent_map_lock_acquire();
+
+    if (fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, length) == -1)
+    {
+        extent_map_lock_release();
+
+        if (errno == EOPNOTSUPP)
+            return 0;
+
+        return -1;
+    }
+
+    extent_map_set_locked(offset, length, 0);
+
+    extent_map_lock_release();
+
+    return 0;
+#else
+    errno = ENODEV;
+    return -1;
+#endif
+}
+
+// Deallocates blocks of a dynamic VHD image that are completely within a
+// range. BAT entry is cleared before space of block is released, so that
+// the block reads as zeroes from then on. Partially covered blocks are left
+// as they are.
+int
+vhd_unmap(off_t_64 offset, off_t_64 length)
+{
+    off_t_64 block_number = (offset + block_size - 1) >> block_shift;
+    off_t_64 end_block = (offset + length) >> block_shift;
+
+    // Blocks of differencing images are kept, or parent data would show
+    // through in their place
+    if (vhd_chain.count > 0)
+        return 0;
+
+    // Last block may be cut short by end of virtual disk
+    if (offset + length >= current_size)
+        end_block = (current_size + block_size - 1) >> block_shift;
+
+    if (end_block > vhd_bat_entries)
+        end_block = vhd_bat_entries;
+
+    for (; block_number < end_block; block_number++)
+    {
+        off_t_64 data_offset = table_offset + (block_number << 2);
+        uint32_t block_offset = vhd_bat[block_number];
+        uint32_t bat_entry = 0xFFFFFFFF;
+
+        if (block_offset == 0xFFFFFFFF)
+            continue;
+
+        dbglog((LOG_ERR, "vhd_unmap: Removing block " SLL_FMT " from vhd file.\n",
+                (off_t_64)block_number));
+
+        if (vhd_write_metadata(&bat_entry, sizeof(bat_entry), data_offset) == -1)
+        {
+            syslog(LOG_ERR, "vhd_unmap: Error updating BAT: %m\n");
+            return -1;
+        }
+
+        vhd_bat[block_number] = 0xFFFFFFFF;
+        vhd_bitmap_drop((uint32_t)block_number);
+
+        // Bitmap and data of the block are no longer referenced, failing to
+        // release their space only leaves it unused
+        physical_unmap(((off_t_64)block_offset) << sector_shift,
+                       (off_t_64)sector_size + block_size);
+    }
+
+    return 0;
+}
+
+// Fills a range in image file with zeroes, using FALLOC_FL_ZERO_RANGE on
+// regular files and BLKZEROOUT on block devices. Zeroes are written the
+// usual way where the file system cannot zero ranges. Returns -1 with errno
+// set on failure.
+int
+physical_zero(off_t_64 offset, off_t_64 length)
+{
+    char *zero_buf;
+    safeio_size_t buf_size;
+
+#ifdef __linux__
+    if (image_blkdev)
+    {
+        uint64_t range[2];
+
+        range[0] = (uint64_t)offset;
+        range[1] = (uint64_t)length;
+
+        return ioctl(image_fd, BLKZEROOUT, range);
+    }
+
+    if (!dll_mode)
+    {
+        int result;
+
+        extent_map_lock_acquire();
+
+        result = fallocate(image_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                           offset, length);
+
+        if (result == 0)
+            extent_map_set_locked(offset, length, 0);
+
+        extent_map_lock_release();
+
+        if (result == 0)
+            return 0;
+
+        if (errno != EOPNOTSUPP)
+            return -1;
+    }
+#endif
+
+    buf_size = length < (1 << 20) ? (safeio_size_t)length : (1 << 20);
+
+    // Transfer buffer is aligned for direct I/O
+    zero_buf = (char *)buf_alloc(buf_size);
+    if (zero_buf == NULL)
+        return -1;
+
+    memset(zero_buf, 0, buf_size);
+
+    while (length > 0)
+    {
+        safeio_size_t size = buf_size;
+
+        // Chunks of long ranges end at multiples of buffer size, so that
+        // only first and last ones may need bouncing for direct I/O
+        if (length > buf_size)
+            size -= (safeio_size_t)(offset % buf_size);
+
+        if (length < size)
+            size = (safeio_size_t)length;
+
+        if (physical_write(zero_buf, size, offset) != (safeio_ssize_t)size)
+        {
+            if (errno == 0)
+                errno = E2BIG;
+
+            buf_free(zero_buf, buf_size);
+            return -1;
+        }
+
+        offset += size;
+        length -= size;
+    }
+
+    buf_free(zero_buf, buf_size);
+    return 0;
+}
+
+// Zeroes a range in a differencing VHD image. Clearing bits in sector
+// bitmaps would let parent data show through, so zeroes are written to all
+// blocks where any layer has data, allocating them where needed.
+int
+vhd_zero_chain(off_t_64 offset, off_t_64 length)
+{
+    char *zero_buf = NULL;
+    int result = 0;
+
+    while (length > 0)
+    {
+        uint32_t block = (uint32_t)(offset >> block_shift);
+        safeio_size_t size =
+            block_size - ((safeio_size_t)offset & (block_size - 1));
+        int owner;
+
+        if (size > length)
+            size = (safeio_size_t)length;
+
+        owner = vhd_chain_owner(block);
+        if (owner == -1)
+        {
+            result = -1;
+            break;
+        }
+
+        if (owner != VHD_OWNER_NONE)
+        {
+            if (zero_buf == NULL)
+            {
+                zero_buf = (char *)calloc(1, block_size);
+                if (zero_buf == NULL)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+
+            if (vhd_write(zero_buf, size, offset) != (safeio_ssize_t)size)
+            {
+                syslog(LOG_ERR, "vhd_zero: Error writing zeroes: %m\n");
+
+                if (errno == 0)
+                    errno = E2BIG;
+
+                result = -1;
+                break;
+            }
+        }
+
+        offset += size;
+        length -= size;
+    }
+
+    free(zero_buf);
+    return result;
+}
+
+// Zeroes a range in a dynamic VHD image without allocating any new blocks.
+// In blocks already allocated, data is zeroed and bits for sectors that are
+// completely within the range are cleared in sector bitmap.
+int
+vhd_zero(off_t_64 offset, off_t_64 length)
+{
+    if (offset + length > current_size)
+        length = current_size - offset;
+
+    if (vhd_chain.count > 0)
+        return vhd_zero_chain(offset, length);
+
+    while (length > 0)
+    {
+        off_t_64 block_number = offset >> block_shift;
+        safeio_size_t in_block_offset = (safeio_size_t)offset & (block_size - 1);
+        safeio_size_t size = block_size - in_block_offset;
+        safeio_size_t first_sector;
+        safeio_size_t end_sector;
+        off_t_64 block_start;
+        PVHD_BITMAP bitmap;
+
+        if (size > length)
+            size = (safeio_size_t)length;
+
+        offset += size;
+        length -= size;
+
+        if (block_number >= vhd_bat_entries ||
+            vhd_bat[block_number] == 0xFFFFFFFF)
+            continue;
+
+        block_start = ((off_t_64)vhd_bat[block_number]) << sector_shift;
+
+        if (physical_zero(block_start + sector_size + in_block_offset,
+                          size) == -1)
+        {
+            syslog(LOG_ERR, "vhd_zero: Error zeroing block data: %m\n");
+
+            return -1;
+        }
+
+        first_sector = (in_block_offset + sector_size - 1) >> sector_shift;
+        end_sector = (in_block_offset + size) >> sector_shift;
+
+        if (end_sector <= first_sector)
+            continue;
+
+        bitmap = vhd_bitmap_get((uint32_t)block_number, 1);
+        if (bitmap == NULL)
+            return -1;
+
+        if (vhd_bitmap_update(bitmap, first_sector, end_sector, 0))
+            vhd_bitmap_dirty(bitmap);
+    }
+
+    return 0;
+}
+
+// Releases a payload block of a VHDX image. BAT entry is changed to the
+// zero state before space of block is released, so that the block reads as
+// zeroes from then on.
+int
+vhdx_free_block(off_t_64 block_number)
+{
+    off_t_64 block_offset =
+        (off_t_64)(vhdx.bat[block_number] & VHDX_BLOCK_OFFSET_MASK);
+
+    if (vhdx_write_bat_entry(block_number, VHDX_BLOCK_ZERO) == -1)
+        return -1;
+
+    physical_unmap(block_offset, block_size);
+
+    return 0;
+}
+
+// Deallocates blocks of a VHDX image that are completely within a range,
+// unless the image is a fixed one where blocks are to stay allocated.
+int
+vhdx_unmap(off_t_64 offset, off_t_64 length)
+{
+    off_t_64 block_number = (offset + block_size - 1) >> block_shift;
+    off_t_64 end_block = (offset + length) >> block_shift;
+
+    if (vhdx.leave_allocated)
+        return 0;
+
+    // Last block may be cut short by end of virtual disk
+    if (offset + length >= current_size)
+        end_block = (current_size + block_size - 1) >> block_shift;
+
+    if (end_block > vhdx.bat_entries)
+        end_block = vhdx.bat_entries;
+
+    for (; block_number < end_block; block_number++)
+        if ((vhdx.bat[block_number] & VHDX_BLOCK_STATE_MASK) ==
+                VHDX_BLOCK_FULLY_PRESENT &&
+            vhdx_free_block(block_number) == -1)
+            return -1;
+
+    return 0;
+}
+
+// Zeroes a range in a VHDX image without allocating any new blocks. Blocks
+// completely within the range are deallocated where allowed, and data is
+// zeroed in place in other allocated blocks.
+int
+vhdx_zero(off_t_64 offset, off_t_64 length)
+{
+    if (offset + length > current_size)
+        length = current_size - offset;
+
+    while (length > 0)
+    {
+        off_t_64 block_number = offset >> block_shift;
+        safeio_size_t in_block_offset = (safeio_size_t)offset & (block_size - 1);
+        safeio_size_t size = block_size - in_block_offset;
+        uint64_t entry;
+
+        if (size > length)
+            size = (safeio_size_t)length;
+
+        offset += size;
+        length -= size;
+
+        if (block_number >= vhdx.bat_entries)
+            continue;
+
+        entry = vhdx.bat[block_number];
+
+        if ((entry & VHDX_BLOCK_STATE_MASK) != VHDX_BLOCK_FULLY_PRESENT)
+            continue;
+
+        if (size == block_size && !vhdx.leave_allocated)
+        {
+            if (vhdx_free_block(block_number) == -1)
+                return -1;
+
+            continue;
+        }
+
+        if (physical_zero((off_t_64)(entry & VHDX_BLOCK_OFFSET_MASK) +
+                              in_block_offset,
+                          size) == -1)
+        {
+            syslog(LOG_ERR, "vhdx_zero: Error zeroing block data: %m\n");
+
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Identifiers of VHDX regions and metadata items, in the byte order they
+// are stored in image file.
+static const uint8_t vhdx_region_bat[16] = {
+    0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42,
+    0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08};
+static const uint8_t vhdx_region_metadata[16] = {
+    0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B,
+    0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E};
+static const uint8_t vhdx_item_file_parameters[16] = {
+    0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D,
+    0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B};
+static const uint8_t vhdx_item_virtual_disk_size[16] = {
+    0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48,
+    0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8};
+static const uint8_t vhdx_item_logical_sector_size[16] = {
+    0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47,
+    0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F};
+static const uint8_t vhdx_item_physical_sector_size[16] = {
+    0xC7, 0x48, 0xA3, 0xCD, 0x5D, 0x44, 0x71, 0x44,
+    0x9C, 0xC9, 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56};
+static const uint8_t vhdx_item_virtual_disk_id[16] = {
+    0xAB, 0x12, 0xCA, 0xBE, 0xE6, 0xB2, 0x23, 0x45,
+    0x93, 0xEF, 0xC3, 0x09, 0xE0, 0x00, 0xC7, 0x46};
+
+// CRC-32C of size bytes at data, continuing from crc, as used for checksums
+// in VHDX files.
+uint32_t vhdx_crc32c(uint32_t crc, const void *data, size_t size)
+{
+    static uint32_t table[256];
+    const uint8_t *ptr = (const uint8_t *)data;
+
+    if (table[1] == 0)
+    {
+        uint32_t i;
+
+        for (i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            int k;
+
+            for (k = 0; k < 8; k++)
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+
+    while (size-- > 0)
+        crc = table[(crc ^ *ptr++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+// Checksum of a VHDX structure of size bytes, where the checksum field at
+// offset 4 counts as zero.
+uint32_t vhdx_checksum(const uint8_t *data, size_t size)
+{
+    static const uint8_t zero[4] = {0};
+    uint32_t crc = vhdx_crc32c(0, data, 4);
+
+    crc = vhdx_crc32c(crc, zero, sizeof(zero));
+
+    return vhdx_crc32c(crc, data + 8, size - 8);
+}
+
+// Fills guid with a new random GUID.
+void vhdx_new_guid(uint8_t *guid)
+{
+    char random = 0;
+    int i;
+
+#ifndef _WIN32
+    int fd = _open("/dev/urandom", O_RDONLY);
+
+    if (fd != -1)
+    {
+        random = read(fd, guid, 16) == 16;
+        _close(fd);
+    }
+#endif
+
+    if (!random)
+    {
+        srand((unsigned int)devio_ticks());
+
+        for (i = 0; i < 16; i++)
+            guid[i] = (uint8_t)rand();
+    }
+
+    // Version 4, variant 1
+    guid[7] = (guid[7] & 0x0F) | 0x40;
+    guid[8] = (guid[8] & 0x3F) | 0x80;
+}
+
+// Makes a changed copy of current VHDX header the current one, by writing
+// it with the next sequence number in place of the other header. Returns
+// zero on failure.
+int
+vhdx_write_header()
+{
+    int slot = 1 - vhdx.header_slot;
+
+    SetLittleEndian64U(vhdx.header + 8, GetLittleEndian64U(vhdx.header + 8) + 1);
+    SetLittleEndian32U(vhdx.header + 4,
+                       vhdx_checksum(vhdx.header, VHDX_HEADER_SIZE));
+
+    if (physical_write(vhdx.header, VHDX_HEADER_SIZE,
+                       (off_t_64)VHDX_HEADER_OFFSET * (slot + 1)) !=
+            VHDX_HEADER_SIZE ||
+        (!dll_mode && file_sync(image_fd) == -1))
+    {
+        syslog(LOG_ERR, "Error writing VHDX header: %m\n");
+        return 0;
+    }
+
+    vhdx.header_slot = slot;
+
+    return 1;
+}
+
+// Checks log entry at pos in log, a buffer that holds the log twice over
+// so that entries that wrap around end of log are contiguous. Returns
+// length of entry, or 0 if there is no valid entry of current log there.
+uint32_t
+vhdx_log_entry(const uint8_t *log, uint32_t log_length, uint32_t pos)
+{
+    const uint8_t *entry = log + pos;
+    uint32_t length = GetLittleEndian32U((uint8_t *)entry + 8);
+    uint64_t sequence = GetLittleEndian64U((uint8_t *)entry + 16);
+    uint32_t count = GetLittleEndian32U((uint8_t *)entry + 24);
+    size_t header_size;
+    uint32_t data_sectors = 0;
+    uint32_t i;
+
+    if (memcmp(entry, "loge", 4) != 0 ||
+        length < VHDX_LOG_SECTOR_SIZE || length % VHDX_LOG_SECTOR_SIZE != 0 ||
+        length > log_length || count > length / 32 ||
+        memcmp(entry + 32, vhdx.header + 48, 16) != 0)
+        return 0;
+
+    header_size = (64 + (size_t)count * 32 + VHDX_LOG_SECTOR_SIZE - 1) &
+                  ~(size_t)(VHDX_LOG_SECTOR_SIZE - 1);
+
+    for (i = 0; i < count; i++)
+    {
+        const uint8_t *descriptor = entry + 64 + i * 32;
+
+        if (memcmp(descriptor, "desc", 4) == 0)
+            data_sectors++;
+        else if (memcmp(descriptor, "zero", 4) != 0)
+            return 0;
+
+        if (GetLittleEndian64U((uint8_t *)descriptor + 24) != sequence)
+            return 0;
+    }
+
+    if (header_size + (size_t)data_sectors * VHDX_LOG_SECTOR_SIZE != length)
+        return 0;
+
+    for (i = 0; i < data_sectors; i++)
+    {
+        const uint8_t *sector = entry + header_size + i * VHDX_LOG_SECTOR_SIZE;
+
+        if (memcmp(sector, "data", 4) != 0 ||
+            GetLittleEndian32U((uint8_t *)sector + 4) != (uint32_t)(sequence >> 32) ||
+            GetLittleEndian32U((uint8_t *)sector + VHDX_LOG_SECTOR_SIZE - 4) !=
+                (uint32_t)sequence)
+            return 0;
+    }
+
+    if (GetLittleEndian32U((uint8_t *)entry + 4) != vhdx_checksum(entry, length))
+        return 0;
+
+    return length;
+}
+
+// Finds active sequence in VHDX log, the valid sequence of entries with the
+// highest sequence number, where the last entry points back to the first
+// one. Returns non-zero if found, with *tail and *head set to positions of
+// first and last entry.
+int
+vhdx_log_search(const uint8_t *log, uint32_t log_length, uint32_t *tail,
+                uint32_t *head)
+{
+    uint64_t head_sequence = 0;
+    int found = 0;
+    uint32_t pos;
+
+    for (pos = 0; pos < log_length; pos += VHDX_LOG_SECTOR_SIZE)
+    {
+        uint64_t sequence = GetLittleEndian64U((uint8_t *)log + pos + 16);
+        uint32_t first = GetLittleEndian32U((uint8_t *)log + pos + 12);
+        uint32_t walk = first;
+        uint32_t walked = 0;
+        uint64_t walk_sequence = 0;
+
+        if (vhdx_log_entry(log, log_length, pos) == 0 ||
+            (found && sequence <= head_sequence) ||
+            first % VHDX_LOG_SECTOR_SIZE != 0 || first >= log_length)
+            continue;
+
+        // Entries from tail up to this one need to follow each other
+        while (walked < log_length)
+        {
+            uint32_t length = vhdx_log_entry(log, log_length, walk);
+            uint64_t walk_next = GetLittleEndian64U((uint8_t *)log + walk + 16);
+
+            if (length == 0 || (walk != first && walk_next != walk_sequence + 1))
+                break;
+
+            walk_sequence = walk_next;
+
+            if (walk == pos)
+            {
+                found = 1;
+                head_sequence = sequence;
+                *tail = first;
+                *head = pos;
+                break;
+            }
+
+            walked += length;
+            walk = (walk + length) % log_length;
+        }
+    }
+
+    return found;
+}
+
+// Replays active sequence in log of a VHDX image, if any, and marks log as
+// empty in header copy in memory, to be written when image is opened for
+// writing. Returns zero on failure.
+int
+vhdx_replay_log(char read_only)
+{
+    uint32_t log_length = GetLittleEndian32U(vhdx.header + 68);
+    off_t_64 log_offset = (off_t_64)GetLittleEndian64U(vhdx.header + 72);
+    uint8_t *log;
+    uint32_t tail;
+    uint32_t head;
+    uint32_t pos;
+    int entries = 0;
+    static const uint8_t no_log[16] = {0};
+
+    if (memcmp(vhdx.header + 48, no_log, sizeof(no_log)) == 0)
+        return 1;
+
+    if (log_length == 0 || log_length % VHDX_ALIGNMENT != 0)
+    {
+        syslog(LOG_ERR, "Invalid VHDX log size.\n");
+        return 0;
+    }
+
+    log = (uint8_t *)malloc((size_t)log_length * 2);
+    if (log == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    if (physical_read(log, log_length, log_offset) != (safeio_ssize_t)log_length)
+    {
+        syslog(LOG_ERR, "Error reading VHDX log: %m\n");
+        free(log);
+        return 0;
+    }
+
+    memcpy(log + log_length, log, log_length);
+
+    if (!vhdx_log_search(log, log_length, &tail, &head))
+    {
+        free(log);
+        memset(vhdx.header + 48, 0, 16);
+        return 1;
+    }
+
+    if (read_only)
+    {
+        syslog(LOG_ERR, "VHDX log needs to be replayed, open image for "
+                        "writing first.\n");
+        free(log);
+        return 0;
+    }
+
+    for (pos = tail;; pos = (pos + GetLittleEndian32U(log + pos + 8)) % log_length)
+    {
+        const uint8_t *entry = log + pos;
+        uint32_t count = GetLittleEndian32U((uint8_t *)entry + 24);
+        const uint8_t *sector = entry +
+                                ((64 + (size_t)count * 32 + VHDX_LOG_SECTOR_SIZE - 1) &
+                                 ~(size_t)(VHDX_LOG_SECTOR_SIZE - 1));
+        uint32_t i;
+
+        for (i = 0; i < count; i++)
+        {
+            const uint8_t *descriptor = entry + 64 + i * 32;
+            off_t_64 file_offset =
+                (off_t_64)GetLittleEndian64U((uint8_t *)descriptor + 16);
+            int result;
+
+            if (memcmp(descriptor, "zero", 4) == 0)
+            {
+                result = physical_zero(file_offset,
+                                       (off_t_64)GetLittleEndian64U((uint8_t *)descriptor + 8));
+            }
+            else
+            {
+                uint8_t data[VHDX_LOG_SECTOR_SIZE];
+
+                // Leading and trailing bytes of the sector are stored in
+                // descriptor, in place of signature and sequence number
+                memcpy(data, descriptor + 8, 8);
+                memcpy(data + 8, sector + 8, VHDX_LOG_SECTOR_SIZE - 12);
+                memcpy(data + VHDX_LOG_SECTOR_SIZE - 4, descriptor + 4, 4);
+
+                sector += VHDX_LOG_SECTOR_SIZE;
+
+                result = physical_write(data, sizeof(data), file_offset) ==
+                                 sizeof(data) ?
+                             0 :
+                             -1;
+            }
+
+            if (result == -1)
+            {
+                syslog(LOG_ERR, "Error replaying VHDX log: %m\n");
+                free(log);
+                return 0;
+            }
+        }
+
+        entries++;
+
+        if (pos == head)
+            break;
+    }
+
+    // File is at least as large as it was when the last entry was written
+    if (!dll_mode)
+    {
+        off_t_64 last_file_offset =
+            (off_t_64)GetLittleEndian64U(log + head + 56);
+
+        if (_lseeki64(image_fd, 0, SEEK_END) < last_file_offset &&
+            file_truncate(image_fd, last_file_offset) == -1)
+        {
+            syslog(LOG_ERR, "Error extending image file: %m\n");
+            free(log);
+            return 0;
+        }
+    }
+
+    free(log);
+
+    if (!dll_mode && file_sync(image_fd) == -1)
+    {
+        syslog(LOG_ERR, "Error replaying VHDX log: %m\n");
+        return 0;
+    }
+
+    printf("Replayed %i VHDX log entries.\n", entries);
+
+    memset(vhdx.header + 48, 0, 16);
+
+    return 1;
+}
+
+// Reads headers, region table, metadata and BAT of a VHDX image, replaying
+// log first if needed. Unless read_only is set, a header with new file and
+// data write identifiers is written before anything else is changed, as
+// VHDX requires. Returns zero on failure.
+int
+vhdx_open(char read_only)
+{
+    uint8_t *table;
+    uint8_t header[VHDX_HEADER_SIZE];
+    off_t_64 metadata_offset = -1;
+    uint64_t sequence = 0;
+    uint32_t block_flags = 0;
+    uint32_t logical_sector_size = 0;
+    uint64_t virtual_disk_size = 0;
+    uint64_t bat_length = 0;
+    uint32_t total_entries;
+    uint32_t entry;
+    int slot;
+    int i;
+
+    // Current header is the valid one with highest sequence number
+    vhdx.header_slot = -1;
+
+    for (slot = 0; slot < 2; slot++)
+    {
+        if (physical_read(header, VHDX_HEADER_SIZE,
+                          (off_t_64)VHDX_HEADER_OFFSET * (slot + 1)) !=
+                VHDX_HEADER_SIZE ||
+            memcmp(header, "head", 4) != 0 ||
+            GetLittleEndian32U(header + 4) != vhdx_checksum(header, VHDX_HEADER_SIZE) ||
+            (vhdx.header_slot != -1 && GetLittleEndian64U(header + 8) <= sequence))
+            continue;
+
+        memcpy(vhdx.header, header, VHDX_HEADER_SIZE);
+        vhdx.header_slot = slot;
+        sequence = GetLittleEndian64U(header + 8);
+    }
+
+    if (vhdx.header_slot == -1)
+    {
+        syslog(LOG_ERR, "No valid VHDX header found.\n");
+        return 0;
+    }
+
+    table = (uint8_t *)malloc(VHDX_REGION_TABLE_SIZE);
+    if (table == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    for (i = 0; i < 2; i++)
+        if (physical_read(table, VHDX_REGION_TABLE_SIZE,
+                          VHDX_REGION_TABLE_OFFSET + (off_t_64)i * VHDX_REGION_TABLE_SIZE) ==
+                VHDX_REGION_TABLE_SIZE &&
+            memcmp(table, "regi", 4) == 0 &&
+            GetLittleEndian32U(table + 4) == vhdx_checksum(table, VHDX_REGION_TABLE_SIZE))
+            break;
+
+    if (i == 2)
+    {
+        syslog(LOG_ERR, "No valid VHDX region table found.\n");
+        free(table);
+        return 0;
+    }
+
+    for (i = 0; i < (int)GetLittleEndian32U(table + 8) && i < 2047; i++)
+    {
+        uint8_t *region = table + 16 + i * 32;
+
+        if (memcmp(region, vhdx_region_bat, 16) == 0)
+        {
+            vhdx.bat_offset = (off_t_64)GetLittleEndian64U(region + 16);
+            bat_length = GetLittleEndian32U(region + 24);
+        }
+        else if (memcmp(region, vhdx_region_metadata, 16) == 0)
+        {
+            metadata_offset = (off_t_64)GetLittleEndian64U(region + 16);
+        }
+        else if (GetLittleEndian32U(region + 28) & 1)
+        {
+            syslog(LOG_ERR, "Unknown required region in VHDX image.\n");
+            free(table);
+            return 0;
+        }
+    }
+
+    if (bat_length == 0 || metadata_offset == -1 ||
+        physical_read(table, VHDX_METADATA_TABLE_SIZE, metadata_offset) !=
+            VHDX_METADATA_TABLE_SIZE ||
+        memcmp(table, "metadata", 8) != 0)
+    {
+        syslog(LOG_ERR, "VHDX metadata not found.\n");
+        free(table);
+        return 0;
+    }
+
+    for (i = 0; i < (table[10] | (table[11] << 8)) && i < 2047; i++)
+    {
+        uint8_t *item = table + 32 + i * 32;
+        off_t_64 item_offset = metadata_offset + GetLittleEndian32U(item + 16);
+        void *value = NULL;
+        safeio_size_t value_size = 0;
+
+        if (memcmp(item, vhdx_item_file_parameters, 16) == 0)
+        {
+            uint8_t file_parameters[8];
+
+            if (physical_read(file_parameters, sizeof(file_parameters),
+                              item_offset) == sizeof(file_parameters))
+            {
+                block_size = GetLittleEndian32U(file_parameters);
+                block_flags = GetLittleEndian32U(file_parameters + 4);
+                continue;
+            }
+
+            block_size = 0;
+            continue;
+        }
+        else if (memcmp(item, vhdx_item_virtual_disk_size, 16) == 0)
+        {
+            value = &virtual_disk_size;
+            value_size = sizeof(virtual_disk_size);
+        }
+        else if (memcmp(item, vhdx_item_logical_sector_size, 16) == 0)
+        {
+            value = &logical_sector_size;
+            value_size = sizeof(logical_sector_size);
+        }
+        else if (memcmp(item, vhdx_item_physical_sector_size, 16) != 0 &&
+                 memcmp(item, vhdx_item_virtual_disk_id, 16) != 0 &&
+                 (GetLittleEndian32U(item + 24) & 4))
+        {
+            syslog(LOG_ERR, "Unknown required metadata item in VHDX image.\n");
+            free(table);
+            return 0;
+        }
+
+        if (value != NULL &&
+            physical_read(value, value_size, item_offset) != (safeio_ssize_t)value_size)
+            memset(value, 0, value_size);
+    }
+
+    free(table);
+
+    virtual_disk_size = GetLittleEndian64U((uint8_t *)&virtual_disk_size);
+    logical_sector_size = GetLittleEndian32U((uint8_t *)&logical_sector_size);
+
+    if (block_flags & 2)
+    {
+        syslog(LOG_ERR, "Differencing VHDX images are not supported.\n");
+        return 0;
+    }
+
+    for (block_shift = 20;
+         block_shift <= 28 && (((safeio_size_t)1) << block_shift) != block_size;
+         block_shift++)
+        ;
+
+    if (block_shift > 28 || virtual_disk_size == 0 ||
+        (logical_sector_size != 512 && logical_sector_size != 4096))
+    {
+        syslog(LOG_ERR, "Unsupported VHDX block size, sector size or disk "
+                        "size.\n");
+        return 0;
+    }
+
+    // A sector bitmap block entry follows each chunk of payload block
+    // entries in BAT
+    vhdx.chunk_ratio = (uint32_t)((((uint64_t)1 << 23) * logical_sector_size) >>
+                                  block_shift);
+    vhdx.bat_entries = (uint32_t)((virtual_disk_size + block_size - 1) >>
+                                  block_shift);
+    vhdx.leave_allocated = (char)(block_flags & 1);
+    total_entries = vhdx.bat_entries + (vhdx.bat_entries - 1) / vhdx.chunk_ratio;
+
+    if ((uint64_t)total_entries << 3 > bat_length)
+    {
+        syslog(LOG_ERR, "VHDX block table too small for disk size.\n");
+        return 0;
+    }
+
+    if (!vhdx_replay_log(read_only))
+        return 0;
+
+    vhdx.bat = (uint64_t *)malloc((size_t)total_entries << 3);
+    if (vhdx.bat == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    if (physical_read(vhdx.bat, total_entries << 3, vhdx.bat_offset) !=
+        (safeio_ssize_t)(total_entries << 3))
+    {
+        syslog(LOG_ERR, "Error reading VHDX block table: %m\n");
+        free(vhdx.bat);
+        vhdx.bat = NULL;
+        return 0;
+    }
+
+    // Payload block entries are moved together, in host byte order
+    for (entry = 0; entry < vhdx.bat_entries; entry++)
+        vhdx.bat[entry] =
+            GetLittleEndian64U((uint8_t *)(vhdx.bat + entry + entry / vhdx.chunk_ratio));
+
+    if (!read_only)
+    {
+        vhdx_new_guid(vhdx.header + 16);
+        vhdx_new_guid(vhdx.header + 32);
+
+        if (!vhdx_write_header())
+        {
+            free(vhdx.bat);
+            vhdx.bat = NULL;
+            return 0;
+        }
+    }
+
+    current_size = (off_t_64)virtual_disk_size;
+    sector_size = logical_sector_size;
+
+    return 1;
+}
+
+// Drops a cluster from L2 table of a QCOW2 image, and releases it. Where
+// there is a backing file, it becomes a zero cluster so that backing file
+// data does not show through in its place.
+int
+qcow2_drop_cluster(uint64_t cluster)
+{
+    uint64_t entry;
+    int kind;
+
+    if (qcow2_l2_entry(0, cluster, &entry) == -1)
+        return -1;
+
+    kind = qcow2_entry_kind(entry);
+
+    if (kind == QCOW2_CLUSTER_ZERO ||
+        (kind == QCOW2_CLUSTER_UNALLOCATED && qcow2.count == 1))
+        return 0;
+
+    if (qcow2_set_entry(cluster, qcow2.count > 1 ? QCOW2_OFLAG_ZERO : 0,
+                        NULL, 0, 0) == -1)
+        return -1;
+
+    qcow2_free_cluster(entry);
+
+    return 0;
+}
+
+// Drops clusters of a QCOW2 image that are completely within a range.
+// Partially covered clusters are left as they are.
+int
+qcow2_unmap(off_t_64 offset, off_t_64 length)
+{
+    uint64_t cluster = (uint64_t)(offset + block_size - 1) >> block_shift;
+    uint64_t end_cluster = (uint64_t)(offset + length) >> block_shift;
+
+    // Version 2 images have no zero clusters to hide backing file data
+    if (qcow2.count > 1 && qcow2.version < 3)
+        return 0;
+
+    // Last cluster may be cut short by end of virtual disk
+    if (offset + length >= current_size)
+        end_cluster = (uint64_t)(current_size + block_size - 1) >> block_shift;
+
+    for (; cluster < end_cluster; cluster++)
+        if (qcow2_drop_cluster(cluster) == -1)
+            return -1;
+
+    return 0;
+}
+
+// Zeroes a range in a QCOW2 image. Clusters completely within the range are
+// dropped where they can be, data is zeroed in place in other clusters that
+// are written in place, and zeroes are written the usual way to the rest of
+// clusters that do not read as zeroes already.
+int
+qcow2_zero(off_t_64 offset, off_t_64 length)
+{
+    char *zero_buf = NULL;
+    int result = 0;
+
+    if (offset + length > current_size)
+        length = current_size - offset;
+
+    while (length > 0)
+    {
+        uint64_t cluster = (uint64_t)offset >> block_shift;
+        safeio_size_t in_cluster_offset = (safeio_size_t)offset & (block_size - 1);
+        safeio_size_t size = block_size - in_cluster_offset;
+        uint64_t entry;
+        int kind;
+
+        if (size > length)
+            size = (safeio_size_t)length;
+
+        if (qcow2_l2_entry(0, cluster, &entry) == -1)
+        {
+            result = -1;
+            break;
+        }
+
+        kind = qcow2_entry_kind(entry);
+
+        if (in_cluster_offset == 0 &&
+            (size == block_size || offset + size == current_size) &&
+            (qcow2.count == 1 || qcow2.version >= 3))
+        {
+            if (qcow2_drop_cluster(cluster) == -1)
+            {
+                result = -1;
+                break;
+            }
+        }
+        else if (kind == QCOW2_CLUSTER_DATA && (entry & QCOW2_OFLAG_COPIED))
+        {
+            if (physical_zero((off_t_64)(entry & QCOW2_OFFSET_MASK) +
+                                  in_cluster_offset,
+                              size) == -1)
+            {
+                syslog(LOG_ERR, "qcow2_zero: Error zeroing cluster data: %m\n");
+
+                result = -1;
+                break;
+            }
+        }
+        else if (kind != QCOW2_CLUSTER_ZERO &&
+                 (kind != QCOW2_CLUSTER_UNALLOCATED || qcow2.count > 1))
+        {
+            if (zero_buf == NULL)
+            {
+                zero_buf = (char *)calloc(1, block_size);
+                if (zero_buf == NULL)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+
+            if (qcow2_write(zero_buf, size, offset) != (safeio_ssize_t)size)
+            {
+                syslog(LOG_ERR, "qcow2_zero: Error writing zeroes: %m\n");
+
+                if (errno == 0)
+                    errno = E2BIG;
+
+                result = -1;
+                break;
+            }
+        }
+
+        offset += size;
+        length -= size;
+    }
+
+    free(zero_buf);
+    return result;
+}
+
+// Reads header and L1 table of an image in a QCOW2 chain, with file
+// descriptor and path set already. Version 2 headers are extended to
+// QCOW2_HEADER_SIZE bytes the way version 3 ones are. Name of backing file,
+// if any, is returned in *backing as a string to free, and *backing_raw is
+// set to 1 for raw backing files, 0 for QCOW2 ones, or -1 where header does
+// not say. Returns zero on failure.
+int
+qcow2_open_layer(int layer, uint8_t *header, char **backing,
+                 char *backing_raw)
+{
+    PQCOW2_LAYER image = &qcow2.layers[layer];
+    uint64_t incompatible = 0;
+    uint32_t header_length = 72;
+    uint32_t backing_length;
+    off_t_64 backing_offset;
+    uint64_t clusters;
+    uint32_t entry;
+
+    *backing = NULL;
+    *backing_raw = -1;
+
+    memset(header, 0, QCOW2_HEADER_SIZE);
+
+    if (qcow2_layer_read(layer, header, QCOW2_HEADER_SIZE, 0) < 72 ||
+        GetBigEndian32U(header) != QCOW2_MAGIC)
+    {
+        syslog(LOG_ERR, "'%s' is not a QCOW2 image.\n", image->path);
+        return 0;
+    }
+
+    switch (GetBigEndian32U(header + 4))
+    {
+    case 2:
+        memset(header + 72, 0, QCOW2_HEADER_SIZE - 72);
+        SetBigEndian32U(header + 96, 4);
+        SetBigEndian32U(header + 100, 72);
+        break;
+
+    case 3:
+        incompatible = GetBigEndian64U(header + 72);
+        header_length = GetBigEndian32U(header + 100);
+        break;
+
+    default:
+        syslog(LOG_ERR, "Unsupported QCOW2 version in '%s'.\n", image->path);
+        return 0;
+    }
+
+    image->cluster_bits = (int)GetBigEndian32U(header + 20);
+    image->size = (off_t_64)GetBigEndian64U(header + 24);
+    image->l1_size = GetBigEndian32U(header + 36);
+    image->l1_offset = (off_t_64)GetBigEndian64U(header + 40);
+
+    if (image->cluster_bits < 9 || image->cluster_bits > 21 ||
+        GetBigEndian32U(header + 32) != 0 ||
+        GetBigEndian32U(header + 96) > 6 || header_length < 72 ||
+        (incompatible & ~(uint64_t)(QCOW2_INCOMPAT_DIRTY |
+                                    QCOW2_INCOMPAT_CORRUPT |
+                                    QCOW2_INCOMPAT_COMPRESSION)))
+    {
+        syslog(LOG_ERR, "Unsupported QCOW2 features or encryption in '%s'.\n",
+               image->path);
+        return 0;
+    }
+
+    // Each L1 table entry covers a cluster of L2 table entries
+    clusters = ((uint64_t)image->size + (1 << image->cluster_bits) - 1) >>
+               image->cluster_bits;
+
+    if (image->l1_size < (clusters + (1 << (image->cluster_bits - 3)) - 1) >>
+                             (image->cluster_bits - 3) ||
+        image->l1_size > 0x7FFFFFFF >> 3)
+    {
+        syslog(LOG_ERR, "QCOW2 L1 table of '%s' does not match disk size.\n",
+               image->path);
+        return 0;
+    }
+
+    image->l1 = (uint64_t *)malloc(((size_t)image->l1_size << 3) + 1);
+    if (image->l1 == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    if (qcow2_layer_read(layer, image->l1, image->l1_size << 3,
+                         image->l1_offset) != (safeio_ssize_t)(image->l1_size << 3))
+    {
+        syslog(LOG_ERR, "Error reading QCOW2 L1 table of '%s': %m\n", image->path);
+        return 0;
+    }
+
+    for (entry = 0; entry < image->l1_size; entry++)
+        image->l1[entry] = GetBigEndian64U((uint8_t *)(image->l1 + entry));
+
+    backing_offset = (off_t_64)GetBigEndian64U(header + 8);
+    backing_length = GetBigEndian32U(header + 16);
+
+    if (backing_offset == 0 || backing_length == 0)
+        return 1;
+
+    if (backing_length > 1023)
+    {
+        syslog(LOG_ERR, "Invalid backing file name in '%s'.\n", image->path);
+        return 0;
+    }
+
+    *backing = (char *)calloc(1, backing_length + 1);
+    if (*backing == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    if (qcow2_layer_read(layer, *backing, backing_length, backing_offset) !=
+        (safeio_ssize_t)backing_length)
+    {
+        syslog(LOG_ERR, "Error reading backing file name in '%s': %m\n",
+               image->path);
+        return 0;
+    }
+
+    // Backing file format is found in header extensions that follow header
+    // in first cluster
+    while (header_length + 8 <= ((uint32_t)1 << image->cluster_bits))
+    {
+        uint8_t extension[16];
+        uint32_t extension_length;
+
+        if (qcow2_layer_read(layer, extension, sizeof(extension), header_length) !=
+                sizeof(extension) ||
+            GetBigEndian32U(extension) == 0)
+            break;
+
+        extension_length = GetBigEndian32U(extension + 4);
+
+        if (GetBigEndian32U(extension) == 0xE2792ACA)
+        {
+            if (extension_length == 3 && memcmp(extension + 8, "raw", 3) == 0)
+                *backing_raw = 1;
+            else if (extension_length == 5 && memcmp(extension + 8, "qcow2", 5) == 0)
+                *backing_raw = 0;
+            else
+            {
+                syslog(LOG_ERR, "Unsupported backing file format in '%s'.\n",
+                       image->path);
+                return 0;
+            }
+        }
+
+        header_length += 8 + ((extension_length + 7) & ~7);
+    }
+
+    return 1;
+}
+
+// Opens a QCOW2 image along with its backing files, and sets up table
+// cache. Unless read_only is set, refcount table is loaded, and new clusters
+// are placed after the last one in use. Returns zero on failure.
+int
+qcow2_open(const char *image_path, char read_only)
+{
+    uint8_t header[QCOW2_HEADER_SIZE];
+    int max_cluster_bits;
+    char *backing;
+    char backing_raw;
+    uint32_t refcount_table_clusters;
+    int i;
+
+    qcow2.layers[0].fd = image_fd;
+    qcow2.layers[0].path = (char *)image_path;
+    qcow2.count = 1;
+
+    if (!qcow2_open_layer(0, header, &backing, &backing_raw))
+        return 0;
+
+    qcow2.version = (int)GetBigEndian32U(header + 4);
+    qcow2.refcount_order = (int)GetBigEndian32U(header + 96);
+    qcow2.refcount_table_offset = (off_t_64)GetBigEndian64U(header + 48);
+    refcount_table_clusters = GetBigEndian32U(header + 56);
+
+    block_shift = (int16_t)qcow2.layers[0].cluster_bits;
+    block_size = ((safeio_size_t)1) << block_shift;
+    current_size = qcow2.layers[0].size;
+
+    if (!read_only)
+    {
+        if (GetBigEndian32U(header + 60) != 0)
+        {
+            syslog(LOG_ERR, "QCOW2 images with internal snapshots can only be "
+                            "opened read-only.\n");
+            return 0;
+        }
+
+        if (GetBigEndian64U(header + 72) &
+            (QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT))
+        {
+            syslog(LOG_ERR, "QCOW2 image needs to be checked and repaired "
+                            "before it can be opened for writing.\n");
+            return 0;
+        }
+
+        // Programs that change an image clear features they do not know
+        if (GetBigEndian64U(header + 88) != 0)
+        {
+            uint8_t autoclear[sizeof(uint64_t)] = {0};
+
+            if (physical_write(autoclear, sizeof(autoclear), 88) !=
+                sizeof(autoclear))
+            {
+                syslog(LOG_ERR, "Error writing QCOW2 header: %m\n");
+                return 0;
+            }
+        }
+    }
+
+    if (backing != NULL && dll_mode)
+    {
+        syslog(LOG_ERR, "QCOW2 images with backing files cannot be opened "
+                        "through a DLL.\n");
+        return 0;
+    }
+
+    while (backing != NULL)
+    {
+        PQCOW2_LAYER image = &qcow2.layers[qcow2.count];
+
+        if (qcow2.count > QCOW2_MAX_BACKING)
+        {
+            syslog(LOG_ERR, "More than %i backing files of '%s'.\n",
+                   QCOW2_MAX_BACKING, image_path);
+            return 0;
+        }
+
+        image->path = image_relative_path(qcow2.layers[qcow2.count - 1].path,
+                                          backing);
+        free(backing);
+
+        if (image->path == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        image->fd = _open(image->path, O_BINARY | O_DIRECT | O_RDONLY);
+        if (image->fd == -1)
+        {
+            syslog(LOG_ERR, "Error opening backing file '%s': %m\n", image->path);
+            return 0;
+        }
+
+        qcow2.count++;
+
+        if (backing_raw == -1)
+        {
+            uint8_t magic[4];
+
+            backing_raw = pread(image->fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+                          GetBigEndian32U(magic) != QCOW2_MAGIC;
+        }
+
+        if (backing_raw)
+        {
+            image->size = _lseeki64(image->fd, 0, SEEK_END);
+            if (image->size == -1)
+            {
+                syslog(LOG_ERR, "Error reading backing file '%s': %m\n", image->path);
+                return 0;
+            }
+
+            printf("Backing file: '%s', raw.\n", image->path);
+            break;
+        }
+
+        if (!qcow2_open_layer(qcow2.count - 1, header, &backing, &backing_raw))
+            return 0;
+
+        printf("Backing file: '%s'.\n", image->path);
+    }
+
+    // Cache is shared by all images in chain, tables as large as the
+    // largest clusters
+    max_cluster_bits = 0;
+    for (i = 0; i < qcow2.count; i++)
+        if (qcow2.layers[i].cluster_bits > max_cluster_bits)
+            max_cluster_bits = qcow2.layers[i].cluster_bits;
+
+    qcow2.table_count = QCOW2_CACHE_SIZE >> max_cluster_bits;
+    if (qcow2.table_count < QCOW2_CACHE_MIN_TABLES)
+        qcow2.table_count = QCOW2_CACHE_MIN_TABLES;
+    if (qcow2.table_count > QCOW2_CACHE_MAX_TABLES)
+        qcow2.table_count = QCOW2_CACHE_MAX_TABLES;
+
+    qcow2.tables = (PQCOW2_TABLE)calloc(qcow2.table_count, sizeof(QCOW2_TABLE));
+    qcow2.cluster_buf = (uint8_t *)malloc(block_size);
+    if (qcow2.tables == NULL || qcow2.cluster_buf == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    for (i = 0; i < qcow2.table_count; i++)
+    {
+        qcow2.tables[i].layer = -1;
+        qcow2.tables[i].data = (uint8_t *)malloc((size_t)1 << max_cluster_bits);
+        if (qcow2.tables[i].data == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+    }
+
+    if (read_only)
+        return 1;
+
+    qcow2.refcount_table_size = refcount_table_clusters << (block_shift - 3);
+    qcow2.refcount_table =
+        (uint64_t *)malloc(((size_t)qcow2.refcount_table_size << 3) + 1);
+    if (qcow2.refcount_table_size > 0x7FFFFFFF >> 3 ||
+        qcow2.refcount_table == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    if (physical_read(qcow2.refcount_table, qcow2.refcount_table_size << 3,
+                      qcow2.refcount_table_offset) !=
+        (safeio_ssize_t)(qcow2.refcount_table_size << 3))
+    {
+        syslog(LOG_ERR, "Error reading QCOW2 refcount table: %m\n");
+        return 0;
+    }
+
+    for (i = 0; i < (int)qcow2.refcount_table_size; i++)
+        qcow2.refcount_table[i] =
+            GetBigEndian64U((uint8_t *)(qcow2.refcount_table + i));
+
+    // New clusters go after end of file, and after last cluster with a
+    // refcount, in case that is beyond end of file
+    qcow2.next_cluster = _lseeki64(image_fd, 0, SEEK_END);
+    if (qcow2.next_cluster == -1)
+    {
+        syslog(LOG_ERR, "Error finding end of QCOW2 image file: %m\n");
+        return 0;
+    }
+
+    qcow2.next_cluster = (qcow2.next_cluster + block_size - 1) &
+                         ~(off_t_64)(block_size - 1);
+
+    for (i = (int)qcow2.refcount_table_size - 1; i >= 0; i--)
+    {
+        int entries_bits = block_shift + 3 - qcow2.refcount_order;
+        PQCOW2_TABLE block;
+        int64_t index;
+
+        if ((qcow2.refcount_table[i] & QCOW2_OFFSET_MASK) == 0)
+            continue;
+
+        block = qcow2_table_get(0, (off_t_64)(qcow2.refcount_table[i] &
+                                              QCOW2_OFFSET_MASK));
+        if (block == NULL)
+            return 0;
+
+        for (index = (((int64_t)1) << entries_bits) - 1; index >= 0; index--)
+            if (qcow2_refcount_get(block->data, (uint64_t)index) != 0)
+                break;
+
+        if (index < 0)
+            continue;
+
+        if (((((off_t_64)i << entries_bits) + index + 1) << block_shift) >
+            qcow2.next_cluster)
+            qcow2.next_cluster =
+                (((off_t_64)i << entries_bits) + index + 1) << block_shift;
+
+        break;
+    }
+
+    qcow2.reserved_end = qcow2.next_cluster;
+
+    return 1;
+}
+
+// Releases space in a range of a file of a VMDK extent.
+int
+vmdk_extent_punch(PVMDK_EXTENT extent, off_t_64 offset, off_t_64 length)
+{
+    if (extent->fd == image_fd)
+        return physical_unmap(offset, length);
+
+#ifdef __linux__
+    if (fallocate(extent->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, length) == -1 &&
+        errno != EOPNOTSUPP)
+        return -1;
+#endif
+
+    return 0;
+}
+
+// Drops a grain from grain table of a sparse VMDK extent, and releases its
+// space. Grain table entry is changed before space is released. Grains
+// dropped are not used again, as there is no record of free space in VMDK
+// images.
+int
+vmdk_drop_grain(PVMDK_EXTENT extent, uint64_t grain)
+{
+    uint32_t entry;
+
+    if (vmdk_grain_entry(extent, grain, &entry) == -1)
+        return -1;
+
+    if (entry <= VMDK_GRAIN_ZERO)
+        return 0;
+
+    // With no parent images, grains not allocated read as zeroes as well
+    if (vmdk_set_grain_entry(extent, grain,
+                             extent->zero_grains ? VMDK_GRAIN_ZERO : 0) == -1)
+        return -1;
+
+    if (vmdk_extent_punch(extent, ((off_t_64)entry) << 9,
+                          ((off_t_64)1) << extent->grain_shift) == -1)
+        syslog(LOG_ERR, "vmdk_unmap: Error releasing grain space: %m\n");
+
+    return 0;
+}
+
+// Releases space of a range in a VMDK image. Grains completely within the
+// range are dropped from sparse extents, and space is released in place in
+// flat extents. Partially covered grains are left as they are.
+int
+vmdk_unmap(off_t_64 offset, off_t_64 length)
+{
+    if (offset + length > current_size)
+        length = current_size - offset;
+
+    while (length > 0)
+    {
+        PVMDK_EXTENT extent = vmdk_extent_find(offset);
+        off_t_64 extent_offset = offset - extent->start;
+        off_t_64 extent_length = extent->size - extent_offset;
+
+        if (extent_length > length)
+            extent_length = length;
+
+        if (extent->read_only)
+            ;
+        else if (extent->type == VMDK_EXTENT_FLAT)
+        {
+            if (vmdk_extent_punch(extent, extent->file_offset + extent_offset,
+                                  extent_length) == -1)
+                return -1;
+        }
+        else if (extent->type == VMDK_EXTENT_SPARSE)
+        {
+            off_t_64 grain_size = ((off_t_64)1) << extent->grain_shift;
+            uint64_t grain =
+                (uint64_t)(extent_offset + grain_size - 1) >> extent->grain_shift;
+            uint64_t end_grain =
+                (uint64_t)(extent_offset + extent_length) >> extent->grain_shift;
+
+            // Last grain may be cut short by end of extent
+            if (extent_offset + extent_length == extent->size)
+                end_grain =
+                    (uint64_t)(extent->size + grain_size - 1) >> extent->grain_shift;
+
+            for (; grain < end_grain; grain++)
+                if (vmdk_drop_grain(extent, grain) == -1)
+                    return -1;
+        }
+
+        offset += extent_length;
+        length -= extent_length;
+    }
+
+    return 0;
+}
+
+// Zeroes a range in a VMDK image. Grains of sparse extents completely
+// within the range are dropped, grains not allocated are left as they are,
+// and zeroes are written to the rest, as to flat extents. Zero extents read
+// as zeroes already.
+int
+vmdk_zero(off_t_64 offset, off_t_64 length)
+{
+    safeio_size_t zero_buf_size = 1 << 16;
+    char *zero_buf = NULL;
+    int result = 0;
+
+    if (offset + length > current_size)
+        length = current_size - offset;
+
+    while (length > 0)
+    {
+        PVMDK_EXTENT extent = vmdk_extent_find(offset);
+        off_t_64 extent_offset = offset - extent->start;
+        safeio_size_t size = zero_buf_size;
+
+        if (size > extent->size - extent_offset)
+            size = (safeio_size_t)(extent->size - extent_offset);
+
+        if (size > length)
+            size = (safeio_size_t)length;
+
+        if (extent->type == VMDK_EXTENT_SPARSE)
+        {
+            safeio_size_t grain_size = ((safeio_size_t)1) << extent->grain_shift;
+            safeio_size_t in_grain_offset =
+                (safeio_size_t)extent_offset & (grain_size - 1);
+            uint64_t grain = (uint64_t)extent_offset >> extent->grain_shift;
+            uint32_t entry;
+
+            size = grain_size - in_grain_offset;
+
+            if (size > extent->size - extent_offset)
+                size = (safeio_size_t)(extent->size - extent_offset);
+
+            if (size > length)
+                size = (safeio_size_t)length;
+
+            if (vmdk_grain_entry(extent, grain, &entry) == -1)
+            {
+                result = -1;
+                break;
+            }
+
+            if (entry <= VMDK_GRAIN_ZERO)
+            {
+                offset += size;
+                length -= size;
+                continue;
+            }
+
+            if (!extent->read_only && in_grain_offset == 0 &&
+                (size == grain_size || extent_offset + size == extent->size))
+            {
+                if (vmdk_drop_grain(extent, grain) == -1)
+                {
+                    result = -1;
+                    break;
+                }
+
+                offset += size;
+                length -= size;
+                continue;
+            }
+
+            if (size > zero_buf_size)
+                size = zero_buf_size;
+        }
+        else if (extent->type == VMDK_EXTENT_ZERO)
+        {
+            offset += size;
+            length -= size;
+            continue;
+        }
+
+        if (zero_buf == NULL)
+        {
+            zero_buf = (char *)calloc(1, zero_buf_size);
+            if (zero_buf == NULL)
+            {
+                result = -1;
+                break;
+            }
+        }
+
+        if (vmdk_write(zero_buf, size, offset) != (safeio_ssize_t)size)
+        {
+            syslog(LOG_ERR, "vmdk_zero: Error writing zeroes: %m\n");
+
+            if (errno == 0)
+                errno = E2BIG;
+
+            result = -1;
+            break;
+        }
+
+        offset += size;
+        length -= size;
+    }
+
+    free(zero_buf);
+    return result;
+}
+
+// Checks a VMDK descriptor, and adds extents it lists to vmdk.extents
+// unless embedded, where the only extent is the image file itself. Only
+// images without parent are supported. Returns zero on failure.
+int
+vmdk_parse_descriptor(char *descriptor, const char *image_path,
+                      char read_only, char embedded)
+{
+    char *line;
+    char *next_line;
+
+    for (line = descriptor; line != NULL && *line != 0; line = next_line)
+    {
+        char access[16];
+        char type[16];
+        unsigned long long sectors;
+        int name_start = 0;
+        char *name_end;
+        PVMDK_EXTENT extent;
+
+        next_line = strpbrk(line, "\r\n");
+        if (next_line != NULL)
+            *(next_line++) = 0;
+
+        while (*line == ' ' || *line == '\t')
+            line++;
+
+        if (strncmp(line, "parentCID", 9) == 0)
+        {
+            char *value = strchr(line, '=');
+
+            if (value != NULL &&
+                strtoul(value + 1, NULL, 16) != 0xFFFFFFFFUL)
+            {
+                syslog(LOG_ERR, "Differencing VMDK images are not supported.\n");
+                return 0;
+            }
+
+            continue;
+        }
+
+        if (embedded ||
+            sscanf(line, "%15s %llu %15s %n", access, &sectors, type,
+                   &name_start) < 3 ||
+            (strcmp(access, "RW") != 0 && strcmp(access, "RDONLY") != 0 &&
+             strcmp(access, "NOACCESS") != 0))
+            continue;
+
+        // Zero extents have no file name
+        name_end = NULL;
+        if (name_start != 0 && line[name_start] == '"')
+            name_end = strchr(line + name_start + 1, '"');
+
+        if (name_end == NULL && strcmp(type, "ZERO") != 0)
+        {
+            syslog(LOG_ERR, "Bad extent line in VMDK descriptor: %s\n", line);
+            return 0;
+        }
+
+        if (name_end != NULL)
+            *name_end = 0;
+
+        extent = (PVMDK_EXTENT)realloc(vmdk.extents,
+                                       (vmdk.count + 1) * sizeof(VMDK_EXTENT));
+        if (extent == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        vmdk.extents = extent;
+        extent += vmdk.count;
+        memset(extent, 0, sizeof(*extent));
+        extent->fd = -1;
+        extent->start = vmdk.count > 0 ?
+            extent[-1].start + extent[-1].size : 0;
+        extent->size = (off_t_64)sectors << 9;
+        extent->read_only = read_only || strcmp(access, "RW") != 0;
+        vmdk.count++;
+
+        if (strcmp(access, "NOACCESS") == 0)
+        {
+            syslog(LOG_ERR, "VMDK extents without access are not supported.\n");
+            return 0;
+        }
+
+        if (strcmp(type, "ZERO") == 0)
+        {
+            extent->type = VMDK_EXTENT_ZERO;
+            continue;
+        }
+
+        if (strcmp(type, "FLAT") == 0 || strcmp(type, "VMFS") == 0)
+        {
+            extent->type = VMDK_EXTENT_FLAT;
+            extent->file_offset = (off_t_64)strtoull(name_end + 1, NULL, 10) << 9;
+        }
+        else if (strcmp(type, "SPARSE") == 0)
+            extent->type = VMDK_EXTENT_SPARSE;
+        else
+        {
+            syslog(LOG_ERR, "VMDK extents of type %s are not supported.\n", type);
+            return 0;
+        }
+
+        extent->path = image_relative_path(image_path, line + name_start + 1);
+        if (extent->path == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        extent->fd = _open(extent->path, O_BINARY | O_DIRECT | IMAGE_SYNC_FLAG |
+                                         (extent->read_only ? O_RDONLY : O_RDWR));
+        if (extent->fd == -1)
+        {
+            syslog(LOG_ERR, "Error opening extent file '%s': %m\n", extent->path);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Reads header and grain directories of a sparse VMDK extent, with file
+// descriptor set already, and marks it in use when it is to be written.
+// Returns zero on failure.
+int
+vmdk_open_sparse(PVMDK_EXTENT extent, char embedded)
+{
+    uint8_t header[VMDK_HEADER_SIZE];
+    uint32_t flags;
+    uint64_t capacity;
+    uint64_t grain_sectors;
+    uint64_t desc_offset;
+    uint64_t desc_size;
+    uint64_t grains;
+    int copy;
+
+    if (vmdk_extent_io(extent, 0, header, sizeof(header), 0) != sizeof(header) ||
+        GetLittleEndian32U(header) != VMDK_MAGIC)
+    {
+        syslog(LOG_ERR, "Bad VMDK sparse extent header in '%s'.\n", extent->path);
+        return 0;
+    }
+
+    flags = GetLittleEndian32U(header + 8);
+    capacity = GetLittleEndian64U(header + 12);
+    grain_sectors = GetLittleEndian64U(header + 20);
+    desc_offset = GetLittleEndian64U(header + 28);
+    desc_size = GetLittleEndian64U(header + 36);
+    extent->gt_entries = GetLittleEndian32U(header + 44);
+    extent->rgd_offset = (off_t_64)GetLittleEndian64U(header + 48) << 9;
+    extent->gd_offset = (off_t_64)GetLittleEndian64U(header + 56) << 9;
+
+    if (GetLittleEndian32U(header + 4) > 3)
+    {
+        syslog(LOG_ERR, "VMDK version %u is not supported.\n",
+               (unsigned int)GetLittleEndian32U(header + 4));
+        return 0;
+    }
+
+    // Stream optimized images keep grain directory at end of file, and
+    // compress grains
+    if ((flags & VMDK_FLAG_COMPRESSED) ||
+        (header[77] | header[78]) != 0 ||
+        GetLittleEndian64U(header + 56) == 0xFFFFFFFFFFFFFFFFULL)
+    {
+        syslog(LOG_ERR, "Compressed VMDK images are not supported.\n");
+        return 0;
+    }
+
+    for (extent->grain_shift = 9;
+         extent->grain_shift < 31 &&
+         (((uint64_t)1) << (extent->grain_shift - 9)) != grain_sectors;
+         extent->grain_shift++)
+        ;
+
+    if (extent->grain_shift >= 31 || extent->gt_entries == 0 ||
+        extent->gt_entries > 1 << 20)
+    {
+        syslog(LOG_ERR, "Bad VMDK grain size or grain table size in '%s'.\n",
+               extent->path);
+        return 0;
+    }
+
+    if (embedded)
+        extent->size = (off_t_64)capacity << 9;
+    else if (extent->size > (off_t_64)capacity << 9)
+    {
+        syslog(LOG_ERR, "VMDK extent '%s' is smaller than in descriptor.\n",
+               extent->path);
+        return 0;
+    }
+
+    // Descriptor in image file of monolithic sparse images tells whether it
+    // has a parent
+    if (embedded && desc_offset != 0 && desc_size != 0)
+    {
+        char *descriptor;
+
+        if (desc_size > VMDK_DESCRIPTOR_MAX_SIZE >> 9)
+            desc_size = VMDK_DESCRIPTOR_MAX_SIZE >> 9;
+
+        descriptor = (char *)malloc((size_t)(desc_size << 9) + 1);
+        if (descriptor == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        if (vmdk_extent_io(extent, 0, descriptor, (safeio_size_t)(desc_size << 9),
+                           (off_t_64)desc_offset << 9) !=
+            (safeio_ssize_t)(desc_size << 9))
+        {
+            syslog(LOG_ERR, "Error reading VMDK descriptor: %m\n");
+            free(descriptor);
+            return 0;
+        }
+
+        descriptor[desc_size << 9] = 0;
+
+        if (!vmdk_parse_descriptor(descriptor, extent->path, 1, 1))
+        {
+            free(descriptor);
+            return 0;
+        }
+
+        free(descriptor);
+    }
+
+    grains = (capacity + grain_sectors - 1) / grain_sectors;
+    extent->gd_entries =
+        (uint32_t)((grains + extent->gt_entries - 1) / extent->gt_entries);
+    extent->zero_grains = (flags & VMDK_FLAG_ZERO_GRAINS) != 0;
+
+    extent->gd = (uint32_t *)malloc(((size_t)extent->gd_entries << 2) + 1);
+    extent->gt_slot = (uint32_t *)calloc((size_t)extent->gd_entries + 1,
+                                         sizeof(uint32_t));
+    if (!(flags & VMDK_FLAG_REDUNDANT_GD))
+        extent->rgd_offset = 0;
+    if (extent->rgd_offset != 0)
+        extent->rgd = (uint32_t *)malloc(((size_t)extent->gd_entries << 2) + 1);
+
+    if (extent->gd == NULL || extent->gt_slot == NULL ||
+        (extent->rgd_offset != 0 && extent->rgd == NULL))
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    for (copy = 0; copy < (extent->rgd != NULL ? 2 : 1); copy++)
+    {
+        uint32_t *gd = copy ? extent->rgd : extent->gd;
+        uint32_t index;
+
+        if (vmdk_extent_io(extent, 0, gd, extent->gd_entries << 2,
+                           copy ? extent->rgd_offset : extent->gd_offset) !=
+            (safeio_ssize_t)(extent->gd_entries << 2))
+        {
+            syslog(LOG_ERR, "Error reading VMDK grain directory in '%s': %m\n",
+                   extent->path);
+            return 0;
+        }
+
+        for (index = 0; index < extent->gd_entries; index++)
+            gd[index] = GetLittleEndian32U((uint8_t *)(gd + index));
+    }
+
+    if (extent->read_only)
+        return 1;
+
+    if (header[72] != 0)
+    {
+        syslog(LOG_ERR, "VMDK image '%s' was not closed cleanly and needs to be "
+                        "checked before it can be opened for writing.\n",
+               extent->path);
+        return 0;
+    }
+
+    extent->file_end = _lseeki64(extent->fd, 0, SEEK_END);
+    if (extent->file_end == -1)
+    {
+        syslog(LOG_ERR, "Error finding end of VMDK extent '%s': %m\n",
+               extent->path);
+        return 0;
+    }
+
+    extent->file_end = (extent->file_end + 511) & ~(off_t_64)511;
+
+    // Marked in use until closed
+    header[72] = 1;
+    if (vmdk_extent_io(extent, 1, header + 72, 1, 72) != 1)
+    {
+        syslog(LOG_ERR, "Error writing VMDK header: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Opens a VMDK image, either a monolithic sparse image file or a descriptor
+// file listing extents in other files. Returns zero on failure.
+int
+vmdk_open(const char *image_path, char read_only)
+{
+    uint8_t magic[4];
+    int max_gt_entries = 0;
+    int max_grain_shift = 0;
+    int i;
+
+    if (physical_read(magic, sizeof(magic), 0) != sizeof(magic))
+        return 0;
+
+    if (GetLittleEndian32U(magic) == VMDK_MAGIC)
+    {
+        vmdk.extents = (PVMDK_EXTENT)calloc(1, sizeof(VMDK_EXTENT));
+        if (vmdk.extents == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        vmdk.extents->fd = image_fd;
+        vmdk.extents->path = (char *)image_path;
+        vmdk.extents->type = VMDK_EXTENT_SPARSE;
+        vmdk.extents->read_only = read_only;
+        vmdk.count = 1;
+
+        if (!vmdk_open_sparse(vmdk.extents, 1))
+            return 0;
+    }
+    else
+    {
+        off_t_64 descriptor_size = _lseeki64(image_fd, 0, SEEK_END);
+        char *descriptor;
+
+        if (descriptor_size == -1 || descriptor_size > VMDK_DESCRIPTOR_MAX_SIZE)
+        {
+            syslog(LOG_ERR, "Bad size of VMDK descriptor file.\n");
+            return 0;
+        }
+
+        descriptor = (char *)malloc((size_t)descriptor_size + 1);
+        if (descriptor == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+
+        if (physical_read(descriptor, (safeio_size_t)descriptor_size, 0) !=
+            (safeio_ssize_t)descriptor_size)
+        {
+            syslog(LOG_ERR, "Error reading VMDK descriptor: %m\n");
+            free(descriptor);
+            return 0;
+        }
+
+        descriptor[descriptor_size] = 0;
+
+        if (!vmdk_parse_descriptor(descriptor, image_path, read_only, 0))
+        {
+            free(descriptor);
+            return 0;
+        }
+
+        free(descriptor);
+
+        if (vmdk.count == 0)
+        {
+            syslog(LOG_ERR, "No extents in VMDK descriptor.\n");
+            return 0;
+        }
+
+        for (i = 0; i < vmdk.count; i++)
+            if (vmdk.extents[i].type == VMDK_EXTENT_SPARSE &&
+                !vmdk_open_sparse(&vmdk.extents[i], 0))
+                return 0;
+    }
+
+    current_size = vmdk.extents[vmdk.count - 1].start +
+                   vmdk.extents[vmdk.count - 1].size;
+
+    for (i = 0; i < vmdk.count; i++)
+        if (vmdk.extents[i].type == VMDK_EXTENT_SPARSE)
+        {
+            if ((int)vmdk.extents[i].gt_entries > max_gt_entries)
+                max_gt_entries = (int)vmdk.extents[i].gt_entries;
+            if (vmdk.extents[i].grain_shift > max_grain_shift)
+                max_grain_shift = vmdk.extents[i].grain_shift;
+        }
+
+    if (max_gt_entries == 0)
+        return 1;
+
+    block_shift = (int16_t)max_grain_shift;
+    block_size = ((safeio_size_t)1) << block_shift;
+
+    vmdk.table_count = VMDK_CACHE_SIZE / (max_gt_entries << 2);
+    if (vmdk.table_count < VMDK_CACHE_MIN_TABLES)
+        vmdk.table_count = VMDK_CACHE_MIN_TABLES;
+
+    vmdk.tables = (PVMDK_TABLE)calloc(vmdk.table_count, sizeof(VMDK_TABLE));
+    vmdk.grain_buf = (char *)malloc(block_size);
+    if (vmdk.tables == NULL || vmdk.grain_buf == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    for (i = 0; i < vmdk.table_count; i++)
+    {
+        vmdk.tables[i].entries = (uint32_t *)malloc((size_t)max_gt_entries << 2);
+        if (vmdk.tables[i].entries == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Marks sparse extents of a VMDK image no longer in use, and closes extent
+// files.
+void
+vmdk_close()
+{
+    int i;
+
+    for (i = 0; i < vmdk.count; i++)
+    {
+        PVMDK_EXTENT extent = &vmdk.extents[i];
+        uint8_t unclean = 0;
+
+        if (extent->type == VMDK_EXTENT_SPARSE && !extent->read_only &&
+            vmdk_extent_io(extent, 1, &unclean, 1, 72) != 1)
+            syslog(LOG_ERR, "Error writing VMDK header: %m\n");
+
+        if (extent->fd != -1 && extent->fd != image_fd)
+            close(extent->fd);
+    }
+}
+
+int
+backend_unmap(off_t_64 offset, off_t_64 length)
+{
+    if (vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode)
+    {
+        int result;
+
+        vhd_lock_acquire_write();
+
+        if (vhdx_mode)
+            result = vhdx_unmap(offset, length);
+        else if (qcow2_mode)
+            result = qcow2_unmap(offset, length);
+        else if (vmdk_mode)
+            result = vmdk_unmap(offset, length);
+        else
+            result = vhd_unmap(offset, length);
+        vhd_journal.unsynced = 1;
+
+        vhd_lock_release();
+
+        return result;
+    }
+    else
+        return physical_unmap(offset, length);
+}
+
+int
+backend_zero(off_t_64 offset, off_t_64 length)
+{
+    if (vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode)
+    {
+        int result;
+
+        vhd_lock_acquire_write();
+
+        if (vhdx_mode)
+            result = vhdx_zero(offset, length);
+        else if (qcow2_mode)
+            result = qcow2_zero(offset, length);
+        else if (vmdk_mode)
+            result = vmdk_zero(offset, length);
+        else
+            result = vhd_zero(offset, length);
+        vhd_journal.unsynced = 1;
+
+        vhd_lock_release();
+
+        return result;
+    }
+    else
+        return physical_zero(offset, length);
+}
+
+// Blocks in cache are dropped both before and after they are unmapped or
+// zeroed, so that blocks read meanwhile are not kept.
+int
+logical_unmap(off_t_64 offset, off_t_64 length)
+{
+    int result;
+
+    if (block_cache.block_count == 0)
+        return backend_unmap(offset, length);
+
+    block_cache_invalidate(offset, length);
+    result = backend_unmap(offset, length);
+    block_cache_invalidate(offset, length);
+
+    return result;
+}
+
+int
+logical_zero(off_t_64 offset, off_t_64 length)
+{
+    int result;
+
+    if (block_cache.block_count == 0)
+        return backend_zero(offset, length);
+
+    block_cache_invalidate(offset, length);
+    result = backend_zero(offset, length);
+    block_cache_invalidate(offset, length);
+
+    return result;
+}
+
+#ifdef __linux__
+pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Write-back state is also read by sync thread of --sync=interval.
+void writeback_lock_acquire()
+{
+#ifdef __linux__
+    if (worker_count > 0 || writeback.mode == SYNC_INTERVAL)
+        pthread_mutex_lock(&writeback_lock);
+#endif
+}
+
+void writeback_lock_release()
+{
+#ifdef __linux__
+    if (worker_count > 0 || writeback.mode == SYNC_INTERVAL)
+        pthread_mutex_unlock(&writeback_lock);
+#endif
+}
+
+// Makes everything written to image files so far durable, including
+// metadata in journal of a VHD image. Returns -1 with errno set on failure.
+int image_flush()
+{
+    int i;
+
+    if (dll_mode)
+        return 0;
+
+    writeback_lock_acquire();
+
+    writeback.dirty = 0;
+    writeback.synced_since = devio_ticks();
+
+    writeback_lock_release();
+
+    // Commit syncs image file first if it has been written to
+    if (vhd_journal.fd != -1)
+        return vhd_journal_commit();
+
+    if (file_sync(image_fd) == -1)
+    {
+        syslog(LOG_ERR, "Error syncing image file: %m\n");
+        return -1;
+    }
+
+    for (i = 0; i < vmdk.count; i++)
+    {
+        PVMDK_EXTENT extent = &vmdk.extents[i];
+
+        if (extent->fd != -1 && extent->fd != image_fd &&
+            !extent->read_only && file_sync(extent->fd) == -1)
+        {
+            syslog(LOG_ERR, "Error syncing extent file '%s': %m\n",
+                   extent->path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Counts size bytes written in write-back mode, and flushes image files
+// once limit is reached. Returns -1 with errno set if flush fails.
+int writeback_account(ULONGLONG size)
+{
+    char due;
+
+    if (!SYNC_ON_FLUSH)
+        return 0;
+
+    writeback_lock_acquire();
+
+    writeback.dirty += size;
+    due = writeback.limit > 0 && writeback.dirty >= writeback.limit;
+
+    writeback_lock_release();
+
+    if (!due)
+        return 0;
+
+    return image_flush();
+}
+
+// Fills in response block for a read request of size bytes, where readdone
+// is the result from the read operation, with errno set if -1.
+void read_result(const FSCRYPTDPROXY_READ_REQ *req_block, safeio_size_t size,
+                 safeio_ssize_t readdone, PFSCRYPTDPROXY_READ_RESP resp_block)
+{
+    if (readdone == -1)
+    {
+        resp_block->errorno = errno;
+        resp_block->length = 0;
+        syslog(LOG_ERR, "Device read: %m\n");
+    }
+    else
+    {
+        resp_block->errorno = 0;
+        resp_block->length = size;
+
+        if (req_block->length != readdone)
+        {
+            syslog(LOG_ERR,
+                   "Partial read at " SLL_FMT ": Got " SLL_FMT ", req " ULL_FMT ".\n",
+                   (int64_t)(image_offset + req_block->offset), (int64_t)readdone, req_block->length);
+        }
+    }
+
+    dbglog((LOG_ERR, "read done reporting/sending " ULL_FMT " bytes.\n",
+            resp_block->length));
+}
+
+// Reads data for a read request into io_buf, which holds size bytes, and
+// fills in response block. Size is smaller than requested length if a
+// large enough buffer could not be allocated.
+void do_read(const FSCRYPTDPROXY_READ_REQ *req_block, char *io_buf,
+             safeio_size_t size, PFSCRYPTDPROXY_READ_RESP resp_block)
+{
+    safeio_ssize_t readdone;
+
+    dbglog((LOG_ERR, "read request " ULL_FMT " bytes at " ULL_FMT " + " ULL_FMT " = " ULL_FMT ".\n",
+            req_block->length, req_block->offset, image_offset,
+            req_block->offset + image_offset));
+
+    readdone =
+        logical_read(io_buf, (safeio_size_t)size, (off_t_64)(image_offset + req_block->offset));
+
+    // Image formats fill in unallocated parts themselves, so only what was
+    // not read at end of image file is zeroed
+    if (readdone >= 0 && readdone < (safeio_ssize_t)size)
+        memset(io_buf + readdone, 0, size - readdone);
+
+    read_result(req_block, size, readdone, resp_block);
+}
+
+// Fills in response block for a write request, where writedone is the
+// result from the write operation, with errno set if -1.
+void write_result(const FSCRYPTDPROXY_WRITE_REQ *req_block,
+                  safeio_ssize_t writedone,
+                  PFSCRYPTDPROXY_WRITE_RESP resp_block)
+{
+    if (writedone == -1)
+    {
+        resp_block->errorno = errno;
+        resp_block->length = writedone;
+#ifdef _WIN32
+        perror("Device write");
+#else
+        syslog(LOG_ERR, "Device write: %m\n");
+#endif
+    }
+    else
+    {
+        resp_block->errorno = 0;
+        resp_block->length = writedone;
+    }
+
+    if (req_block->length != resp_block->length)
+    {
+        if (writedone < 0)
+        {
+            syslog(LOG_ERR, "Write error (code " ULL_FMT ") at " ULL_FMT ": Req " ULL_FMT ".\n",
+                   resp_block->errorno, image_offset + req_block->offset, req_block->length);
+        }
+        else
+        {
+            syslog(LOG_ERR, "Partial write at " ULL_FMT ": Got " ULL_FMT ", req " ULL_FMT ".\n",
+                   resp_block->errorno, image_offset + req_block->offset, req_block->length);
+        }
+    }
+
+    dbglog((LOG_ERR, "write done reporting/sending " ULL_FMT " bytes.\n",
+            resp_block->length));
+}
+
+// Writes data for a write request with FSCRYPTDPROXY_WRITE_FLAG_xxx flags
+// from io_buf and fills in response block.
+void do_write(const FSCRYPTDPROXY_WRITE_REQ *req_block, ULONGLONG flags,
+              char *io_buf, PFSCRYPTDPROXY_WRITE_RESP resp_block)
+{
+    dbglog((LOG_ERR, "write request " ULL_FMT " bytes at " ULL_FMT " + " ULL_FMT " = " ULL_FMT ".\n",
+            req_block->length, req_block->offset, image_offset,
+            req_block->offset + image_offset));
+
+    if (devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
+    {
+        resp_block->errorno = EBADF;
+        resp_block->length = 0;
+        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
+    }
+    else
+    {
+        // Without write-back, all writes are synchronous already
+        char fua = (flags & FSCRYPTDPROXY_WRITE_FLAG_FUA) && SYNC_ON_FLUSH;
+        char raw = !(vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode);
+        safeio_ssize_t writedone = logical_write(io_buf, (safeio_size_t)req_block->length,
+                                                 (off_t_64)(image_offset + req_block->offset),
+                                                 fua && raw);
+
+        write_result(req_block, writedone, resp_block);
+
+        if (resp_block->errorno != 0 || (fua && raw))
+            return;
+
+        // Image formats need metadata that refers to new data synced too
+        if ((fua ? image_flush() :
+             writeback_account((safeio_size_t)writedone)) == -1)
+            resp_block->errorno = errno;
+    }
+}
+
+// Makes writes done so far durable for a flush request and fills in
+// response block.
+void do_flush(PFSCRYPTDPROXY_FLUSH_RESP resp_block)
+{
+    resp_block->errorno = 0;
+
+    if ((devio_info.flags & FSCRYPTDPROXY_FLAG_RO) || !SYNC_ON_FLUSH)
+        return;
+
+    if (image_flush() == -1)
+        resp_block->errorno = errno;
+}
+
+// Deallocates or zeroes ranges listed in size bytes at ranges for an unmap
+// or zero request and fills in response block. Parts of ranges outside of
+// virtual disk are ignored.
+void do_range_list(ULONGLONG request_code, const char *ranges,
+                   safeio_size_t size, PFSCRYPTDPROXY_UNMAP_RESP resp_block)
+{
+    const char *name =
+        request_code == FSCRYPTDPROXY_REQ_ZERO ? "zero" : "unmap";
+    const char *ptr;
+
+    resp_block->errorno = 0;
+
+    if (devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
+    {
+        resp_block->errorno = EBADF;
+        syslog(LOG_ERR, "Device %s attempt on read-only device.\n", name);
+        return;
+    }
+
+    if (size % sizeof(DEVIO_RANGE) != 0)
+    {
+        resp_block->errorno = EINVAL;
+        syslog(LOG_ERR, "Invalid %s range list size: %u bytes.\n", name,
+               (int)size);
+        return;
+    }
+
+    for (ptr = ranges; ptr < ranges + size; ptr += sizeof(DEVIO_RANGE))
+    {
+        DEVIO_RANGE range;
+
+        memcpy(&range, ptr, sizeof range);
+
+        if (range.offset < 0 || (ULONGLONG)range.offset >= devio_info.file_size)
+            continue;
+
+        if (range.length > devio_info.file_size - range.offset)
+            range.length = devio_info.file_size - range.offset;
+
+        dbglog((LOG_ERR, "%s request " ULL_FMT " bytes at " SLL_FMT " + " SLL_FMT ".\n",
+                name, (ULONGLONG)range.length, (int64_t)range.offset,
+                (int64_t)image_offset));
+
+        if (range.length == 0)
+            continue;
+
+        if ((request_code == FSCRYPTDPROXY_REQ_ZERO ?
+             logical_zero((off_t_64)(image_offset + range.offset),
+                          (off_t_64)range.length) :
+             logical_unmap((off_t_64)(image_offset + range.offset),
+                           (off_t_64)range.length)) == -1)
+        {
+            resp_block->errorno = errno;
+            syslog(LOG_ERR, "Device %s error at " SLL_FMT ": %m\n", name,
+                   (int64_t)(image_offset + range.offset));
+            return;
+        }
+
+        if (writeback_account((ULONGLONG)range.length) == -1)
+        {
+            resp_block->errorno = errno;
+            return;
+        }
+    }
+}
+
+// Grants tagged operation for a FSCRYPTDPROXY_REQ_TAGGED request. Fills in
+// response block and returns non-zero if connection should switch to tagged
+// mode after response has been sent.
+int do_set_tagged(PDEVIO_CONN conn, const FSCRYPTDPROXY_TAGGED_REQ *req_block,
+                  PFSCRYPTDPROXY_TAGGED_RESP resp_block)
+{
+    if ((~devio_info.flags & FSCRYPTDPROXY_FLAG_SUPPORTS_TAGGED) ||
+        conn->tagged || req_block->flags != 0)
+    {
+        resp_block->errorno = EINVAL;
+        resp_block->max_outstanding = 0;
+        return 0;
+    }
+
+    resp_block->errorno = 0;
+    resp_block->max_outstanding = req_block->max_outstanding;
+
+    if (resp_block->max_outstanding > DEVIO_MAX_OUTSTANDING)
+        resp_block->max_outstanding = DEVIO_MAX_OUTSTANDING;
+    else if (resp_block->max_outstanding == 0)
+        resp_block->max_outstanding = 1;
+
+    dbglog((LOG_ERR, "Switching to tagged mode, " ULL_FMT " requests in flight.\n",
+            resp_block->max_outstanding));
+
+    return 1;
+}
+
+#ifdef __linux__
+
+// Returns zero_copy mode for a connection on sd. Read responses can be sent
+// with sendfile() from raw image files to sockets and pipes, unless they
+// are to be read through block cache, or with direct I/O.
+char zero_copy_mode(SOCKET sd)
+{
+    struct stat sd_stat;
+
+    if (vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode || dll_mode ||
+        shm_mode || drv_mode || block_cache.block_count > 0 ||
+        direct_io.align != 0 ||
+        image_file_size == 0 || fstat(sd, &sd_stat) == -1)
+        return 0;
+
+    if (S_ISSOCK(sd_stat.st_mode))
+        return 1;
+
+    if (S_ISFIFO(sd_stat.st_mode))
+        return 2;
+
+    return 0;
+}
+
+// Smallest read sent with sendfile(). Smaller reads are cheaper to copy
+// through request buffer and send together with response header in one
+// gather write.
+#define ZERO_COPY_MIN_SIZE (64 << 10)
+
+// Checks whether a read request is for data that is all within image
+// file, so that it can be sent without translation. Ranges past end of file
+// read as zeroes and are handled by do_read().
+int zero_copy_range(const FSCRYPTDPROXY_READ_REQ *req_block,
+                    safeio_size_t size)
+{
+    return image_offset + req_block->offset + size <= (ULONGLONG)image_file_size &&
+           req_block->length == size &&
+           size >= ZERO_COPY_MIN_SIZE &&
+           !extent_map_is_hole((off_t_64)(image_offset + req_block->offset),
+                               size);
+}
+
+// Sends all of a response header to a socket with MSG_MORE, so that it is
+// held back until data sent after it with sendfile() follows it.
+int send_more(SOCKET sd, const void *pdata, safeio_size_t size)
+{
+    const char *data = (const char *)pdata;
+
+    while (size > 0)
+    {
+        ssize_t sizedone = send(sd, data, size, MSG_MORE);
+
+        if (sizedone == -1 && errno == EINTR)
+            continue;
+
+        if (sizedone <= 0)
+        {
+            syslog(LOG_ERR, "send() failed: %m\n");
+            return 0;
+        }
+
+        size -= sizedone;
+        data += sizedone;
+    }
+
+    return 1;
+}
+
+// Sends size bytes from image file at offset to a zero_copy connection.
+// If image file has shrunk since it was opened, data past its end is sent
+// as zeroes. If sendfile() fails, the rest is read and sent the usual way.
+int send_file_data(PDEVIO_CONN conn, off_t_64 offset, safeio_size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sizedone = sendfile(conn->sd, image_fd, &offset, size);
+
+        conn->stat_sends++;
+
+        if (sizedone > 0)
+        {
+            size -= sizedone;
+            continue;
+        }
+
+        if (sizedone == -1 && errno == EINTR)
+            continue;
+
+        if (sizedone == -1)
+            syslog(LOG_ERR, "sendfile() failed: %m\n");
+
+        if (size > conn->buffer_size)
+            buf_realloc(conn, size);
+
+        if (size > conn->buffer_size)
+            return 0;
+
+        sizedone = physical_read(conn->buf, size, offset);
+        if (sizedone == -1)
+            return 0;
+
+        if (sizedone < (ssize_t)size)
+            memset(conn->buf + sizedone, 0, size - sizedone);
+
+        return safe_write(conn->sd, conn->buf, size);
+    }
+
+    return 1;
+}
+
+// Detects sequential reads on a connection and reads raw image file ahead
+// of them into page cache, with posix_fadvise() so that it happens in the
+// background. Called in main thread for each read request, before it is
+// executed. Direct I/O does not read from page cache.
+void read_ahead(PDEVIO_CONN conn, off_t_64 offset, safeio_size_t size)
+{
+    off_t_64 end = offset + size;
+    off_t_64 ra_end;
+    int i;
+
+    if (dll_mode || vhd_mode || vhdx_mode || qcow2_mode || vmdk_mode ||
+        direct_io.align != 0 ||
+        image_file_size == 0 || size == 0 || offset >= image_file_size)
+        return;
+
+    for (i = 0; i < READ_AHEAD_HISTORY; i++)
+        if (conn->ra_history[i] == offset && offset != 0)
+            break;
+
+    conn->ra_history[conn->ra_history_pos] = end;
+    conn->ra_history_pos = (conn->ra_history_pos + 1) % READ_AHEAD_HISTORY;
+
+    if (i == READ_AHEAD_HISTORY)
+    {
+        // Stream stopped, with much read ahead for nothing
+        if (conn->ra_end - conn->ra_start > (off_t_64)(conn->ra_window >> 1) &&
+            conn->ra_window > READ_AHEAD_MIN_WINDOW)
+            conn->ra_window >>= 1;
+
+        conn->ra_stream = 0;
+        conn->ra_start = conn->ra_end = 0;
+        return;
+    }
+
+    if (++conn->ra_stream < READ_AHEAD_TRIGGER)
+        return;
+
+    if (conn->ra_window == 0)
+    {
+        conn->ra_window = size << 2;
+        if (conn->ra_window < READ_AHEAD_MIN_WINDOW)
+            conn->ra_window = READ_AHEAD_MIN_WINDOW;
+        if (conn->ra_window > READ_AHEAD_MAX_WINDOW)
+            conn->ra_window = READ_AHEAD_MAX_WINDOW;
+    }
+
+    conn->stat_ra_reads++;
+
+    if (offset >= conn->ra_start && end <= conn->ra_end)
+        conn->stat_ra_hits++;
+    else if (conn->ra_end > conn->ra_start &&
+             conn->ra_window < READ_AHEAD_MAX_WINDOW)
+        conn->ra_window <<= 1;
+
+    if (conn->ra_start < offset)
+        conn->ra_start = offset;
+
+    // More is read ahead once half of window has been read
+    if (conn->ra_end - end > (off_t_64)(conn->ra_window >> 1))
+        return;
+
+    ra_end = end + conn->ra_window;
+    if (ra_end > image_file_size)
+        ra_end = image_file_size;
+
+    if (conn->ra_end < end)
+        conn->ra_end = end;
+
+    if (ra_end > conn->ra_end)
+    {
+        posix_fadvise(image_fd, conn->ra_end, ra_end - conn->ra_end,
+                      POSIX_FADV_WILLNEED);
+
+        conn->ra_end = ra_end;
+    }
+}
+
+#endif
+
+int read_data(PDEVIO_CONN conn)
+{
+    FSCRYPTDPROXY_READ_REQ req_block = {0};
+    FSCRYPTDPROXY_READ_RESP resp_block = {0};
+    safeio_size_t size;
+
+    if (!comm_read(conn, &req_block.offset,
+                   sizeof(req_block) - sizeof(req_block.request_code)))
+    {
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
+    }
+
+    if (req_block.length > conn->buffer_size) // we will need larger buffer to complete this request
+    {
+        buf_realloc(conn, req_block.length);
+    }
+
+    size = (safeio_size_t)(req_block.length < conn->buffer_size ? req_block.length : conn->buffer_size);
+
+#ifdef __linux__
+    read_ahead(conn, (off_t_64)(image_offset + req_block.offset), size);
+
+    if (conn->zero_copy && zero_copy_range(&req_block, size))
+    {
+        dbglog((LOG_ERR, "read request " ULL_FMT " bytes at " ULL_FMT " + " ULL_FMT " sent from image file.\n",
+                req_block.length, req_block.offset, image_offset));
+
+        resp_block.errorno = 0;
+        resp_block.length = size;
+
+        conn->stat_responses++;
+        conn->stat_pieces += 2;
+        conn->stat_sends++;
+
+        if (conn->zero_copy == 1 ?
+            !send_more(conn->sd, &resp_block, sizeof resp_block) :
+            !safe_write(conn->sd, &resp_block, sizeof resp_block))
+        {
+            syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+            return 0;
+        }
+
+        if (!send_file_data(conn, (off_t_64)(image_offset + req_block.offset),
+                            size))
+        {
+            syslog(LOG_ERR, "Error sending read response to caller.\n");
+            return 0;
+        }
+
+        return 1;
+    }
+#endif
+
+    do_read(&req_block, conn->buf, size, &resp_block);
+
+    if (!send_response(conn, &resp_block, sizeof resp_block, conn->buf,
+                       resp_block.errorno == 0 ?
+                       (safeio_size_t)resp_block.length : 0))
+    {
+        syslog(LOG_ERR, "Error sending read response to caller.\n");
+        return 0;
+    }
+
+    if (!comm_flush(conn))
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Handles FSCRYPTDPROXY_REQ_WRITE and FSCRYPTDPROXY_REQ_WRITE_EX requests,
+// where the latter has flags after the same fields as the former.
+int write_data(PDEVIO_CONN conn, ULONGLONG request_code)
+{
+    FSCRYPTDPROXY_WRITE_REQ req_block = {0};
+    FSCRYPTDPROXY_WRITE_RESP resp_block = {0};
+    ULONGLONG flags = 0;
+
+    if (!comm_read(conn, &req_block.offset,
+                   sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    if (request_code == FSCRYPTDPROXY_REQ_WRITE_EX &&
+        !comm_read(conn, &flags, sizeof(flags)))
+        return 0;
+
+    if (req_block.length > conn->buffer_size)
+    {
+        syslog(LOG_ERR, "Too big block write requested: %u bytes.\n",
+               (int)req_block.length);
+        return 0;
+    }
+
+    if (!comm_read(conn, conn->buf, (safeio_size_t)req_block.length))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+        return 0;
+    }
+
+    do_write(&req_block, flags, conn->buf, &resp_block);
+
+    // Write is durable before it is acknowledged, unless that waits for a
+    // flush request
+    if (writeback.mode == SYNC_ALWAYS &&
+        vhd_journal_commit() == -1 && resp_block.errorno == 0)
+        resp_block.errorno = errno;
+
+    if (!send_response(conn, &resp_block, sizeof resp_block, NULL, 0))
+    {
+        syslog(LOG_ERR, "Error sending write response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush(conn))
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Handles FSCRYPTDPROXY_REQ_UNMAP and FSCRYPTDPROXY_REQ_ZERO requests, which
+// share request and response layout.
+int range_list_data(PDEVIO_CONN conn, ULONGLONG request_code)
+{
+    FSCRYPTDPROXY_UNMAP_REQ req_block = {0};
+    FSCRYPTDPROXY_UNMAP_RESP resp_block = {0};
+
+    if (!comm_read(conn, &req_block.length,
+                   sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    if (req_block.length > conn->buffer_size)
+    {
+        syslog(LOG_ERR, "Too big range list: %u bytes.\n",
+               (int)req_block.length);
+        return 0;
+    }
+
+    if (!comm_read(conn, conn->buf, (safeio_size_t)req_block.length))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+        return 0;
+    }
+
+    do_range_list(request_code, conn->buf, (safeio_size_t)req_block.length,
+                  &resp_block);
+
+    if (writeback.mode == SYNC_ALWAYS &&
+        vhd_journal_commit() == -1 && resp_block.errorno == 0)
+        resp_block.errorno = errno;
+
+    if (!send_response(conn, &resp_block, sizeof resp_block, NULL, 0))
+    {
+        syslog(LOG_ERR, "Error sending response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush(conn))
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int flush_data(PDEVIO_CONN conn)
+{
+    FSCRYPTDPROXY_FLUSH_RESP resp_block = {0};
+
+    do_flush(&resp_block);
+
+    if (!send_response(conn, &resp_block, sizeof resp_block, NULL, 0))
+    {
+        syslog(LOG_ERR, "Error sending flush response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush(conn))
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int set_tagged(PDEVIO_CONN conn)
+{
+    FSCRYPTDPROXY_TAGGED_REQ req_block = {0};
+    FSCRYPTDPROXY_TAGGED_RESP resp_block = {0};
+    int tagged;
+
+    if (!comm_read(conn, &req_block.flags,
+                   sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    tagged = do_set_tagged(conn, &req_block, &resp_block);
+
+    if (!send_response(conn, &resp_block, sizeof resp_block, NULL, 0))
+    {
+        syslog(LOG_ERR, "Error sending response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush(conn))
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    if (tagged)
+    {
+        conn->tagged = 1;
+        conn->max_outstanding = resp_block.max_outstanding;
+        conn->zero_copy = 0;
+    }
+
+    return 1;
+}
+
+int do_comm(char *comm_device);
+
+#ifdef __linux__
+int worker_parse_cpus(const char *list);
+int sync_start();
+#endif
+
+int main(int argc, char **argv)
+{
+    safeio_ssize_t readdone;
+    int partition_number = 0;
+    char mbr[512];
+    int retval;
+    char *comm_device = NULL;
+    char sync_set = 0;
+
+#ifdef _WIN32
+    WSADATA wsadata;
+
+    SetUnhandledExceptionFilter(ExceptionFilter);
+
+    (void)WSAStartup(0x0101, &wsadata);
+#endif
+
+    if (argc > 1 && _stricmp(argv[1], "--dll") == 0)
+    {
+        fprintf(stderr,
+                "devio with custom DLL support\n"
+                "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+                "\n"
+                "Usage for unmanaged C/C++ DLL files:\n"
+                "devio --dll=dllfile;procedure other_devio_parameters ...\n"
+                "\n"
+                "dllfile     Name of custom DLL file to use for device I/O.\n"
+                "\n"
+                "procedure   Name of procedure in DLL file to use for opening device. This\n"
+                "            procedure must follow the dllopen_proc typedef as specified in\n"
+                "devio.h.\n"
+                "\n"
+                "Declaration for dllopen is:\n"
+                "void * __cdecl dllopen(const char *str,\n"
+                "                       int read_only,\n"
+                "                       dllread_proc *dllread,\n"
+                "                       dllwrite_proc *dllwrite,\n"
+                "                       dllclose_proc *dllclose,\n"
+                "                       __int64 *size)\n"
+                "\n"
+                "str         Device name to open as specified at devio command line.\n"
+                "\n"
+                "read_only   A non-zero value requests a device to be opened in read only mode.\n"
+                "\n"
+                "dllread     Pointer to memory where dllopen should store address to a function\n"
                 "            that is used when reading from device.\n"
                 "\n"
                 "dllwrite    Pointer to memory where dllopen should store address to a function\n"
@@ -1247,814 +10429,2785 @@ int main(int argc, char **argv)
                 "Close() methods as well as Position and Length properties on opened Stream\n"
                 "object.\n");
 
-        return -1;
+        return -1;
+    }
+
+    if (argc >= 3 && _strnicmp(argv[1], "--dll=", 6) == 0)
+    {
+#ifdef _WIN32
+        char *dllargs = argv[1] + 6;
+
+        char *dllfile = strtok(dllargs, ";");
+        char *dllfunc = strtok(NULL, "");
+
+        HMODULE hDLL;
+
+        hDLL = LoadLibrary(dllfile);
+        if (hDLL == NULL)
+        {
+            syslog(stderr, "Error loading %s: %m\n", dllfile);
+            return 1;
+        }
+
+        dll_open = (dllopen_proc)GetProcAddress(hDLL, dllfunc);
+        if (dll_open == NULL)
+        {
+            syslog(stderr, "Cannot find procedure %s in %s: %m\n",
+                   dllfunc,
+                   dllfile);
+            return 1;
+        }
+
+        dll_mode = 1;
+
+        argc--;
+        argv++;
+#else
+        fprintf(stderr, "Custom DLL mode only supported on Windows.\n");
+        return -1;
+#endif
+    }
+
+    while (argc >= 4)
+    {
+        if (strcmp(argv[1], "--drv") == 0)
+        {
+            drv_mode = 1;
+        }
+        else if (strcmp(argv[1], "--novhd") == 0)
+        {
+            auto_vhd_detect = 0;
+        }
+        else if (strcmp(argv[1], "--nojournal") == 0)
+        {
+            vhd_journal_mode = 0;
+        }
+        else if (strcmp(argv[1], "-r") == 0)
+        {
+            devio_info.flags |= FSCRYPTDPROXY_FLAG_RO;
+        }
+        else if (strcmp(argv[1], "--multi") == 0)
+        {
+#ifdef __linux__
+            multi_mode = 1;
+#else
+            fprintf(stderr, "Multi client operation only supported on Linux.\n");
+            return -1;
+#endif
+        }
+        else if (_strnicmp(argv[1], "--threads=", 10) == 0)
+        {
+#ifdef __linux__
+            worker_count = (int)strtoul(argv[1] + 10, NULL, 0);
+#else
+            fprintf(stderr, "Worker threads only supported on Linux.\n");
+            return -1;
+#endif
+        }
+        else if (_strnicmp(argv[1], "--affinity=", 11) == 0)
+        {
+#ifdef __linux__
+            if (!worker_parse_cpus(argv[1] + 11))
+            {
+                fprintf(stderr, "Invalid CPU list: %s\n", argv[1] + 11);
+                return -1;
+            }
+#else
+            fprintf(stderr, "Worker threads only supported on Linux.\n");
+            return -1;
+#endif
+        }
+        else if (_strnicmp(argv[1], "--writeback=", 12) == 0)
+        {
+            writeback.limit = strtoull(argv[1] + 12, NULL, 0) << 20;
+        }
+        else if (strcmp(argv[1], "--sync=always") == 0)
+        {
+            writeback.mode = SYNC_ALWAYS;
+            sync_set = 1;
+        }
+        else if (strncmp(argv[1], "--sync=interval=", 16) == 0)
+        {
+#ifdef __linux__
+            writeback.mode = SYNC_INTERVAL;
+            writeback.interval = strtoull(argv[1] + 16, NULL, 0);
+            sync_set = 1;
+
+            if (writeback.interval == 0)
+            {
+                fprintf(stderr, "Invalid sync interval: %s\n", argv[1] + 16);
+                return -1;
+            }
+#else
+            fprintf(stderr, "Sync interval only supported on Linux.\n");
+            return -1;
+#endif
+        }
+        else if (strcmp(argv[1], "--sync=flush") == 0)
+        {
+            writeback.mode = SYNC_FLUSH;
+            sync_set = 1;
+        }
+        else if (strcmp(argv[1], "--sync=none") == 0)
+        {
+            writeback.mode = SYNC_NONE;
+            sync_set = 1;
+        }
+        else if (_strnicmp(argv[1], "--blockcache=", 13) == 0)
+        {
+            if (!block_cache_init(strtoull(argv[1] + 13, NULL, 0) << 20))
+                return -1;
+        }
+        else if (strcmp(argv[1], "--io=sync") == 0)
+        {
+            uring_mode = 0;
+        }
+        else if (strcmp(argv[1], "--cache=buffered") == 0)
+        {
+            cache_mode = CACHE_BUFFERED;
+        }
+        else if (strcmp(argv[1], "--cache=direct") == 0)
+        {
+#ifdef __linux__
+            cache_mode = CACHE_DIRECT;
+#else
+            fprintf(stderr, "Direct I/O only supported on Linux.\n");
+            return -1;
+#endif
+        }
+        else if (strcmp(argv[1], "--cache=mmap") == 0)
+        {
+#ifdef __linux__
+            cache_mode = CACHE_MMAP;
+#else
+            fprintf(stderr, "Mapped image files only supported on Linux.\n");
+            return -1;
+#endif
+        }
+        else if (strcmp(argv[1], "--io=uring") == 0)
+        {
+#ifdef __linux__
+            uring_mode = 1;
+#else
+            fprintf(stderr, "io_uring only supported on Linux.\n");
+            return -1;
+#endif
+        }
+        else
+        {
+            break;
+        }
+
+        argv++;
+        argc--;
+    }
+
+    if (argc < 3 || argc > 7)
+    {
+        fprintf(stderr,
+                "devio - Device I/O Service ver " DEVIO_VERSION "\n"
+                "With support for Microsoft VHD and VHDX formats, QEMU QCOW2 and VMware VMDK\n"
+                "formats, custom DLL files, shared memory proxy operation and also for use with\n"
+                "DevIO Client Driver, if installed.\n"
+                "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+                "\n"
+                "Usage:\n"
+                "devio [options] tcp-port|commdev diskdev [blocks] [offset] [alignm] [buffersize]\n"
+                "devio [options] tcp-port|commdev diskdev [partitionnumber] [alignm] [buffersize]\n"
+                "\n"
+                "-r      Open image file in read-only mode.\n"
+                "\n"
+                "--novhd Do not detect VHD, VHDX, QCOW2 or VMDK image file format.\n"
+                "\n"
+                "--nojournal\n"
+                "        Write block table and bitmaps of dynamic VHD images in place with\n"
+                "        synchronous writes. By default, they are committed to a journal\n"
+                "        named after image file with " VHD_JOURNAL_SUFFIX " appended, with one sync\n"
+                "        for all writes completed together, and image file is not opened\n"
+                "        for synchronous writes. Journal left by a crash is replayed in\n"
+                "        either case. Linux only.\n"
+                "\n"
+                "--multi Keep listening on tcp-port and serve any number of simultaneous\n"
+                "        client connections to the same image. Linux only.\n"
+                "\n"
+                "--threads=N\n"
+                "        Execute reads and writes in a pool of N worker threads, while\n"
+                "        main thread receives requests and sends responses. Requires\n"
+                "        --multi. Overlapping requests from the same connection are\n"
+                "        executed in the order they were received. Default is 0, execute\n"
+                "        requests in main thread. Linux only.\n"
+                "\n"
+                "--affinity=cpulist\n"
+                "        Bind worker threads in turn to CPUs in cpulist, for example 0,2-5.\n"
+                "        Linux only.\n"
+                "\n"
+                "--blockcache=N\n"
+                "        Keep N MB of image data in a block cache shared by all\n"
+                "        connections, where blocks read again are kept longer than those\n"
+                "        read once so that a scan through the image does not push them\n"
+                "        out. Writes go through to image. Default is 0, no block cache.\n"
+                "\n"
+                "--sync=always|interval=ms|flush|none\n"
+                "        When writes to image files are made durable. With always, every\n"
+                "        write is synchronous. Otherwise image files are opened without\n"
+                "        synchronous writes, and synced every ms milliseconds by a\n"
+                "        background thread with interval, when client sends a flush\n"
+                "        request with interval and flush, or only on a clean exit with\n"
+                "        none. Writes not yet synced may be lost in a crash. Default is\n"
+                "        always, or flush if --writeback is used. Interval is Linux only.\n"
+                "\n"
+                "--writeback=N\n"
+                "        Also sync image files when N MB have been written since last\n"
+                "        sync, with --sync=interval or flush. Default is 0, no limit.\n"
+                "\n"
+                "--io=sync|uring\n"
+                "        Method for image file I/O. Default is sync, one system call for\n"
+                "        each operation. With uring, operations are submitted through an\n"
+                "        io_uring instance, and with --multi, requests for raw image files\n"
+                "        are executed asynchronously so that requests pipelined by tagged\n"
+                "        clients reach the disk together. Linux only.\n"
+                "\n"
+                "--cache=buffered|direct|mmap\n"
+                "        Page cache use for image file. Default is buffered, read and write\n"
+                "        through page cache. With direct, image file is opened with\n"
+                "        O_DIRECT, and transfers that are not aligned as it requires are\n"
+                "        done through aligned buffers. With mmap, raw image files are read\n"
+                "        from a shared mapping. Which one is in use is printed at startup,\n"
+                "        as it falls back to buffered where not supported. Linux only.\n"
+                "\n"
+                "tcp-port can be any free tcp port where this service should listen for incoming\n"
+                "client connections.\n"
+                "\n"
+                "commdev is a path to a communications port, named pipe or similar where this\n"
+                "service should listen for incoming client connections.\n"
+                "\n"
+                "commdev can also start with shm: followed by an section object name for using\n"
+                "shared memory communication. Alternatively, drv: followed by a name for using\n"
+                "DevIO Client Driver to expose a device object connected to this devio instance.\n"
+                "\n"
+                "Default number of blocks is 0. When running on Windows the program will try to\n"
+                "get the size of the image file or partition automatically, otherwise the client\n"
+                "must know the exact size without help from this service.\n"
+                "\n"
+                "Default number of blocks for dynamically expanding VHD image files are read\n"
+                "automatically from VHD header structure within image file.\n"
+                "\n"
+                "Differencing VHD image files are opened along with their parent images, found\n"
+                "through parent locators in VHD header or by file name in the same directory.\n"
+                "Parent images are opened read-only.\n"
+                "\n"
+                "Dynamically expanding and fixed VHDX image files are detected as well. Log left\n"
+                "in VHDX image file by a crash is replayed when it is opened for writing.\n"
+                "Differencing VHDX image files are not supported.\n"
+                "\n"
+                "QCOW2 image files, version 2 and 3, are opened along with their backing files,\n"
+                "QCOW2 or raw, which are opened read-only. Compressed clusters are not supported,\n"
+                "and images with internal snapshots can only be opened read-only.\n"
+                "\n"
+                "Sparse VMDK image files are opened either as a monolithic image file or\n"
+                "through a descriptor file listing sparse, flat and zero extents in other files\n"
+                "in the same directory. Compressed and differencing VMDK images are not\n"
+                "supported.\n"                "\n"
+                "Default alignment is %u bytes.\n"
+                "Default buffer size is %i bytes.\n"
+                "\n"
+                "For syntax help with custom I/O DLL under Windows, type:\n"
+                "devio --dll\n",
+                DEF_REQUIRED_ALIGNMENT,
+                DEF_BUFFER_SIZE);
+        return -1;
+    }
+
+    if (worker_count > 0 && !multi_mode)
+    {
+        fprintf(stderr, "Worker threads require --multi.\n");
+        return -1;
+    }
+
+    if (writeback.limit > 0 && !sync_set)
+        writeback.mode = SYNC_FLUSH;
+
+    // io_uring instance is only used from main thread
+    if (worker_count > 0 && uring_mode)
+    {
+        fprintf(stderr, "Worker threads cannot be combined with --io=uring.\n");
+        return -1;
+    }
+
+    comm_device = argv[1];
+
+    if (dll_mode)
+    {
+        if (devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
+            libhandle = dll_open(argv[2], 1, &dll_read, &dll_write, &dll_close,
+                                 (off_t_64 *)&devio_info.file_size);
+        else
+            libhandle = dll_open(argv[2], 0, &dll_read, &dll_write, &dll_close,
+                                 (off_t_64 *)&devio_info.file_size);
+
+        if (libhandle == NULL)
+        {
+            syslog(LOG_ERR, "Library call failed to open '%s': %m\n", argv[2]);
+            return 1;
+        }
+    }
+    else
+    {
+        if (devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
+            image_fd = _open(argv[2], O_BINARY | O_DIRECT | O_FSYNC | O_RDONLY);
+        else
+            image_fd = _open(argv[2], O_BINARY | O_DIRECT | IMAGE_SYNC_FLAG | O_RDWR);
+
+        if (image_fd == -1)
+        {
+            syslog(LOG_ERR, "Failed to open '%s': %m\n", argv[2]);
+            return 1;
+        }
+    }
+
+    printf("Successfully opened '%s'.\n", argv[2]);
+
+#ifdef __linux__
+    if (uring_mode && !uring_init())
+    {
+        puts("io_uring not available, using synchronous I/O.");
+        uring_mode = 0;
+    }
+#endif
+
+    // Autodetect Microsoft .vhd files
+    readdone = physical_read(&vhd_info, (safeio_size_t)sizeof(vhd_info), 0);
+
+    if (auto_vhd_detect &&
+        (readdone == sizeof(vhd_info)) &&
+        (strncmp((char *)vhd_info.Header.Cookie, "cxsparse", 8) == 0) &&
+        (strncmp((char *)vhd_info.Footer.Cookie, "conectix", 8) == 0) &&
+        (vhd_info.Footer.DiskType == 0x03000000UL ||
+         vhd_info.Footer.DiskType == 0x04000000UL))
+    {
+        void *geometry = &vhd_info.Footer.DiskGeometry;
+
+        if (vhd_info.Footer.DiskType == 0x04000000UL)
+            puts("Detected differencing Microsoft VHD image file format.");
+        else
+            puts("Detected dynamically expanding Microsoft VHD image file format.");
+
+        // Calculate vhd shifts
+        current_size = GetBigEndian64(vhd_info.Footer.CurrentSize);
+        table_offset = GetBigEndian64(vhd_info.Header.TableOffset);
+
+        sector_size = 512;
+
+        block_size = ntohl(vhd_info.Header.BlockSize);
+
+        for (block_shift = 0;
+             (block_shift < 64) &&
+             ((((safeio_size_t)1) << block_shift) != block_size);
+             block_shift++)
+            ;
+
+        vhd_gap_buf = (char *)malloc(sector_size);
+        if (vhd_gap_buf == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 2;
+        }
+
+        // Block allocation table is kept in memory from here on
+        vhd_bat_entries = ntohl(vhd_info.Header.MaxTableEntries);
+
+        vhd_bat = (uint32_t *)malloc((size_t)vhd_bat_entries << 2);
+        if (vhd_bat == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 2;
+        }
+
+        if (!vhd_load_bat())
+            return 2;
+
+        if (!vhd_bitmaps_init())
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 2;
+        }
+
+        devio_info.file_size = current_size;
+
+        vhd_mode = 1;
+
+        printf("VHD block size: %u bytes. C/H/S geometry: %u/%u/%u.\n",
+               (unsigned int)block_size,
+               (unsigned int)ntohs(*(u_short *)geometry),
+               (unsigned int)((u_char *)geometry)[2],
+               (unsigned int)((u_char *)geometry)[3]);
+    }
+    else if (auto_vhd_detect && readdone >= 8 &&
+             memcmp(&vhd_info, "vhdxfile", 8) == 0)
+    {
+        if (!vhdx_open((char)((devio_info.flags & FSCRYPTDPROXY_FLAG_RO) != 0)))
+            return 2;
+
+        if (vhdx.leave_allocated)
+            puts("Detected fixed Microsoft VHDX image file format.");
+        else
+            puts("Detected dynamically expanding Microsoft VHDX image file format.");
+
+        devio_info.file_size = current_size;
+
+        vhdx_mode = 1;
+
+        printf("VHDX block size: %u bytes. Logical sector size: %u bytes.\n",
+               (unsigned int)block_size, (unsigned int)sector_size);
+    }
+    else if (auto_vhd_detect && readdone >= 4 &&
+             GetBigEndian32U((uint8_t *)&vhd_info) == QCOW2_MAGIC)
+    {
+        if (!qcow2_open(argv[2],
+                        (char)((devio_info.flags & FSCRYPTDPROXY_FLAG_RO) != 0)))
+            return 2;
+
+        puts("Detected QEMU QCOW2 image file format.");
+
+        devio_info.file_size = current_size;
+
+        qcow2_mode = 1;
+
+        printf("QCOW2 version: %i. Cluster size: %u bytes.\n",
+               qcow2.version, (unsigned int)block_size);
+    }
+    else if (auto_vhd_detect &&
+             ((readdone >= 4 &&
+               GetLittleEndian32U((uint8_t *)&vhd_info) == VMDK_MAGIC) ||
+              (readdone >= 21 &&
+               memcmp(&vhd_info, "# Disk DescriptorFile", 21) == 0)))
+    {
+        if (!vmdk_open(argv[2],
+                       (char)((devio_info.flags & FSCRYPTDPROXY_FLAG_RO) != 0)))
+            return 2;
+
+        puts("Detected VMware VMDK image file format.");
+
+        devio_info.file_size = current_size;
+
+        vmdk_mode = 1;
+
+        printf("VMDK extents: %i.\n", vmdk.count);
+    }
+
+    for (sector_shift = 0;
+         (sector_shift < 64) &&
+         ((((safeio_size_t)1) << sector_shift) != sector_size);
+         sector_shift++)
+        ;
+
+    // Parent images are opened by path, next to image file
+    if (vhd_mode && vhd_info.Footer.DiskType == 0x04000000UL)
+    {
+        if (dll_mode)
+        {
+            syslog(LOG_ERR, "Differencing VHD images cannot be opened through a DLL.\n");
+            return 2;
+        }
+
+        if (!vhd_chain_open(argv[2]))
+            return 2;
+    }
+
+    if (argc > 3)
+    {
+        ULONGLONG spec_size = 0;
+        char suf = 0;
+
+        if (sscanf(argv[3], ULL_FMT "%c", &spec_size, &suf) == 2)
+        {
+            switch (suf)
+            {
+            case 'T':
+                spec_size <<= 10;
+            case 'G':
+                spec_size <<= 10;
+            case 'M':
+                spec_size <<= 10;
+            case 'K':
+                spec_size <<= 10;
+            case 'B':
+                break;
+            case 't':
+                spec_size *= 1000;
+            case 'g':
+                spec_size *= 1000;
+            case 'm':
+                spec_size *= 1000;
+            case 'k':
+                spec_size *= 1000;
+            case 'b':
+                break;
+            default:
+                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
+            }
+
+            devio_info.file_size = spec_size;
+        }
+        else if (spec_size < 512)
+        {
+            partition_number = (int)spec_size;
+        }
+        else
+        {
+            devio_info.file_size = spec_size << 9;
+        }
+    }
+    else
+    {
+        partition_number = 1;
+    }
+
+#ifdef _WIN32
+
+    if (devio_info.file_size == 0)
+    {
+        if (dll_mode)
+            syslog(LOG_ERR, "DLL did not return size of image/partition.\n");
+        else
+        {
+            HANDLE h = (HANDLE)_get_osfhandle(image_fd);
+            BY_HANDLE_FILE_INFORMATION by_handle_file_info;
+
+            if ((!GetFileInformationByHandle(h, &by_handle_file_info) &&
+                 (by_handle_file_info.nFileSizeLow = GetFileSize(h,
+                                                                 &by_handle_file_info.nFileSizeHigh)) == INVALID_FILE_SIZE) &&
+                GetLastError() != NO_ERROR)
+            {
+                // If not regular disk file, try to lock volume using FSCTL operation.
+
+                DWORD dw;
+                FlushFileBuffers(h);
+                if (DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0,
+                                    &dw, NULL))
+                {
+                    if (!DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL,
+                                         0, &dw, NULL))
+                    {
+                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
+                               argv[2]);
+
+                        if (~devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
+                            return 9;
+                    }
+                }
+                else
+                {
+                    switch (GetLastError())
+                    {
+                    case ERROR_NOT_SUPPORTED:
+                    case ERROR_INVALID_FUNCTION:
+                    case ERROR_INVALID_HANDLE:
+                    case ERROR_INVALID_PARAMETER:
+                        break;
+
+                    default:
+                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
+                               argv[2]);
+
+                        if (~devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
+                            return 9;
+                    }
+                }
+
+                if (devio_info.file_size == 0)
+                {
+                    PARTITION_INFORMATION partition_info = {0};
+
+                    if (!DeviceIoControl(h, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0,
+                                         &partition_info, sizeof(partition_info),
+                                         &dw, NULL))
+                    {
+                        syslog(LOG_ERR,
+                               "Cannot determine size of disk volume.\n");
+                    }
+                    else
+                    {
+                        devio_info.file_size =
+                            partition_info.PartitionLength.QuadPart;
+                    }
+                }
+            }
+            else
+            {
+                LARGE_INTEGER file_size = {0};
+                file_size.HighPart = by_handle_file_info.nFileSizeHigh;
+                file_size.LowPart = by_handle_file_info.nFileSizeLow;
+
+                devio_info.file_size = file_size.QuadPart;
+            }
+        }
+    }
+#else
+    if (devio_info.file_size == 0)
+    {
+        struct stat file_stat = {0};
+        if (fstat(image_fd, &file_stat) == 0)
+            devio_info.file_size = file_stat.st_size;
+        else
+            syslog(LOG_ERR, "Cannot determine size of image/partition: %m\n");
+    }
+#endif
+
+    if (current_size == 0)
+        current_size = devio_info.file_size;
+
+#ifdef __linux__
+    // Size of raw image file, or block device, within which read responses
+    // can be sent directly from the file
+    if (!dll_mode && !vhd_mode)
+    {
+        image_file_size = _lseeki64(image_fd, 0, SEEK_END);
+        if (image_file_size == -1)
+            image_file_size = 0;
+    }
+
+    // Unmapped and zeroed ranges are handled with ioctls on block devices
+    // and fallocate() on image files
+    if (!dll_mode)
+    {
+        struct stat file_stat = {0};
+
+        if (fstat(image_fd, &file_stat) == 0 && S_ISBLK(file_stat.st_mode))
+        {
+            image_blkdev = 1;
+            image_discard_granularity =
+                blkdev_discard_granularity(file_stat.st_rdev);
+        }
+    }
+
+    // Holes in raw image files are read as zeroes without touching file
+    if (!dll_mode && !image_blkdev && !vhd_mode && !vhdx_mode && !qcow2_mode &&
+        !vmdk_mode)
+        extent_map_build();
+
+    // Metadata of writable dynamic VHD image files goes through a journal
+    // next to image file. Journal left by a previous run is replayed even if
+    // it is not to be used from now on.
+    if (vhd_mode && !dll_mode && !image_blkdev &&
+        (~devio_info.flags & FSCRYPTDPROXY_FLAG_RO) &&
+        !vhd_journal_open(argv[2], vhd_journal_mode))
+        return 2;
+
+    // Image file is opened through page cache, and only switched to direct
+    // I/O here, once it has been opened again by journal setup
+    if (cache_mode == CACHE_DIRECT && !dll_mode)
+        direct_io_setup();
+
+    if (cache_mode == CACHE_MMAP && !dll_mode)
+        image_map_open();
+#endif
+
+    if (devio_info.file_size != 0)
+    {
+        printf("Image size used: " ULL_FMT " bytes.\n", devio_info.file_size);
+    }
+
+    if (partition_number >= 1 && partition_number < 512)
+    {
+        if (logical_read(mbr, 512, 0) < 512)
+        {
+            syslog(LOG_ERR, "Error reading device: %m\n");
+        }
+        else if ((*(u_char *)(mbr + 0x01FE) == 0x55) &&
+                 (*(u_char *)(mbr + 0x01FF) == 0xAA) &&
+                 ((*(u_char *)(mbr + 0x01BE) & 0x7F) == 0) &&
+                 ((*(u_char *)(mbr + 0x01CE) & 0x7F) == 0) &&
+                 ((*(u_char *)(mbr + 0x01DE) & 0x7F) == 0) &&
+                 ((*(u_char *)(mbr + 0x01EE) & 0x7F) == 0))
+        {
+            size_t i = 0;
+            int c = 0;
+
+            puts("Detected a master boot record at sector 0.");
+
+            image_offset = 0;
+
+            for (i = 0; i < 4; i++)
+            {
+                char type = *(mbr + 512 - 66 + (i << 4) + 4);
+
+                if (type == 0)
+                {
+                    continue;
+                }
+
+                if (type == 0x05 || type == 0x0F)
+                {
+                    char read_next_ebr = TRUE;
+
+                    off_t_64 first_ebr_offset =
+                        ((off_t_64)GetLittleEndian32U((uint8_t *)mbr + 512 - 66 + (i << 4) + 8))
+                        << sector_shift;
+
+                    image_offset = first_ebr_offset;
+
+                    while (read_next_ebr)
+                    {
+                        char ebr[512];
+                        size_t e;
+
+                        read_next_ebr = FALSE;
+
+                        printf("Reading extended partition table at " SLL_FMT
+                               ".\n",
+                               (int64_t)image_offset);
+
+                        if (logical_read(ebr, 512, image_offset) == 512 &&
+                            (*(u_char *)(ebr + 0x01FE) == 0x55) &&
+                            (*(u_char *)(ebr + 0x01FF) == 0xAA) &&
+                            ((*(u_char *)(ebr + 0x01BE) & 0x7F) == 0) &&
+                            ((*(u_char *)(ebr + 0x01CE) & 0x7F) == 0) &&
+                            ((*(u_char *)(ebr + 0x01DE) & 0x7F) == 0) &&
+                            ((*(u_char *)(ebr + 0x01EE) & 0x7F) == 0))
+                        {
+                            puts("Found valid extended partition table.");
+                        }
+                        else
+                        {
+                            puts("Invalid extended partition table.");
+                            break;
+                        }
+
+                        for (e = 0; e < 4; e++)
+                        {
+                            type = *(ebr + 512 - 66 + (e << 4) + 4);
+
+                            if (type == 0)
+                            {
+                                continue;
+                            }
+
+                            if (type == 0x05 || type == 0x0F)
+                            {
+                                image_offset =
+                                    first_ebr_offset + (((off_t_64)
+                                                             GetLittleEndian32U((uint8_t *)ebr + 512 - 66 + (e << 4) + 8))
+                                                        << sector_shift);
+
+                                read_next_ebr = TRUE;
+
+                                break;
+                            }
+
+                            ++c;
+
+                            if (c == partition_number)
+                            {
+                                image_offset += ((off_t_64)
+                                                     GetLittleEndian32U((uint8_t *)ebr + 512 - 66 + (e << 4) + 8))
+                                                << sector_shift;
+                                devio_info.file_size = ((off_t_64)
+                                                            GetLittleEndian32U((uint8_t *)ebr + 512 - 66 + (e << 4) + 12))
+                                                       << sector_shift;
+
+                                break;
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    ++c;
+
+                    if (c == partition_number)
+                    {
+                        image_offset = ((off_t_64)
+                                            GetLittleEndian32U((uint8_t *)mbr + 512 - 66 + (i << 4) + 8))
+                                       << sector_shift;
+                        devio_info.file_size = ((off_t_64)
+                                                    GetLittleEndian32U((uint8_t *)mbr + 512 - 66 + (i << 4) + 12))
+                                               << sector_shift;
+
+                        break;
+                    }
+                }
+            }
+
+            if ((devio_info.file_size == 0) ||
+                ((current_size != 0) &&
+                 (image_offset + (off_t_64)devio_info.file_size > current_size)))
+            {
+                syslog(LOG_ERR,
+                       "Partition %i not found.\n", partition_number);
+                return 1;
+            }
+
+            printf("Using partition %i.\n", partition_number);
+        }
+        else
+            puts("No master boot record detected. Using entire image.");
+    }
+
+    if (image_offset == 0 && argc > 4)
+    {
+        int64_t offset64 = image_offset;
+
+        char suf = 0;
+        if (sscanf(argv[4], SLL_FMT "%c", &offset64, &suf) == 2)
+            switch (suf)
+            {
+            case 'T':
+                offset64 <<= 10;
+            case 'G':
+                offset64 <<= 10;
+            case 'M':
+                offset64 <<= 10;
+            case 'K':
+                offset64 <<= 10;
+            case 'B':
+                break;
+            case 't':
+                offset64 *= 1000;
+            case 'g':
+                offset64 *= 1000;
+            case 'm':
+                offset64 *= 1000;
+            case 'k':
+                offset64 *= 1000;
+            case 'b':
+                break;
+            default:
+                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
+            }
+        else
+            offset64 <<= 9;
+
+        if ((((int64_t)(-1) - (off_t_64)(-1)) & offset64) != 0)
+        {
+            syslog(LOG_ERR, "Offset too big for this system.\n");
+        }
+
+        image_offset = (off_t_64)offset64;
+
+        argc--;
+        argv++;
+    }
+
+    if (argc > 4)
+    {
+        if (sscanf(argv[4], ULL_FMT, &devio_info.req_alignment) != 1)
+        {
+            syslog(LOG_ERR, "Invalid alignment specification: '%s'\n",
+                   argv[4]);
+
+            return -1;
+        }
+    }
+    else
+    {
+        devio_info.req_alignment = DEF_REQUIRED_ALIGNMENT;
+    }
+
+    if (argc > 5)
+    {
+        char suf = 0;
+        if (sscanf(argv[5], SIZ_FMT "%c", &buffer_size, &suf) == 2)
+        {
+            switch (suf)
+            {
+            case 'T':
+                buffer_size <<= 10;
+            case 'G':
+                buffer_size <<= 10;
+            case 'M':
+                buffer_size <<= 10;
+            case 'K':
+                buffer_size <<= 10;
+            case 'B':
+                break;
+            case 't':
+                buffer_size *= 1000;
+            case 'g':
+                buffer_size *= 1000;
+            case 'm':
+                buffer_size *= 1000;
+            case 'k':
+                buffer_size *= 1000;
+            case 'b':
+                break;
+            default:
+                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
+            }
+        }
+
+        /*
+        buffer_size = 0;
+        sscanf(argv[5], "%u", &buffer_size);
+        */
+    }
+
+    printf("Total size: " SLL_FMT " bytes. Using " ULL_FMT " bytes from offset " SLL_FMT ".\n"
+           "Required alignment: " ULL_FMT " bytes.\n"
+           "Buffer size: " SIZ_FMT " bytes.\n",
+           (int64_t)current_size,
+           devio_info.file_size,
+           (int64_t)image_offset,
+           devio_info.req_alignment,
+           buffer_size);
+
+#ifdef __linux__
+    // A VHD metadata journal is committed by main thread when interval has
+    // passed instead
+    if (writeback.mode == SYNC_INTERVAL && !dll_mode &&
+        (~devio_info.flags & FSCRYPTDPROXY_FLAG_RO) &&
+        vhd_journal.fd == -1 && !sync_start())
+        return 1;
+#endif
+
+    retval = do_comm(comm_device);
+
+    // Writes not yet flushed by client are synced on a clean exit
+    if (writeback.mode != SYNC_ALWAYS)
+        image_flush();
+
+    if (vhd_mode)
+    {
+        vhd_flush_metadata(1);
+        vhd_trim();
+        vhd_journal_close();
+    }
+
+    if (vhdx_mode)
+        vhdx_trim();
+
+    if (qcow2_mode)
+        qcow2_trim();
+
+    if (vmdk_mode)
+        vmdk_close();
+
+    block_cache_print_stats();
+
+#ifdef __linux__
+    if (direct_io.align != 0)
+        printf("Direct I/O: " ULL_FMT " transfers bounced through aligned "
+               "buffers.\n", direct_io.bounced);
+
+    if (image_map.base != NULL)
+        munmap(image_map.base, (size_t)image_map.size);
+#endif
+
+    printf("Image close result: %i\n", physical_close(image_fd));
+
+    return retval;
+}
+
+#ifdef _WIN32
+int do_comm_shm(PDEVIO_CONN conn, char *comm_device)
+{
+    HANDLE hFileMap = NULL;
+    MEMORY_BASIC_INFORMATION memory_info = {0};
+    safeio_size_t detected_buffer_size = 0;
+    ULARGE_INTEGER map_size = {0};
+    char *objname = (char *)malloc(OBJNAME_SIZE);
+    char *namespace_prefix;
+    HANDLE h = CreateFile("\\\\?\\Global", 0, FILE_SHARE_READ, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ((h == INVALID_HANDLE_VALUE) && (GetLastError() == ERROR_FILE_NOT_FOUND))
+        namespace_prefix = "";
+    else
+        namespace_prefix = "Global\\";
+
+    if (h != INVALID_HANDLE_VALUE)
+        CloseHandle(h);
+
+    if (objname == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return -1;
+    }
+
+    puts("Shared memory operation.");
+
+    _snprintf(objname, OBJNAME_SIZE,
+              "%s%s", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+
+    map_size.QuadPart = (ULONGLONG)conn->buffer_size + FSCRYPTDPROXY_HEADER_SIZE;
+
+    hFileMap = CreateFileMapping(INVALID_HANDLE_VALUE,
+                                 NULL,
+                                 PAGE_READWRITE | SEC_COMMIT,
+                                 map_size.HighPart,
+                                 map_size.LowPart,
+                                 objname);
+
+    if (hFileMap == NULL)
+    {
+        syslog(LOG_ERR, "CreateFileMapping() failed: %m\n");
+        return 2;
+    }
+
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        syslog(LOG_ERR, "A service with this name is already running.\n");
+        return 2;
+    }
+
+    conn->shm_view = (char *)MapViewOfFile(hFileMap, FILE_MAP_WRITE, 0, 0, 0);
+
+    if (conn->shm_view == NULL)
+    {
+        syslog(LOG_ERR, "MapViewOfFile() failed: %m\n");
+        return 2;
+    }
+
+    conn->buf = conn->shm_view + FSCRYPTDPROXY_HEADER_SIZE;
+
+    if (!VirtualQuery(conn->shm_view, &memory_info, sizeof(memory_info)))
+    {
+        syslog(LOG_ERR, "VirtualQuery() failed: %m\n");
+        return 2;
+    }
+
+    detected_buffer_size = (safeio_size_t)(memory_info.RegionSize - FSCRYPTDPROXY_HEADER_SIZE);
+
+    conn->buffer_size = detected_buffer_size;
+
+    _snprintf(objname, OBJNAME_SIZE,
+              "%s%s_Server", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+    shm_server_mutex = CreateMutex(NULL, FALSE, objname);
+
+    if (shm_server_mutex == NULL)
+    {
+        syslog(LOG_ERR, "CreateMutex() failed: %m\n");
+        return 2;
+    }
+
+    if (WaitForSingleObject(shm_server_mutex, 0) != WAIT_OBJECT_0)
+    {
+        syslog(LOG_ERR, "A service with this name is already running.\n");
+        return 2;
+    }
+
+    _snprintf(objname, OBJNAME_SIZE,
+              "%s%s_Request", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+    shm_request_event = CreateEvent(NULL, FALSE, FALSE, objname);
+
+    if (shm_request_event == NULL)
+    {
+        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
+        return 2;
+    }
+
+    _snprintf(objname, OBJNAME_SIZE,
+              "%s%s_Response", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+    shm_response_event = CreateEvent(NULL, FALSE, FALSE, objname);
+
+    if (shm_response_event == NULL)
+    {
+        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
+        return 2;
+    }
+
+    free(objname);
+    objname = NULL;
+
+    shm_mode = 1;
+
+    printf("Waiting for connection on object %s. Press Ctrl+C to cancel.\n",
+           comm_device);
+
+    if (WaitForSingleObject(shm_request_event, INFINITE) != WAIT_OBJECT_0)
+    {
+        syslog(LOG_ERR, "Wait failed: %m.\n");
+        return 2;
+    }
+
+    printf("Connection on object %s.\n",
+           comm_device);
+
+    return 0;
+}
+
+int do_comm_drv(PDEVIO_CONN conn, char *comm_device)
+{
+    int rc;
+
+    char *objname = (char *)malloc(OBJNAME_SIZE);
+    if (objname == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m");
+        return -1;
+    }
+
+    drv_memory_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    drv_request_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (drv_memory_io.hEvent == NULL || drv_request_io.hEvent == NULL)
+    {
+        syslog(LOG_ERR, "Event object create failed: %m");
+        return -1;
+    }
+
+    puts("Driver mode.");
+
+    _snprintf(objname, OBJNAME_SIZE,
+              "%ws\\%s", DEVIODRV_DEVICE_DOSDEV_NAME, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+
+    conn->sd = (SOCKET)CreateFile(objname, GENERIC_ALL, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+
+    if (conn->sd == INVALID_SOCKET)
+    {
+        if (GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            syslog(LOG_ERR, "A service with this name is already running.\n");
+        }
+        else
+        {
+            syslog(LOG_ERR, "Error opening '%s': %m", objname);
+        }
+
+        return 2;
+    }
+
+    free(objname);
+    objname = NULL;
+
+    rc = alloc_drv_buffer(conn);
+    if (rc > 0)
+    {
+        return rc;
+    }
+
+    drv_mode = 1;
+
+    printf("Waiting for client connection on object %s. Press Ctrl+C to cancel.\n",
+           comm_device);
+
+    ((PFSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER)conn->shm_view)->request_code = FSCRYPTDPROXY_REQ_INFO;
+
+    if (!send_info(conn))
+    {
+        syslog(LOG_ERR, "Wait failed: %m.\n");
+        return 2;
+    }
+
+    printf("Connection on object %s.\n",
+           comm_device);
+
+    return 0;
+}
+#endif
+
+// Dispatches a request where request code, or tagged header, has already
+// been read from the connection. Returns zero if connection cannot be used
+// any longer.
+int handle_request(PDEVIO_CONN conn, ULONGLONG req)
+{
+    switch (req)
+    {
+    case FSCRYPTDPROXY_REQ_INFO:
+        return send_info(conn);
+
+    case FSCRYPTDPROXY_REQ_READ:
+        return read_data(conn);
+
+    case FSCRYPTDPROXY_REQ_WRITE:
+    case FSCRYPTDPROXY_REQ_WRITE_EX:
+        return write_data(conn, req);
+
+    case FSCRYPTDPROXY_REQ_UNMAP:
+    case FSCRYPTDPROXY_REQ_ZERO:
+        return range_list_data(conn, req);
+
+    case FSCRYPTDPROXY_REQ_FLUSH:
+        return flush_data(conn);
+
+    case FSCRYPTDPROXY_REQ_TAGGED:
+        return set_tagged(conn);
+
+    default:
+        return send_failed(conn);
+    }
+}
+
+#ifdef __linux__
+
+#define MULTI_MAX_EVENTS 64
+
+// Largest number of buffers gathered into one send system call.
+#define MULTI_MAX_IOV 64
+
+// Number of requests to receive from one connection before giving other
+// connections a chance. Remaining requests are picked up next time epoll
+// reports the connection as readable.
+#define MULTI_MAX_REQUESTS_PER_EVENT 16
+
+// Number of bytes that follow request code in request header.
+safeio_size_t request_header_size(ULONGLONG req)
+{
+    switch (req)
+    {
+    case FSCRYPTDPROXY_REQ_READ:
+        return sizeof(FSCRYPTDPROXY_READ_REQ) - sizeof(ULONGLONG);
+
+    case FSCRYPTDPROXY_REQ_WRITE:
+        return sizeof(FSCRYPTDPROXY_WRITE_REQ) - sizeof(ULONGLONG);
+
+    case FSCRYPTDPROXY_REQ_WRITE_EX:
+        return sizeof(FSCRYPTDPROXY_WRITE_EX_REQ) - sizeof(ULONGLONG);
+
+    case FSCRYPTDPROXY_REQ_UNMAP:
+    case FSCRYPTDPROXY_REQ_ZERO:
+        return sizeof(FSCRYPTDPROXY_UNMAP_REQ) - sizeof(ULONGLONG);
+
+    case FSCRYPTDPROXY_REQ_TAGGED:
+        return sizeof(FSCRYPTDPROXY_TAGGED_REQ) - sizeof(ULONGLONG);
+
+    default:
+        return 0;
+    }
+}
+
+// Size of request code or tagged header that starts each request.
+safeio_size_t request_code_size(PDEVIO_CONN conn)
+{
+    return conn->tagged ?
+        sizeof(FSCRYPTDPROXY_TAGGED_HEADER) : sizeof(ULONGLONG);
+}
+
+// Updates fixed buffer slot for request buffer. A slot held for a previous
+// buffer is released, and current buffer, if any, is registered in a free
+// slot. Requests without a slot use non-fixed operations.
+void uring_update_req_buf(PDEVIO_REQ req)
+{
+    struct iovec iov = {0};
+    struct io_uring_rsrc_update2 update = {0};
+
+    update.data = (uintptr_t)&iov;
+    update.nr = 1;
+
+    if (req->buf_index >= 0)
+    {
+        update.offset = req->buf_index;
+
+        syscall(__NR_io_uring_register, uring.fd,
+                IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof update);
+
+        uring.free_slots[uring.free_slot_count++] = req->buf_index;
+        req->buf_index = -1;
+    }
+
+    if (req->buf == NULL || uring.free_slot_count == 0)
+        return;
+
+    iov.iov_base = req->buf;
+    iov.iov_len = req->buffer_size;
+    update.offset = uring.free_slots[uring.free_slot_count - 1];
+
+    if (syscall(__NR_io_uring_register, uring.fd,
+                IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof update) == -1)
+    {
+        dbglog((LOG_ERR, "Failed registering io_uring buffer: %m\n"));
+        return;
+    }
+
+    req->buf_index = uring.free_slots[--uring.free_slot_count];
+}
+
+// Makes sure request data buffer can hold size bytes. Returns zero if it
+// cannot be enlarged.
+int req_buf_alloc(PDEVIO_REQ req, safeio_size_t size)
+{
+    char *new_buf;
+
+    if (req->buffer_size >= size)
+        return 1;
+
+    new_buf = (char *)buf_alloc(size);
+    if (new_buf == NULL)
+    {
+        syslog(LOG_ERR, "Failed allocating new buffer: %m\n");
+        return 0;
+    }
+
+    buf_free(req->buf, req->buffer_size);
+    req->buf = new_buf;
+    req->buffer_size = size;
+
+    if (uring_mode)
+        uring_update_req_buf(req);
+
+    return 1;
+}
+
+PDEVIO_REQ req_alloc(PDEVIO_CONN conn)
+{
+    PDEVIO_REQ req = conn->free_reqs;
+
+    if (req != NULL)
+    {
+        conn->free_reqs = req->next;
+    }
+    else
+    {
+        req = (PDEVIO_REQ)calloc(1, sizeof(DEVIO_REQ));
+        if (req == NULL)
+        {
+            syslog(LOG_ERR, "calloc() failed: %m\n");
+            return NULL;
+        }
+
+        req->conn = conn;
+        req->buf_index = -1;
+    }
+
+    req->next = NULL;
+    req->resp_size = 0;
+    req->resp_payload_size = 0;
+    req->sendfile = 0;
+    conn->outstanding++;
+
+    return req;
+}
+
+void req_free(PDEVIO_REQ req)
+{
+    PDEVIO_CONN conn = req->conn;
+
+    req->next = conn->free_reqs;
+    conn->free_reqs = req;
+    conn->outstanding--;
+}
+
+// Stages response for a request, preceded by tagged header if client uses
+// tagged operation. Payload_size bytes from request buffer are sent after
+// the response structure.
+void req_respond(PDEVIO_REQ req, const void *resp, safeio_size_t resp_size,
+                 safeio_size_t payload_size)
+{
+    if (req->conn->tagged)
+    {
+        memcpy(req->resp, &req->hdr, sizeof req->hdr);
+        req->resp_size = sizeof req->hdr;
+    }
+    else
+    {
+        req->resp_size = 0;
+    }
+
+    memcpy(req->resp + req->resp_size, resp, resp_size);
+    req->resp_size += resp_size;
+    req->resp_payload_size = payload_size;
+
+    req->conn->stat_responses++;
+    req->conn->stat_pieces += payload_size > 0 ? 2 : 1;
+}
+
+// Queues a request with its response staged for sending to client.
+void req_complete(PDEVIO_REQ req)
+{
+    PDEVIO_CONN conn = req->conn;
+
+    if (conn->send_tail != NULL)
+        conn->send_tail->next = req;
+    else
+        conn->send_head = req;
+
+    conn->send_tail = req;
+    req->next = NULL;
+}
+
+// Connections with completed io_uring requests, to be flushed by event
+// loop.
+PDEVIO_CONN multi_ready = NULL;
+
+void multi_set_ready(PDEVIO_CONN conn)
+{
+    if (conn->ready)
+        return;
+
+    conn->ready = 1;
+    conn->ready_next = multi_ready;
+    multi_ready = conn;
+}
+
+// Removes a completed request from list of requests being executed on its
+// connection.
+void req_io_unlink(PDEVIO_REQ req)
+{
+    PDEVIO_REQ *ptr;
+
+    for (ptr = &req->conn->io_head; *ptr != req; ptr = &(*ptr)->next)
+        ;
+
+    *ptr = req->next;
+}
+
+int req_is_write(PDEVIO_REQ req)
+{
+    return req->hdr.request_code == FSCRYPTDPROXY_REQ_WRITE ||
+           req->hdr.request_code == FSCRYPTDPROXY_REQ_WRITE_EX;
+}
+
+// Unmap and zero requests carry a list of ranges anywhere on the device, so
+// they are ordered against all other requests on the same connection.
+int req_is_range_list(PDEVIO_REQ req)
+{
+    return req->hdr.request_code == FSCRYPTDPROXY_REQ_UNMAP ||
+           req->hdr.request_code == FSCRYPTDPROXY_REQ_ZERO;
+}
+
+// Flush requests cover writes received before them, so like range list
+// requests they wait for everything in flight on the same connection.
+int req_is_barrier(PDEVIO_REQ req)
+{
+    return req_is_range_list(req) ||
+           req->hdr.request_code == FSCRYPTDPROXY_REQ_FLUSH;
+}
+
+// Checks whether a request overlaps the range of a request on the same
+// connection already submitted to io_uring or worker threads, where at
+// least one of them is a write.
+int req_overlaps_io(PDEVIO_REQ req)
+{
+    PDEVIO_REQ io_req;
+
+    for (io_req = req->conn->io_head; io_req != NULL; io_req = io_req->next)
+    {
+        if (req_is_barrier(req) || req_is_barrier(io_req))
+            return 1;
+
+        if (!req_is_write(io_req) && !req_is_write(req))
+            continue;
+
+        if (io_req->offset < req->offset + req->length &&
+            req->offset < io_req->offset + io_req->length)
+            return 1;
     }
 
-    if (argc >= 3 && _strnicmp(argv[1], "--dll=", 6) == 0)
+    return 0;
+}
+
+// Submits image file I/O for a read or write request to io_uring, using
+// request buffer as fixed buffer if registered. Response is queued when
+// operation completes. Only raw image files are supported, VHD requests
+// need several dependent operations. Returns zero if request needs to be
+// executed synchronously instead.
+int uring_submit_req(PDEVIO_REQ req, safeio_size_t size)
+{
+    PDEVIO_CONN conn = req->conn;
+    struct io_uring_sqe *sqe;
+    char write = (char)req_is_write(req);
+    __u8 opcode;
+
+    if (uring.event_fd == -1 || vhd_mode || vhdx_mode || qcow2_mode ||
+        vmdk_mode || block_cache.block_count > 0)
+        return 0;
+
+    // Reads within holes are filled in synchronously, unless they need to
+    // wait for a write submitted before
+    if (!write && !req_overlaps_io(req) &&
+        extent_map_is_hole((off_t_64)(image_offset + req->offset), size))
+        return 0;
+
+    // So are reads from a mapped image file, and transfers bounced for
+    // direct I/O
+    if ((!write && image_map.base != NULL) ||
+        !direct_io_aligned(req->buf, size,
+                           (off_t_64)(image_offset + req->offset)))
+        return 0;
+
+    if (req->buf_index >= 0)
+        opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else
+        opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+    sqe = uring_get_sqe(opcode, req->buf, size,
+                        (off_t_64)(image_offset + req->offset));
+    if (sqe == NULL)
     {
-#ifdef _WIN32
-        char *dllargs = argv[1] + 6;
+        uring_enter(0);
 
-        char *dllfile = strtok(dllargs, ";");
-        char *dllfunc = strtok(NULL, "");
+        sqe = uring_get_sqe(opcode, req->buf, size,
+                            (off_t_64)(image_offset + req->offset));
+        if (sqe == NULL)
+            return 0;
+    }
 
-        HMODULE hDLL;
+    dbglog((LOG_ERR, "io_uring %s request " ULL_FMT " bytes at " ULL_FMT " + " ULL_FMT ".\n",
+            write ? "write" : "read", req->length, req->offset,
+            image_offset));
 
-        hDLL = LoadLibrary(dllfile);
-        if (hDLL == NULL)
+    sqe->buf_index = req->buf_index >= 0 ? (__u16)req->buf_index : 0;
+    sqe->user_data = (uintptr_t)req;
+
+    // Overlapping requests from the same connection are executed in the
+    // order they were received. Drained operations start when everything
+    // submitted before has completed.
+    if (req_overlaps_io(req))
+        sqe->flags |= IOSQE_IO_DRAIN;
+
+    // Without write-back, image file is opened for synchronous writes
+    if (write && (req->write_flags & FSCRYPTDPROXY_WRITE_FLAG_FUA) &&
+        SYNC_ON_FLUSH)
+        sqe->rw_flags = RWF_DSYNC;
+
+    req->io_size = size;
+    req->next = conn->io_head;
+    conn->io_head = req;
+
+    return 1;
+}
+
+// Completes a request submitted by uring_submit_req() and queues its
+// response.
+void uring_req_done(PDEVIO_REQ req, int res)
+{
+    PDEVIO_CONN conn = req->conn;
+    safeio_ssize_t done = res;
+
+    req_io_unlink(req);
+
+    if (res < 0)
+    {
+        errno = -res;
+        done = -1;
+    }
+
+    if (req->hdr.request_code == FSCRYPTDPROXY_REQ_READ)
+    {
+        FSCRYPTDPROXY_READ_REQ req_block = {0};
+        FSCRYPTDPROXY_READ_RESP resp_block = {0};
+
+        req_block.request_code = req->hdr.request_code;
+        req_block.offset = req->offset;
+        req_block.length = req->length;
+
+        // Part of buffer beyond end of image reads as zeroes
+        if (done >= 0 && done < (safeio_ssize_t)req->io_size)
+            memset(req->buf + done, 0, req->io_size - done);
+
+        read_result(&req_block, req->io_size, done, &resp_block);
+
+        req_respond(req, &resp_block, sizeof resp_block,
+                    resp_block.errorno == 0 ?
+                    (safeio_size_t)resp_block.length : 0);
+    }
+    else
+    {
+        FSCRYPTDPROXY_WRITE_REQ req_block = {0};
+        FSCRYPTDPROXY_WRITE_RESP resp_block = {0};
+
+        req_block.request_code = req->hdr.request_code;
+        req_block.offset = req->offset;
+        req_block.length = req->length;
+
+        extent_map_set_data((off_t_64)(image_offset + req->offset),
+                            req->io_size);
+
+        write_result(&req_block, done, &resp_block);
+
+        if (resp_block.errorno == 0 &&
+            (~req->write_flags & FSCRYPTDPROXY_WRITE_FLAG_FUA) &&
+            writeback_account((safeio_size_t)done) == -1)
+            resp_block.errorno = errno;
+
+        req_respond(req, &resp_block, sizeof resp_block, 0);
+    }
+
+    req_complete(req);
+    multi_set_ready(conn);
+}
+
+// Executes a received request and stages its response. Returns zero if
+// request was submitted to io_uring and completes later.
+int req_run(PDEVIO_REQ req)
+{
+    switch (req->hdr.request_code)
+    {
+    case FSCRYPTDPROXY_REQ_INFO:
+        req_respond(req, &devio_info, sizeof devio_info, 0);
+        break;
+
+    case FSCRYPTDPROXY_REQ_READ:
+    {
+        FSCRYPTDPROXY_READ_REQ req_block = {0};
+        FSCRYPTDPROXY_READ_RESP resp_block = {0};
+        safeio_size_t size;
+
+        req_block.request_code = req->hdr.request_code;
+        req_block.offset = req->offset;
+        req_block.length = req->length;
+
+        size = (safeio_size_t)(req->length < buffer_size ?
+                               req->length : buffer_size);
+
+        // Without io_uring or worker threads, data is sent directly from
+        // image file by multi_flush()
+        if (req->conn->zero_copy && !uring_mode && worker_count == 0 &&
+            zero_copy_range(&req_block, size))
         {
-            syslog(stderr, "Error loading %s: %m\n", dllfile);
-            return 1;
+            resp_block.length = size;
+            req->sendfile = 1;
+            req->file_offset = (off_t_64)(image_offset + req->offset);
+
+            req_respond(req, &resp_block, sizeof resp_block, size);
+            break;
         }
 
-        dll_open = (dllopen_proc)GetProcAddress(hDLL, dllfunc);
-        if (dll_open == NULL)
+        if (!req_buf_alloc(req, size))
+            size = req->buffer_size;
+
+        if (uring_submit_req(req, size))
+            return 0;
+
+        do_read(&req_block, req->buf, size, &resp_block);
+
+        req_respond(req, &resp_block, sizeof resp_block,
+                    resp_block.errorno == 0 ?
+                    (safeio_size_t)resp_block.length : 0);
+        break;
+    }
+
+    case FSCRYPTDPROXY_REQ_WRITE:
+    case FSCRYPTDPROXY_REQ_WRITE_EX:
+    {
+        FSCRYPTDPROXY_WRITE_REQ req_block = {0};
+        FSCRYPTDPROXY_WRITE_RESP resp_block = {0};
+
+        req_block.request_code = req->hdr.request_code;
+        req_block.offset = req->offset;
+        req_block.length = req->length;
+
+        if ((~devio_info.flags & FSCRYPTDPROXY_FLAG_RO) &&
+            uring_submit_req(req, (safeio_size_t)req->length))
+            return 0;
+
+        do_write(&req_block, req->write_flags, req->buf, &resp_block);
+
+        req_respond(req, &resp_block, sizeof resp_block, 0);
+        break;
+    }
+
+    case FSCRYPTDPROXY_REQ_UNMAP:
+    case FSCRYPTDPROXY_REQ_ZERO:
+    {
+        FSCRYPTDPROXY_UNMAP_RESP resp_block = {0};
+
+        do_range_list(req->hdr.request_code, req->buf,
+                      (safeio_size_t)req->length, &resp_block);
+
+        req_respond(req, &resp_block, sizeof resp_block, 0);
+        break;
+    }
+
+    case FSCRYPTDPROXY_REQ_FLUSH:
+    {
+        FSCRYPTDPROXY_FLUSH_RESP resp_block = {0};
+
+        do_flush(&resp_block);
+
+        req_respond(req, &resp_block, sizeof resp_block, 0);
+        break;
+    }
+
+    default:
+    {
+        ULONGLONG errorno = ENODEV;
+        req_respond(req, &errorno, sizeof errorno, 0);
+        break;
+    }
+    }
+
+    return 1;
+}
+
+// Worker threads used with --threads. Event loop thread receives requests
+// and hands reads and writes to workers, which execute them with responses
+// staged and hand them back through done queue. Workers signal event_fd
+// when something is added to done queue.
+struct _DEVIO_WORKERS
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    PDEVIO_REQ work_head;
+    PDEVIO_REQ work_tail;
+    PDEVIO_REQ done_head;
+    PDEVIO_REQ done_tail;
+    int event_fd;
+    int cpus[CPU_SETSIZE];
+    int cpu_count;
+} workers = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+             NULL, NULL, NULL, NULL, -1};
+
+void *worker_thread(void *arg)
+{
+    for (;;)
+    {
+        PDEVIO_REQ req;
+
+        pthread_mutex_lock(&workers.lock);
+
+        while (workers.work_head == NULL)
+            pthread_cond_wait(&workers.work_ready, &workers.lock);
+
+        req = workers.work_head;
+        workers.work_head = req->work_next;
+        if (workers.work_head == NULL)
+            workers.work_tail = NULL;
+
+        pthread_mutex_unlock(&workers.lock);
+
+        req_run(req);
+
+        req->work_next = NULL;
+
+        pthread_mutex_lock(&workers.lock);
+
+        if (workers.done_tail != NULL)
+            workers.done_tail->work_next = req;
+        else
+            workers.done_head = req;
+
+        workers.done_tail = req;
+
+        pthread_mutex_unlock(&workers.lock);
+
+        eventfd_write(workers.event_fd, 1);
+    }
+
+    return NULL;
+}
+
+// Parses a list of CPU numbers and ranges, such as 0,2-5, that worker
+// threads are bound to in turn. Returns zero if list is not valid.
+int worker_parse_cpus(const char *list)
+{
+    workers.cpu_count = 0;
+
+    while (*list != 0)
+    {
+        char *end;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+
+        if (end == list)
+            return 0;
+
+        if (*end == '-')
         {
-            syslog(stderr, "Cannot find procedure %s in %s: %m\n",
-                   dllfunc,
-                   dllfile);
-            return 1;
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list)
+                return 0;
         }
 
-        dll_mode = 1;
+        if (first > last || last >= CPU_SETSIZE)
+            return 0;
 
-        argc--;
-        argv++;
-#else
-        fprintf(stderr, "Custom DLL mode only supported on Windows.\n");
-        return -1;
-#endif
+        for (; first <= last && workers.cpu_count < CPU_SETSIZE; first++)
+            workers.cpus[workers.cpu_count++] = (int)first;
+
+        if (*end == ',')
+            end++;
+        else if (*end != 0)
+            return 0;
+
+        list = end;
     }
 
-    if (argc >= 4 && strcmp(argv[1], "--drv") == 0)
+    return workers.cpu_count > 0;
+}
+
+// Starts worker threads and adds eventfd for their completions to epoll.
+// Returns zero on failure.
+int worker_start(int epfd)
+{
+    struct epoll_event ev = {0};
+    int i;
+
+    workers.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (workers.event_fd == -1)
     {
-        drv_mode = 1;
-        argv++;
-        argc--;
+        syslog(LOG_ERR, "eventfd() failed: %m\n");
+        return 0;
     }
 
-    if (argc >= 4 && strcmp(argv[1], "--novhd") == 0)
+    ev.events = EPOLLIN;
+    ev.data.ptr = &workers;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, workers.event_fd, &ev) == -1)
     {
-        auto_vhd_detect = 0;
-        argv++;
-        argc--;
+        syslog(LOG_ERR, "epoll_ctl() failed: %m\n");
+        return 0;
     }
 
-    if (argc >= 4 && strcmp(argv[1], "-r") == 0)
+    for (i = 0; i < worker_count; i++)
     {
-        devio_info.flags |= FSCRYPTDPROXY_FLAG_RO;
-        argv++;
-        argc--;
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, worker_thread, NULL);
+
+        if (err != 0)
+        {
+            errno = err;
+            syslog(LOG_ERR, "Failed creating worker thread: %m\n");
+            return 0;
+        }
+
+        if (workers.cpu_count > 0)
+        {
+            cpu_set_t cpus;
+
+            CPU_ZERO(&cpus);
+            CPU_SET(workers.cpus[i % workers.cpu_count], &cpus);
+
+            err = pthread_setaffinity_np(thread, sizeof cpus, &cpus);
+            if (err != 0)
+            {
+                errno = err;
+                syslog(LOG_ERR, "Failed setting worker thread affinity: %m\n");
+            }
+        }
+
+        pthread_detach(thread);
     }
 
-    if (argc < 3 || argc > 7)
+    printf("Started %i worker threads.\n", worker_count);
+    fflush(stdout);
+
+    return 1;
+}
+
+// Syncs image files every interval milliseconds for --sync=interval, if
+// they have been written to since last sync.
+void *sync_thread(void *arg)
+{
+    struct timespec delay;
+
+    delay.tv_sec = (time_t)(writeback.interval / 1000);
+    delay.tv_nsec = (long)(writeback.interval % 1000) * 1000000;
+
+    for (;;)
     {
-        fprintf(stderr,
-                "devio - Device I/O Service ver " DEVIO_VERSION "\n"
-                "With support for Microsoft VHD format, custom DLL files, shared memory proxy\n"
-                "operation and also for use with DevIO Client Driver, if installed.\n"
-                "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
-                "\n"
-                "Usage:\n"
-                "devio [-r] tcp-port|commdev diskdev [blocks] [offset] [alignm] [buffersize]\n"
-                "devio [-r] tcp-port|commdev diskdev [partitionnumber] [alignm] [buffersize]\n"
-                "\n"
-                "-r      Open image file in read-only mode.\n"
-                "\n"
-                "tcp-port can be any free tcp port where this service should listen for incoming\n"
-                "client connections.\n"
-                "\n"
-                "commdev is a path to a communications port, named pipe or similar where this\n"
-                "service should listen for incoming client connections.\n"
-                "\n"
-                "commdev can also start with shm: followed by an section object name for using\n"
-                "shared memory communication. Alternatively, drv: followed by a name for using\n"
-                "DevIO Client Driver to expose a device object connected to this devio instance.\n"
-                "\n"
-                "Default number of blocks is 0. When running on Windows the program will try to\n"
-                "get the size of the image file or partition automatically, otherwise the client\n"
-                "must know the exact size without help from this service.\n"
-                "\n"
-                "Default number of blocks for dynamically expanding VHD image files are read\n"
-                "automatically from VHD header structure within image file.\n"
-                "\n"
-                "Default alignment is %u bytes.\n"
-                "Default buffer size is %i bytes.\n"
-                "\n"
-                "For syntax help with custom I/O DLL under Windows, type:\n"
-                "devio --dll\n",
-                DEF_REQUIRED_ALIGNMENT,
-                DEF_BUFFER_SIZE);
-        return -1;
+        char dirty;
+
+        while (nanosleep(&delay, NULL) == -1 && errno == EINTR)
+            ;
+
+        writeback_lock_acquire();
+        dirty = writeback.dirty > 0;
+        writeback_lock_release();
+
+        // Errors are logged by image_flush()
+        if (dirty)
+            (void)image_flush();
     }
 
-    comm_device = argv[1];
+    return NULL;
+}
+
+// Starts background thread for --sync=interval. Returns zero on failure.
+int sync_start()
+{
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, sync_thread, NULL);
+
+    if (err != 0)
+    {
+        errno = err;
+        syslog(LOG_ERR, "Failed creating sync thread: %m\n");
+        return 0;
+    }
+
+    pthread_detach(thread);
+
+    printf("Syncing image files every " ULL_FMT " ms.\n", writeback.interval);
+    fflush(stdout);
+
+    return 1;
+}
+
+// Hands a request to worker threads.
+void worker_queue(PDEVIO_REQ req)
+{
+    PDEVIO_CONN conn = req->conn;
+
+    req->next = conn->io_head;
+    conn->io_head = req;
+
+    req->work_next = NULL;
 
-    if (dll_mode)
-    {
-        if (devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
-            libhandle = dll_open(argv[2], 1, &dll_read, &dll_write, &dll_close,
-                                 (off_t_64 *)&devio_info.file_size);
-        else
-            libhandle = dll_open(argv[2], 0, &dll_read, &dll_write, &dll_close,
-                                 (off_t_64 *)&devio_info.file_size);
+    pthread_mutex_lock(&workers.lock);
 
-        if (libhandle == NULL)
-        {
-            syslog(LOG_ERR, "Library call failed to open '%s': %m\n", argv[2]);
-            return 1;
-        }
-    }
+    if (workers.work_tail != NULL)
+        workers.work_tail->work_next = req;
     else
+        workers.work_head = req;
+
+    workers.work_tail = req;
+
+    pthread_cond_signal(&workers.work_ready);
+    pthread_mutex_unlock(&workers.lock);
+}
+
+// Hands requests in blocked list of a connection to workers, up to one that
+// still overlaps a request being executed.
+void worker_unblock(PDEVIO_CONN conn)
+{
+    while (!conn->closed &&
+           conn->blocked_head != NULL &&
+           !req_overlaps_io(conn->blocked_head))
     {
-        if (devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
-            image_fd = _open(argv[2], O_BINARY | O_DIRECT | O_FSYNC | O_RDONLY);
-        else
-            image_fd = _open(argv[2], O_BINARY | O_DIRECT | O_FSYNC | O_RDWR);
+        PDEVIO_REQ blocked = conn->blocked_head;
 
-        if (image_fd == -1)
-        {
-            syslog(LOG_ERR, "Failed to open '%s': %m\n", argv[2]);
-            return 1;
-        }
+        conn->blocked_head = blocked->next;
+        if (conn->blocked_head == NULL)
+            conn->blocked_tail = NULL;
+
+        worker_queue(blocked);
     }
+}
 
-    printf("Successfully opened '%s'.\n", argv[2]);
+// Requests that changed a VHD image with metadata journal, waiting for
+// multi_commit(), linked through work_next.
+PDEVIO_REQ multi_commit_head = NULL;
+PDEVIO_REQ multi_commit_tail = NULL;
 
-    // Autodetect Microsoft .vhd files
-    readdone = physical_read(&vhd_info, (safeio_size_t)sizeof(vhd_info), 0);
+// Queues response of an executed request. Responses to requests that
+// changed a VHD image with metadata journal wait in commit list instead,
+// and the requests stay in io_head so that overlapping requests are not
+// handed to workers and connection is not freed until they are sent.
+void req_finish(PDEVIO_REQ req)
+{
+    PDEVIO_CONN conn = req->conn;
 
-    if (auto_vhd_detect &&
-        (readdone == sizeof(vhd_info)) &&
-        (strncmp((char *)vhd_info.Header.Cookie, "cxsparse", 8) == 0) &&
-        (strncmp((char *)vhd_info.Footer.Cookie, "conectix", 8) == 0) &&
-        vhd_info.Footer.DiskType == 0x03000000UL)
+    if (vhd_journal.fd == -1 || writeback.mode != SYNC_ALWAYS ||
+        (!req_is_write(req) && !req_is_range_list(req)))
     {
-        void *geometry = &vhd_info.Footer.DiskGeometry;
+        req_complete(req);
+        return;
+    }
 
-        // VHD I/O uses a secondary buffer
-        buf2 = (char *)malloc(buffer_size);
-        if (buf2 == NULL)
-        {
-            syslog(LOG_ERR, "malloc() failed: %m\n");
-            return 2;
-        }
+    req->next = conn->io_head;
+    conn->io_head = req;
 
-        puts("Detected dynamically expanding Microsoft VHD image file format.");
+    req->work_next = NULL;
 
-        // Calculate vhd shifts
-        current_size = GetBigEndian64(vhd_info.Footer.CurrentSize);
-        table_offset = GetBigEndian64(vhd_info.Header.TableOffset);
+    if (multi_commit_tail != NULL)
+        multi_commit_tail->work_next = req;
+    else
+        multi_commit_head = req;
 
-        sector_size = 512;
+    multi_commit_tail = req;
+}
 
-        block_size = ntohl(vhd_info.Header.BlockSize);
+// Makes changes of all requests in commit list durable with one group
+// commit and queues their responses. If commit fails, requests get the
+// error in their responses.
+void multi_commit()
+{
+    PDEVIO_REQ req = multi_commit_head;
+    ULONGLONG errorno = 0;
 
-        for (block_shift = 0;
-             (block_shift < 64) &&
-             ((((safeio_size_t)1) << block_shift) != block_size);
-             block_shift++)
-            ;
+    if (req == NULL)
+        return;
 
-        devio_info.file_size = current_size;
+    multi_commit_head = NULL;
+    multi_commit_tail = NULL;
 
-        vhd_mode = 1;
+    if (vhd_journal_commit() == -1)
+        errorno = errno;
 
-        printf("VHD block size: %u bytes. C/H/S geometry: %u/%u/%u.\n",
-               (unsigned int)block_size,
-               (unsigned int)ntohs(*(u_short *)geometry),
-               (unsigned int)((u_char *)geometry)[2],
-               (unsigned int)((u_char *)geometry)[3]);
-    }
+    while (req != NULL)
+    {
+        PDEVIO_REQ next = req->work_next;
+        PDEVIO_CONN conn = req->conn;
 
-    for (sector_shift = 0;
-         (sector_shift < 64) &&
-         ((((safeio_size_t)1) << sector_shift) != sector_size);
-         sector_shift++)
-        ;
+        // Write, unmap and zero responses all start with errorno
+        if (errorno != 0)
+            memcpy(req->resp + (conn->tagged ? sizeof req->hdr : 0),
+                   &errorno, sizeof errorno);
 
-    if (argc > 3)
-    {
-        ULONGLONG spec_size = 0;
-        char suf = 0;
+        req_io_unlink(req);
+        req_complete(req);
 
-        if (sscanf(argv[3], ULL_FMT "%c", &spec_size, &suf) == 2)
-        {
-            switch (suf)
-            {
-            case 'T':
-                spec_size <<= 10;
-            case 'G':
-                spec_size <<= 10;
-            case 'M':
-                spec_size <<= 10;
-            case 'K':
-                spec_size <<= 10;
-            case 'B':
-                break;
-            case 't':
-                spec_size *= 1000;
-            case 'g':
-                spec_size *= 1000;
-            case 'm':
-                spec_size *= 1000;
-            case 'k':
-                spec_size *= 1000;
-            case 'b':
-                break;
-            default:
-                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
-            }
+        worker_unblock(conn);
+        multi_set_ready(conn);
 
-            devio_info.file_size = spec_size;
-        }
-        else if (spec_size < 512)
-        {
-            partition_number = (int)spec_size;
-        }
-        else
-        {
-            devio_info.file_size = spec_size << 9;
-        }
+        req = next;
     }
-    else
+}
+
+// Picks up requests completed by worker threads and queues their
+// responses. Requests blocked by completed ones are handed to workers.
+void worker_reap()
+{
+    PDEVIO_REQ req;
+    eventfd_t count;
+
+    eventfd_read(workers.event_fd, &count);
+
+    pthread_mutex_lock(&workers.lock);
+
+    req = workers.done_head;
+    workers.done_head = NULL;
+    workers.done_tail = NULL;
+
+    pthread_mutex_unlock(&workers.lock);
+
+    while (req != NULL)
     {
-        partition_number = 1;
+        PDEVIO_REQ next = req->work_next;
+        PDEVIO_CONN conn = req->conn;
+
+        req_io_unlink(req);
+        req_finish(req);
+
+        worker_unblock(conn);
+        multi_set_ready(conn);
+
+        req = next;
     }
+}
 
-#ifdef _WIN32
+// Executes a received request and queues its response. With worker
+// threads, reads and writes are handed to workers, unless they overlap a
+// request from the same connection that is still being executed. Such
+// requests, and requests received after them, wait in blocked list so that
+// overlapping writes are executed in the order they were received.
+void req_execute(PDEVIO_REQ req)
+{
+    PDEVIO_CONN conn = req->conn;
 
-    if (devio_info.file_size == 0)
+    if (req->hdr.request_code == FSCRYPTDPROXY_REQ_READ)
+        read_ahead(conn, (off_t_64)(image_offset + req->offset),
+                   (safeio_size_t)(req->length < buffer_size ?
+                                   req->length : buffer_size));
+
+    if (worker_count > 0 &&
+        (req->hdr.request_code == FSCRYPTDPROXY_REQ_READ ||
+         req_is_write(req) || req_is_barrier(req)))
     {
-        if (dll_mode)
-            syslog(LOG_ERR, "DLL did not return size of image/partition.\n");
-        else
+        if (conn->blocked_head != NULL || req_overlaps_io(req))
         {
-            HANDLE h = (HANDLE)_get_osfhandle(image_fd);
-            BY_HANDLE_FILE_INFORMATION by_handle_file_info;
+            req->next = NULL;
 
-            if ((!GetFileInformationByHandle(h, &by_handle_file_info) &&
-                 (by_handle_file_info.nFileSizeLow = GetFileSize(h,
-                                                                 &by_handle_file_info.nFileSizeHigh)) == INVALID_FILE_SIZE) &&
-                GetLastError() != NO_ERROR)
-            {
-                // If not regular disk file, try to lock volume using FSCTL operation.
+            if (conn->blocked_tail != NULL)
+                conn->blocked_tail->next = req;
+            else
+                conn->blocked_head = req;
 
-                DWORD dw;
-                FlushFileBuffers(h);
-                if (DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0,
-                                    &dw, NULL))
-                {
-                    if (!DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL,
-                                         0, &dw, NULL))
-                    {
-                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
-                               argv[2]);
+            conn->blocked_tail = req;
+            return;
+        }
 
-                        if (~devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
-                            return 9;
-                    }
-                }
-                else
-                {
-                    switch (GetLastError())
-                    {
-                    case ERROR_NOT_SUPPORTED:
-                    case ERROR_INVALID_FUNCTION:
-                    case ERROR_INVALID_HANDLE:
-                    case ERROR_INVALID_PARAMETER:
-                        break;
+        worker_queue(req);
+        return;
+    }
 
-                    default:
-                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
-                               argv[2]);
+    // Range list and flush requests run in event loop once everything
+    // submitted to io_uring before them on the connection has completed
+    if (uring.event_fd != -1 && req_is_barrier(req))
+    {
+        multi_commit();
 
-                        if (~devio_info.flags & FSCRYPTDPROXY_FLAG_RO)
-                            return 9;
-                    }
-                }
+        while (conn->io_head != NULL)
+        {
+            uring_enter(1);
+            uring_reap();
+        }
+    }
 
-                if (devio_info.file_size == 0)
-                {
-                    PARTITION_INFORMATION partition_info = {0};
+    if (req_run(req))
+        req_finish(req);
+}
 
-                    if (!DeviceIoControl(h, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0,
-                                         &partition_info, sizeof(partition_info),
-                                         &dw, NULL))
-                    {
-                        syslog(LOG_ERR,
-                               "Cannot determine size of disk volume.\n");
-                    }
-                    else
-                    {
-                        devio_info.file_size =
-                            partition_info.PartitionLength.QuadPart;
-                    }
-                }
-            }
-            else
-            {
-                LARGE_INTEGER file_size = {0};
-                file_size.HighPart = by_handle_file_info.nFileSizeHigh;
-                file_size.LowPart = by_handle_file_info.nFileSizeLow;
+void multi_accept(int epfd, SOCKET ssd)
+{
+    struct sockaddr_in saddr = {0};
+    socklen_t i = sizeof saddr;
+    struct epoll_event ev = {0};
+    PDEVIO_CONN conn;
 
-                devio_info.file_size = file_size.QuadPart;
-            }
-        }
+    SOCKET sd = accept(ssd, (struct sockaddr *)&saddr, &i);
+    if (sd == -1)
+    {
+        syslog(LOG_ERR, "accept() failed: %m\n");
+        return;
     }
-#else
-    if (devio_info.file_size == 0)
+
+    conn = (PDEVIO_CONN)calloc(1, sizeof(DEVIO_CONN));
+    if (conn == NULL)
     {
-        struct stat file_stat = {0};
-        if (fstat(image_fd, &file_stat) == 0)
-            devio_info.file_size = file_stat.st_size;
-        else
-            syslog(LOG_ERR, "Cannot determine size of image/partition: %m\n");
+        syslog(LOG_ERR, "calloc() failed: %m\n");
+        closesocket(sd);
+        return;
     }
-#endif
 
-    if (current_size == 0)
-        current_size = devio_info.file_size;
+    conn->sd = sd;
+    conn->buffer_size = buffer_size;
+    conn->max_outstanding = 1;
+    conn->zero_copy = zero_copy_mode(sd);
 
-    if (devio_info.file_size != 0)
+    conn->recv_buf = (char *)malloc(COMM_RECV_BUFFER_SIZE);
+    if (conn->recv_buf == NULL)
     {
-        printf("Image size used: " ULL_FMT " bytes.\n", devio_info.file_size);
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        closesocket(sd);
+        free(conn);
+        return;
     }
+    conn->req_hdr_size = request_code_size(conn);
 
-    if (partition_number >= 1 && partition_number < 512)
+    snprintf(conn->peer, sizeof(conn->peer), "%s:%u",
+             inet_ntoa(saddr.sin_addr),
+             (unsigned int)ntohs(saddr.sin_port));
+
+    printf("Got connection from %s.\n", conn->peer);
+    fflush(stdout);
+
+    i = 1;
+    if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (const char *)&i, sizeof i))
+        syslog(LOG_ERR, "setsockopt(..., TCP_NODELAY): %m\n");
+
+    if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) == -1)
     {
-        if (logical_read(mbr, 512, 0) < 512)
+        syslog(LOG_ERR, "fcntl(..., O_NONBLOCK): %m\n");
+        closesocket(sd);
+        free(conn);
+        return;
+    }
+
+    conn->events = EPOLLIN;
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) == -1)
+    {
+        syslog(LOG_ERR, "epoll_ctl() failed: %m\n");
+        closesocket(sd);
+        free(conn->recv_buf);
+        free(conn);
+    }
+}
+
+void multi_free_reqs(PDEVIO_REQ req)
+{
+    while (req != NULL)
+    {
+        PDEVIO_REQ next = req->next;
+
+        buf_free(req->buf, req->buffer_size);
+
+        if (req->buf_index >= 0)
         {
-            syslog(LOG_ERR, "Error reading device: %m\n");
+            req->buf = NULL;
+            uring_update_req_buf(req);
         }
-        else if ((*(u_char *)(mbr + 0x01FE) == 0x55) &&
-                 (*(u_char *)(mbr + 0x01FF) == 0xAA) &&
-                 ((*(u_char *)(mbr + 0x01BE) & 0x7F) == 0) &&
-                 ((*(u_char *)(mbr + 0x01CE) & 0x7F) == 0) &&
-                 ((*(u_char *)(mbr + 0x01DE) & 0x7F) == 0) &&
-                 ((*(u_char *)(mbr + 0x01EE) & 0x7F) == 0))
+
+        free(req);
+        req = next;
+    }
+}
+
+void multi_close(int epfd, PDEVIO_CONN conn)
+{
+    if (!conn->closed)
+    {
+        printf("Connection from %s closed.\n", conn->peer);
+        print_stats(conn);
+        fflush(stdout);
+
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sd, NULL);
+        closesocket(conn->sd);
+        conn->closed = 1;
+    }
+
+    // Requests in io_uring own their buffers until they complete. Event
+    // loop calls again when connection is on ready list.
+    if (conn->io_head != NULL || conn->ready)
+        return;
+
+    multi_free_reqs(conn->recv_req);
+    multi_free_reqs(conn->blocked_head);
+    multi_free_reqs(conn->send_head);
+    multi_free_reqs(conn->free_reqs);
+    free(conn->recv_buf);
+    free(conn);
+}
+
+// Sends as much as possible of queued responses without blocking. Headers
+// and payloads of consecutive responses are sent together with one gather
+// write, up to a payload that is sent from image file with sendfile().
+// Returns zero if connection should be closed.
+int multi_flush(PDEVIO_CONN conn)
+{
+    while (conn->send_head != NULL)
+    {
+        PDEVIO_REQ req = conn->send_head;
+        struct iovec iov[MULTI_MAX_IOV];
+        struct msghdr msg = {0};
+        safeio_size_t sent = conn->resp_sent;
+        int iovcnt = 0;
+        int flags = MSG_NOSIGNAL;
+        ssize_t sizedone;
+
+        if (req->sendfile && conn->resp_sent >= req->resp_size)
         {
-            size_t i = 0;
-            int c = 0;
+            safeio_size_t payload_sent = conn->resp_sent - req->resp_size;
+            safeio_size_t size = req->resp_payload_size - payload_sent;
+            off_t_64 offset = req->file_offset + payload_sent;
 
-            puts("Detected a master boot record at sector 0.");
+            sizedone = sendfile(conn->sd, image_fd, &offset, size);
 
-            image_offset = 0;
+            conn->stat_sends++;
 
-            for (i = 0; i < 4; i++)
+            if (sizedone == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 1;
+
+            if (sizedone > 0)
             {
-                char type = *(mbr + 512 - 66 + (i << 4) + 4);
+                conn->resp_sent += sizedone;
 
-                if (type == 0)
+                if (conn->resp_sent == req->resp_size + req->resp_payload_size)
                 {
-                    continue;
+                    conn->send_head = req->next;
+                    if (conn->send_head == NULL)
+                        conn->send_tail = NULL;
+
+                    conn->resp_sent = 0;
+
+                    req_free(req);
                 }
 
-                if (type == 0x05 || type == 0x0F)
-                {
-                    char read_next_ebr = TRUE;
+                continue;
+            }
 
-                    off_t_64 first_ebr_offset =
-                        ((off_t_64)GetLittleEndian32U((uint8_t *)mbr + 512 - 66 + (i << 4) + 8))
-                        << sector_shift;
+            // Image file has shrunk or sendfile() failed. Rest of payload
+            // is read into request buffer, with zeroes past end of file.
+            if (sizedone == -1)
+                syslog(LOG_ERR, "sendfile() to %s: %m\n", conn->peer);
 
-                    image_offset = first_ebr_offset;
+            if (!req_buf_alloc(req, req->resp_payload_size))
+                return 0;
 
-                    while (read_next_ebr)
-                    {
-                        char ebr[512];
-                        size_t e;
+            memset(req->buf + payload_sent, 0, size);
 
-                        read_next_ebr = FALSE;
+            if (physical_read(req->buf + payload_sent, size, offset) == -1)
+            {
+                syslog(LOG_ERR, "Device read: %m\n");
+                return 0;
+            }
 
-                        printf("Reading extended partition table at " SLL_FMT
-                               ".\n",
-                               (int64_t)image_offset);
+            req->sendfile = 0;
+            continue;
+        }
 
-                        if (logical_read(ebr, 512, image_offset) == 512 &&
-                            (*(u_char *)(ebr + 0x01FE) == 0x55) &&
-                            (*(u_char *)(ebr + 0x01FF) == 0xAA) &&
-                            ((*(u_char *)(ebr + 0x01BE) & 0x7F) == 0) &&
-                            ((*(u_char *)(ebr + 0x01CE) & 0x7F) == 0) &&
-                            ((*(u_char *)(ebr + 0x01DE) & 0x7F) == 0) &&
-                            ((*(u_char *)(ebr + 0x01EE) & 0x7F) == 0))
-                        {
-                            puts("Found valid extended partition table.");
-                        }
-                        else
-                        {
-                            puts("Invalid extended partition table.");
-                            break;
-                        }
+        for (; req != NULL && iovcnt < MULTI_MAX_IOV - 1; req = req->next)
+        {
+            if (sent < req->resp_size)
+            {
+                iov[iovcnt].iov_base = req->resp + sent;
+                iov[iovcnt].iov_len = req->resp_size - sent;
+                iovcnt++;
+                sent = req->resp_size;
+            }
 
-                        for (e = 0; e < 4; e++)
-                        {
-                            type = *(ebr + 512 - 66 + (e << 4) + 4);
+            if (req->resp_payload_size > 0)
+            {
+                // Header is held back until payload follows it
+                if (req->sendfile)
+                {
+                    flags |= MSG_MORE;
+                    break;
+                }
 
-                            if (type == 0)
-                            {
-                                continue;
-                            }
+                iov[iovcnt].iov_base = req->buf + sent - req->resp_size;
+                iov[iovcnt].iov_len =
+                    req->resp_size + req->resp_payload_size - sent;
+                iovcnt++;
+            }
 
-                            if (type == 0x05 || type == 0x0F)
-                            {
-                                image_offset =
-                                    first_ebr_offset + (((off_t_64)
-                                                             GetLittleEndian32U((uint8_t *)ebr + 512 - 66 + (e << 4) + 8))
-                                                        << sector_shift);
+            sent = 0;
+        }
 
-                                read_next_ebr = TRUE;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
 
-                                break;
-                            }
+        sizedone = sendmsg(conn->sd, &msg, flags);
 
-                            ++c;
+        conn->stat_sends++;
 
-                            if (c == partition_number)
-                            {
-                                image_offset += ((off_t_64)
-                                                     GetLittleEndian32U((uint8_t *)ebr + 512 - 66 + (e << 4) + 8))
-                                                << sector_shift;
-                                devio_info.file_size = ((off_t_64)
-                                                            GetLittleEndian32U((uint8_t *)ebr + 512 - 66 + (e << 4) + 12))
-                                                       << sector_shift;
+        if (sizedone == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
 
-                                break;
-                            }
-                        }
-                    }
-                }
-                else
-                {
-                    ++c;
+        if (sizedone <= 0)
+        {
+            syslog(LOG_ERR, "sendmsg() to %s: %m\n", conn->peer);
+            return 0;
+        }
 
-                    if (c == partition_number)
-                    {
-                        image_offset = ((off_t_64)
-                                            GetLittleEndian32U((uint8_t *)mbr + 512 - 66 + (i << 4) + 8))
-                                       << sector_shift;
-                        devio_info.file_size = ((off_t_64)
-                                                    GetLittleEndian32U((uint8_t *)mbr + 512 - 66 + (i << 4) + 12))
-                                               << sector_shift;
+        // Release responses that have been completely sent
+        while (sizedone > 0)
+        {
+            safeio_size_t size;
 
-                        break;
-                    }
-                }
-            }
+            req = conn->send_head;
 
-            if ((devio_info.file_size == 0) ||
-                ((current_size != 0) &&
-                 (image_offset + (off_t_64)devio_info.file_size > current_size)))
+            size = req->resp_size - conn->resp_sent;
+            if (!req->sendfile || conn->resp_sent >= req->resp_size)
+                size = req->resp_size + req->resp_payload_size -
+                    conn->resp_sent;
+
+            if ((safeio_size_t)sizedone < size)
             {
-                syslog(LOG_ERR,
-                       "Partition %i not found.\n", partition_number);
-                return 1;
+                conn->resp_sent += sizedone;
+                break;
             }
 
-            printf("Using partition %i.\n", partition_number);
+            sizedone -= size;
+            conn->resp_sent += size;
+
+            if (conn->resp_sent < req->resp_size + req->resp_payload_size)
+                break;
+
+            conn->send_head = req->next;
+            if (conn->send_head == NULL)
+                conn->send_tail = NULL;
+
+            conn->resp_sent = 0;
+
+            req_free(req);
         }
-        else
-            puts("No master boot record detected. Using entire image.");
     }
 
-    if (image_offset == 0 && argc > 4)
+    return 1;
+}
+
+// Parses a completely received request header into a new request object.
+// Returns zero if connection should be closed.
+int multi_parse(PDEVIO_CONN conn)
+{
+    FSCRYPTDPROXY_TAGGED_HEADER hdr = {0};
+    PDEVIO_REQ req;
+    safeio_size_t code_size = request_code_size(conn);
+    const char *ptr = conn->req_hdr + code_size;
+
+    memcpy(&hdr, conn->req_hdr, code_size);
+
+    if (hdr.request_code == FSCRYPTDPROXY_REQ_CLOSE)
+        return 0;
+
+    req = req_alloc(conn);
+    if (req == NULL)
+        return 0;
+
+    req->hdr = hdr;
+    req->hdr.flags = 0;
+    req->offset = 0;
+    req->length = 0;
+    req->write_flags = 0;
+
+    switch (hdr.request_code)
     {
-        int64_t offset64 = image_offset;
+    case FSCRYPTDPROXY_REQ_WRITE_EX:
+        memcpy(&req->write_flags, ptr + sizeof(req->offset) + sizeof(req->length),
+               sizeof(req->write_flags));
+        // fall through
+
+    case FSCRYPTDPROXY_REQ_READ:
+    case FSCRYPTDPROXY_REQ_WRITE:
+        memcpy(&req->offset, ptr, sizeof(req->offset));
+        memcpy(&req->length, ptr + sizeof(req->offset), sizeof(req->length));
+        break;
+
+    case FSCRYPTDPROXY_REQ_UNMAP:
+    case FSCRYPTDPROXY_REQ_ZERO:
+        memcpy(&req->length, ptr, sizeof(req->length));
+        break;
+
+    case FSCRYPTDPROXY_REQ_TAGGED:
+    {
+        FSCRYPTDPROXY_TAGGED_REQ req_block = {0};
+        FSCRYPTDPROXY_TAGGED_RESP resp_block = {0};
 
-        char suf = 0;
-        if (sscanf(argv[4], SLL_FMT "%c", &offset64, &suf) == 2)
-            switch (suf)
-            {
-            case 'T':
-                offset64 <<= 10;
-            case 'G':
-                offset64 <<= 10;
-            case 'M':
-                offset64 <<= 10;
-            case 'K':
-                offset64 <<= 10;
-            case 'B':
-                break;
-            case 't':
-                offset64 *= 1000;
-            case 'g':
-                offset64 *= 1000;
-            case 'm':
-                offset64 *= 1000;
-            case 'k':
-                offset64 *= 1000;
-            case 'b':
-                break;
-            default:
-                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
-            }
-        else
-            offset64 <<= 9;
+        int tagged;
 
-        if ((((int64_t)(-1) - (off_t_64)(-1)) & offset64) != 0)
+        memcpy(&req_block.flags, ptr,
+               sizeof(req_block) - sizeof(req_block.request_code));
+
+        // Response is staged untagged before switching. Nothing else is in
+        // flight since untagged connections allow one request at a time.
+        tagged = do_set_tagged(conn, &req_block, &resp_block);
+
+        req_respond(req, &resp_block, sizeof resp_block, 0);
+
+        if (tagged)
         {
-            syslog(LOG_ERR, "Offset too big for this system.\n");
+            conn->tagged = 1;
+            conn->max_outstanding = resp_block.max_outstanding;
+            conn->zero_copy = 0;
         }
 
-        image_offset = (off_t_64)offset64;
-
-        argc--;
-        argv++;
+        req_complete(req);
+        return 1;
+    }
     }
 
-    if (argc > 4)
+    // Write data and range lists follow request header
+    if ((req_is_write(req) || req_is_range_list(req)) && req->length > 0)
     {
-        if (sscanf(argv[4], ULL_FMT, &devio_info.req_alignment) != 1)
+        if (req->length > buffer_size)
         {
-            syslog(LOG_ERR, "Invalid alignment specification: '%s'\n",
-                   argv[4]);
+            syslog(LOG_ERR, "Too big request data: %u bytes.\n",
+                   (int)req->length);
+            req_free(req);
+            return 0;
+        }
 
-            return -1;
+        if (!req_buf_alloc(req, (safeio_size_t)req->length))
+        {
+            req_free(req);
+            return 0;
         }
-    }
-    else
-    {
-        devio_info.req_alignment = DEF_REQUIRED_ALIGNMENT;
+
+        conn->recv_req = req;
+        return 1;
     }
 
-    if (argc > 5)
+    req_execute(req);
+    return 1;
+}
+
+// Receives as much as is available of requests on a connection and executes
+// complete requests. Returns zero if connection should be closed.
+int multi_receive(PDEVIO_CONN conn)
+{
+    int requests = 0;
+
+    for (;;)
     {
-        char suf = 0;
-        if (sscanf(argv[5], SIZ_FMT "%c", &buffer_size, &suf) == 2)
+        char *ptr;
+        safeio_size_t size;
+        ssize_t sizedone;
+
+        if (conn->recv_req != NULL)
         {
-            switch (suf)
+            ptr = conn->recv_req->buf;
+            size = (safeio_size_t)conn->recv_req->length;
+        }
+        else if (conn->outstanding >= conn->max_outstanding)
+        {
+            return 1;
+        }
+        else if (requests >= MULTI_MAX_REQUESTS_PER_EVENT)
+        {
+            // Requests already in receive buffer do not make socket
+            // readable again, so connection is picked up next time around
+            if (conn->recv_end > conn->recv_start)
+                multi_set_ready(conn);
+
+            return 1;
+        }
+        else
+        {
+            ptr = conn->req_hdr;
+            size = conn->req_hdr_size;
+        }
+
+        if (conn->req_got < size)
+        {
+            safeio_size_t avail = conn->recv_end - conn->recv_start;
+
+            if (avail > 0)
             {
-            case 'T':
-                buffer_size <<= 10;
-            case 'G':
-                buffer_size <<= 10;
-            case 'M':
-                buffer_size <<= 10;
-            case 'K':
-                buffer_size <<= 10;
-            case 'B':
-                break;
-            case 't':
-                buffer_size *= 1000;
-            case 'g':
-                buffer_size *= 1000;
-            case 'm':
-                buffer_size *= 1000;
-            case 'k':
-                buffer_size *= 1000;
-            case 'b':
-                break;
-            default:
-                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
+                if (avail > size - conn->req_got)
+                    avail = size - conn->req_got;
+
+                memcpy(ptr + conn->req_got, conn->recv_buf + conn->recv_start,
+                       avail);
+                conn->recv_start += avail;
+                conn->req_got += avail;
+                continue;
             }
-        }
 
-        /*
-        buffer_size = 0;
-        sscanf(argv[5], "%u", &buffer_size);
-        */
-    }
+            // Large payloads are received directly into request buffer,
+            // everything else through receive buffer
+            if (size - conn->req_got >= COMM_RECV_BUFFER_SIZE)
+            {
+                sizedone = recv(conn->sd, ptr + conn->req_got,
+                                size - conn->req_got, 0);
+            }
+            else
+            {
+                conn->recv_start = 0;
+                conn->recv_end = 0;
 
-    printf("Total size: " SLL_FMT " bytes. Using " ULL_FMT " bytes from offset " SLL_FMT ".\n"
-           "Required alignment: " ULL_FMT " bytes.\n"
-           "Buffer size: " SIZ_FMT " bytes.\n",
-           (int64_t)current_size,
-           devio_info.file_size,
-           (int64_t)image_offset,
-           devio_info.req_alignment,
-           buffer_size);
+                sizedone = recv(conn->sd, conn->recv_buf,
+                                COMM_RECV_BUFFER_SIZE, 0);
+            }
 
-    retval = do_comm(comm_device);
+            if (sizedone == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 1;
 
-    printf("Image close result: %i\n", physical_close(image_fd));
+            if (sizedone == -1)
+            {
+                syslog(LOG_ERR, "recv() from %s: %m\n", conn->peer);
+                return 0;
+            }
 
-    return retval;
-}
+            if (sizedone == 0)
+                return 0;
 
-#ifdef _WIN32
-int do_comm_shm(char *comm_device)
-{
-    HANDLE hFileMap = NULL;
-    MEMORY_BASIC_INFORMATION memory_info = {0};
-    safeio_size_t detected_buffer_size = 0;
-    ULARGE_INTEGER map_size = {0};
-    char *objname = (char *)malloc(OBJNAME_SIZE);
-    char *namespace_prefix;
-    HANDLE h = CreateFile("\\\\?\\Global", 0, FILE_SHARE_READ, NULL,
-                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if ((h == INVALID_HANDLE_VALUE) && (GetLastError() == ERROR_FILE_NOT_FOUND))
-        namespace_prefix = "";
-    else
-        namespace_prefix = "Global\\";
+            if (size - conn->req_got >= COMM_RECV_BUFFER_SIZE)
+                conn->req_got += sizedone;
+            else
+                conn->recv_end = sizedone;
 
-    if (h != INVALID_HANDLE_VALUE)
-        CloseHandle(h);
+            continue;
+        }
 
-    if (objname == NULL)
-    {
-        syslog(LOG_ERR, "Memory allocation failed: %m\n");
-        return -1;
-    }
+        if (conn->recv_req != NULL)
+        {
+            PDEVIO_REQ req = conn->recv_req;
+            conn->recv_req = NULL;
+            conn->req_got = 0;
+            conn->req_hdr_size = request_code_size(conn);
+            requests++;
+
+            req_execute(req);
+            continue;
+        }
 
-    puts("Shared memory operation.");
+        if (conn->req_hdr_size == request_code_size(conn))
+        {
+            ULONGLONG req;
 
-    _snprintf(objname, OBJNAME_SIZE,
-              "%s%s", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
+            memcpy(&req, conn->req_hdr, sizeof(req));
 
-    map_size.QuadPart = (ULONGLONG)buffer_size + FSCRYPTDPROXY_HEADER_SIZE;
+            if (request_header_size(req) > 0)
+            {
+                conn->req_hdr_size += request_header_size(req);
+                continue;
+            }
+        }
 
-    hFileMap = CreateFileMapping(INVALID_HANDLE_VALUE,
-                                 NULL,
-                                 PAGE_READWRITE | SEC_COMMIT,
-                                 map_size.HighPart,
-                                 map_size.LowPart,
-                                 objname);
+        conn->req_got = 0;
 
-    if (hFileMap == NULL)
-    {
-        syslog(LOG_ERR, "CreateFileMapping() failed: %m\n");
-        return 2;
-    }
+        if (!multi_parse(conn))
+            return 0;
 
-    if (GetLastError() == ERROR_ALREADY_EXISTS)
-    {
-        syslog(LOG_ERR, "A service with this name is already running.\n");
-        return 2;
+        if (conn->recv_req == NULL)
+        {
+            conn->req_hdr_size = request_code_size(conn);
+            requests++;
+        }
     }
+}
 
-    shm_view = (char *)MapViewOfFile(hFileMap, FILE_MAP_WRITE, 0, 0, 0);
+// Waits for socket to become readable while more requests are accepted, and
+// writable while responses are waiting to be sent.
+int multi_update_events(int epfd, PDEVIO_CONN conn)
+{
+    struct epoll_event ev = {0};
 
-    if (shm_view == NULL)
-    {
-        syslog(LOG_ERR, "MapViewOfFile() failed: %m\n");
-        return 2;
-    }
+    ev.events = 0;
 
-    buf = shm_view + FSCRYPTDPROXY_HEADER_SIZE;
+    if (conn->recv_req != NULL || conn->outstanding < conn->max_outstanding)
+        ev.events |= EPOLLIN;
 
-    if (!VirtualQuery(shm_view, &memory_info, sizeof(memory_info)))
-    {
-        syslog(LOG_ERR, "VirtualQuery() failed: %m\n");
-        return 2;
-    }
+    if (conn->send_head != NULL)
+        ev.events |= EPOLLOUT;
 
-    detected_buffer_size = (safeio_size_t)(memory_info.RegionSize - FSCRYPTDPROXY_HEADER_SIZE);
+    if (ev.events == conn->events)
+        return 1;
 
-    if (buffer_size != detected_buffer_size)
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sd, &ev) == -1)
     {
-        buffer_size = detected_buffer_size;
-        if (buf2 != NULL)
-        {
-            free(buf2);
-            buf2 = (char *)malloc(buffer_size);
-            if (buf2 == NULL)
-            {
-                syslog(LOG_ERR, "malloc() failed: %m\n");
-                return 2;
-            }
-        }
+        syslog(LOG_ERR, "epoll_ctl() failed: %m\n");
+        return 0;
     }
 
-    _snprintf(objname, OBJNAME_SIZE,
-              "%s%s_Server", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
-    shm_server_mutex = CreateMutex(NULL, FALSE, objname);
+    conn->events = ev.events;
 
-    if (shm_server_mutex == NULL)
+    return 1;
+}
+
+// Sets up an eventfd that io_uring signals when operations complete, so
+// that completions wake up epoll. Without it, --multi requests are executed
+// synchronously.
+void uring_add_eventfd(int epfd)
+{
+    struct epoll_event ev = {0};
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (event_fd == -1)
     {
-        syslog(LOG_ERR, "CreateMutex() failed: %m\n");
-        return 2;
+        syslog(LOG_ERR, "eventfd() failed: %m\n");
+        return;
     }
 
-    if (WaitForSingleObject(shm_server_mutex, 0) != WAIT_OBJECT_0)
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_EVENTFD,
+                &event_fd, 1) == -1)
     {
-        syslog(LOG_ERR, "A service with this name is already running.\n");
-        return 2;
+        syslog(LOG_ERR, "Failed registering io_uring eventfd: %m\n");
+        close(event_fd);
+        return;
     }
 
-    _snprintf(objname, OBJNAME_SIZE,
-              "%s%s_Request", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
-    shm_request_event = CreateEvent(NULL, FALSE, FALSE, objname);
-
-    if (shm_request_event == NULL)
+    ev.events = EPOLLIN;
+    ev.data.ptr = &uring;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, event_fd, &ev) == -1)
     {
-        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
-        return 2;
+        syslog(LOG_ERR, "epoll_ctl() failed: %m\n");
+        return;
     }
 
-    _snprintf(objname, OBJNAME_SIZE,
-              "%s%s_Response", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
-    shm_response_event = CreateEvent(NULL, FALSE, FALSE, objname);
+    uring.event_fd = event_fd;
+}
 
-    if (shm_response_event == NULL)
+int do_comm_multi(SOCKET ssd)
+{
+    struct epoll_event ev = {0};
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epfd == -1)
     {
-        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
+        syslog(LOG_ERR, "epoll_create1() failed: %m\n");
         return 2;
     }
 
-    free(objname);
-    objname = NULL;
-
-    shm_mode = 1;
-
-    printf("Waiting for connection on object %s. Press Ctrl+C to cancel.\n",
-           comm_device);
+    // Clients that disconnect while we are sending should not terminate
+    // the service for everyone else
+    signal(SIGPIPE, SIG_IGN);
 
-    if (WaitForSingleObject(shm_request_event, INFINITE) != WAIT_OBJECT_0)
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ssd, &ev) == -1)
     {
-        syslog(LOG_ERR, "Wait failed: %m.\n");
+        syslog(LOG_ERR, "epoll_ctl() failed: %m\n");
         return 2;
     }
 
-    printf("Connection on object %s.\n",
-           comm_device);
-
-    return 0;
-}
+    if (uring_mode)
+        uring_add_eventfd(epfd);
 
-int do_comm_drv(char *comm_device)
-{
-    int rc;
+    if (worker_count > 0 && !worker_start(epfd))
+        return 2;
 
-    char *objname = (char *)malloc(OBJNAME_SIZE);
-    if (objname == NULL)
+    for (;;)
     {
-        syslog(LOG_ERR, "Memory allocation failed: %m");
-        return -1;
-    }
+        struct epoll_event events[MULTI_MAX_EVENTS];
+        PDEVIO_CONN conn;
+        PDEVIO_CONN ready;
+        int timeout;
+        int i;
+        int n;
 
-    drv_memory_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    drv_request_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        // Operations queued while handling previous events are submitted
+        // together
+        if (uring_mode)
+            uring_enter(0);
 
-    if (drv_memory_io.hEvent == NULL || drv_request_io.hEvent == NULL)
-    {
-        syslog(LOG_ERR, "Event object create failed: %m");
-        return -1;
-    }
+        // Changes by requests handled since last time are made durable
+        // together before their responses are sent
+        multi_commit();
 
-    puts("Driver mode.");
+        timeout = vhd_metadata_timeout();
 
-    _snprintf(objname, OBJNAME_SIZE,
-              "%ws\\%s", DEVIODRV_DEVICE_DOSDEV_NAME, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
+        n = epoll_wait(epfd, events, MULTI_MAX_EVENTS,
+                       multi_ready != NULL ? 0 : timeout);
 
-    sd = (SOCKET)CreateFile(objname, GENERIC_ALL, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+        if (timeout >= 0)
+            vhd_flush_metadata(0);
 
-    if (sd == INVALID_SOCKET)
-    {
-        if (GetLastError() == ERROR_ALREADY_EXISTS)
-        {
-            syslog(LOG_ERR, "A service with this name is already running.\n");
-        }
-        else
+        if (n == -1)
         {
-            syslog(LOG_ERR, "Error opening '%s': %m", objname);
+            if (errno == EINTR)
+                continue;
+
+            syslog(LOG_ERR, "epoll_wait() failed: %m\n");
+            return 2;
         }
 
-        return 2;
-    }
+        for (i = 0; i < n; i++)
+        {
+            conn = (PDEVIO_CONN)events[i].data.ptr;
 
-    free(objname);
-    objname = NULL;
+            if (conn == NULL)
+            {
+                multi_accept(epfd, ssd);
+                continue;
+            }
 
-    rc = alloc_drv_buffer();
-    if (rc > 0)
-    {
-        return rc;
-    }
+            if (events[i].data.ptr == &uring)
+            {
+                eventfd_t count;
+                eventfd_read(uring.event_fd, &count);
+                uring_reap();
+                continue;
+            }
 
-    drv_mode = 1;
+            if (events[i].data.ptr == &workers)
+            {
+                worker_reap();
+                continue;
+            }
 
-    printf("Waiting for client connection on object %s. Press Ctrl+C to cancel.\n",
-           comm_device);
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+                !multi_flush(conn) ||
+                !multi_receive(conn) ||
+                !multi_flush(conn) ||
+                !multi_update_events(epfd, conn))
+            {
+                multi_close(epfd, conn);
+            }
+        }
 
-    ((PFSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER)shm_view)->request_code = FSCRYPTDPROXY_REQ_INFO;
+        // Connections that become ready while these are handled are
+        // picked up after polling for new events
+        ready = multi_ready;
+        multi_ready = NULL;
 
-    if (!send_info())
-    {
-        syslog(LOG_ERR, "Wait failed: %m.\n");
-        return 2;
+        while ((conn = ready) != NULL)
+        {
+            ready = conn->ready_next;
+            conn->ready = 0;
+
+            if (conn->closed ||
+                !multi_flush(conn) ||
+                !multi_receive(conn) ||
+                !multi_flush(conn) ||
+                !multi_update_events(epfd, conn))
+            {
+                multi_close(epfd, conn);
+            }
+        }
     }
-
-    printf("Connection on object %s.\n",
-           comm_device);
-
-    return 0;
 }
+
 #endif
 
 int do_comm(char *comm_device)
 {
+    DEVIO_CONN conn = {0};
     ULONGLONG req = 0;
     u_short port = (u_short)strtoul(comm_device, NULL, 0);
 
+    conn.sd = INVALID_SOCKET;
+    conn.buffer_size = buffer_size;
+
+    if (multi_mode && port == 0)
+    {
+        fprintf(stderr, "Multi client operation requires a tcp port.\n");
+        return 2;
+    }
+
     if (_strnicmp(comm_device, "shm:", 4) == 0)
     {
 #ifdef _WIN32
-        int shmresult = do_comm_shm(comm_device + 4);
+        int shmresult = do_comm_shm(&conn, comm_device + 4);
         if (shmresult != 0)
             return shmresult;
 #else
@@ -2065,7 +13218,7 @@ int do_comm(char *comm_device)
     else if (_strnicmp(comm_device, "drv:", 4) == 0)
     {
 #ifdef _WIN32
-        int drvresult = do_comm_drv(comm_device + 4);
+        int drvresult = do_comm_drv(&conn, comm_device + 4);
         if (drvresult != 0)
             return drvresult;
 #else
@@ -2073,16 +13226,48 @@ int do_comm(char *comm_device)
         return 2;
 #endif
     }
-    else
+    else if (!multi_mode)
     {
-        buf = (char *)malloc(buffer_size);
-        if (buf == NULL)
+        conn.buf = (char *)buf_alloc(conn.buffer_size);
+        if (conn.buf == NULL)
         {
             syslog(LOG_ERR, "malloc() failed: %m\n");
             return 2;
         }
     }
 
+    // Tagged operation needs a stream where client and server can send
+    // independently of each other
+    if (!shm_mode && !drv_mode)
+    {
+        devio_info.flags |= FSCRYPTDPROXY_FLAG_SUPPORTS_TAGGED;
+    }
+
+    // Client need not keep its own copy of last data read for re-reads
+    if (block_cache.block_count > 0)
+    {
+        devio_info.flags |= FSCRYPTDPROXY_FLAG_BLOCK_CACHE;
+    }
+
+    // With --sync=none, client need not wait for flush requests
+    if ((~devio_info.flags & FSCRYPTDPROXY_FLAG_RO) &&
+        writeback.mode != SYNC_NONE)
+    {
+        devio_info.flags |= FSCRYPTDPROXY_FLAG_SUPPORTS_FLUSH |
+                            FSCRYPTDPROXY_FLAG_SUPPORTS_WRITE_EX;
+    }
+
+#ifdef __linux__
+    if (!dll_mode && (~devio_info.flags & FSCRYPTDPROXY_FLAG_RO))
+    {
+        devio_info.flags |= FSCRYPTDPROXY_FLAG_SUPPORTS_ZERO;
+
+        // Block devices without discard support have nothing to unmap
+        if (!image_blkdev || image_discard_granularity != 0)
+            devio_info.flags |= FSCRYPTDPROXY_FLAG_SUPPORTS_UNMAP;
+    }
+#endif
+
     if (shm_mode || drv_mode)
     {
     }
@@ -2114,7 +13299,7 @@ int do_comm(char *comm_device)
             return 2;
         }
 
-        if (listen(ssd, 1) == -1)
+        if (listen(ssd, multi_mode ? SOMAXCONN : 1) == -1)
         {
             syslog(LOG_ERR, "listen() failed for %s:%u: %m\n",
                    inet_ntoa(saddr.sin_addr),
@@ -2122,12 +13307,23 @@ int do_comm(char *comm_device)
             return 2;
         }
 
+#ifdef __linux__
+        if (multi_mode)
+        {
+            printf("Waiting for connections on port %u. Press Ctrl+C to cancel.\n",
+                   (unsigned int)ntohs(saddr.sin_port));
+            fflush(stdout);
+
+            return do_comm_multi(ssd);
+        }
+#endif
+
         printf("Waiting for connection on port %u. Press Ctrl+C to cancel.\n",
                (unsigned int)ntohs(saddr.sin_port));
 
         i = sizeof saddr;
-        sd = accept(ssd, (struct sockaddr *)&saddr, &i);
-        if (sd == -1)
+        conn.sd = accept(ssd, (struct sockaddr *)&saddr, &i);
+        if (conn.sd == -1)
         {
             syslog(LOG_ERR, "accept() failed port %u: %m\n",
                    (unsigned int)port);
@@ -2141,15 +13337,15 @@ int do_comm(char *comm_device)
                (unsigned int)ntohs(saddr.sin_port));
 
         i = 1;
-        if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (const char *)&i, sizeof i))
+        if (setsockopt(conn.sd, IPPROTO_TCP, TCP_NODELAY, (const char *)&i, sizeof i))
             syslog(LOG_ERR, "setsockopt(..., TCP_NODELAY): %m\n");
     }
     else if (strcmp(comm_device, "-") == 0)
     {
 #ifdef _WIN32
-        sd = (SOCKET)GetStdHandle(STD_INPUT_HANDLE);
+        conn.sd = (SOCKET)GetStdHandle(STD_INPUT_HANDLE);
 #else
-        sd = 0;
+        conn.sd = 0;
 #endif
 
         dbglog((LOG_ERR, "Using stdin as comm device.\n"));
@@ -2157,17 +13353,17 @@ int do_comm(char *comm_device)
     else
     {
 #ifdef _WIN32
-        sd = (SOCKET)CreateFile(comm_device,
-                                GENERIC_READ | GENERIC_WRITE,
-                                FILE_SHARE_READ | FILE_SHARE_WRITE,
-                                NULL,
-                                OPEN_ALWAYS,
-                                FILE_ATTRIBUTE_NORMAL,
-                                NULL);
+        conn.sd = (SOCKET)CreateFile(comm_device,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                     NULL,
+                                     OPEN_ALWAYS,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
 #else
-        sd = open(comm_device, O_BINARY | O_RDWR | O_DIRECT | O_FSYNC);
+        conn.sd = open(comm_device, O_BINARY | O_RDWR | O_DIRECT | O_FSYNC);
 #endif
-        if (sd == -1)
+        if (conn.sd == -1)
         {
             syslog(LOG_ERR, "File open failed on '%s': %m\n", comm_device);
             return 1;
@@ -2176,36 +13372,34 @@ int do_comm(char *comm_device)
         printf("Waiting for I/O requests on device '%s'.\n", comm_device);
     }
 
+#ifdef __linux__
+    conn.zero_copy = zero_copy_mode(conn.sd);
+#endif
+
     for (;;)
     {
-        if (!comm_read(&req, sizeof(req)) || req == FSCRYPTDPROXY_REQ_CLOSE)
+        int rc;
+
+        if (conn.tagged)
         {
-            puts("Connection closed.");
-            return 0;
+            rc = comm_read(&conn, &conn.tag, sizeof(conn.tag));
+            req = conn.tag.request_code;
         }
-
-        switch (req)
+        else
         {
-        case FSCRYPTDPROXY_REQ_INFO:
-            if (!send_info())
-                return 1;
-            break;
-
-        case FSCRYPTDPROXY_REQ_READ:
-            if (!read_data())
-                return 1;
-            break;
-
-        case FSCRYPTDPROXY_REQ_WRITE:
-            if (!write_data())
-                return 1;
-            break;
+            rc = comm_read(&conn, &req, sizeof(req));
+            conn.tag.request_code = req;
+        }
 
-        default:
-            if (!send_failed())
-                return 1;
-            break;
+        if (!rc || req == FSCRYPTDPROXY_REQ_CLOSE)
+        {
+            puts("Connection closed.");
+            print_stats(&conn);
+            return 0;
         }
+
+        if (!handle_request(&conn, req))
+            return 1;
     }
 }
 
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include "devio_types.h"
 #include "safeio.h"
@@ -83,3 +84,41 @@ safe_write(int fd, const void *pdata, size_t size)
 
   return 1;
 }
+
+/* Writes all buffers in iov, in one system call unless the descriptor
+   accepts less than everything at once. Entries in iov are updated to
+   reflect what remains after a partial write. */
+int
+safe_writev(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+    {
+      ssize_t sizedone = writev(fd, iov, iovcnt);
+      if (sizedone == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  syslog(LOG_ERR, "safe_writev(): %m\n");
+	  return 0;
+	}
+
+      if (sizedone == 0)
+	return 0;
+
+      while (iovcnt > 0 && (size_t) sizedone >= iov->iov_len)
+	{
+	  sizedone -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+
+      if (iovcnt > 0)
+	{
+	  iov->iov_base = (char*) iov->iov_base + sizedone;
+	  iov->iov_len -= sizedone;
+	}
+    }
+
+  return 1;
+}
@@ -25,7 +25,9 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
 OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#ifdef _MSC_VER
 #pragma warning(disable: 4996)
+#endif
 
 #ifndef _INC_SAFEIO_
 #define _INC_SAFEIO_
@@ -92,12 +94,20 @@ extern "C" {
         return _write(d, buf, nbytes);
     }
 
+    struct iovec
+    {
+        void *iov_base;
+        size_t iov_len;
+    };
+
 #endif
 
     int safe_read(SOCKET fd, void *pdata, safeio_size_t size);
 
     int safe_write(SOCKET fd, const void *pdata, safeio_size_t size);
 
+    int safe_writev(SOCKET fd, struct iovec *iov, int iovcnt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -52,3 +52,15 @@ safe_write(SOCKET fd, const void *pdata, safeio_size_t size)
 {
   return Overlapped.BufSend((HANDLE) fd, pdata, size);
 }
+
+extern "C"
+int
+safe_writev(SOCKET fd, struct iovec *iov, int iovcnt)
+{
+  for (int i = 0; i < iovcnt; i++)
+    if (!Overlapped.BufSend((HANDLE) fd, iov[i].iov_base,
+                            (safeio_size_t) iov[i].iov_len))
+      return 0;
+
+  return 1;
+}
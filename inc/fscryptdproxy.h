@@ -52,6 +52,10 @@ typedef u_char UCHAR;
 #define FSCRYPTDPROXY_FLAG_SUPPORTS_SCSI 0x08   // SCSI SRB operations
 #define FSCRYPTDPROXY_FLAG_SUPPORTS_SHARED 0x10 // Shared image access with reservations
 #define FSCRYPTDPROXY_FLAG_KEEP_OPEN 0x20       // DevIoDrv mode with persistent virtual file
+#define FSCRYPTDPROXY_FLAG_SUPPORTS_TAGGED 0x40 // Tagged, pipelined requests
+#define FSCRYPTDPROXY_FLAG_SUPPORTS_FLUSH 0x80  // Flush written data to stable storage
+#define FSCRYPTDPROXY_FLAG_SUPPORTS_WRITE_EX 0x100 // Writes with per-request flags
+#define FSCRYPTDPROXY_FLAG_BLOCK_CACHE 0x200    // Server caches image blocks for re-reads
 
 typedef enum _FSCRYPTDPROXY_REQ
 {
@@ -64,7 +68,10 @@ typedef enum _FSCRYPTDPROXY_REQ
     FSCRYPTDPROXY_REQ_UNMAP,
     FSCRYPTDPROXY_REQ_ZERO,
     FSCRYPTDPROXY_REQ_SCSI,
-    FSCRYPTDPROXY_REQ_SHARED
+    FSCRYPTDPROXY_REQ_SHARED,
+    FSCRYPTDPROXY_REQ_TAGGED,
+    FSCRYPTDPROXY_REQ_FLUSH,
+    FSCRYPTDPROXY_REQ_WRITE_EX
 } FSCRYPTDPROXY_REQ,
     *PFSCRYPTDPROXY_REQ;
 
@@ -119,6 +126,20 @@ typedef struct _FSCRYPTDPROXY_WRITE_RESP
     ULONGLONG length;
 } FSCRYPTDPROXY_WRITE_RESP, *PFSCRYPTDPROXY_WRITE_RESP;
 
+#define FSCRYPTDPROXY_WRITE_FLAG_FUA 0x01 // Data on stable storage when write completes
+
+// Write request with flags, FSCRYPTDPROXY_WRITE_FLAG_xxx. Only valid if
+// server reports FSCRYPTDPROXY_FLAG_SUPPORTS_WRITE_EX. Starts with same
+// fields as FSCRYPTDPROXY_WRITE_REQ, and response is a
+// FSCRYPTDPROXY_WRITE_RESP.
+typedef struct _FSCRYPTDPROXY_WRITE_EX_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG offset;
+    ULONGLONG length;
+    ULONGLONG flags;
+} FSCRYPTDPROXY_WRITE_EX_REQ, *PFSCRYPTDPROXY_WRITE_EX_REQ;
+
 typedef struct _FSCRYPTDPROXY_UNMAP_REQ
 {
     ULONGLONG request_code;
@@ -141,6 +162,19 @@ typedef struct _FSCRYPTDPROXY_ZERO_RESP
     ULONGLONG errorno;
 } FSCRYPTDPROXY_ZERO_RESP, *PFSCRYPTDPROXY_ZERO_RESP;
 
+// Only valid if server reports FSCRYPTDPROXY_FLAG_SUPPORTS_FLUSH. Server
+// responds once all writes it has responded to before the request are on
+// stable storage.
+typedef struct _FSCRYPTDPROXY_FLUSH_REQ
+{
+    ULONGLONG request_code;
+} FSCRYPTDPROXY_FLUSH_REQ, *PFSCRYPTDPROXY_FLUSH_REQ;
+
+typedef struct _FSCRYPTDPROXY_FLUSH_RESP
+{
+    ULONGLONG errorno;
+} FSCRYPTDPROXY_FLUSH_RESP, *PFSCRYPTDPROXY_FLUSH_RESP;
+
 typedef struct _FSCRYPTDPROXY_SCSI_REQ
 {
     ULONGLONG request_code;
@@ -213,6 +247,31 @@ typedef struct _FSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER
     ULONGLONG flags;        // Reserved. Currently not used.
 } FSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER, *PFSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER;
 
+// Switches a stream connection (tcp or similar) to tagged operation. Only
+// valid if server reports FSCRYPTDPROXY_FLAG_SUPPORTS_TAGGED. The response
+// is sent untagged. After a successful response, each request starts with
+// a FSCRYPTDPROXY_TAGGED_HEADER instead of a request code, followed by the
+// rest of the request structure after its request_code field and any
+// request data. Each response starts with a FSCRYPTDPROXY_TAGGED_HEADER with
+// request_code and io_tag from the request, followed by the response
+// structure and data. Client can send up to max_outstanding requests before
+// waiting for responses, and responses may arrive in any order.
+typedef struct _FSCRYPTDPROXY_TAGGED_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG flags;           // Reserved. Must be zero.
+    ULONGLONG max_outstanding; // Number of requests client wants in flight.
+} FSCRYPTDPROXY_TAGGED_REQ, *PFSCRYPTDPROXY_TAGGED_REQ;
+
+typedef struct _FSCRYPTDPROXY_TAGGED_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG max_outstanding; // Number of requests server accepts in flight.
+} FSCRYPTDPROXY_TAGGED_RESP, *PFSCRYPTDPROXY_TAGGED_RESP;
+
+// Same layout as used with deviodrv.
+typedef FSCRYPTDPROXY_DEVIODRV_BUFFER_HEADER FSCRYPTDPROXY_TAGGED_HEADER, *PFSCRYPTDPROXY_TAGGED_HEADER;
+
 #if defined(CTL_CODE) && !defined(IOCTL_DEVIODRV_EXCHANGE_IO)
 #ifndef FILE_DEVICE_FSCRYPTDISK
 #define FILE_DEVICE_FSCRYPTDISK 0x8372
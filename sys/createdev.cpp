@@ -428,6 +428,9 @@ FscryptDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
     PDEVICE_EXTENSION device_extension;
     BOOLEAN proxy_supports_unmap = FALSE;
     BOOLEAN proxy_supports_zero = FALSE;
+    BOOLEAN proxy_supports_flush = FALSE;
+    BOOLEAN proxy_supports_write_ex = FALSE;
+    BOOLEAN proxy_block_cache = FALSE;
     DEVICE_TYPE device_type;
     ULONG device_characteristics;
     HANDLE file_handle = NULL;
@@ -1470,6 +1473,15 @@ FscryptDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
             if (proxy_info.flags & FSCRYPTDPROXY_FLAG_SUPPORTS_ZERO)
                 proxy_supports_zero = TRUE;
 
+            if (proxy_info.flags & FSCRYPTDPROXY_FLAG_SUPPORTS_FLUSH)
+                proxy_supports_flush = TRUE;
+
+            if (proxy_info.flags & FSCRYPTDPROXY_FLAG_SUPPORTS_WRITE_EX)
+                proxy_supports_write_ex = TRUE;
+
+            if (proxy_info.flags & FSCRYPTDPROXY_FLAG_BLOCK_CACHE)
+                proxy_block_cache = TRUE;
+
             KdPrint(("FscryptDisk: Got from proxy: Siz=0x%.8x%.8x Flg=%#x Alg=%#x.\n",
                      CreateData->DiskGeometry.Cylinders.HighPart,
                      CreateData->DiskGeometry.Cylinders.LowPart,
@@ -2126,6 +2138,12 @@ FscryptDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
 
     device_extension->proxy_zero = proxy_supports_zero;
 
+    device_extension->proxy_flush = proxy_supports_flush;
+
+    device_extension->proxy_write_ex = proxy_supports_write_ex;
+
+    device_extension->proxy_block_cache = proxy_block_cache;
+
     device_extension->media_change_count++;
 
     device_extension->drive_letter = CreateData->DriveLetter;
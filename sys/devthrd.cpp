@@ -93,6 +93,42 @@ VOID FscryptDiskDeviceThreadRead(IN PIRP Irp,
     offset.QuadPart = io_stack->Parameters.Read.ByteOffset.QuadPart +
                       DeviceExtension->image_offset.QuadPart;
 
+    // Proxy with a block cache serves re-reads itself, so data is read
+    // straight into request buffer without keeping a copy
+    if (DeviceExtension->use_proxy && DeviceExtension->proxy_block_cache)
+    {
+        Irp->IoStatus.Status =
+            FscryptDiskReadProxy(&DeviceExtension->proxy,
+                                 &Irp->IoStatus,
+                                 &DeviceExtension->terminate_thread,
+                                 system_buffer,
+                                 io_stack->Parameters.Read.Length,
+                                 &offset);
+
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
+        {
+            KdPrint(("FscryptDisk: Read failed on device %i: %#x.\n",
+                     DeviceExtension->device_number,
+                     Irp->IoStatus.Status));
+
+            Irp->IoStatus.Status = STATUS_DEVICE_DOES_NOT_EXIST;
+            Irp->IoStatus.Information = 0;
+            return;
+        }
+
+        if (DeviceExtension->byte_swap)
+            FscryptDiskByteSwapBuffer(system_buffer,
+                                      Irp->IoStatus.Information);
+
+        if (io_stack->FileObject != NULL)
+        {
+            io_stack->FileObject->CurrentByteOffset.QuadPart +=
+                Irp->IoStatus.Information;
+        }
+
+        return;
+    }
+
     FscryptDiskAcquireLock(&DeviceExtension->last_io_lock, &lock_handle);
 
     if ((DeviceExtension->last_io_data != NULL) &&
@@ -323,7 +359,29 @@ VOID FscryptDiskDeviceThreadWrite(IN PIRP Irp,
                                       &DeviceExtension->terminate_thread,
                                       DeviceExtension->last_io_data,
                                       io_stack->Parameters.Write.Length,
-                                      &offset);
+                                      &offset,
+                                      DeviceExtension->proxy_write_ex &&
+                                      (io_stack->Flags & SL_WRITE_THROUGH) ?
+                                      FSCRYPTDPROXY_WRITE_FLAG_FUA : 0);
+        }
+
+        // Write-through requests are on stable storage when completed,
+        // either with FUA flag or with a flush afterwards
+        if (NT_SUCCESS(Irp->IoStatus.Status) &&
+            DeviceExtension->proxy_flush &&
+            (io_stack->Flags & SL_WRITE_THROUGH) &&
+            (set_zero_data || !DeviceExtension->proxy_write_ex))
+        {
+            IO_STATUS_BLOCK flush_status;
+
+            FscryptDiskFlushProxy(&DeviceExtension->proxy,
+                                  &flush_status,
+                                  &DeviceExtension->terminate_thread);
+
+            if (!NT_SUCCESS(flush_status.Status))
+            {
+                Irp->IoStatus.Status = flush_status.Status;
+            }
         }
 
         if (!NT_SUCCESS(Irp->IoStatus.Status))
@@ -420,6 +478,22 @@ VOID FscryptDiskDeviceThreadFlushBuffers(IN PIRP Irp,
     KEVENT io_complete_event;
     PIO_STACK_LOCATION image_io_stack;
 
+    if (DeviceExtension->use_proxy)
+    {
+        FscryptDiskFlushProxy(&DeviceExtension->proxy,
+                              &Irp->IoStatus,
+                              &DeviceExtension->terminate_thread);
+
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
+        {
+            KdPrint(("FscryptDisk: Flush failed on device %i: %#x.\n",
+                     DeviceExtension->device_number,
+                     Irp->IoStatus.Status));
+        }
+
+        return;
+    }
+
     if (DeviceExtension->file_object == NULL)
     {
         status = ObReferenceObjectByHandle(
@@ -121,7 +121,8 @@ FscryptDiskFloppyFormat(IN PDEVICE_EXTENSION Extension,
                                            &Extension->terminate_thread,
                                            format_buffer,
                                            track_length,
-                                           &start_offset);
+                                           &start_offset,
+                                           0);
         }
         else
         {
@@ -178,6 +178,10 @@ typedef struct _DEVICE_EXTENSION
                                 // shared memory, TCP/IP, serial port etc for I/O
     BOOLEAN proxy_unmap;        // TRUE if proxy supports UNMAP operations
     BOOLEAN proxy_zero;         // TRUE if proxy supports ZERO operations
+    BOOLEAN proxy_flush;        // TRUE if proxy supports FLUSH operations
+    BOOLEAN proxy_write_ex;     // TRUE if proxy supports WRITE_EX operations
+    BOOLEAN proxy_block_cache;  // TRUE if proxy caches blocks, so that last
+                                // I/O buffer is not used for re-reads
     BOOLEAN image_modified;     // TRUE if this device has been written to
     LONG special_file_count;    // Number of swapfiles/hiberfiles on device
     BOOLEAN use_set_zero_data;  // TRUE if FSCTL_SET_ZERO_DATA is used to write
@@ -316,7 +320,8 @@ FscryptDiskWriteProxy(IN PPROXY_CONNECTION Proxy,
                       IN PKEVENT CancelEvent OPTIONAL,
                       IN PVOID Buffer,
                       IN ULONG Length,
-                      IN PLARGE_INTEGER ByteOffset);
+                      IN PLARGE_INTEGER ByteOffset,
+                      IN ULONGLONG Flags);
 
 NTSTATUS
 FscryptDiskUnmapOrZeroProxy(IN PPROXY_CONNECTION Proxy,
@@ -326,6 +331,11 @@ FscryptDiskUnmapOrZeroProxy(IN PPROXY_CONNECTION Proxy,
                             IN ULONG Items,
                             IN PDEVICE_DATA_SET_RANGE Ranges);
 
+NTSTATUS
+FscryptDiskFlushProxy(IN PPROXY_CONNECTION Proxy,
+                      IN OUT PIO_STATUS_BLOCK IoStatusBlock,
+                      IN PKEVENT CancelEvent OPTIONAL);
+
 //
 // Reads in a loop up to "Length" or until eof reached.
 //
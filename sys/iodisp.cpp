@@ -218,7 +218,8 @@ FscryptDiskDispatchReadWrite(IN PDEVICE_OBJECT DeviceObject,
 
     if ((io_stack->MajorFunction == IRP_MJ_READ) &&
         (device_extension->last_io_data != NULL) &&
-        !device_extension->shared_image)
+        !device_extension->shared_image &&
+        !device_extension->proxy_block_cache)
     {
         KLOCK_QUEUE_HANDLE lock_handle = {0};
 
@@ -1935,7 +1936,8 @@ FscryptDiskDispatchFlushBuffers(IN PDEVICE_OBJECT DeviceObject,
         return status;
     }
 
-    if (device_extension->use_proxy | device_extension->vm_disk)
+    if ((device_extension->use_proxy && !device_extension->proxy_flush) |
+        device_extension->vm_disk)
     {
         Irp->IoStatus.Status = STATUS_SUCCESS;
 
@@ -781,9 +781,10 @@ FscryptDiskWriteProxy(IN PPROXY_CONNECTION Proxy,
                       IN PKEVENT CancelEvent,
                       IN PVOID Buffer,
                       IN ULONG Length,
-                      IN PLARGE_INTEGER ByteOffset)
+                      IN PLARGE_INTEGER ByteOffset,
+                      IN ULONGLONG Flags)
 {
-    FSCRYPTDPROXY_WRITE_REQ write_req = {0};
+    FSCRYPTDPROXY_WRITE_EX_REQ write_req = {0};
     FSCRYPTDPROXY_WRITE_RESP write_resp = {0};
     NTSTATUS status;
     ULONG_PTR max_transfer_size;
@@ -810,7 +811,11 @@ FscryptDiskWriteProxy(IN PPROXY_CONNECTION Proxy,
                   "FSCRYPTDPROXY_REQ_WRITE 0x%.8x done 0x%.8x left to do.\n",
                   length_done, length_to_do));
 
-        write_req.request_code = FSCRYPTDPROXY_REQ_WRITE;
+        // Requests without flags are sent as FSCRYPTDPROXY_REQ_WRITE, which
+        // has the same layout without flags field
+        write_req.request_code =
+            Flags != 0 ? FSCRYPTDPROXY_REQ_WRITE_EX : FSCRYPTDPROXY_REQ_WRITE;
+        write_req.flags = Flags;
         write_req.offset = ByteOffset->QuadPart + length_done;
         write_req.length =
             length_to_do <= max_transfer_size ? length_to_do : max_transfer_size;
@@ -826,7 +831,8 @@ FscryptDiskWriteProxy(IN PPROXY_CONNECTION Proxy,
                                       IoStatusBlock,
                                       CancelEvent,
                                       &write_req,
-                                      sizeof(write_req),
+                                      Flags != 0 ? sizeof(write_req) :
+                                      sizeof(FSCRYPTDPROXY_WRITE_REQ),
                                       (PUCHAR)Buffer + length_done,
                                       (ULONG)write_req.length,
                                       &write_resp,
@@ -946,3 +952,57 @@ FscryptDiskUnmapOrZeroProxy(IN PPROXY_CONNECTION Proxy,
     IoStatusBlock->Information = 0;
     return IoStatusBlock->Status;
 }
+
+NTSTATUS
+FscryptDiskFlushProxy(IN PPROXY_CONNECTION Proxy,
+                      IN OUT PIO_STATUS_BLOCK IoStatusBlock,
+                      IN PKEVENT CancelEvent OPTIONAL)
+{
+    FSCRYPTDPROXY_FLUSH_REQ flush_req = {0};
+    FSCRYPTDPROXY_FLUSH_RESP flush_resp = {0};
+    NTSTATUS status;
+
+    ASSERT(Proxy != NULL);
+    ASSERT(IoStatusBlock != NULL);
+
+    flush_req.request_code = FSCRYPTDPROXY_REQ_FLUSH;
+
+    KdPrint2(("FscryptDisk Proxy Client: Flush.\n"));
+
+    status = FscryptDiskCallProxy(Proxy,
+                                  IoStatusBlock,
+                                  CancelEvent,
+                                  &flush_req,
+                                  sizeof(flush_req),
+                                  NULL,
+                                  0,
+                                  &flush_resp,
+                                  sizeof(flush_resp),
+                                  NULL,
+                                  0,
+                                  NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        IoStatusBlock->Status = status;
+        IoStatusBlock->Information = 0;
+        return status;
+    }
+
+    if (flush_resp.errorno != 0)
+    {
+#pragma warning(suppress : 6064)
+#pragma warning(suppress : 6328)
+        KdPrint(("FscryptDisk Proxy Client: Server returned error 0x%.8x%.8x.\n",
+                 flush_resp.errorno));
+        IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    KdPrint2(("FscryptDisk Proxy Client: Server replied OK.\n"));
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = 0;
+    return IoStatusBlock->Status;
+}